@@ -0,0 +1,387 @@
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <new>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+#include <boost/make_shared.hpp>
+#include <Eigen/Geometry>
+#include <pcl/common/transforms.h>
+#include <pcl/kdtree/kdtree_flann.h>
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+
+#include "prob_point_cloud_registration/data_association.hpp"
+#include "prob_point_cloud_registration/neighbour_search.hpp"
+#include "prob_point_cloud_registration/prob_point_cloud_registration.h"
+#include "prob_point_cloud_registration/prob_point_cloud_registration_iteration.hpp"
+#include "prob_point_cloud_registration/probabilistic_weights.hpp"
+
+/**
+ * Benchmarks of the registration hot paths on synthetic clouds.
+ *
+ * Besides the usual Google Benchmark flags it accepts
+ *   --cloud_size=<int>        number of points of the target cloud (default: 10000 and 100000)
+ *   --max_neighbours=<int>    (default: 20)
+ *   --noise=<float>           standard deviation of the noise added to the source (default: 0.01)
+ *   --outlier_ratio=<float>   fraction of source points replaced by outliers (default: 0.1)
+ * Every benchmark reports points/sec (items_per_second), the heap allocations and the
+ * allocated bytes per iteration.
+ */
+
+namespace {
+
+std::atomic<long> num_allocations(0);
+std::atomic<long> allocated_bytes(0);
+
+}  // namespace
+
+void *operator new(std::size_t size)
+{
+    num_allocations.fetch_add(1, std::memory_order_relaxed);
+    allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+    void *pointer = std::malloc(size == 0 ? 1 : size);
+    if (pointer == nullptr) {
+        throw std::bad_alloc();
+    }
+    return pointer;
+}
+
+void operator delete(void *pointer) noexcept
+{
+    std::free(pointer);
+}
+
+void operator delete(void *pointer, std::size_t) noexcept
+{
+    std::free(pointer);
+}
+
+namespace {
+
+using prob_point_cloud_registration::ProbPointCloudRegistration;
+using prob_point_cloud_registration::ProbPointCloudRegistrationIteration;
+using prob_point_cloud_registration::ProbPointCloudRegistrationParams;
+using prob_point_cloud_registration::ProbabilisticWeights;
+
+struct BenchmarkConfig {
+    std::vector<int> cloud_sizes = {10000, 100000};
+    int max_neighbours = 20;
+    double noise = 0.01;
+    double outlier_ratio = 0.1;
+};
+
+BenchmarkConfig config;
+
+// Counts the allocations done between construction and report()
+class AllocationCounter
+{
+public:
+    AllocationCounter(): allocations_(num_allocations.load()), bytes_(allocated_bytes.load()) {}
+
+    void report(benchmark::State &state)
+    {
+        state.counters["allocs"] = benchmark::Counter(num_allocations.load() - allocations_,
+                                                      benchmark::Counter::kAvgIterations);
+        state.counters["alloc_bytes"] = benchmark::Counter(allocated_bytes.load() - bytes_,
+                                                           benchmark::Counter::kAvgIterations);
+    }
+
+private:
+    long allocations_;
+    long bytes_;
+};
+
+// A grid sampled surface, with the same shape as the clouds of PointCloudRegistrationTest
+pcl::PointCloud<pcl::PointXYZ>::Ptr generateTarget(int size)
+{
+    auto cloud = boost::make_shared<pcl::PointCloud<pcl::PointXYZ>>();
+    const int side = std::ceil(std::sqrt(size));
+    const double step = 0.2;
+    cloud->reserve(size);
+    for (int i = 0; i < side && cloud->size() < size; i++) {
+        for (int j = 0; j < side && cloud->size() < size; j++) {
+            const double x = i * step;
+            const double y = j * step;
+            cloud->push_back(pcl::PointXYZ(x, y, std::sin(x) + std::cos(y)));
+        }
+    }
+    return cloud;
+}
+
+Eigen::Affine3d groundTruth()
+{
+    Eigen::Affine3d transform = Eigen::Affine3d::Identity();
+    transform.translation() << 0.3, -0.2, 0.1;
+    transform.rotate(Eigen::AngleAxisd(0.05, Eigen::Vector3d::UnitZ()));
+    return transform;
+}
+
+// The target moved by the inverse of groundTruth(), with noise and outliers
+pcl::PointCloud<pcl::PointXYZ>::Ptr generateSource(const pcl::PointCloud<pcl::PointXYZ> &target)
+{
+    auto cloud = boost::make_shared<pcl::PointCloud<pcl::PointXYZ>>();
+    pcl::transformPointCloud(target, *cloud, groundTruth().inverse());
+    std::mt19937 generator(42);
+    std::normal_distribution<float> noise(0, config.noise);
+    std::uniform_real_distribution<float> uniform(0, 1);
+    Eigen::Vector4f min_point = Eigen::Vector4f::Constant(std::numeric_limits<float>::max());
+    Eigen::Vector4f max_point = Eigen::Vector4f::Constant(-std::numeric_limits<float>::max());
+    for (const pcl::PointXYZ &point : *cloud) {
+        min_point = min_point.cwiseMin(Eigen::Vector4f(point.x, point.y, point.z, 0));
+        max_point = max_point.cwiseMax(Eigen::Vector4f(point.x, point.y, point.z, 0));
+    }
+    for (pcl::PointXYZ &point : *cloud) {
+        if (uniform(generator) < config.outlier_ratio) {
+            point.x = min_point[0] + uniform(generator) * (max_point[0] - min_point[0]);
+            point.y = min_point[1] + uniform(generator) * (max_point[1] - min_point[1]);
+            point.z = min_point[2] + uniform(generator) * (max_point[2] - min_point[2]);
+        } else {
+            point.x += noise(generator);
+            point.y += noise(generator);
+            point.z += noise(generator);
+        }
+    }
+    return cloud;
+}
+
+ProbPointCloudRegistrationParams registrationParams()
+{
+    ProbPointCloudRegistrationParams params;
+    params.max_neighbours = config.max_neighbours;
+    params.radius = 0.5;
+    params.n_iter = 10;
+    return params;
+}
+
+ceres::Solver::Options solverOptions()
+{
+    ceres::Solver::Options options;
+    options.linear_solver_type = ceres::DENSE_QR;
+    options.use_nonmonotonic_steps = true;
+    options.minimizer_progress_to_stdout = false;
+    options.max_num_iterations = std::numeric_limits<int>::max();
+    options.function_tolerance = 10e-6;
+    options.num_threads = std::thread::hardware_concurrency();
+    return options;
+}
+
+void kdTreeBuild(benchmark::State &state, int size)
+{
+    auto target = generateTarget(size);
+    AllocationCounter allocations;
+    for (auto _ : state) {
+        pcl::KdTreeFLANN<pcl::PointXYZ> kdtree;
+        kdtree.setInputCloud(target);
+        benchmark::DoNotOptimize(kdtree);
+    }
+    allocations.report(state);
+    state.SetItemsProcessed(state.iterations() * size);
+}
+
+void dataAssociation(benchmark::State &state, int size)
+{
+    auto target = generateTarget(size);
+    auto source = generateSource(*target);
+    pcl::KdTreeFLANN<pcl::PointXYZ> kdtree;
+    kdtree.setInputCloud(target);
+    const ProbPointCloudRegistrationParams params = registrationParams();
+    AllocationCounter allocations;
+    for (auto _ : state) {
+        auto data_association = prob_point_cloud_registration::computeDataAssociation(*source, *target, kdtree,
+                                                                                      params.radius, params.max_neighbours);
+        benchmark::DoNotOptimize(data_association.valuePtr());
+    }
+    allocations.report(state);
+    state.SetItemsProcessed(state.iterations() * source->size());
+}
+
+void voxelHashBuild(benchmark::State &state, int size)
+{
+    auto target = generateTarget(size);
+    const ProbPointCloudRegistrationParams params = registrationParams();
+    AllocationCounter allocations;
+    for (auto _ : state) {
+        prob_point_cloud_registration::VoxelHashSearch voxel_hash(target, params.radius);
+        benchmark::DoNotOptimize(voxel_hash);
+    }
+    allocations.report(state);
+    state.SetItemsProcessed(state.iterations() * size);
+}
+
+void voxelHashDataAssociation(benchmark::State &state, int size)
+{
+    auto target = generateTarget(size);
+    auto source = generateSource(*target);
+    const ProbPointCloudRegistrationParams params = registrationParams();
+    const prob_point_cloud_registration::VoxelHashSearch voxel_hash(target, params.radius);
+    prob_point_cloud_registration::OpenMPExecutor executor(params.num_threads);
+    // Refilled as across the iterations of a registration, only the first fill allocates its storage
+    prob_point_cloud_registration::DataAssociation data_association;
+    AllocationCounter allocations;
+    for (auto _ : state) {
+        prob_point_cloud_registration::computeDataAssociation(*source, voxel_hash, params.radius,
+                                                              params.max_neighbours, executor, &data_association);
+        benchmark::DoNotOptimize(data_association.matrix().valuePtr());
+    }
+    allocations.report(state);
+    state.SetItemsProcessed(state.iterations() * source->size());
+}
+
+// Scalar is the type of the squared errors and of the weights, see ScalarType
+template <typename Scalar>
+void updateWeights(benchmark::State &state, int size, double dof)
+{
+    auto target = generateTarget(size);
+    auto source = generateSource(*target);
+    pcl::KdTreeFLANN<pcl::PointXYZ> kdtree;
+    kdtree.setInputCloud(target);
+    const ProbPointCloudRegistrationParams params = registrationParams();
+    auto data_association = prob_point_cloud_registration::computeDataAssociation(*source, *target, kdtree,
+                                                                                  params.radius, params.max_neighbours);
+    std::vector<Scalar> squared_errors(data_association.valuePtr(),
+                                       data_association.valuePtr() + data_association.nonZeros());
+    std::vector<Scalar> weights(squared_errors.size());
+    ProbabilisticWeights weight_updater(dof, 3, params.max_neighbours);
+    AllocationCounter allocations;
+    for (auto _ : state) {
+        weight_updater.updateWeights(data_association, squared_errors, weights.data());
+        benchmark::DoNotOptimize(weights.data());
+    }
+    allocations.report(state);
+    state.SetItemsProcessed(state.iterations() * squared_errors.size());
+    state.counters["associations"] = squared_errors.size();
+}
+
+void singleSolve(benchmark::State &state, int size)
+{
+    auto target = generateTarget(size);
+    auto source = generateSource(*target);
+    pcl::KdTreeFLANN<pcl::PointXYZ> kdtree;
+    kdtree.setInputCloud(target);
+    const ProbPointCloudRegistrationParams params = registrationParams();
+    auto data_association = prob_point_cloud_registration::computeDataAssociation(*source, *target, kdtree,
+                                                                                  params.radius, params.max_neighbours);
+    ProbPointCloudRegistrationIteration registration(params);
+    AllocationCounter allocations;
+    for (auto _ : state) {
+        registration.setDataAssociation(*source, *target, data_association);
+        ceres::Solver::Summary summary;
+        registration.solve(solverOptions(), &summary);
+        benchmark::DoNotOptimize(summary.final_cost);
+    }
+    allocations.report(state);
+    state.SetItemsProcessed(state.iterations() * data_association.nonZeros());
+    state.counters["associations"] = data_association.nonZeros();
+}
+
+// deterministic against the default fast path, see ProbPointCloudRegistrationParams::deterministic
+void endToEndAlign(benchmark::State &state, int size, prob_point_cloud_registration::SolverType solver_type,
+                   bool deterministic)
+{
+    auto target = generateTarget(size);
+    auto source = generateSource(*target);
+    ProbPointCloudRegistrationParams params = registrationParams();
+    params.solver_type = solver_type;
+    params.deterministic = deterministic;
+    AllocationCounter allocations;
+    for (auto _ : state) {
+        ProbPointCloudRegistration registration(source, boost::make_shared<pcl::PointCloud<pcl::PointXYZ>>(*target),
+                                                params);
+        registration.align();
+        benchmark::DoNotOptimize(registration.transformation());
+    }
+    allocations.report(state);
+    state.SetItemsProcessed(state.iterations() * source->size());
+}
+
+// The Ceres path with prune_weight, the pruned associations compacted out of the solves, against Align
+void prunedAlign(benchmark::State &state, int size, double prune_weight)
+{
+    auto target = generateTarget(size);
+    auto source = generateSource(*target);
+    ProbPointCloudRegistrationParams params = registrationParams();
+    params.prune_weight = prune_weight;
+    std::size_t num_active_associations = 0;
+    for (auto _ : state) {
+        ProbPointCloudRegistration registration(source, boost::make_shared<pcl::PointCloud<pcl::PointXYZ>>(*target),
+                                                params);
+        registration.align();
+        benchmark::DoNotOptimize(registration.transformation());
+        num_active_associations = registration.statistics().iterations.back().num_active_associations;
+    }
+    state.counters["active_associations"] = num_active_associations;
+    state.SetItemsProcessed(state.iterations() * source->size());
+}
+
+// Removes the arguments of this benchmark from argv, leaving the Google Benchmark ones
+void parseConfig(int *argc, char **argv)
+{
+    bool custom_sizes = false;
+    int kept = 1;
+    for (int i = 1; i < *argc; i++) {
+        const std::string argument(argv[i]);
+        const std::size_t separator = argument.find('=');
+        const std::string name = argument.substr(0, separator);
+        const std::string value = separator == std::string::npos ? "" : argument.substr(separator + 1);
+        if (name == "--cloud_size") {
+            if (!custom_sizes) {
+                config.cloud_sizes.clear();
+                custom_sizes = true;
+            }
+            config.cloud_sizes.push_back(std::atoi(value.c_str()));
+        } else if (name == "--max_neighbours") {
+            config.max_neighbours = std::atoi(value.c_str());
+        } else if (name == "--noise") {
+            config.noise = std::atof(value.c_str());
+        } else if (name == "--outlier_ratio") {
+            config.outlier_ratio = std::atof(value.c_str());
+        } else {
+            argv[kept++] = argv[i];
+        }
+    }
+    *argc = kept;
+}
+
+}  // namespace
+
+int main(int argc, char **argv)
+{
+    parseConfig(&argc, argv);
+    for (int size : config.cloud_sizes) {
+        const std::string suffix = "/" + std::to_string(size);
+        benchmark::RegisterBenchmark(("KdTreeBuild" + suffix).c_str(), kdTreeBuild, size);
+        benchmark::RegisterBenchmark(("DataAssociation" + suffix).c_str(), dataAssociation, size);
+        benchmark::RegisterBenchmark(("VoxelHashBuild" + suffix).c_str(), voxelHashBuild, size);
+        benchmark::RegisterBenchmark(("VoxelHashDataAssociation" + suffix).c_str(), voxelHashDataAssociation, size);
+        benchmark::RegisterBenchmark(("UpdateWeightsStudentT" + suffix).c_str(), updateWeights<double>, size, 5.0);
+        benchmark::RegisterBenchmark(("UpdateWeightsGaussian" + suffix).c_str(), updateWeights<double>, size,
+                                     std::numeric_limits<double>::infinity());
+        benchmark::RegisterBenchmark(("UpdateWeightsStudentTFloat" + suffix).c_str(), updateWeights<float>, size,
+                                     5.0);
+        benchmark::RegisterBenchmark(("UpdateWeightsGaussianFloat" + suffix).c_str(), updateWeights<float>, size,
+                                     std::numeric_limits<double>::infinity());
+        benchmark::RegisterBenchmark(("SingleSolve" + suffix).c_str(), singleSolve, size)->Unit(
+            benchmark::kMillisecond);
+        for (bool deterministic : {false, true}) {
+            const std::string mode = deterministic ? "Deterministic" : "";
+            benchmark::RegisterBenchmark(("Align" + mode + suffix).c_str(), endToEndAlign, size,
+                                         prob_point_cloud_registration::SolverType::CERES, deterministic)->Unit(
+                benchmark::kMillisecond);
+            benchmark::RegisterBenchmark(("ProcrustesAlign" + mode + suffix).c_str(), endToEndAlign, size,
+                                         prob_point_cloud_registration::SolverType::PROCRUSTES, deterministic)->Unit(
+                benchmark::kMillisecond);
+        }
+        benchmark::RegisterBenchmark(("AlignPruned" + suffix).c_str(), prunedAlign, size, 1e-4)->Unit(
+            benchmark::kMillisecond);
+    }
+    benchmark::Initialize(&argc, argv);
+    benchmark::RunSpecifiedBenchmarks();
+    return 0;
+}
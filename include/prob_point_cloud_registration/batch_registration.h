@@ -0,0 +1,73 @@
+#ifndef PROB_POINT_CLOUD_REGISTRATION_BATCH_REGISTRATION_HPP
+#define PROB_POINT_CLOUD_REGISTRATION_BATCH_REGISTRATION_HPP
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <Eigen/Geometry>
+#include <pcl/kdtree/kdtree_flann.h>
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+
+#include "prob_point_cloud_registration/neighbour_search.hpp"
+#include "prob_point_cloud_registration/prob_point_cloud_registration_params.hpp"
+#include "prob_point_cloud_registration/registration_statistics.hpp"
+
+namespace prob_point_cloud_registration {
+
+struct BatchRegistrationResult {
+    // Maps the source cloud onto the target, initial guess included
+    Eigen::Affine3d transformation = Eigen::Affine3d::Identity();
+    // report() of the registration, its poses are relative to the initial guess
+    std::string report;
+    RegistrationStatistics statistics;
+};
+
+/**
+ * Registers many source clouds against the same target. The target is filtered and indexed
+ * once, the scans are aligned concurrently by a pool of threads that shares the
+ * parameters.num_threads budget (all the hardware threads when 0): with W concurrent scans
+ * each of their solves gets num_threads / W threads. When parameters.executor is set the scans
+ * are run as its tasks instead, and it also runs their parallel sections. Their Ceres solves,
+ * which start their own threads, are then capped to the executor threads / W (see
+ * max_solver_threads).
+ */
+class BatchRegistration
+{
+public:
+    BatchRegistration(pcl::PointCloud<pcl::PointXYZ>::Ptr target_cloud,
+                      ProbPointCloudRegistrationParams parameters);
+
+    // initial_guesses is either empty (identity) or holds one guess per source cloud
+    std::vector<BatchRegistrationResult> align(
+        const std::vector<pcl::PointCloud<pcl::PointXYZ>::Ptr> &source_clouds,
+        const std::vector<Eigen::Affine3d> &initial_guesses = std::vector<Eigen::Affine3d>()) const;
+
+    // Filtering and index build times of the target
+    inline const RegistrationStatistics &targetStatistics() const
+    {
+        return target_statistics_;
+    }
+
+    // NULL unless parameters.neighbour_search is KDTREE
+    inline pcl::KdTreeFLANN<pcl::PointXYZ>::Ptr targetKdTree() const
+    {
+        return target_kdtree_;
+    }
+
+    inline std::shared_ptr<NeighbourSearch> target() const
+    {
+        return target_;
+    }
+
+private:
+    ProbPointCloudRegistrationParams parameters_;
+    RegistrationStatistics target_statistics_;
+    std::shared_ptr<NeighbourSearch> target_;
+    pcl::KdTreeFLANN<pcl::PointXYZ>::Ptr target_kdtree_;
+};
+
+}  // namespace prob_point_cloud_registration
+
+#endif
@@ -0,0 +1,433 @@
+#ifndef PROB_POINT_CLOUD_REGISTRATION_BATCHED_ERROR_TERM_HPP
+#define PROB_POINT_CLOUD_REGISTRATION_BATCHED_ERROR_TERM_HPP
+
+#include <ceres/ceres.h>
+#include <Eigen/Core>
+#include <Eigen/Sparse>
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <numeric>
+#include <vector>
+
+#include "prob_point_cloud_registration/executor.hpp"
+#include "prob_point_cloud_registration/neighbour_search.hpp"
+
+namespace prob_point_cloud_registration {
+
+namespace internal {
+
+// Same expansion as ceres::UnitQuaternionRotatePoint, q = (w, x, y, z).
+inline Eigen::Matrix3d rotationMatrix(const Eigen::Vector4d &q)
+{
+    Eigen::Matrix3d rot;
+    rot << 1 - 2 * (q[2] * q[2] + q[3] * q[3]), 2 * (q[1] * q[2] - q[0] * q[3]),
+        2 * (q[0] * q[2] + q[1] * q[3]),
+        2 * (q[0] * q[3] + q[1] * q[2]), 1 - 2 * (q[1] * q[1] + q[3] * q[3]),
+        2 * (q[2] * q[3] - q[0] * q[1]),
+        2 * (q[1] * q[3] - q[0] * q[2]), 2 * (q[0] * q[1] + q[2] * q[3]),
+        1 - 2 * (q[1] * q[1] + q[2] * q[2]);
+    return rot;
+}
+
+/**
+ * d(R(p / |p|) x) / dp at the quaternion parameters p = norm * q, rotated being R(q) x. It is
+ * (dg / dq - 2 R(q) x q^T) / |p|, with g(q) = (w^2 - v.v) x + 2 (v.x) v + 2 w (v cross x) and
+ * q = (w, v).
+ */
+inline Eigen::Matrix<double, 3, 4> rotatedPointJacobian(const Eigen::Vector4d &q, double norm,
+                                                        const Eigen::Vector3d &x, const Eigen::Vector3d &rotated)
+{
+    const double w = q[0];
+    const Eigen::Vector3d v = q.tail<3>();
+    Eigen::Matrix<double, 3, 4> d_rotated;
+    d_rotated.col(0) = 2 * (w * x + v.cross(x));
+    Eigen::Matrix3d skew_x;
+    skew_x << 0, -x[2], x[1],
+           x[2], 0, -x[0],
+           -x[1], x[0], 0;
+    d_rotated.rightCols<3>() = 2 * (v * x.transpose() - x * v.transpose() - w * skew_x);
+    d_rotated.rightCols<3>().diagonal().array() += 2 * v.dot(x);
+    d_rotated -= 2 * rotated * q.transpose();
+    d_rotated /= norm;
+    return d_rotated;
+}
+
+}  // namespace internal
+
+/**
+ * Point-to-point residuals of all the associations in a single cost function.
+ *
+ * For the k-th association the residual is sqrt(w_k) * (y_k - (R(q / |q|) * x_k + t)), which is
+ * the same cost as an ErrorTerm wrapped in a ScaledLoss of weight w_k. Every associated point is
+ * stored once, in float structure-of-arrays buffers (the precision of the clouds), and the
+ * associations are (source index, target index, weight) arrays into them. The associations of a
+ * source point are contiguous, so its rotation and the Jacobian w.r.t. the quaternion, computed
+ * analytically, are shared by all of them.
+ *
+ * When the associations come with a TargetGeometry, the residual is sqrt(w_k) * L_k (y_k - (R x_k + t)),
+ * with L_k the square root information matrix of y_k, stored with the other target buffers.
+ * Pruned associations, see prune(), have null residuals and Jacobians that are not computed, and
+ * compact() drops them from the residuals altogether.
+ *
+ * Scalar, float or double, is the type of the weights and of the squared errors handed to the
+ * weight updates: with float these per association arrays take half the memory traffic. The
+ * residuals and the Jacobians are always double, for Ceres.
+ */
+template <typename Scalar>
+class BasicBatchedErrorTerm : public ceres::CostFunction
+{
+public:
+    static const int kResiduals = 3;
+
+    BasicBatchedErrorTerm(): executor_(&defaultExecutor())
+    {
+        mutable_parameter_block_sizes()->push_back(4);
+        mutable_parameter_block_sizes()->push_back(3);
+        set_num_residuals(0);
+    }
+
+    BasicBatchedErrorTerm(const pcl::PointCloud<pcl::PointXYZ> &source_cloud,
+                          const pcl::PointCloud<pcl::PointXYZ> &target_cloud,
+                          const Eigen::SparseMatrix<double, Eigen::RowMajor> &data_association):
+        BasicBatchedErrorTerm()
+    {
+        setAssociations(source_cloud, target_cloud, data_association);
+    }
+
+    // Runs the per association loops, it must outlive this object
+    void setExecutor(Executor *executor)
+    {
+        executor_ = executor;
+    }
+
+    // Replaces the point pairs, reusing the storage of the previous ones. All weights are reset to 1.
+    void setAssociations(const pcl::PointCloud<pcl::PointXYZ> &source_cloud,
+                         const pcl::PointCloud<pcl::PointXYZ> &target_cloud,
+                         const Eigen::SparseMatrix<double, Eigen::RowMajor> &data_association)
+    {
+        assignAssociations(source_cloud, [&](int index) {
+            return target_cloud[index];
+        }, data_association);
+    }
+
+    /**
+     * Same, the target points are fetched from the search structure the associations come from.
+     * With a geometry (of target) the residuals are point-to-plane or point-to-distribution.
+     */
+    void setAssociations(const pcl::PointCloud<pcl::PointXYZ> &source_cloud, const NeighbourSearch &target,
+                         const Eigen::SparseMatrix<double, Eigen::RowMajor> &data_association,
+                         const TargetGeometry *geometry = NULL)
+    {
+        assignAssociations(source_cloud, [&](int index) {
+            return target.point(index);
+        }, data_association);
+        if (geometry != NULL) {
+            target_sqrt_information_.resize(kInformationSize * target_points_.size());
+            for (std::size_t j = 0; j < target_points_.size(); j++) {
+                InformationMap(target_sqrt_information_.data() + kInformationSize * j) =
+                    geometry->sqrtInformation(target_points_[j]);
+            }
+        }
+    }
+
+    // Whether the residuals are y - (R x + t), the ones Procrustes fits
+    bool isPointToPoint() const
+    {
+        return target_sqrt_information_.empty();
+    }
+
+    bool Evaluate(double const *const *parameters, double *residuals, double **jacobians) const override
+    {
+        const double *rotation = parameters[0];
+        const double *translation = parameters[1];
+        const double norm = std::sqrt(rotation[0] * rotation[0] + rotation[1] * rotation[1] +
+                                      rotation[2] * rotation[2] + rotation[3] * rotation[3]);
+        const Eigen::Vector4d q(rotation[0] / norm, rotation[1] / norm, rotation[2] / norm,
+                                rotation[3] / norm);
+        const Eigen::Matrix3d rot = internal::rotationMatrix(q);
+        const Eigen::Vector3d t(translation[0], translation[1], translation[2]);
+        double *rotation_jacobian = jacobians != NULL ? jacobians[0] : NULL;
+        double *translation_jacobian = jacobians != NULL ? jacobians[1] : NULL;
+
+        parallelForBlocks(*executor_, numSourcePoints(), [&](int, int begin, int end) {
+            Eigen::Matrix<double, 3, 4> d_rotated;
+            for (int source = begin; source < end; source++) {
+                const Eigen::Vector3d x = sourcePointByIndex(source);
+                const Eigen::Vector3d rotated = rot * x;
+                if (rotation_jacobian != NULL) {
+                    // The residual is y - R x - t
+                    d_rotated = -internal::rotatedPointJacobian(q, norm, x, rotated);
+                }
+                for (int k = source_begin_[source]; k < source_begin_[source + 1]; k++) {
+                    const int row = residual_row_[k];
+                    if (row < 0) {
+                        continue;
+                    }
+                    if (!active_[k]) {
+                        std::fill_n(residuals + kResiduals * row, kResiduals, 0.0);
+                        if (rotation_jacobian != NULL) {
+                            std::fill_n(rotation_jacobian + 12 * row, 12, 0.0);
+                        }
+                        if (translation_jacobian != NULL) {
+                            std::fill_n(translation_jacobian + 9 * row, 9, 0.0);
+                        }
+                        continue;
+                    }
+                    const int target = target_index_[k];
+                    const double scale = std::sqrt(static_cast<double>(weights_[k]));
+                    if (!isPointToPoint()) {
+                        const Eigen::Matrix3d sqrt_information = sqrtInformationByIndex(target);
+                        const Eigen::Vector3d difference = targetPointByIndex(target) - rotated - t;
+                        Eigen::Map<Eigen::Vector3d>(residuals + kResiduals * row) =
+                            scale * sqrt_information * difference;
+                        if (rotation_jacobian != NULL) {
+                            Eigen::Map<Eigen::Matrix<double, 3, 4, Eigen::RowMajor>>(rotation_jacobian + 12 * row) =
+                                scale * sqrt_information * d_rotated;
+                        }
+                        if (translation_jacobian != NULL) {
+                            Eigen::Map<Eigen::Matrix<double, 3, 3, Eigen::RowMajor>>(translation_jacobian + 9 * row) =
+                                -scale * sqrt_information;
+                        }
+                        continue;
+                    }
+                    residuals[kResiduals * row] = scale * (target_x_[target] - rotated[0] - t[0]);
+                    residuals[kResiduals * row + 1] = scale * (target_y_[target] - rotated[1] - t[1]);
+                    residuals[kResiduals * row + 2] = scale * (target_z_[target] - rotated[2] - t[2]);
+                    if (rotation_jacobian != NULL) {
+                        Eigen::Map<Eigen::Matrix<double, 3, 4, Eigen::RowMajor>>(rotation_jacobian + 12 * row) =
+                            scale * d_rotated;
+                    }
+                    if (translation_jacobian != NULL) {
+                        Eigen::Map<Eigen::Matrix<double, 3, 3, Eigen::RowMajor>>(translation_jacobian + 9 * row) =
+                            -scale * Eigen::Matrix3d::Identity();
+                    }
+                }
+            }
+        }, minParallelSourcePoints());
+        return true;
+    }
+
+    /**
+     * Unweighted squared residual norm of every association, in data association order. With
+     * active_only the entries of the pruned associations are left untouched.
+     */
+    void squaredErrors(const double *rotation, const double *translation,
+                       std::vector<Scalar> *squared_errors, bool active_only = false) const
+    {
+        const double norm = std::sqrt(rotation[0] * rotation[0] + rotation[1] * rotation[1] +
+                                      rotation[2] * rotation[2] + rotation[3] * rotation[3]);
+        const Eigen::Matrix3d rot = internal::rotationMatrix(Eigen::Vector4d(rotation[0] / norm, rotation[1] / norm,
+                                                                             rotation[2] / norm, rotation[3] / norm));
+        const Eigen::Vector3d t(translation[0], translation[1], translation[2]);
+        squared_errors->resize(size());
+        parallelForBlocks(*executor_, numSourcePoints(), [&](int, int begin, int end) {
+            for (int source = begin; source < end; source++) {
+                const Eigen::Vector3d moved = rot * sourcePointByIndex(source) + t;
+                for (int k = source_begin_[source]; k < source_begin_[source + 1]; k++) {
+                    if (active_only && !active_[k]) {
+                        continue;
+                    }
+                    const int target = target_index_[k];
+                    if (isPointToPoint()) {
+                        (*squared_errors)[k] = (targetPointByIndex(target) - moved).squaredNorm();
+                    } else {
+                        (*squared_errors)[k] = (sqrtInformationByIndex(target) *
+                                                (targetPointByIndex(target) - moved)).squaredNorm();
+                    }
+                }
+            }
+        }, minParallelSourcePoints());
+    }
+
+    std::vector<Scalar> &weights()
+    {
+        return weights_;
+    }
+
+    double weight(int k) const
+    {
+        return weights_[k];
+    }
+
+    // Deactivates, with a null weight, the associations whose weight is below min_weight. Returns the active ones.
+    int prune(double min_weight)
+    {
+        int num_active = 0;
+        for (std::size_t k = 0; k < weights_.size(); k++) {
+            if (!active_[k] || weights_[k] < min_weight) {
+                active_[k] = false;
+                weights_[k] = 0;
+            } else {
+                num_active++;
+            }
+        }
+        return num_active;
+    }
+
+    // The associations that compact() dropped only get their residuals back at the next compact()
+    void activateAll()
+    {
+        active_.assign(weights_.size(), true);
+    }
+
+    /**
+     * Keeps only the active associations in the residuals, e.g. for a Ceres solve that no longer
+     * factors the rows of the pruned ones. The number of residuals changes: the cost function
+     * must be added to its problem again. Returns the associations kept.
+     */
+    int compact()
+    {
+        int rows = 0;
+        for (std::size_t k = 0; k < active_.size(); k++) {
+            residual_row_[k] = active_[k] ? rows++ : -1;
+        }
+        set_num_residuals(kResiduals * rows);
+        return rows;
+    }
+
+    bool isActive(int k) const
+    {
+        return active_[k];
+    }
+
+    int numActive() const
+    {
+        return std::count(active_.begin(), active_.end(), true);
+    }
+
+    // Source point of the k-th association
+    Eigen::Vector3d sourcePoint(int k) const
+    {
+        return sourcePointByIndex(source_index_[k]);
+    }
+
+    // Target point of the k-th association
+    Eigen::Vector3d targetPoint(int k) const
+    {
+        return targetPointByIndex(target_index_[k]);
+    }
+
+    int size() const
+    {
+        return weights_.size();
+    }
+
+private:
+    template <typename TargetPointAt>
+    void assignAssociations(const pcl::PointCloud<pcl::PointXYZ> &source_cloud, TargetPointAt target_point_at,
+                         const Eigen::SparseMatrix<double, Eigen::RowMajor> &data_association)
+    {
+        const std::size_t num_associations = data_association.nonZeros();
+        source_index_.resize(num_associations);
+        target_index_.resize(num_associations);
+        source_x_.clear();
+        source_y_.clear();
+        source_z_.clear();
+        source_begin_.clear();
+        // The associated source points, in row order
+        int k = 0;
+        for (int i = 0; i < data_association.outerSize(); i++) {
+            Eigen::SparseMatrix<double, Eigen::RowMajor>::InnerIterator it(data_association, i);
+            if (!it) {
+                continue;
+            }
+            const int source = source_x_.size();
+            const pcl::PointXYZ &source_point = source_cloud[i];
+            source_x_.push_back(source_point.x);
+            source_y_.push_back(source_point.y);
+            source_z_.push_back(source_point.z);
+            source_begin_.push_back(k);
+            for (; it; ++it, ++k) {
+                source_index_[k] = source;
+                target_index_[k] = it.col();
+            }
+        }
+        source_begin_.push_back(k);
+        // The associated target points, in increasing index order
+        target_points_.assign(target_index_.begin(), target_index_.end());
+        std::sort(target_points_.begin(), target_points_.end());
+        target_points_.erase(std::unique(target_points_.begin(), target_points_.end()), target_points_.end());
+        target_x_.resize(target_points_.size());
+        target_y_.resize(target_points_.size());
+        target_z_.resize(target_points_.size());
+        for (std::size_t j = 0; j < target_points_.size(); j++) {
+            const pcl::PointXYZ target_point = target_point_at(target_points_[j]);
+            target_x_[j] = target_point.x;
+            target_y_[j] = target_point.y;
+            target_z_[j] = target_point.z;
+        }
+        for (int &target : target_index_) {
+            target = std::lower_bound(target_points_.begin(), target_points_.end(), target) - target_points_.begin();
+        }
+        target_sqrt_information_.clear();
+        weights_.assign(num_associations, 1.0);
+        active_.assign(num_associations, true);
+        residual_row_.resize(num_associations);
+        std::iota(residual_row_.begin(), residual_row_.end(), 0);
+        set_num_residuals(kResiduals * num_associations);
+    }
+
+
+    static const int kMinParallelAssociations = 4096;
+    static const int kInformationSize = 9;
+    typedef Eigen::Map<Eigen::Matrix<float, 3, 3, Eigen::RowMajor>> InformationMap;
+
+    int numSourcePoints() const
+    {
+        return source_x_.size();
+    }
+
+    // The loops over the source points run in parallel above kMinParallelAssociations associations
+    int minParallelSourcePoints() const
+    {
+        return size() > kMinParallelAssociations ? 0 : std::numeric_limits<int>::max();
+    }
+
+    Eigen::Vector3d sourcePointByIndex(int source) const
+    {
+        return Eigen::Vector3d(source_x_[source], source_y_[source], source_z_[source]);
+    }
+
+    Eigen::Vector3d targetPointByIndex(int target) const
+    {
+        return Eigen::Vector3d(target_x_[target], target_y_[target], target_z_[target]);
+    }
+
+    Eigen::Matrix3d sqrtInformationByIndex(int target) const
+    {
+        return Eigen::Map<const Eigen::Matrix<float, 3, 3, Eigen::RowMajor>>(
+                   target_sqrt_information_.data() + kInformationSize * target).cast<double>();
+    }
+
+    std::vector<float> source_x_;
+    std::vector<float> source_y_;
+    std::vector<float> source_z_;
+    // The associations of source point s are [source_begin_[s], source_begin_[s + 1])
+    std::vector<int> source_begin_;
+    std::vector<float> target_x_;
+    std::vector<float> target_y_;
+    std::vector<float> target_z_;
+    // Row-major L of the stored target points, empty for point-to-point residuals
+    std::vector<float> target_sqrt_information_;
+    // Cloud index of the stored target points, only used while building the buffers
+    std::vector<int> target_points_;
+    std::vector<int> source_index_;
+    std::vector<int> target_index_;
+    std::vector<Scalar> weights_;
+    // Pruned associations have a null weight and are not evaluated, see prune()
+    std::vector<char> active_;
+    // The residuals of the k-th association are rows [3 * r, 3 * r + 3) for r = residual_row_[k], -1 when
+    // compact() dropped it
+    std::vector<int> residual_row_;
+    Executor *executor_;
+};
+
+typedef BasicBatchedErrorTerm<double> BatchedErrorTerm;
+
+}  // namespace prob_point_cloud_registration
+
+#endif
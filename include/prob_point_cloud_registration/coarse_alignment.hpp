@@ -0,0 +1,112 @@
+#ifndef PROB_POINT_CLOUD_REGISTRATION_COARSE_ALIGNMENT_HPP
+#define PROB_POINT_CLOUD_REGISTRATION_COARSE_ALIGNMENT_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include <Eigen/Geometry>
+#include <pcl/common/centroid.h>
+#include <pcl/common/transforms.h>
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+
+#include "prob_point_cloud_registration/executor.hpp"
+#include "prob_point_cloud_registration/neighbour_search.hpp"
+#include "prob_point_cloud_registration/prob_point_cloud_registration_params.hpp"
+#include "prob_point_cloud_registration/utilities.hpp"
+
+namespace prob_point_cloud_registration {
+
+// A candidate pose of the source and its robust score, the lower the better
+struct ScoredPose {
+    Eigen::Affine3d pose;
+    double score;
+};
+
+/**
+ * The starting poses tried by the coarse alignment: the identity first, then the rotations of
+ * parameters about the centroid of source, evenly spaced about the z axis or, without yaw_only,
+ * spread over all the rotations (a super-Fibonacci spiral of quaternions). With target_cloud,
+ * each rotation is also tried with the centroid of source moved onto the one of target_cloud.
+ */
+inline std::vector<Eigen::Affine3d> coarseHypotheses(const pcl::PointCloud<pcl::PointXYZ> &source,
+                                                     const pcl::PointCloud<pcl::PointXYZ> *target_cloud,
+                                                     const CoarseAlignmentParams &parameters)
+{
+    Eigen::Vector4d source_centroid;
+    pcl::compute3DCentroid(source, source_centroid);
+    std::vector<Eigen::Vector3d> centres(1, source_centroid.head<3>());
+    Eigen::Vector4d target_centroid;
+    if (target_cloud != NULL && parameters.align_centroids && pcl::compute3DCentroid(*target_cloud, target_centroid)) {
+        centres.push_back(target_centroid.head<3>());
+    }
+    std::vector<Eigen::Quaterniond> rotations;
+    for (int i = 0; i < parameters.num_rotations; i++) {
+        if (parameters.yaw_only) {
+            rotations.push_back(Eigen::Quaterniond(Eigen::AngleAxisd(2 * M_PI * i / parameters.num_rotations,
+                                                                     Eigen::Vector3d::UnitZ())));
+        } else if (i == 0) {
+            rotations.push_back(Eigen::Quaterniond::Identity());
+        } else {
+            // Alexa, "Super-Fibonacci spirals", CVPR 2022
+            const double s = i - 0.5;
+            const double r = std::sqrt(s / (parameters.num_rotations - 1));
+            const double radius = std::sqrt(1 - s / (parameters.num_rotations - 1));
+            const double alpha = 2 * M_PI * s / std::sqrt(2.0);
+            const double beta = 2 * M_PI * s / 1.533751168755204288118041;
+            rotations.push_back(Eigen::Quaterniond(radius * std::cos(beta), r * std::sin(alpha), r * std::cos(alpha),
+                                                   radius * std::sin(beta)));
+        }
+    }
+    std::vector<Eigen::Affine3d> hypotheses(1, Eigen::Affine3d::Identity());
+    for (const Eigen::Vector3d &centre : centres) {
+        for (const Eigen::Quaterniond &rotation : rotations) {
+            Eigen::Affine3d pose = Eigen::Translation3d(centre) * rotation.normalized() *
+                                   Eigen::Translation3d(-source_centroid.head<3>());
+            if (!pose.isApprox(Eigen::Affine3d::Identity())) {
+                hypotheses.push_back(pose);
+            }
+        }
+    }
+    return hypotheses;
+}
+
+/**
+ * ClosestDistances::robustSum() of source moved by each of poses against target, the poses being
+ * scored concurrently through executor, sorted by increasing score (by index on ties).
+ */
+inline std::vector<ScoredPose> scorePoses(const pcl::PointCloud<pcl::PointXYZ> &source, const NeighbourSearch &target,
+                                          const std::vector<Eigen::Affine3d> &poses, double robust_factor,
+                                          Executor &executor = defaultExecutor())
+{
+    std::vector<ScoredPose> scored(poses.size());
+    executor.parallelFor(poses.size(), [&](int i) {
+        pcl::PointCloud<pcl::PointXYZ> moved;
+        pcl::transformPointCloud(source, moved, poses[i]);
+        OpenMPExecutor serial(1);
+        scored[i].pose = poses[i];
+        scored[i].score = ClosestDistances(moved, target, serial).robustSum(robust_factor);
+    });
+    std::stable_sort(scored.begin(), scored.end(), [](const ScoredPose &a, const ScoredPose &b) {
+        return a.score < b.score;
+    });
+    return scored;
+}
+
+// At most num_points points of cloud, evenly strided
+inline pcl::PointCloud<pcl::PointXYZ> stridedSubset(const pcl::PointCloud<pcl::PointXYZ> &cloud, int num_points)
+{
+    pcl::PointCloud<pcl::PointXYZ> subset;
+    const std::size_t stride = num_points > 0 ? std::max<std::size_t>(1, (cloud.size() + num_points - 1) / num_points) :
+                               1;
+    subset.reserve(cloud.size() / stride + 1);
+    for (std::size_t i = 0; i < cloud.size(); i += stride) {
+        subset.push_back(cloud[i]);
+    }
+    return subset;
+}
+
+}  // namespace prob_point_cloud_registration
+
+#endif
@@ -0,0 +1,97 @@
+#ifndef PROB_POINT_CLOUD_REGISTRATION_CUDA_KERNELS_HPP
+#define PROB_POINT_CLOUD_REGISTRATION_CUDA_KERNELS_HPP
+
+#include <cstdint>
+#include <memory>
+
+#ifdef __CUDACC__
+#define PROB_POINT_CLOUD_REGISTRATION_HOST_DEVICE __host__ __device__
+#else
+#define PROB_POINT_CLOUD_REGISTRATION_HOST_DEVICE
+#endif
+
+/**
+ * Host interface of the kernels of cuda_kernels.cu, on plain arrays so that nvcc never compiles
+ * the PCL and Eigen headers: see CudaTarget for the user side. The CUDA errors are thrown as
+ * std::runtime_error.
+ */
+namespace prob_point_cloud_registration {
+namespace cuda {
+
+// The most neighbours a source point keeps on the device
+const int kMaxNeighbours = 64;
+
+// The coordinates of a grid cell packed in 21 bits each, cells within 2^20 of the origin
+PROB_POINT_CLOUD_REGISTRATION_HOST_DEVICE inline std::uint64_t cellKey(int x, int y, int z)
+{
+    const std::uint64_t mask = (static_cast<std::uint64_t>(1) << 21) - 1;
+    const int offset = 1 << 20;
+    return ((static_cast<std::uint64_t>(x + offset) & mask) << 42) |
+           ((static_cast<std::uint64_t>(y + offset) & mask) << 21) |
+           (static_cast<std::uint64_t>(z + offset) & mask);
+}
+
+bool deviceAvailable();
+
+// The sums of an E-step, as in WeightedMoments, cross_sum being row-major
+struct Moments {
+    double total_weight;
+    double source_sum[3];
+    double target_sum[3];
+    double cross_sum[9];
+    double cost;
+};
+
+// A target grid, read-only once uploaded
+class DeviceGrid
+{
+public:
+    /**
+     * points holds 3 floats per target point. The num_cells cells, of side 1 / inverse_cell_size,
+     * come by increasing cellKey(): the points of cell c are cell_points[cell_begin[c]] up to
+     * cell_points[cell_begin[c + 1]].
+     */
+    DeviceGrid(const float *points, int num_points, const std::uint64_t *cell_keys, const int *cell_begin,
+               int num_cells, const int *cell_points, float inverse_cell_size);
+    ~DeviceGrid();
+
+private:
+    friend class DeviceSource;
+    struct Buffers;
+    std::unique_ptr<Buffers> buffers_;
+};
+
+// A source and its associations, on the device, with a stream of its own
+class DeviceSource
+{
+public:
+    DeviceSource();
+    ~DeviceSource();
+
+    /**
+     * Uploads source, 3 floats per point, and associates every point with its (at most
+     * max_neighbours, in [1, kMaxNeighbours]) closest points of grid within radius, by increasing
+     * (squared distance, index). indices and squared_distances get max_neighbours entries per
+     * point, row_sizes how many of them are set. grid must outlive the next expectation() calls.
+     */
+    void associate(const DeviceGrid &grid, const float *source, int size, float radius, int max_neighbours,
+                   int *indices, float *squared_distances, int *row_sizes);
+
+    /**
+     * The weights of the last associations with the source moved by rotation (row-major) and
+     * translation, t-distributed with dof degrees of freedom (gaussian when infinite), and their
+     * sums. The weights stay on the device. The sums are accumulated with atomics, in the order the
+     * warps end, unless deterministic: then each block sums its warps in order and the host sums
+     * the blocks in order.
+     */
+    Moments expectation(const double rotation[9], const double translation[3], double dof, bool deterministic);
+
+private:
+    struct Buffers;
+    std::unique_ptr<Buffers> buffers_;
+};
+
+}  // namespace cuda
+}  // namespace prob_point_cloud_registration
+
+#endif
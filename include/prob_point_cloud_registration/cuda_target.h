@@ -0,0 +1,112 @@
+#ifndef PROB_POINT_CLOUD_REGISTRATION_CUDA_TARGET_HPP
+#define PROB_POINT_CLOUD_REGISTRATION_CUDA_TARGET_HPP
+
+#include <memory>
+#include <vector>
+
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+
+#include "prob_point_cloud_registration/data_association.hpp"
+#include "prob_point_cloud_registration/neighbour_search.hpp"
+#include "prob_point_cloud_registration/procrustes.hpp"
+
+namespace prob_point_cloud_registration {
+
+namespace cuda {
+class DeviceGrid;
+class DeviceSource;
+}  // namespace cuda
+
+/**
+ * A source cloud and its associations held on the device by CudaTarget::associate(), with the
+ * staging of what comes back. One per registration: the buffers are kept across the calls.
+ */
+class DeviceAssociation
+{
+public:
+    DeviceAssociation();
+    ~DeviceAssociation();
+
+    /**
+     * The E-step of the associations with the source moved by rotation (w, x, y, z) and
+     * translation: point-to-point residuals, t-distributed weights of dof degrees of freedom
+     * (gaussian when infinite). The weights stay on the device, only their sums come back, in a
+     * fixed order when deterministic.
+     */
+    WeightedMoments expectation(const double rotation[4], const double translation[3], double dof,
+                                bool deterministic = false);
+
+private:
+    friend class CudaTarget;
+    std::unique_ptr<cuda::DeviceSource> device_;
+    std::vector<float> source_;
+    std::vector<int> indices_;
+    std::vector<float> squared_distances_;
+    std::vector<int> row_sizes_;
+};
+
+/**
+ * A target held on the GPU as well, in a voxel grid of cells of the search radius: associate()
+ * runs the radius search of a whole source cloud there and DeviceAssociation::expectation() the
+ * E-steps of the probabilistic weights, one thread per source point. Only the associations and
+ * the weighted sums of the Procrustes M-steps come back (see ProbPointCloudRegistrationIteration).
+ * The queries of NeighbourSearch run on the host, on a VoxelHashSearch of the same cloud.
+ *
+ * Only built with USE_CUDA, see NeighbourSearchType::CUDA.
+ */
+class CudaTarget : public NeighbourSearch
+{
+public:
+    // Throws std::runtime_error without a CUDA device
+    CudaTarget(pcl::PointCloud<pcl::PointXYZ>::ConstPtr cloud, double cell_size);
+    ~CudaTarget() override;
+
+    // Whether a CUDA device is there
+    static bool available();
+
+    // Whether associate() takes max_neighbours: a bounded number, up to 64
+    static bool supports(int max_neighbours);
+
+    /**
+     * The associations computeDataAssociation() would find, computed on the device where
+     * device_association keeps them for its expectation(). Concurrent calls need distinct device
+     * associations.
+     */
+    void associate(const pcl::PointCloud<pcl::PointXYZ> &source, double radius, int max_neighbours,
+                   DeviceAssociation *device_association, DataAssociation *data_association) const;
+
+    int radiusSearch(const pcl::PointXYZ &point, double radius, int max_neighbours, std::vector<int> &indices,
+                     std::vector<float> &squared_distances) const override
+    {
+        return host_search_.radiusSearch(point, radius, max_neighbours, indices, squared_distances);
+    }
+
+    bool nearestSearch(const pcl::PointXYZ &point, int &index, float &squared_distance) const override
+    {
+        return host_search_.nearestSearch(point, index, squared_distance);
+    }
+
+    int size() const override
+    {
+        return host_search_.size();
+    }
+
+    pcl::PointXYZ point(int index) const override
+    {
+        return host_search_.point(index);
+    }
+
+    pcl::PointCloud<pcl::PointXYZ>::ConstPtr cloud() const override
+    {
+        return host_search_.cloud();
+    }
+
+private:
+    VoxelHashSearch host_search_;
+    std::unique_ptr<cuda::DeviceGrid> device_;
+};
+
+}  // namespace prob_point_cloud_registration
+
+#endif
@@ -0,0 +1,376 @@
+#ifndef PROB_POINT_CLOUD_REGISTRATION_DATA_ASSOCIATION_HPP
+#define PROB_POINT_CLOUD_REGISTRATION_DATA_ASSOCIATION_HPP
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <limits>
+#include <utility>
+#include <vector>
+
+#include <Eigen/Core>
+#include <Eigen/Sparse>
+#include <pcl/kdtree/kdtree_flann.h>
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+
+#include "prob_point_cloud_registration/executor.hpp"
+#include "prob_point_cloud_registration/neighbour_search.hpp"
+
+namespace prob_point_cloud_registration {
+
+/**
+ * The associations of the source points (rows) with the target points (columns), filled with at
+ * most stride entries per row. Each row is written in place, concurrently with the other rows,
+ * at a fixed offset of row * stride in the storage of a row-major matrix. finish() then compacts
+ * the rows into a compressed matrix, without sorting or copying through triplets. The storage
+ * is kept by the next fills, so an object reused across outer iterations stops allocating once
+ * it has seen the largest one.
+ */
+class DataAssociation
+{
+public:
+    // Starts a fill, every row is empty until set
+    void reset(int rows, int cols, int stride)
+    {
+        assert(stride > 0);
+        stride_ = stride;
+        matrix_.resize(rows, cols);
+        matrix_.resizeNonZeros(static_cast<std::size_t>(rows) * stride);
+        row_sizes_.assign(rows, 0);
+    }
+
+    // The first min(size, stride) neighbours of a query, in search order
+    void setRow(int row, const std::vector<int> &indices, const std::vector<float> &squared_distances)
+    {
+        setRow(row, indices.data(), squared_distances.data(), indices.size());
+    }
+
+    void setRow(int row, const int *indices, const float *squared_distances, int size)
+    {
+        size = std::min(size, stride_);
+        int *row_indices = matrix_.innerIndexPtr() + static_cast<std::size_t>(row) * stride_;
+        double *row_values = matrix_.valuePtr() + static_cast<std::size_t>(row) * stride_;
+        for (int k = 0; k < size; k++) {
+            row_indices[k] = indices[k];
+            row_values[k] = squared_distances[k];
+        }
+        sortRow(row_indices, row_values, size);
+        row_sizes_[row] = size;
+    }
+
+    // Same, with (squared distance, index) entries
+    void setRow(int row, const std::vector<std::pair<float, int>> &neighbours)
+    {
+        const int size = std::min<int>(neighbours.size(), stride_);
+        int *row_indices = matrix_.innerIndexPtr() + static_cast<std::size_t>(row) * stride_;
+        double *row_values = matrix_.valuePtr() + static_cast<std::size_t>(row) * stride_;
+        for (int k = 0; k < size; k++) {
+            row_indices[k] = neighbours[k].second;
+            row_values[k] = neighbours[k].first;
+        }
+        sortRow(row_indices, row_values, size);
+        row_sizes_[row] = size;
+    }
+
+    // Closes the fill: the rows are moved, in order, over the unused slots
+    void finish()
+    {
+        int *outer_index = matrix_.outerIndexPtr();
+        int *inner_index = matrix_.innerIndexPtr();
+        double *values = matrix_.valuePtr();
+        int offset = 0;
+        for (std::size_t row = 0; row < row_sizes_.size(); row++) {
+            outer_index[row] = offset;
+            const std::size_t begin = row * stride_;
+            if (static_cast<std::size_t>(offset) != begin) {
+                // Never past the source, offset <= begin
+                std::copy(inner_index + begin, inner_index + begin + row_sizes_[row], inner_index + offset);
+                std::copy(values + begin, values + begin + row_sizes_[row], values + offset);
+            }
+            offset += row_sizes_[row];
+        }
+        outer_index[row_sizes_.size()] = offset;
+        matrix_.resizeNonZeros(offset);
+    }
+
+    // Replaces the associations by the compressed matrix
+    void assign(Eigen::SparseMatrix<double, Eigen::RowMajor> matrix)
+    {
+        matrix_.swap(matrix);
+        row_sizes_.clear();
+    }
+
+    // Compressed, like setFromTriplets() would build it: the columns of a row are increasing
+    const Eigen::SparseMatrix<double, Eigen::RowMajor> &matrix() const
+    {
+        return matrix_;
+    }
+
+    // Hands the matrix over, the next fill allocates again
+    Eigen::SparseMatrix<double, Eigen::RowMajor> release()
+    {
+        Eigen::SparseMatrix<double, Eigen::RowMajor> matrix;
+        matrix.swap(matrix_);
+        return matrix;
+    }
+
+private:
+    // By column, insertion sort as the rows hold at most a few tens of entries
+    static void sortRow(int *indices, double *values, int size)
+    {
+        for (int k = 1; k < size; k++) {
+            const int index = indices[k];
+            const double value = values[k];
+            int j = k;
+            for (; j > 0 && indices[j - 1] > index; j--) {
+                indices[j] = indices[j - 1];
+                values[j] = values[j - 1];
+            }
+            indices[j] = index;
+            values[j] = value;
+        }
+    }
+
+    Eigen::SparseMatrix<double, Eigen::RowMajor> matrix_;
+    std::vector<int> row_sizes_;
+    int stride_ = 1;
+};
+
+namespace internal {
+
+// Concatenates per-block triplet buffers, in block order, into a compressed association matrix
+inline Eigen::SparseMatrix<double, Eigen::RowMajor> assembleDataAssociation(
+    const std::vector<std::vector<Eigen::Triplet<double>>> &block_triplets, int rows, int cols)
+{
+    std::vector<Eigen::Triplet<double>> tripletList;
+    std::size_t num_triplets = 0;
+    for (const auto &triplets : block_triplets) {
+        num_triplets += triplets.size();
+    }
+    tripletList.reserve(num_triplets);
+    for (const auto &triplets : block_triplets) {
+        tripletList.insert(tripletList.end(), triplets.begin(), triplets.end());
+    }
+    Eigen::SparseMatrix<double, Eigen::RowMajor> data_association(rows, cols);
+    data_association.setFromTriplets(tripletList.begin(), tripletList.end());
+    data_association.makeCompressed();
+    return data_association;
+}
+
+/**
+ * Runs search(i, neighbours, distances) for every source point i, in parallel blocks, and writes
+ * the neighbours in association. Unbounded neighbour sets (max_neighbours <= 0) have no stride:
+ * they go through per block triplet buffers, concatenated in block order.
+ */
+template <typename Search>
+void associate(int num_points, int num_targets, int max_neighbours, Executor &executor, Search search,
+               DataAssociation *association)
+{
+    if (max_neighbours > 0) {
+        association->reset(num_points, num_targets, max_neighbours);
+        parallelForBlocks(executor, num_points, [&](int, int begin, int end) {
+            std::vector<int> neighbours;
+            std::vector<float> distances;
+            for (int i = begin; i < end; i++) {
+                search(i, neighbours, distances);
+                association->setRow(i, neighbours, distances);
+            }
+        });
+        association->finish();
+        return;
+    }
+    std::vector<std::vector<Eigen::Triplet<double>>> block_triplets(executor.numThreads());
+    parallelForBlocks(executor, num_points, [&](int block, int begin, int end) {
+        std::vector<Eigen::Triplet<double>> &triplets = block_triplets[block];
+        std::vector<int> neighbours;
+        std::vector<float> distances;
+        for (int i = begin; i < end; i++) {
+            search(i, neighbours, distances);
+            for (std::size_t k = 0; k < neighbours.size(); k++) {
+                triplets.push_back(Eigen::Triplet<double>(i, neighbours[k], distances[k]));
+            }
+        }
+    });
+    association->assign(assembleDataAssociation(block_triplets, num_points, num_targets));
+}
+
+}  // namespace internal
+
+/**
+ * Associates every source point with (at most) the max_neighbours closest target points within
+ * radius. Row i of the result holds the squared distances of the neighbours of source point i.
+ */
+inline void computeDataAssociation(const pcl::PointCloud<pcl::PointXYZ> &source_cloud,
+                                   const NeighbourSearch &target, double radius, int max_neighbours,
+                                   Executor &executor, DataAssociation *association)
+{
+    internal::associate(source_cloud.size(), target.size(), max_neighbours, executor,
+    [&](int i, std::vector<int> &neighbours, std::vector<float> &distances) {
+        target.radiusSearch(source_cloud[i], radius, max_neighbours, neighbours, distances);
+    }, association);
+}
+
+// Same, as a new matrix
+inline Eigen::SparseMatrix<double, Eigen::RowMajor> computeDataAssociation(
+    const pcl::PointCloud<pcl::PointXYZ> &source_cloud, const NeighbourSearch &target, double radius,
+    int max_neighbours, Executor &executor = defaultExecutor())
+{
+    DataAssociation association;
+    computeDataAssociation(source_cloud, target, radius, max_neighbours, executor, &association);
+    return association.release();
+}
+
+// Same, the columns are the indices of the cloud of kdtree
+inline Eigen::SparseMatrix<double, Eigen::RowMajor> computeDataAssociation(
+    const pcl::PointCloud<pcl::PointXYZ> &source_cloud, const pcl::PointCloud<pcl::PointXYZ> &target_cloud,
+    const pcl::KdTreeFLANN<pcl::PointXYZ> &kdtree, double radius, int max_neighbours,
+    Executor &executor = defaultExecutor())
+{
+    DataAssociation association;
+    internal::associate(source_cloud.size(), target_cloud.size(), max_neighbours, executor,
+    [&](int i, std::vector<int> &neighbours, std::vector<float> &distances) {
+        kdtree.radiusSearch(source_cloud, i, radius, neighbours, distances, max_neighbours);
+    }, &association);
+    return association.release();
+}
+
+/**
+ * Same result as computeDataAssociation() over a sequence of poses of the same source cloud,
+ * re-querying the target only for the points that moved significantly.
+ *
+ * A query caches the (at most 2 * max_neighbours) closest target points within
+ * radius * (1 + margin) of the point. The target points missing from the cache are farther than
+ * the last cached candidate, or than radius * (1 + margin) when the cache is not full. While a
+ * point moved by d <= margin * radius since its query, its neighbours are selected from the
+ * cache and kept if the farthest selected one (or radius, when fewer than max_neighbours are
+ * selected) is within that tail distance minus d; otherwise the point is queried again.
+ * The target and the executor must outlive this object.
+ */
+class IncrementalDataAssociation
+{
+public:
+    IncrementalDataAssociation(const NeighbourSearch &target, double radius, int max_neighbours, double margin,
+                               Executor &executor = defaultExecutor()):
+        target_(target), executor_(executor), radius_(radius), max_neighbours_(max_neighbours),
+        max_displacement_(margin * radius), cache_radius_((1 + margin) * radius),
+        cache_capacity_(2 * max_neighbours), num_queries_(0) {}
+
+    void compute(const pcl::PointCloud<pcl::PointXYZ> &source_cloud, DataAssociation *association)
+    {
+        const int num_points = source_cloud.size();
+        if (max_neighbours_ <= 0) {
+            // Unbounded neighbour sets do not fit the fixed size cache
+            num_queries_ = num_points;
+            computeDataAssociation(source_cloud, target_, radius_, max_neighbours_, executor_, association);
+            return;
+        }
+        if (num_points != static_cast<int>(query_points_.size())) {
+            query_points_.assign(num_points, Eigen::Vector3f::Constant(std::numeric_limits<float>::quiet_NaN()));
+            complete_radius_.assign(num_points, 0);
+            num_candidates_.assign(num_points, 0);
+            candidates_.assign(static_cast<std::size_t>(num_points) * cache_capacity_, 0);
+        }
+        association->reset(num_points, target_.size(), max_neighbours_);
+        std::vector<int> block_queries(executor_.numThreads(), 0);
+        parallelForBlocks(executor_, num_points, [&](int block, int begin, int end) {
+            std::vector<int> neighbours;
+            std::vector<float> distances;
+            std::vector<std::pair<float, int>> selected;
+            for (int i = begin; i < end; i++) {
+                const Eigen::Vector3f point = source_cloud[i].getVector3fMap();
+                // NaN for a point never queried, which fails the comparison
+                const float displacement = (point - query_points_[i]).norm();
+                if (!(displacement <= max_displacement_) || !select(i, point, displacement, &selected)) {
+                    query(i, point, &neighbours, &distances, &selected);
+                    block_queries[block]++;
+                }
+                association->setRow(i, selected);
+            }
+        });
+        association->finish();
+        int num_queries = 0;
+        for (int queries : block_queries) {
+            num_queries += queries;
+        }
+        num_queries_ = num_queries;
+    }
+
+    // Same, as a new matrix
+    Eigen::SparseMatrix<double, Eigen::RowMajor> compute(const pcl::PointCloud<pcl::PointXYZ> &source_cloud)
+    {
+        DataAssociation association;
+        compute(source_cloud, &association);
+        return association.release();
+    }
+
+    // Target queries done by the last compute()
+    int numQueries() const
+    {
+        return num_queries_;
+    }
+
+private:
+    // Neighbours of point i among its cached candidates, false when they may differ from a fresh query
+    bool select(int i, const Eigen::Vector3f &point, float displacement,
+                std::vector<std::pair<float, int>> *selected) const
+    {
+        const float squared_radius = radius_ * radius_;
+        selected->clear();
+        const int *candidates = &candidates_[static_cast<std::size_t>(i) * cache_capacity_];
+        for (int k = 0; k < num_candidates_[i]; k++) {
+            const float squared_distance = (target_.point(candidates[k]).getVector3fMap() - point).squaredNorm();
+            if (squared_distance <= squared_radius) {
+                selected->push_back(std::make_pair(squared_distance, candidates[k]));
+            }
+        }
+        float farthest = radius_;
+        if (static_cast<int>(selected->size()) >= max_neighbours_) {
+            std::nth_element(selected->begin(), selected->begin() + max_neighbours_ - 1, selected->end());
+            selected->resize(max_neighbours_);
+            farthest = std::sqrt(selected->back().first);
+        }
+        return farthest <= complete_radius_[i] - displacement;
+    }
+
+    void query(int i, const Eigen::Vector3f &point, std::vector<int> *neighbours, std::vector<float> *distances,
+               std::vector<std::pair<float, int>> *selected)
+    {
+        const pcl::PointXYZ search_point(point.x(), point.y(), point.z());
+        target_.radiusSearch(search_point, cache_radius_, cache_capacity_, *neighbours, *distances);
+        const int num_candidates = neighbours->size();
+        query_points_[i] = point;
+        num_candidates_[i] = num_candidates;
+        std::copy(neighbours->begin(), neighbours->end(), &candidates_[static_cast<std::size_t>(i) * cache_capacity_]);
+        complete_radius_[i] = num_candidates < cache_capacity_ ? cache_radius_ :
+                              std::sqrt(*std::max_element(distances->begin(), distances->end()));
+        const float squared_radius = radius_ * radius_;
+        selected->clear();
+        for (int k = 0; k < num_candidates; k++) {
+            if ((*distances)[k] <= squared_radius) {
+                selected->push_back(std::make_pair((*distances)[k], (*neighbours)[k]));
+            }
+        }
+        if (static_cast<int>(selected->size()) > max_neighbours_) {
+            std::nth_element(selected->begin(), selected->begin() + max_neighbours_ - 1, selected->end());
+            selected->resize(max_neighbours_);
+        }
+    }
+
+    const NeighbourSearch &target_;
+    Executor &executor_;
+    double radius_;
+    int max_neighbours_;
+    float max_displacement_;
+    float cache_radius_;
+    int cache_capacity_;
+    int num_queries_;
+    std::vector<Eigen::Vector3f> query_points_;
+    std::vector<float> complete_radius_;
+    std::vector<int> num_candidates_;
+    std::vector<int> candidates_;
+};
+
+}  // namespace prob_point_cloud_registration
+
+#endif
@@ -0,0 +1,143 @@
+#ifndef PROB_POINT_CLOUD_REGISTRATION_EXECUTOR_HPP
+#define PROB_POINT_CLOUD_REGISTRATION_EXECUTOR_HPP
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include <algorithm>
+#include <functional>
+#include <thread>
+#include <vector>
+
+namespace prob_point_cloud_registration {
+
+/**
+ * Runs the parallel sections of a registration: data association, squared errors, weight
+ * updates and the residual evaluation. Its thread count is also the one given to Ceres, which
+ * manages its own threads.
+ *
+ * parallelFor() may be called concurrently by several registrations and from inside one of
+ * its own tasks. In the latter case an implementation backed by a fixed pool should run the
+ * tasks on the calling thread rather than wait for workers that are all busy.
+ */
+class Executor
+{
+public:
+    virtual ~Executor() {}
+
+    // How many tasks may run at the same time
+    virtual int numThreads() const = 0;
+
+    // Runs task(0), ..., task(num_tasks - 1) and returns once all of them are done
+    virtual void parallelFor(int num_tasks, const std::function<void(int)> &task) = 0;
+};
+
+// OpenMP parallel for, serial when called from inside another parallel region
+class OpenMPExecutor : public Executor
+{
+public:
+    // 0 threads for one per hardware thread
+    explicit OpenMPExecutor(int num_threads = 0):
+        num_threads_(num_threads > 0 ? num_threads : std::max(1u, std::thread::hardware_concurrency())) {}
+
+    int numThreads() const override
+    {
+        return num_threads_;
+    }
+
+    void parallelFor(int num_tasks, const std::function<void(int)> &task) override
+    {
+#ifdef _OPENMP
+        const int num_threads = std::min(num_threads_, num_tasks);
+        if (num_threads > 1 && !omp_in_parallel()) {
+            #pragma omp parallel for schedule(static) num_threads(num_threads)
+            for (int i = 0; i < num_tasks; i++) {
+                task(i);
+            }
+            return;
+        }
+#endif
+        for (int i = 0; i < num_tasks; i++) {
+            task(i);
+        }
+    }
+
+private:
+    int num_threads_;
+};
+
+// Shared by the components that are not given an executor, one thread per hardware thread
+inline Executor &defaultExecutor()
+{
+    static OpenMPExecutor executor;
+    return executor;
+}
+
+/**
+ * Splits [0, size) in at most executor.numThreads() contiguous blocks and calls
+ * function(block, begin, end) for each of them through the executor. Below min_parallel_size
+ * there is a single block, run on the calling thread. The blocks only depend on size and on
+ * the thread count, block b always precedes block b + 1.
+ */
+template <typename Function>
+void parallelForBlocks(Executor &executor, int size, Function function, int min_parallel_size = 0)
+{
+    const int num_blocks = size < min_parallel_size ? 1 : std::max(1, std::min(executor.numThreads(), size));
+    if (num_blocks == 1) {
+        function(0, 0, size);
+        return;
+    }
+    executor.parallelFor(num_blocks, [&](int block) {
+        const int begin = static_cast<long>(size) * block / num_blocks;
+        const int end = static_cast<long>(size) * (block + 1) / num_blocks;
+        function(block, begin, end);
+    });
+}
+
+// The blocks of the deterministic sums, see parallelSum()
+const int kDeterministicBlockSize = 4096;
+
+/**
+ * zero plus the partial_sum(begin, end) of the blocks of [0, size), added in block order. By
+ * default the blocks are the ones of parallelForBlocks(), one per thread, so the rounding of the
+ * result depends on the thread count. When deterministic they have kDeterministicBlockSize
+ * elements whatever the executor, for bit-identical sums with any thread count at the price of
+ * more, smaller tasks.
+ */
+template <typename T, typename Function>
+T parallelSum(Executor &executor, int size, const T &zero, Function partial_sum, bool deterministic = false,
+              int min_parallel_size = 0)
+{
+    std::vector<T> sums;
+    if (deterministic) {
+        const int num_blocks = (size + kDeterministicBlockSize - 1) / kDeterministicBlockSize;
+        sums.assign(num_blocks, zero);
+        auto task = [&](int block) {
+            const int begin = block * kDeterministicBlockSize;
+            sums[block] = partial_sum(begin, std::min(size, begin + kDeterministicBlockSize));
+        };
+        if (size < min_parallel_size || num_blocks == 1) {
+            for (int block = 0; block < num_blocks; block++) {
+                task(block);
+            }
+        } else {
+            executor.parallelFor(num_blocks, task);
+        }
+    } else {
+        // The blocks parallelForBlocks() does not use stay at zero
+        sums.assign(std::max(1, std::min(executor.numThreads(), size)), zero);
+        parallelForBlocks(executor, size, [&](int block, int begin, int end) {
+            sums[block] = partial_sum(begin, end);
+        }, min_parallel_size);
+    }
+    T total = zero;
+    for (const T &sum : sums) {
+        total += sum;
+    }
+    return total;
+}
+
+}  // namespace prob_point_cloud_registration
+
+#endif
@@ -0,0 +1,83 @@
+#ifndef PROB_POINT_CLOUD_REGISTRATION_MULTI_VIEW_REGISTRATION_HPP
+#define PROB_POINT_CLOUD_REGISTRATION_MULTI_VIEW_REGISTRATION_HPP
+
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include <Eigen/Geometry>
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+
+#include "prob_point_cloud_registration/neighbour_search.hpp"
+#include "prob_point_cloud_registration/prob_point_cloud_registration_params.hpp"
+#include "prob_point_cloud_registration/registration_statistics.hpp"
+
+namespace prob_point_cloud_registration {
+
+/**
+ * Joint registration of N overlapping scans. Every scan is filtered and indexed once. At each
+ * outer iteration the probabilistic associations of the pairs are computed in parallel (the
+ * source scan moved into the frame of the target scan by the current poses), and all the poses
+ * are refined together in a single sparse Ceres problem, one PairwiseErrorTerm per pair, with
+ * the weights updated after each successful step as in ProbPointCloudRegistration.
+ *
+ * The pose of the first scan is held fixed at its initial value: the others are estimated in
+ * its frame. The parameters are the ones of a pairwise registration: source_filter_size for the
+ * associated points, target_filter_size and neighbour_search for the indices, radius,
+ * max_neighbours, dof and the termination criteria. Only point-to-point residuals are used.
+ */
+class MultiViewRegistration
+{
+public:
+    MultiViewRegistration(const std::vector<pcl::PointCloud<pcl::PointXYZ>::Ptr> &scans,
+                          ProbPointCloudRegistrationParams parameters);
+
+    /**
+     * The (source, target) scans associated, each pair once, all of them by default. Pairs that
+     * do not overlap simply get no associations.
+     */
+    void setPairs(const std::vector<std::pair<int, int>> &pairs);
+
+    // initial_poses is either empty (identity) or holds one pose per scan
+    void align(const std::vector<Eigen::Affine3d> &initial_poses = std::vector<Eigen::Affine3d>());
+
+    // Map every scan into the frame of the first one, the initial poses until align()
+    inline const std::vector<Eigen::Affine3d> &poses() const
+    {
+        return poses_;
+    }
+
+    inline const std::vector<std::pair<int, int>> &pairs() const
+    {
+        return pairs_;
+    }
+
+    // The index of every scan
+    inline const std::vector<std::shared_ptr<NeighbourSearch>> &targets() const
+    {
+        return targets_;
+    }
+
+    // Filtering and index build times of all the scans, then one entry per outer iteration
+    inline const RegistrationStatistics &statistics() const
+    {
+        return statistics_;
+    }
+
+private:
+    // Whether the cost drop has been under cost_drop_thresh for more than n_cost_drop_it iterations
+    bool hasConverged(int iteration, double cost_drop);
+
+    ProbPointCloudRegistrationParams parameters_;
+    std::vector<pcl::PointCloud<pcl::PointXYZ>::Ptr> filtered_scans_;
+    std::vector<std::shared_ptr<NeighbourSearch>> targets_;
+    std::vector<std::pair<int, int>> pairs_;
+    std::vector<Eigen::Affine3d> poses_;
+    RegistrationStatistics statistics_;
+    int num_unusefull_iter_ = 0;
+};
+
+}  // namespace prob_point_cloud_registration
+
+#endif
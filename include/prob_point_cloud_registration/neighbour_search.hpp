@@ -0,0 +1,542 @@
+#ifndef PROB_POINT_CLOUD_REGISTRATION_NEIGHBOUR_SEARCH_HPP
+#define PROB_POINT_CLOUD_REGISTRATION_NEIGHBOUR_SEARCH_HPP
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <boost/make_shared.hpp>
+#include <Eigen/Eigenvalues>
+#include <Eigen/Geometry>
+#include <pcl/kdtree/kdtree_flann.h>
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+
+#include "prob_point_cloud_registration/executor.hpp"
+#include "prob_point_cloud_registration/prob_point_cloud_registration_params.hpp"
+
+namespace prob_point_cloud_registration {
+
+class TargetGeometry;
+
+/**
+ * The target of a registration: its points, addressed by index, and a radius search over them.
+ * radiusSearch(), nearestSearch() and point() are called concurrently by the association threads.
+ */
+class NeighbourSearch
+{
+public:
+    virtual ~NeighbourSearch() {}
+
+    /**
+     * The (at most max_neighbours, all of them when 0) closest target points within radius of
+     * point, sorted by increasing distance. Returns their number.
+     */
+    virtual int radiusSearch(const pcl::PointXYZ &point, double radius, int max_neighbours,
+                             std::vector<int> &indices, std::vector<float> &squared_distances) const = 0;
+
+    // The closest target point, at any distance, false when the target is empty
+    virtual bool nearestSearch(const pcl::PointXYZ &point, int &index, float &squared_distance) const = 0;
+
+    /**
+     * Squared distance of every point of cloud in [begin, end) from its closest target point,
+     * infinite when the target is empty: squared_distances[i - begin] for point i.
+     */
+    virtual void nearestSquaredDistances(const pcl::PointCloud<pcl::PointXYZ> &cloud, int begin, int end,
+                                         float *squared_distances) const
+    {
+        for (int i = begin; i < end; i++) {
+            int index;
+            if (!nearestSearch(cloud[i], index, squared_distances[i - begin])) {
+                squared_distances[i - begin] = std::numeric_limits<float>::infinity();
+            }
+        }
+    }
+
+    // Indices are in [0, size())
+    virtual int size() const = 0;
+
+    virtual pcl::PointXYZ point(int index) const = 0;
+
+    // The indexed cloud when it is held in memory, NULL otherwise
+    virtual pcl::PointCloud<pcl::PointXYZ>::ConstPtr cloud() const
+    {
+        return pcl::PointCloud<pcl::PointXYZ>::ConstPtr();
+    }
+
+    /**
+     * Called, from a single thread, before the queries of every outer iteration with the bounding
+     * box of the query points: lets a target that is not fully in memory load what they need.
+     */
+    virtual void prepare(const Eigen::AlignedBox3f &query_box, double radius) {}
+
+    /**
+     * The normals or covariances of the points for residual_type, computed by the first call
+     * with these settings and then kept with the index, so that the registrations sharing it
+     * compute them once. Throws std::invalid_argument when the target is not held in memory.
+     */
+    std::shared_ptr<const TargetGeometry> geometry(ResidualType residual_type, double radius, int max_neighbours,
+                                                   Executor &executor) const;
+
+private:
+    mutable std::mutex geometry_mutex_;
+    mutable std::shared_ptr<const TargetGeometry> geometry_;
+};
+
+/**
+ * Square root information matrix L of every target point: the residual of a source point x
+ * associated to the target point y is L (y - x). With C the covariance of the (at most
+ * max_neighbours) target points within radius of y and v0, v1, v2 its eigenvectors by increasing
+ * eigenvalue, the first row of L is v0 for POINT_TO_PLANE, the others are zero, and
+ * L = diag(1 / sqrt(l_i)) [v0 v1 v2]^T for POINT_TO_DISTRIBUTION, with the eigenvalues l_i of C
+ * relative to the largest one and clamped, as in PCL's NDT, to 0.01. Points with fewer than 3
+ * neighbours keep L = I, the point-to-point residual.
+ */
+class TargetGeometry
+{
+public:
+    TargetGeometry(const NeighbourSearch &target, ResidualType residual_type, double radius, int max_neighbours,
+                   Executor &executor):
+        residual_type_(residual_type), radius_(radius), max_neighbours_(max_neighbours),
+        sqrt_information_(target.size(), Eigen::Matrix3f::Identity())
+    {
+        const float min_eigenvalue_ratio = 0.01f;
+        parallelForBlocks(executor, target.size(), [&](int, int begin, int end) {
+            std::vector<int> indices;
+            std::vector<float> squared_distances;
+            for (int i = begin; i < end; i++) {
+                const int num_neighbours = target.radiusSearch(target.point(i), radius, max_neighbours, indices,
+                                                               squared_distances);
+                if (num_neighbours < 3) {
+                    continue;
+                }
+                Eigen::Vector3f mean = Eigen::Vector3f::Zero();
+                for (int index : indices) {
+                    mean += target.point(index).getVector3fMap();
+                }
+                mean /= num_neighbours;
+                Eigen::Matrix3f covariance = Eigen::Matrix3f::Zero();
+                for (int index : indices) {
+                    const Eigen::Vector3f deviation = target.point(index).getVector3fMap() - mean;
+                    covariance += deviation * deviation.transpose();
+                }
+                const Eigen::SelfAdjointEigenSolver<Eigen::Matrix3f> solver(covariance / num_neighbours);
+                const float largest = solver.eigenvalues()[2];
+                if (!(largest > 0)) {
+                    continue;
+                }
+                Eigen::Matrix3f &sqrt_information = sqrt_information_[i];
+                if (residual_type == ResidualType::POINT_TO_PLANE) {
+                    sqrt_information.setZero();
+                    sqrt_information.row(0) = solver.eigenvectors().col(0).transpose();
+                } else {
+                    const Eigen::Array3f ratios = (solver.eigenvalues() / largest).array().max(min_eigenvalue_ratio);
+                    sqrt_information = ratios.rsqrt().matrix().asDiagonal() * solver.eigenvectors().transpose();
+                }
+            }
+        });
+    }
+
+    // Of the target point index
+    inline const Eigen::Matrix3f &sqrtInformation(int index) const
+    {
+        return sqrt_information_[index];
+    }
+
+    inline ResidualType residualType() const
+    {
+        return residual_type_;
+    }
+
+    inline double radius() const
+    {
+        return radius_;
+    }
+
+    inline int maxNeighbours() const
+    {
+        return max_neighbours_;
+    }
+
+private:
+    ResidualType residual_type_;
+    double radius_;
+    int max_neighbours_;
+    std::vector<Eigen::Matrix3f> sqrt_information_;
+};
+
+inline std::shared_ptr<const TargetGeometry> NeighbourSearch::geometry(ResidualType residual_type, double radius,
+                                                                       int max_neighbours, Executor &executor) const
+{
+    if (!cloud()) {
+        throw std::invalid_argument("The normals and covariances need a target held in memory");
+    }
+    std::lock_guard<std::mutex> lock(geometry_mutex_);
+    if (!geometry_ || geometry_->residualType() != residual_type || geometry_->radius() != radius ||
+            geometry_->maxNeighbours() != max_neighbours) {
+        geometry_ = std::make_shared<TargetGeometry>(*this, residual_type, radius, max_neighbours, executor);
+    }
+    return geometry_;
+}
+
+class KdTreeSearch : public NeighbourSearch
+{
+public:
+    explicit KdTreeSearch(pcl::KdTreeFLANN<pcl::PointXYZ>::Ptr kdtree):
+        kdtree_(kdtree), cloud_(kdtree->getInputCloud()) {}
+
+    explicit KdTreeSearch(pcl::PointCloud<pcl::PointXYZ>::ConstPtr cloud):
+        kdtree_(boost::make_shared<pcl::KdTreeFLANN<pcl::PointXYZ>>()), cloud_(cloud)
+    {
+        kdtree_->setInputCloud(cloud);
+    }
+
+    int radiusSearch(const pcl::PointXYZ &point, double radius, int max_neighbours, std::vector<int> &indices,
+                     std::vector<float> &squared_distances) const override
+    {
+        return kdtree_->radiusSearch(point, radius, indices, squared_distances, max_neighbours);
+    }
+
+    bool nearestSearch(const pcl::PointXYZ &point, int &index, float &squared_distance) const override
+    {
+        std::vector<int> neighbours(1);
+        std::vector<float> distances(1);
+        if (kdtree_->nearestKSearch(point, 1, neighbours, distances) < 1) {
+            return false;
+        }
+        index = neighbours[0];
+        squared_distance = distances[0];
+        return true;
+    }
+
+    // Same as the default, with the result buffers of the KD-tree shared by the queries
+    void nearestSquaredDistances(const pcl::PointCloud<pcl::PointXYZ> &cloud, int begin, int end,
+                                 float *squared_distances) const override
+    {
+        std::vector<int> neighbours(1);
+        std::vector<float> distances(1);
+        for (int i = begin; i < end; i++) {
+            squared_distances[i - begin] = kdtree_->nearestKSearch(cloud[i], 1, neighbours, distances) > 0 ?
+                                           distances[0] : std::numeric_limits<float>::infinity();
+        }
+    }
+
+    int size() const override
+    {
+        return cloud_->size();
+    }
+
+    pcl::PointXYZ point(int index) const override
+    {
+        return (*cloud_)[index];
+    }
+
+    pcl::PointCloud<pcl::PointXYZ>::ConstPtr cloud() const override
+    {
+        return cloud_;
+    }
+
+    pcl::KdTreeFLANN<pcl::PointXYZ>::Ptr kdtree() const
+    {
+        return kdtree_;
+    }
+
+private:
+    pcl::KdTreeFLANN<pcl::PointXYZ>::Ptr kdtree_;
+    pcl::PointCloud<pcl::PointXYZ>::ConstPtr cloud_;
+};
+
+namespace internal {
+
+typedef std::array<int, 3> GridKey;
+
+struct GridKeyHash {
+    std::size_t operator()(const GridKey &key) const
+    {
+        return (static_cast<std::size_t>(key[0]) * 73856093) ^ (static_cast<std::size_t>(key[1]) * 19349663) ^
+               (static_cast<std::size_t>(key[2]) * 83492791);
+    }
+};
+
+}  // namespace internal
+
+/**
+ * Hashed voxel grid of cubic cells of side cell_size, best built with the search radius as
+ * cell size: a radius search is then a scan of the 27 cells around the query. The points are
+ * stored contiguously, cell after cell, and the grid is built in linear time. Nearest neighbour
+ * searches scan rings of cells of increasing size around the query.
+ */
+class VoxelHashSearch : public NeighbourSearch
+{
+public:
+    VoxelHashSearch(pcl::PointCloud<pcl::PointXYZ>::ConstPtr cloud, double cell_size):
+        cloud_(cloud), cell_size_(cell_size), inverse_cell_size_(1 / cell_size)
+    {
+        std::vector<int> cell_of_point(cloud->size(), -1);
+        std::vector<int> cell_sizes;
+        for (std::size_t i = 0; i < cloud->size(); i++) {
+            const pcl::PointXYZ &point = (*cloud)[i];
+            if (!std::isfinite(point.x) || !std::isfinite(point.y) || !std::isfinite(point.z)) {
+                continue;
+            }
+            // Until the offsets are known, begin holds the cell id
+            Cell new_cell;
+            new_cell.begin = cell_sizes.size();
+            new_cell.end = 0;
+            const auto cell = cells_.insert(std::make_pair(key(point.getVector3fMap()), new_cell));
+            if (cell.second) {
+                cell_sizes.push_back(0);
+            }
+            cell_of_point[i] = cell.first->second.begin;
+            cell_sizes[cell_of_point[i]]++;
+        }
+        // Cell ids to offsets into the points, in order of first appearance
+        std::vector<int> cell_offsets(cell_sizes.size() + 1, 0);
+        for (std::size_t c = 0; c < cell_sizes.size(); c++) {
+            cell_offsets[c + 1] = cell_offsets[c] + cell_sizes[c];
+        }
+        for (auto &cell : cells_) {
+            const int id = cell.second.begin;
+            cell.second.begin = cell_offsets[id];
+            cell.second.end = cell_offsets[id + 1];
+        }
+        points_.resize(cell_offsets.back());
+        indices_.resize(cell_offsets.back());
+        for (std::size_t i = 0; i < cloud->size(); i++) {
+            if (cell_of_point[i] >= 0) {
+                const int position = cell_offsets[cell_of_point[i]]++;
+                points_[position] = (*cloud)[i].getVector3fMap();
+                indices_[position] = i;
+            }
+        }
+    }
+
+    /**
+     * Restores the index of cloud from the cells() and pointIndices() of the one built with the
+     * same cell size, e.g. mapped from a target file: no point is hashed again. The layout must
+     * be valid, see readTargetFile().
+     */
+    VoxelHashSearch(pcl::PointCloud<pcl::PointXYZ>::ConstPtr cloud, double cell_size, const int *cells,
+                    std::size_t num_cells, const int *point_indices, std::size_t num_points):
+        cloud_(cloud), cell_size_(cell_size), inverse_cell_size_(1 / cell_size), points_(num_points),
+        indices_(point_indices, point_indices + num_points)
+    {
+        cells_.reserve(num_cells);
+        for (std::size_t c = 0; c < num_cells; c++) {
+            const int *cell = cells + kCellInts * c;
+            Cell new_cell;
+            new_cell.begin = cell[3];
+            new_cell.end = cell[4];
+            cells_.insert(std::make_pair(internal::GridKey{{cell[0], cell[1], cell[2]}}, new_cell));
+        }
+        for (std::size_t p = 0; p < num_points; p++) {
+            points_[p] = (*cloud)[indices_[p]].getVector3fMap();
+        }
+    }
+
+    // Ints per cell in cells()
+    static const int kCellInts = 5;
+
+    int radiusSearch(const pcl::PointXYZ &point, double radius, int max_neighbours, std::vector<int> &indices,
+                     std::vector<float> &squared_distances) const override
+    {
+        const Eigen::Vector3f query = point.getVector3fMap();
+        const float squared_radius = radius * radius;
+        const internal::GridKey min_key = key((query.array() - static_cast<float>(radius)).matrix());
+        const internal::GridKey max_key = key((query.array() + static_cast<float>(radius)).matrix());
+        // The storage of a thread is reused by its next queries
+        static thread_local std::vector<std::pair<float, int>> neighbours;
+        neighbours.clear();
+        internal::GridKey current;
+        for (current[0] = min_key[0]; current[0] <= max_key[0]; current[0]++) {
+            for (current[1] = min_key[1]; current[1] <= max_key[1]; current[1]++) {
+                for (current[2] = min_key[2]; current[2] <= max_key[2]; current[2]++) {
+                    const auto cell = cells_.find(current);
+                    if (cell == cells_.end()) {
+                        continue;
+                    }
+                    for (int p = cell->second.begin; p < cell->second.end; p++) {
+                        const float squared_distance = (points_[p] - query).squaredNorm();
+                        if (squared_distance <= squared_radius) {
+                            neighbours.push_back(std::make_pair(squared_distance, indices_[p]));
+                        }
+                    }
+                }
+            }
+        }
+        if (max_neighbours > 0 && static_cast<int>(neighbours.size()) > max_neighbours) {
+            std::partial_sort(neighbours.begin(), neighbours.begin() + max_neighbours, neighbours.end());
+            neighbours.resize(max_neighbours);
+        } else {
+            std::sort(neighbours.begin(), neighbours.end());
+        }
+        indices.resize(neighbours.size());
+        squared_distances.resize(neighbours.size());
+        for (std::size_t k = 0; k < neighbours.size(); k++) {
+            squared_distances[k] = neighbours[k].first;
+            indices[k] = neighbours[k].second;
+        }
+        return neighbours.size();
+    }
+
+    bool nearestSearch(const pcl::PointXYZ &point, int &index, float &squared_distance) const override
+    {
+        const Eigen::Vector3f query = point.getVector3fMap();
+        const internal::GridKey center = key(query);
+        index = -1;
+        squared_distance = std::numeric_limits<float>::max();
+        for (int ring = 0;; ring++) {
+            // Scanning every cell is cheaper than the ring from there on
+            const long ring_cells = ring == 0 ? 1 : 24L * ring * ring + 2;
+            if (ring_cells > static_cast<long>(cells_.size())) {
+                scanAllCells(query, &index, &squared_distance);
+                break;
+            }
+            for (int dx = -ring; dx <= ring; dx++) {
+                for (int dy = -ring; dy <= ring; dy++) {
+                    const bool on_side = std::abs(dx) == ring || std::abs(dy) == ring;
+                    for (int dz = -ring; dz <= ring; dz += on_side ? 1 : std::max(1, 2 * ring)) {
+                        const internal::GridKey current = {{center[0] + dx, center[1] + dy, center[2] + dz}};
+                        const auto cell = cells_.find(current);
+                        if (cell != cells_.end()) {
+                            scanCell(cell->second, query, &index, &squared_distance);
+                        }
+                    }
+                }
+            }
+            // The cells beyond the ring are at least ring cells away from the query
+            const float reach = ring * cell_size_;
+            if (index >= 0 && squared_distance <= reach * reach) {
+                break;
+            }
+        }
+        return index >= 0;
+    }
+
+    int size() const override
+    {
+        return cloud_->size();
+    }
+
+    pcl::PointXYZ point(int index) const override
+    {
+        return (*cloud_)[index];
+    }
+
+    pcl::PointCloud<pcl::PointXYZ>::ConstPtr cloud() const override
+    {
+        return cloud_;
+    }
+
+    inline double cellSize() const
+    {
+        return cell_size_;
+    }
+
+    inline int numCells() const
+    {
+        return cells_.size();
+    }
+
+    // The key and the [begin, end) range into pointIndices() of every cell
+    std::vector<int> cells() const
+    {
+        std::vector<int> cells;
+        cells.reserve(kCellInts * cells_.size());
+        for (const auto &cell : cells_) {
+            cells.insert(cells.end(), cell.first.begin(), cell.first.end());
+            cells.push_back(cell.second.begin);
+            cells.push_back(cell.second.end);
+        }
+        return cells;
+    }
+
+    // The cloud index of the indexed points, cell after cell
+    inline const std::vector<int> &pointIndices() const
+    {
+        return indices_;
+    }
+
+private:
+    struct Cell {
+        int begin;
+        int end;
+    };
+
+    internal::GridKey key(const Eigen::Vector3f &point) const
+    {
+        internal::GridKey key;
+        for (int d = 0; d < 3; d++) {
+            key[d] = static_cast<int>(std::floor(point[d] * inverse_cell_size_));
+        }
+        return key;
+    }
+
+    void scanCell(const Cell &cell, const Eigen::Vector3f &query, int *index, float *squared_distance) const
+    {
+        for (int p = cell.begin; p < cell.end; p++) {
+            const float distance = (points_[p] - query).squaredNorm();
+            if (distance < *squared_distance || (distance == *squared_distance && indices_[p] < *index)) {
+                *squared_distance = distance;
+                *index = indices_[p];
+            }
+        }
+    }
+
+    // Every cell that may hold a closer point than the current one
+    void scanAllCells(const Eigen::Vector3f &query, int *index, float *squared_distance) const
+    {
+        for (const auto &cell : cells_) {
+            const Eigen::Vector3f cell_min = Eigen::Vector3f(cell.first[0], cell.first[1], cell.first[2]) * cell_size_;
+            const Eigen::AlignedBox3f box(cell_min, cell_min + Eigen::Vector3f::Constant(cell_size_));
+            if (box.squaredExteriorDistance(query) <= *squared_distance) {
+                scanCell(cell.second, query, index, squared_distance);
+            }
+        }
+    }
+
+    pcl::PointCloud<pcl::PointXYZ>::ConstPtr cloud_;
+    float cell_size_;
+    float inverse_cell_size_;
+    std::unordered_map<internal::GridKey, Cell, internal::GridKeyHash> cells_;
+    std::vector<Eigen::Vector3f> points_;
+    // Cloud index of points_
+    std::vector<int> indices_;
+};
+
+/**
+ * Indexes cloud with the given backend. radius is the search radius the index will be queried
+ * with, the cell size of the voxel hash. The CUDA target is built by
+ * ProbPointCloudRegistration::buildTarget().
+ */
+inline std::shared_ptr<NeighbourSearch> buildNeighbourSearch(pcl::PointCloud<pcl::PointXYZ>::ConstPtr cloud,
+                                                             NeighbourSearchType type, double radius)
+{
+    if (type == NeighbourSearchType::CUDA) {
+        throw std::invalid_argument("The CUDA target is built by ProbPointCloudRegistration::buildTarget()");
+    }
+    if (type == NeighbourSearchType::VOXEL_HASH) {
+        return std::make_shared<VoxelHashSearch>(cloud, radius);
+    }
+    return std::make_shared<KdTreeSearch>(cloud);
+}
+
+inline Eigen::AlignedBox3f boundingBox(const pcl::PointCloud<pcl::PointXYZ> &cloud)
+{
+    Eigen::AlignedBox3f box;
+    for (const pcl::PointXYZ &point : cloud) {
+        box.extend(point.getVector3fMap());
+    }
+    return box;
+}
+
+}  // namespace prob_point_cloud_registration
+
+#endif
@@ -0,0 +1,73 @@
+#ifndef PROB_POINT_CLOUD_REGISTRATION_ODOMETRY_REGISTRATION_HPP
+#define PROB_POINT_CLOUD_REGISTRATION_ODOMETRY_REGISTRATION_HPP
+
+#include <memory>
+
+#include <Eigen/Geometry>
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+
+#include "prob_point_cloud_registration/neighbour_search.hpp"
+#include "prob_point_cloud_registration/prob_point_cloud_registration_params.hpp"
+#include "prob_point_cloud_registration/registration_statistics.hpp"
+
+namespace prob_point_cloud_registration {
+
+struct OdometryResult {
+    // Maps the scan into the frame of the first scan, or of the map
+    Eigen::Affine3d pose = Eigen::Affine3d::Identity();
+    // Maps the scan into the frame of the previous one
+    Eigen::Affine3d motion = Eigen::Affine3d::Identity();
+    // Whether the time budget stopped the registration before it converged
+    bool timed_out = false;
+    // Wall time from the call to the pose, the index build of the scan excluded
+    double time = 0;
+    RegistrationStatistics statistics;
+};
+
+/**
+ * Registers a sequence of scans, each against the previous one or against a fixed map. The
+ * target stays indexed between the calls and each scan starts from a constant velocity
+ * prediction, the motion between the two previous scans. parameters.time_budget, when set,
+ * bounds every registerScan() up to the pose estimate, filtering of the scan included: the
+ * latest estimate when it is spent is returned. With the previous scan as target, the scan is then indexed for the next call.
+ *
+ * The scans are shared, not copied (unless parameters.target_filter_size has to filter them):
+ * a scan must not change while it is the target.
+ */
+class OdometryRegistration
+{
+public:
+    explicit OdometryRegistration(ProbPointCloudRegistrationParams parameters);
+
+    // The first scan, without a map, only becomes the target: its pose is the identity
+    OdometryResult registerScan(pcl::PointCloud<pcl::PointXYZ>::Ptr scan);
+
+    // Registers the next scans against map, pose being the one of the last scan in the map frame
+    void setMap(std::shared_ptr<NeighbourSearch> map, const Eigen::Affine3d &pose = Eigen::Affine3d::Identity());
+
+    // Back to the state of the construction, map included
+    void reset();
+
+    // Of the last scan
+    inline const Eigen::Affine3d &pose() const
+    {
+        return pose_;
+    }
+
+    inline std::shared_ptr<NeighbourSearch> target() const
+    {
+        return target_;
+    }
+
+private:
+    ProbPointCloudRegistrationParams parameters_;
+    std::shared_ptr<NeighbourSearch> target_;
+    bool map_target_ = false;
+    Eigen::Affine3d pose_ = Eigen::Affine3d::Identity();
+    Eigen::Affine3d motion_ = Eigen::Affine3d::Identity();
+};
+
+}  // namespace prob_point_cloud_registration
+
+#endif
@@ -0,0 +1,184 @@
+#ifndef PROB_POINT_CLOUD_REGISTRATION_PAIRWISE_ERROR_TERM_HPP
+#define PROB_POINT_CLOUD_REGISTRATION_PAIRWISE_ERROR_TERM_HPP
+
+#include <ceres/ceres.h>
+#include <Eigen/Core>
+#include <Eigen/Sparse>
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+
+#include <cmath>
+#include <limits>
+#include <vector>
+
+#include "prob_point_cloud_registration/batched_error_term.hpp"
+#include "prob_point_cloud_registration/executor.hpp"
+#include "prob_point_cloud_registration/neighbour_search.hpp"
+
+namespace prob_point_cloud_registration {
+
+/**
+ * Point-to-point residuals between two scans that both move, in a single cost function of four
+ * parameter blocks: the rotation (w, x, y, z) and the translation of the source scan, then the
+ * ones of the target scan. For the k-th association, of points x_k of the source and y_k of the
+ * target, the residual is sqrt(w_k) * ((R_t y_k + t_t) - (R_s x_k + t_s)), the BatchedErrorTerm
+ * residual expressed in the common frame the poses map the scans to.
+ */
+class PairwiseErrorTerm : public ceres::CostFunction
+{
+public:
+    static const int kResiduals = 3;
+
+    PairwiseErrorTerm(): executor_(&defaultExecutor())
+    {
+        for (int scan = 0; scan < 2; scan++) {
+            mutable_parameter_block_sizes()->push_back(4);
+            mutable_parameter_block_sizes()->push_back(3);
+        }
+        set_num_residuals(0);
+    }
+
+    // Runs the per association loops, it must outlive this object
+    void setExecutor(Executor *executor)
+    {
+        executor_ = executor;
+    }
+
+    /**
+     * The associations of data_association, between the source points (rows) and the points of
+     * target (columns). All weights are reset to 1.
+     */
+    void setAssociations(const pcl::PointCloud<pcl::PointXYZ> &source_cloud, const NeighbourSearch &target,
+                         const Eigen::SparseMatrix<double, Eigen::RowMajor> &data_association)
+    {
+        source_points_.clear();
+        source_begin_.clear();
+        target_points_.resize(data_association.nonZeros());
+        int k = 0;
+        for (int i = 0; i < data_association.outerSize(); i++) {
+            Eigen::SparseMatrix<double, Eigen::RowMajor>::InnerIterator it(data_association, i);
+            if (!it) {
+                continue;
+            }
+            source_points_.push_back(source_cloud[i].getVector3fMap());
+            source_begin_.push_back(k);
+            for (; it; ++it, ++k) {
+                target_points_[k] = target.point(it.col()).getVector3fMap();
+            }
+        }
+        source_begin_.push_back(k);
+        weights_.assign(k, 1.0);
+        set_num_residuals(kResiduals * k);
+    }
+
+    bool Evaluate(double const *const *parameters, double *residuals, double **jacobians) const override
+    {
+        const Pose source(parameters[0], parameters[1]);
+        const Pose target(parameters[2], parameters[3]);
+        double *const jacobian[4] = {jacobians != NULL ? jacobians[0] : NULL, jacobians != NULL ? jacobians[1] : NULL,
+                                     jacobians != NULL ? jacobians[2] : NULL, jacobians != NULL ? jacobians[3] : NULL
+                                    };
+        parallelForBlocks(*executor_, numSourcePoints(), [&](int, int begin, int end) {
+            Eigen::Matrix<double, 3, 4> d_source = Eigen::Matrix<double, 3, 4>::Zero();
+            for (int s = begin; s < end; s++) {
+                const Eigen::Vector3d x = source_points_[s].cast<double>();
+                const Eigen::Vector3d rotated_x = source.rotation * x;
+                if (jacobian[0] != NULL) {
+                    d_source = internal::rotatedPointJacobian(source.q, source.norm, x, rotated_x);
+                }
+                for (int k = source_begin_[s]; k < source_begin_[s + 1]; k++) {
+                    const Eigen::Vector3d y = target_points_[k].cast<double>();
+                    const Eigen::Vector3d rotated_y = target.rotation * y;
+                    const double scale = std::sqrt(weights_[k]);
+                    Eigen::Map<Eigen::Vector3d>(residuals + kResiduals * k) =
+                        scale * (rotated_y + target.translation - rotated_x - source.translation);
+                    if (jacobian[0] != NULL) {
+                        RotationJacobian(jacobian[0] + 12 * k) = -scale * d_source;
+                    }
+                    if (jacobian[1] != NULL) {
+                        TranslationJacobian(jacobian[1] + 9 * k) = -scale * Eigen::Matrix3d::Identity();
+                    }
+                    if (jacobian[2] != NULL) {
+                        RotationJacobian(jacobian[2] + 12 * k) =
+                            scale * internal::rotatedPointJacobian(target.q, target.norm, y, rotated_y);
+                    }
+                    if (jacobian[3] != NULL) {
+                        TranslationJacobian(jacobian[3] + 9 * k) = scale * Eigen::Matrix3d::Identity();
+                    }
+                }
+            }
+        }, minParallelSourcePoints());
+        return true;
+    }
+
+    // Unweighted squared residual norm of every association, in data association order
+    void squaredErrors(const double *source_rotation, const double *source_translation,
+                       const double *target_rotation, const double *target_translation,
+                       std::vector<double> *squared_errors) const
+    {
+        const Pose source(source_rotation, source_translation);
+        const Pose target(target_rotation, target_translation);
+        squared_errors->resize(size());
+        parallelForBlocks(*executor_, numSourcePoints(), [&](int, int begin, int end) {
+            for (int s = begin; s < end; s++) {
+                const Eigen::Vector3d moved = source.rotation * source_points_[s].cast<double>() + source.translation;
+                for (int k = source_begin_[s]; k < source_begin_[s + 1]; k++) {
+                    (*squared_errors)[k] = (target.rotation * target_points_[k].cast<double>() + target.translation -
+                                            moved).squaredNorm();
+                }
+            }
+        }, minParallelSourcePoints());
+    }
+
+    std::vector<double> &weights()
+    {
+        return weights_;
+    }
+
+    int size() const
+    {
+        return weights_.size();
+    }
+
+private:
+    static const int kMinParallelAssociations = 4096;
+    typedef Eigen::Map<Eigen::Matrix<double, 3, 4, Eigen::RowMajor>> RotationJacobian;
+    typedef Eigen::Map<Eigen::Matrix<double, 3, 3, Eigen::RowMajor>> TranslationJacobian;
+
+    // A pose of the parameters, with its normalized quaternion
+    struct Pose {
+        Pose(const double *rotation_parameters, const double *translation_parameters):
+            norm(Eigen::Map<const Eigen::Vector4d>(rotation_parameters).norm()),
+            q(Eigen::Map<const Eigen::Vector4d>(rotation_parameters) / norm),
+            rotation(internal::rotationMatrix(q)),
+            translation(Eigen::Map<const Eigen::Vector3d>(translation_parameters)) {}
+
+        double norm;
+        Eigen::Vector4d q;
+        Eigen::Matrix3d rotation;
+        Eigen::Vector3d translation;
+    };
+
+    int numSourcePoints() const
+    {
+        return source_points_.size();
+    }
+
+    // The loops over the source points run in parallel above kMinParallelAssociations associations
+    int minParallelSourcePoints() const
+    {
+        return size() > kMinParallelAssociations ? 0 : std::numeric_limits<int>::max();
+    }
+
+    std::vector<Eigen::Vector3f> source_points_;
+    // The associations of source point s are [source_begin_[s], source_begin_[s + 1])
+    std::vector<int> source_begin_;
+    // The target point of every association
+    std::vector<Eigen::Vector3f> target_points_;
+    std::vector<double> weights_;
+    Executor *executor_;
+};
+
+}  // namespace prob_point_cloud_registration
+
+#endif
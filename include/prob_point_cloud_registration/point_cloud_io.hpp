@@ -0,0 +1,366 @@
+#ifndef PROB_POINT_CLOUD_REGISTRATION_POINT_CLOUD_IO_HPP
+#define PROB_POINT_CLOUD_REGISTRATION_POINT_CLOUD_IO_HPP
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <pcl/filters/voxel_grid.h>
+#include <pcl/io/pcd_io.h>
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+
+namespace prob_point_cloud_registration {
+
+namespace internal {
+
+// Read-only, private mapping of a whole file
+class MappedFile
+{
+public:
+    explicit MappedFile(const std::string &file_name): data_(NULL), size_(0)
+    {
+        const int fd = open(file_name.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return;
+        }
+        struct stat file_stat;
+        if (fstat(fd, &file_stat) == 0 && file_stat.st_size > 0) {
+            void *data = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data != MAP_FAILED) {
+                data_ = static_cast<const char *>(data);
+                size_ = file_stat.st_size;
+                madvise(data, size_, MADV_SEQUENTIAL);
+            }
+        }
+        close(fd);
+    }
+
+    ~MappedFile()
+    {
+        if (data_ != NULL) {
+            munmap(const_cast<char *>(data_), size_);
+        }
+    }
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    const char *data() const
+    {
+        return data_;
+    }
+
+    std::size_t size() const
+    {
+        return size_;
+    }
+
+private:
+    const char *data_;
+    std::size_t size_;
+};
+
+// Takes count elements of element_size bytes off the remaining bytes, false when there are fewer
+inline bool takeBytes(std::uint64_t count, std::uint64_t element_size, std::uint64_t *remaining)
+{
+    if (count > *remaining / element_size) {
+        return false;
+    }
+    *remaining -= count * element_size;
+    return true;
+}
+
+// Where the coordinates are in the records of an uncompressed point array
+struct PointLayout {
+    std::size_t data_offset = 0;
+    std::size_t num_points = 0;
+    std::size_t point_step = 0;
+    std::size_t x_offset = 0;
+    std::size_t y_offset = 0;
+    std::size_t z_offset = 0;
+};
+
+/**
+ * Parses the header of a PCD file, false unless it has DATA binary and float x, y, z fields. The
+ * header is untrusted: false as well when its sizes and counts do not fit in the file.
+ */
+inline bool parseBinaryPCDHeader(const MappedFile &file, PointLayout *layout)
+{
+    std::vector<std::string> fields;
+    std::vector<long long> sizes;
+    std::vector<char> types;
+    std::vector<long long> counts;
+    long long num_points = -1;
+    std::size_t position = 0;
+    while (position < file.size()) {
+        const char *line_end = static_cast<const char *>(std::memchr(file.data() + position, '\n',
+                                                                     file.size() - position));
+        if (line_end == NULL) {
+            return false;
+        }
+        std::istringstream line(std::string(file.data() + position, line_end));
+        position = line_end - file.data() + 1;
+        std::string keyword;
+        line >> keyword;
+        if (keyword == "FIELDS") {
+            for (std::string field; line >> field;) {
+                fields.push_back(field);
+            }
+        } else if (keyword == "SIZE") {
+            for (long long size; line >> size;) {
+                sizes.push_back(size);
+            }
+        } else if (keyword == "TYPE") {
+            for (char type; line >> type;) {
+                types.push_back(type);
+            }
+        } else if (keyword == "COUNT") {
+            for (long long count; line >> count;) {
+                counts.push_back(count);
+            }
+        } else if (keyword == "POINTS") {
+            line >> num_points;
+        } else if (keyword == "DATA") {
+            std::string data_type;
+            line >> data_type;
+            if (data_type != "binary") {
+                return false;
+            }
+            layout->data_offset = position;
+            break;
+        }
+    }
+    if (layout->data_offset == 0 || num_points < 0 || sizes.size() != fields.size() ||
+            types.size() != fields.size() || counts.size() > fields.size()) {
+        return false;
+    }
+    counts.resize(fields.size(), 1);
+    int found = 0;
+    std::uint64_t point_step = 0;
+    for (std::size_t f = 0; f < fields.size(); f++) {
+        if (sizes[f] <= 0 || counts[f] <= 0) {
+            return false;
+        }
+        const bool is_coordinate = fields[f] == "x" || fields[f] == "y" || fields[f] == "z";
+        if (is_coordinate) {
+            if (types[f] != 'F' || sizes[f] != 4 || counts[f] != 1) {
+                return false;
+            }
+            std::size_t &offset = fields[f] == "x" ? layout->x_offset : fields[f] == "y" ? layout->y_offset :
+                                  layout->z_offset;
+            offset = point_step;
+            found++;
+        }
+        // Then a record of point_step bytes fits in the data
+        std::uint64_t remaining = file.size() - point_step;
+        if (!takeBytes(counts[f], sizes[f], &remaining)) {
+            return false;
+        }
+        point_step = file.size() - remaining;
+    }
+    layout->point_step = point_step;
+    layout->num_points = num_points;
+    std::uint64_t remaining = file.size() - layout->data_offset;
+    return found == 3 && layout->x_offset + sizeof(float) <= point_step &&
+           layout->y_offset + sizeof(float) <= point_step && layout->z_offset + sizeof(float) <= point_step &&
+           takeBytes(layout->num_points, point_step, &remaining);
+}
+
+inline float readFloat(const char *data)
+{
+    float value;
+    std::memcpy(&value, data, sizeof(float));
+    return value;
+}
+
+/**
+ * Streaming voxel grid filter: only the voxels are stored, never the input points. Points
+ * are binned as in pcl::VoxelGrid (floor of the coordinates times the inverse leaf size) and
+ * each voxel becomes the centroid of its points; the output follows the voxel order of
+ * pcl::VoxelGrid as well. The points whose voxel coordinates do not fit in an int are not
+ * binned, see outOfRange().
+ */
+class VoxelAccumulator
+{
+public:
+    explicit VoxelAccumulator(double leaf_size):
+        inverse_leaf_size_(1.0f / static_cast<float>(leaf_size)), out_of_range_(false) {}
+
+    void add(float x, float y, float z)
+    {
+        if (!std::isfinite(x) || !std::isfinite(y) || !std::isfinite(z)) {
+            return;
+        }
+        const float coordinates[3] = {std::floor(x * inverse_leaf_size_), std::floor(y * inverse_leaf_size_),
+                                      std::floor(z * inverse_leaf_size_)
+                                     };
+        Key key;
+        for (int i = 0; i < 3; i++) {
+            // Converting a float beyond the int range is undefined
+            if (!(coordinates[i] >= -2147483648.0f && coordinates[i] < 2147483648.0f)) {
+                out_of_range_ = true;
+                return;
+            }
+            key[i] = static_cast<int>(coordinates[i]);
+        }
+        Voxel &voxel = voxels_[key];
+        voxel.sum[0] += x;
+        voxel.sum[1] += y;
+        voxel.sum[2] += z;
+        voxel.count++;
+    }
+
+    // Whether a point was too far from the origin for the leaf size, the voxels are then incomplete
+    bool outOfRange() const
+    {
+        return out_of_range_;
+    }
+
+    void centroids(pcl::PointCloud<pcl::PointXYZ> &cloud) const
+    {
+        std::vector<std::pair<Key, const Voxel *>> sorted;
+        sorted.reserve(voxels_.size());
+        for (const auto &voxel : voxels_) {
+            sorted.push_back(std::make_pair(voxel.first, &voxel.second));
+        }
+        std::sort(sorted.begin(), sorted.end(), [](const std::pair<Key, const Voxel *> &a,
+                                                    const std::pair<Key, const Voxel *> &b) {
+            return std::tie(a.first[2], a.first[1], a.first[0]) < std::tie(b.first[2], b.first[1], b.first[0]);
+        });
+        cloud.clear();
+        cloud.reserve(sorted.size());
+        for (const auto &voxel : sorted) {
+            const Voxel &v = *voxel.second;
+            cloud.push_back(pcl::PointXYZ(v.sum[0] / v.count, v.sum[1] / v.count, v.sum[2] / v.count));
+        }
+        cloud.width = cloud.size();
+        cloud.height = 1;
+        cloud.is_dense = true;
+    }
+
+private:
+    typedef std::array<int, 3> Key;
+
+    struct KeyHash {
+        std::size_t operator()(const Key &key) const
+        {
+            return (static_cast<std::size_t>(key[0]) * 73856093) ^ (static_cast<std::size_t>(key[1]) * 19349663) ^
+                   (static_cast<std::size_t>(key[2]) * 83492791);
+        }
+    };
+
+    struct Voxel {
+        double sum[3] = {0, 0, 0};
+        int count = 0;
+    };
+
+    float inverse_leaf_size_;
+    bool out_of_range_;
+    std::unordered_map<Key, Voxel, KeyHash> voxels_;
+};
+
+inline void voxelGridFilter(double leaf_size, pcl::PointCloud<pcl::PointXYZ> &cloud)
+{
+    pcl::PointCloud<pcl::PointXYZ>::Ptr unfiltered = cloud.makeShared();
+    pcl::VoxelGrid<pcl::PointXYZ> filter;
+    filter.setInputCloud(unfiltered);
+    filter.setLeafSize(leaf_size, leaf_size, leaf_size);
+    filter.filter(cloud);
+}
+
+// Reads the coordinates straight from the mapping, filtering them on the fly when leaf_size > 0
+inline void readPoints(const MappedFile &file, const PointLayout &layout, double leaf_size,
+                       pcl::PointCloud<pcl::PointXYZ> &cloud)
+{
+    const char *data = file.data() + layout.data_offset;
+    if (leaf_size > 0) {
+        VoxelAccumulator accumulator(leaf_size);
+        for (std::size_t i = 0; i < layout.num_points && !accumulator.outOfRange(); i++, data += layout.point_step) {
+            accumulator.add(readFloat(data + layout.x_offset), readFloat(data + layout.y_offset),
+                            readFloat(data + layout.z_offset));
+        }
+        if (!accumulator.outOfRange()) {
+            accumulator.centroids(cloud);
+            return;
+        }
+        // pcl::VoxelGrid detects the overflow as well, warns and keeps the points as they are
+        readPoints(file, layout, 0, cloud);
+        voxelGridFilter(leaf_size, cloud);
+        return;
+    }
+    cloud.resize(layout.num_points);
+    bool is_dense = true;
+    for (std::size_t i = 0; i < layout.num_points; i++, data += layout.point_step) {
+        pcl::PointXYZ &point = cloud[i];
+        point.x = readFloat(data + layout.x_offset);
+        point.y = readFloat(data + layout.y_offset);
+        point.z = readFloat(data + layout.z_offset);
+        is_dense = is_dense && std::isfinite(point.x) && std::isfinite(point.y) && std::isfinite(point.z);
+    }
+    cloud.width = layout.num_points;
+    cloud.height = 1;
+    cloud.is_dense = is_dense;
+}
+
+inline bool hasExtension(const std::string &file_name, const std::string &extension)
+{
+    return file_name.size() >= extension.size() &&
+           file_name.compare(file_name.size() - extension.size(), extension.size(), extension) == 0;
+}
+
+}  // namespace internal
+
+/**
+ * Loads the points of file_name, voxel filtered with leaf_size when it is positive.
+ *
+ * Binary PCD files and packed float xyz files (".xyz32": three native endian float32 per
+ * point, no header) are memory-mapped and the points are read, and filtered, straight from the
+ * mapping: the full resolution cloud is never built when filtering. ASCII and compressed PCD
+ * files go through pcl::io::loadPCDFile and pcl::VoxelGrid. Returns false when the file can not
+ * be read.
+ */
+inline bool loadPointCloud(const std::string &file_name, double leaf_size, pcl::PointCloud<pcl::PointXYZ> &cloud)
+{
+    internal::MappedFile file(file_name);
+    internal::PointLayout layout;
+    if (file.data() != NULL && internal::hasExtension(file_name, ".xyz32")) {
+        if (file.size() % (3 * sizeof(float)) != 0) {
+            return false;
+        }
+        layout.num_points = file.size() / (3 * sizeof(float));
+        layout.point_step = 3 * sizeof(float);
+        layout.y_offset = sizeof(float);
+        layout.z_offset = 2 * sizeof(float);
+        internal::readPoints(file, layout, leaf_size, cloud);
+        return true;
+    }
+    if (file.data() != NULL && internal::parseBinaryPCDHeader(file, &layout)) {
+        internal::readPoints(file, layout, leaf_size, cloud);
+        return true;
+    }
+    if (pcl::io::loadPCDFile<pcl::PointXYZ>(file_name, cloud) == -1) {
+        return false;
+    }
+    if (leaf_size > 0) {
+        internal::voxelGridFilter(leaf_size, cloud);
+    }
+    return true;
+}
+
+}  // namespace prob_point_cloud_registration
+
+#endif
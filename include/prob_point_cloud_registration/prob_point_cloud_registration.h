@@ -1,20 +1,31 @@
 #ifndef PROB_POINT_CLOUD_REGISTRATION_POINT_CLOUD_REGISTRATION_HPP
 #define PROB_POINT_CLOUD_REGISTRATION_POINT_CLOUD_REGISTRATION_HPP
 
+#include <memory>
 #include <sstream>
+#include <string>
 
 #include <Eigen/Core>
+#include <Eigen/Sparse>
 #include <pcl/filters/filter.h>
 #include <pcl/filters/voxel_grid.h>
+#include <pcl/kdtree/kdtree_flann.h>
 #include <pcl/point_cloud.h>
 #include <pcl/point_types.h>
 
+#include "prob_point_cloud_registration/data_association.hpp"
+#include "prob_point_cloud_registration/neighbour_search.hpp"
 #include "prob_point_cloud_registration/output_stream.hpp"
 #include "prob_point_cloud_registration/prob_point_cloud_registration_iteration.hpp"
 #include "prob_point_cloud_registration/prob_point_cloud_registration_params.hpp"
+#include "prob_point_cloud_registration/registration_statistics.hpp"
 
 namespace prob_point_cloud_registration {
 
+/**
+ * The source (and ground truth) cloud is shared, not copied, and is never modified: it must not
+ * change while the registration is alive.
+ */
 class ProbPointCloudRegistration
 {
 public:
@@ -27,13 +38,76 @@ public:
         pcl::PointCloud<pcl::PointXYZ>::Ptr target_cloud,
         ProbPointCloudRegistrationParams parameters,
         pcl::PointCloud<pcl::PointXYZ>::Ptr ground_truth_cloud);
+    /**
+     * Registers the source against a target that has already been filtered and indexed,
+     * e.g. by buildTargetKdTree(). The tree can be shared by several registrations,
+     * parameters.target_filter_size is ignored.
+     */
+    ProbPointCloudRegistration(
+        pcl::PointCloud<pcl::PointXYZ>::Ptr source_cloud,
+        pcl::KdTreeFLANN<pcl::PointXYZ>::Ptr target_kdtree,
+        ProbPointCloudRegistrationParams parameters);
+    /**
+     * Registers the source against any target search structure, e.g. one built by buildTarget()
+     * or a TiledTargetMap that is not fully in memory. parameters.target_filter_size is ignored,
+     * and so are the target filter sizes of the pyramid levels when the target has no cloud().
+     */
+    ProbPointCloudRegistration(
+        pcl::PointCloud<pcl::PointXYZ>::Ptr source_cloud,
+        std::shared_ptr<NeighbourSearch> target,
+        ProbPointCloudRegistrationParams parameters);
+    ProbPointCloudRegistration(
+        pcl::PointCloud<pcl::PointXYZ>::Ptr source_cloud,
+        std::shared_ptr<NeighbourSearch> target,
+        ProbPointCloudRegistrationParams parameters,
+        pcl::PointCloud<pcl::PointXYZ>::Ptr ground_truth_cloud);
+
+    // The filtering and KD-tree build times are added to statistics when given
+    static pcl::KdTreeFLANN<pcl::PointXYZ>::Ptr buildTargetKdTree(
+        pcl::PointCloud<pcl::PointXYZ>::Ptr target_cloud,
+        const ProbPointCloudRegistrationParams &parameters,
+        RegistrationStatistics *statistics = NULL);
+    // Same, with the parameters.neighbour_search backend
+    static std::shared_ptr<NeighbourSearch> buildTarget(
+        pcl::PointCloud<pcl::PointXYZ>::Ptr target_cloud,
+        const ProbPointCloudRegistrationParams &parameters,
+        RegistrationStatistics *statistics = NULL);
+    /**
+     * Reads a target saved by saveTarget() from the current source_file_name, with the same
+     * neighbour search, target filter size and radius, instead of filtering and indexing it
+     * again: a voxel hash is restored as it was, the other searches are built on the saved
+     * points. NULL when there is no such file, or the source cloud changed since it was saved.
+     */
+    static std::shared_ptr<NeighbourSearch> loadTarget(
+        const std::string &file_name,
+        const std::string &source_file_name,
+        const ProbPointCloudRegistrationParams &parameters,
+        RegistrationStatistics *statistics = NULL);
+    // Saves a target built by buildTarget() with parameters from the cloud of source_file_name,
+    // false when it cannot be written
+    static bool saveTarget(
+        const NeighbourSearch &target,
+        const std::string &source_file_name,
+        const ProbPointCloudRegistrationParams &parameters,
+        const std::string &file_name);
+
     void align();
     bool hasConverged();
+    // The identity when no iteration has run, e.g. when the time budget was spent before the first one
     inline Eigen::Affine3d transformation()
     {
+        if (transformation_history_.empty()) {
+            return Eigen::Affine3d::Identity();
+        }
         return transformation_history_.back();
     }
 
+    // Whether the last align() stopped because parameters.time_budget was spent
+    inline bool timedOut() const
+    {
+        return timed_out_;
+    }
+
     inline std::vector<Eigen::Affine3d> transformation_history()
     {
         return transformation_history_;
@@ -44,23 +118,71 @@ public:
         return report_.str();
     }
 
+    // Per-phase wall times and counters, also appended to the report() rows
+    inline const RegistrationStatistics &statistics() const
+    {
+        return statistics_;
+    }
+
+    // NULL unless the target is a KdTreeSearch
+    inline pcl::KdTreeFLANN<pcl::PointXYZ>::Ptr targetKdTree()
+    {
+        return target_kdtree_;
+    }
+
+    inline std::shared_ptr<NeighbourSearch> target()
+    {
+        return target_;
+    }
+
 private:
+    void initialize(pcl::PointCloud<pcl::PointXYZ>::Ptr source_cloud);
+    void setGroundTruth(pcl::PointCloud<pcl::PointXYZ>::Ptr ground_truth_cloud);
+    // Filters target_cloud in place with parameters.target_filter_size, returns the time it took
+    static double filterTarget(pcl::PointCloud<pcl::PointXYZ>::Ptr target_cloud,
+                               const ProbPointCloudRegistrationParams &parameters);
+    static void downsample(pcl::PointCloud<pcl::PointXYZ>::ConstPtr cloud, double leaf_size,
+                           pcl::PointCloud<pcl::PointXYZ> &filtered_cloud);
+    // NULL for point-to-point residuals, the time it takes is accounted as an index build
+    std::shared_ptr<const TargetGeometry> targetGeometry(const NeighbourSearch &target, double radius);
+    // Scores the hypotheses of parameters.coarse_alignment, refines the best ones and pushes the
+    // best refined pose to the transformation history
+    void coarseAlign();
+    // Runs outer iterations until hasConverged(), source_cloud is moved with the estimate
+    void alignLevel(pcl::PointCloud<pcl::PointXYZ>::Ptr source_cloud, NeighbourSearch &target, double radius,
+                    const TargetGeometry *geometry);
+    // Same, with the iteration of parameters_.scalar_type
+    template <typename Scalar>
+    void alignLevel(BasicProbPointCloudRegistrationIteration<Scalar> &registration,
+                    pcl::PointCloud<pcl::PointXYZ>::Ptr source_cloud, NeighbourSearch &target, double radius,
+                    const TargetGeometry *geometry);
+
     ProbPointCloudRegistrationParams parameters_;
-    pcl::PointCloud<pcl::PointXYZ>::Ptr target_cloud_;
+    pcl::PointCloud<pcl::PointXYZ>::ConstPtr target_cloud_;
+    pcl::KdTreeFLANN<pcl::PointXYZ>::Ptr target_kdtree_;
+    std::shared_ptr<NeighbourSearch> target_;
     pcl::PointCloud<pcl::PointXYZ>::Ptr source_cloud_;
     pcl::PointCloud<pcl::PointXYZ>::Ptr filtered_source_cloud_;
-    pcl::PointCloud<pcl::PointXYZ>::Ptr prev_source_cloud_;
     pcl::PointCloud<pcl::PointXYZ>::Ptr ground_truth_cloud_;
-    bool ground_truth_;
-    double mse_ground_truth_;
-    double mse_prev_it_;
-    double cost_drop_;
-    int num_unusefull_iter_;
-    int current_iteration_;
+    bool ground_truth_ = false;
+    double mse_ground_truth_ = 0;
+    double mse_prev_it_ = 0;
+    double cost_drop_ = 0;
+    int num_unusefull_iter_ = 0;
+    int current_iteration_ = 0;
+    int level_iteration_ = 0;
+    // Of the running align(), parameters_.deadline or the end of parameters_.time_budget
+    std::chrono::steady_clock::time_point deadline_ = std::chrono::steady_clock::time_point::max();
+    bool timed_out_ = false;
     OutputStream output_stream_;
     std::vector<Eigen::Affine3d> transformation_history_;
     std::stringstream report_;
-    pcl::VoxelGrid<pcl::PointXYZ> filter_;
+    RegistrationStatistics statistics_;
+    // Only the one of parameters_.scalar_type is set
+    std::unique_ptr<ProbPointCloudRegistrationIteration> registration_;
+    std::unique_ptr<BasicProbPointCloudRegistrationIteration<float>> float_registration_;
+    // Refilled at each iteration, its storage is reused across the iterations and the levels
+    DataAssociation data_association_;
 };
 
 }  // namespace prob_point_cloud_registration
@@ -3,59 +3,157 @@
 
 #include <ceres/ceres.h>
 #include <Eigen/Core>
+#include <Eigen/Geometry>
 #include <Eigen/Sparse>
 #include <pcl/point_cloud.h>
 #include <pcl/point_types.h>
 
+#include <algorithm>
+#include <cmath>
 #include <vector>
 
-#include "prob_point_cloud_registration/error_term.hpp"
+#include "prob_point_cloud_registration/batched_error_term.hpp"
+#include "prob_point_cloud_registration/data_association.hpp"
+#include "prob_point_cloud_registration/neighbour_search.hpp"
 #include "prob_point_cloud_registration/probabilistic_weights.hpp"
+#include "prob_point_cloud_registration/procrustes.hpp"
 #include "prob_point_cloud_registration/weight_updater_callback.hpp"
 #include "prob_point_cloud_registration/prob_point_cloud_registration_params.hpp"
+#include "prob_point_cloud_registration/registration_statistics.hpp"
+#ifdef PROB_POINT_CLOUD_REGISTRATION_USE_CUDA
+#include "prob_point_cloud_registration/cuda_target.h"
+#endif
 
 #define DIMENSIONS 3
 
 namespace prob_point_cloud_registration {
 
-class ProbPointCloudRegistrationIteration
+class DeviceAssociation;
+
+/**
+ * Scalar, float or double, is the type of the weights and the squared errors of the E-steps, see
+ * BasicBatchedErrorTerm. ProbPointCloudRegistration instantiates the one of
+ * ProbPointCloudRegistrationParams::scalar_type.
+ */
+template <typename Scalar>
+class BasicProbPointCloudRegistrationIteration
 {
 public:
-    ProbPointCloudRegistrationIteration(const pcl::PointCloud<pcl::PointXYZ> &source_cloud,
-                                    const pcl::PointCloud<pcl::PointXYZ> &target_cloud,
-                                    const Eigen::SparseMatrix<double, Eigen::RowMajor> &data_association,
-                                    ProbPointCloudRegistrationParams parameters)
-        : error_terms_(), data_association_(data_association), parameters_(parameters),
-          weight_updater_(parameters.dof, DIMENSIONS, parameters.max_neighbours)
+    /**
+     * The Ceres problem, the error term and the weight updater live as long as this object:
+     * setDataAssociation() swaps in the point pairs of a new outer iteration, reusing their
+     * storage.
+     */
+    explicit BasicProbPointCloudRegistrationIteration(ProbPointCloudRegistrationParams parameters)
+        : error_term_(new BasicBatchedErrorTerm<Scalar>()), residual_block_id_(NULL),
+          parameters_(withDefaultExecutor(parameters)),
+          weight_updater_(parameters.dof, residualDimension(parameters.residual_type), parameters.max_neighbours)
     {
-        std::copy(std::begin(parameters_.initial_rotation), std::end(parameters_.initial_rotation),
-                  std::begin(rotation_));
-        std::copy(std::begin(parameters_.initial_translation), std::end(parameters_.initial_translation),
-                  std::begin(translation_));
-        error_terms_.reserve(source_cloud.size());
-        problem_.reset(new ceres::Problem());
-        for (size_t i = 0; i < data_association.outerSize(); i++) {
-            for (Eigen::SparseMatrix<double, Eigen::RowMajor>::InnerIterator it(data_association, i); it;
-                    ++it) {
-                ErrorTerm *error_term = new ErrorTerm(source_cloud[it.row()], target_cloud[it.col()]);
-                error_terms_.push_back(error_term);
-                problem_->AddResidualBlock(new ceres::AutoDiffCostFunction
-                                           < ErrorTerm, ErrorTerm::kResiduals, 4, 3 > (error_term), error_term->weight(), rotation_,
-                                           translation_);
-            }
-        }
-        weight_updater_callback_.reset(new WeightUpdaterCallback(&data_association_, &parameters_,
-                                                                 &error_terms_, &weight_updater_, rotation_, translation_));
-        (*weight_updater_callback_)(ceres::IterationSummary());
+        error_term_->setExecutor(parameters_.executor.get());
+        ceres::Problem::Options problem_options;
+        problem_options.cost_function_ownership = ceres::DO_NOT_TAKE_OWNERSHIP;
+        problem_.reset(new ceres::Problem(problem_options));
+        weight_updater_callback_.reset(new BasicWeightUpdaterCallback<Scalar>(&parameters_, error_term_.get(),
+                                                                              &weight_updater_, rotation_,
+                                                                              translation_));
+    }
+
+    BasicProbPointCloudRegistrationIteration(const pcl::PointCloud<pcl::PointXYZ> &source_cloud,
+                                             const pcl::PointCloud<pcl::PointXYZ> &target_cloud,
+                                             const Eigen::SparseMatrix<double, Eigen::RowMajor> &data_association,
+                                             ProbPointCloudRegistrationParams parameters)
+        : BasicProbPointCloudRegistrationIteration(parameters)
+    {
+        setDataAssociation(source_cloud, target_cloud, data_association);
+    }
+
+    // Restarts from the initial pose of the parameters with the given point pairs, which are copied.
+    void setDataAssociation(const pcl::PointCloud<pcl::PointXYZ> &source_cloud,
+                            const pcl::PointCloud<pcl::PointXYZ> &target_cloud,
+                            const Eigen::SparseMatrix<double, Eigen::RowMajor> &data_association)
+    {
+        owned_data_association_ = data_association;
+        data_association_ = &owned_data_association_;
+        device_association_ = NULL;
+        device_weight_time_ = 0;
+        weight_updater_callback_->reset(data_association_);
+        error_term_->setAssociations(source_cloud, target_cloud, *data_association_);
+        restart();
+    }
+
+    /**
+     * Same, with the target points fetched from the search structure the associations come from.
+     * The geometry of the target, required unless parameters.residual_type is POINT_TO_POINT,
+     * must outlive the solve.
+     */
+    void setDataAssociation(const pcl::PointCloud<pcl::PointXYZ> &source_cloud, const NeighbourSearch &target,
+                            const Eigen::SparseMatrix<double, Eigen::RowMajor> &data_association,
+                            const TargetGeometry *geometry = NULL)
+    {
+        owned_data_association_ = data_association;
+        setDataAssociation(source_cloud, target, &owned_data_association_, geometry);
+    }
+
+    // Same, data_association is referenced instead of copied: it must not change until the solve is over
+    void setDataAssociation(const pcl::PointCloud<pcl::PointXYZ> &source_cloud, const NeighbourSearch &target,
+                            const DataAssociation &data_association, const TargetGeometry *geometry = NULL)
+    {
+        setDataAssociation(source_cloud, target, &data_association.matrix(), geometry);
     }
 
+#ifdef PROB_POINT_CLOUD_REGISTRATION_USE_CUDA
+    /**
+     * Same, with associations computed by CudaTarget::associate(), that device_association keeps on
+     * the device: solve() then runs the EM of the PROCRUSTES solver there, whatever solver_type,
+     * and only the weighted sums of the M-steps come back. Point-to-point residuals, no pruning.
+     */
+    void setDataAssociation(DeviceAssociation &device_association, const DataAssociation &data_association)
+    {
+        data_association_ = &data_association.matrix();
+        device_association_ = &device_association;
+        weight_updater_callback_->reset(data_association_);
+        resetPose();
+        Stopwatch expectation;
+        device_moments_ = device_association.expectation(rotation_, translation_, parameters_.dof,
+                                                         parameters_.deterministic);
+        device_weight_time_ = expectation.elapsed();
+    }
+#endif
+
     void solve(ceres::Solver::Options options, ceres::Solver::Summary *summary)
     {
+#ifdef PROB_POINT_CLOUD_REGISTRATION_USE_CUDA
+        if (device_association_ != NULL) {
+            solveOnDevice(options, summary);
+            return;
+        }
+#endif
+        // Procrustes only has a closed form for point-to-point residuals
+        if (parameters_.solver_type == SolverType::PROCRUSTES && error_term_->isPointToPoint()) {
+            solveProcrustes(options, summary);
+            return;
+        }
         options.callbacks.push_back(weight_updater_callback_.get());
         options.update_state_every_iteration = true;
+        if (parameters_.prune_weight > 0 && residual_block_id_ != NULL) {
+            solvePruned(options, summary);
+            return;
+        }
         ceres::Solve(options, problem_.get(), summary);
     }
 
+    // The associations that were not pruned, see ProbPointCloudRegistrationParams::prune_weight
+    int numActiveAssociations() const
+    {
+        return device_association_ != NULL ? data_association_->nonZeros() : error_term_->numActive();
+    }
+
+    // Seconds spent updating the weights since the last setDataAssociation(), including its own update
+    double weightUpdateTime() const
+    {
+        return weight_updater_callback_->elapsedTime() + device_weight_time_;
+    }
+
     Eigen::Affine3d transformation()
     {
         Eigen::Affine3d affine = Eigen::Affine3d::Identity();
@@ -67,16 +165,226 @@ public:
     }
 
 private:
-    std::vector<ErrorTerm *> error_terms_;
+    void setDataAssociation(const pcl::PointCloud<pcl::PointXYZ> &source_cloud, const NeighbourSearch &target,
+                            const Eigen::SparseMatrix<double, Eigen::RowMajor> *data_association,
+                            const TargetGeometry *geometry)
+    {
+        data_association_ = data_association;
+        device_association_ = NULL;
+        device_weight_time_ = 0;
+        weight_updater_callback_->reset(data_association_);
+        error_term_->setAssociations(source_cloud, target, *data_association_, geometry);
+        restart();
+    }
+
+    // The degrees of freedom of a residual, for the t-distribution of the weights
+    static int residualDimension(ResidualType residual_type)
+    {
+        return residual_type == ResidualType::POINT_TO_PLANE ? 1 : DIMENSIONS;
+    }
+
+    void resetPose()
+    {
+        std::copy(std::begin(parameters_.initial_rotation), std::end(parameters_.initial_rotation),
+                  std::begin(rotation_));
+        std::copy(std::begin(parameters_.initial_translation), std::end(parameters_.initial_translation),
+                  std::begin(translation_));
+    }
+
+    // Back to the initial pose of the parameters, with the residual block and the weights of the new point pairs
+    void restart()
+    {
+        resetPose();
+        // The residual block is re-added so that Ceres picks up the new number of residuals
+        if (residual_block_id_ != NULL) {
+            problem_->RemoveResidualBlock(residual_block_id_);
+            residual_block_id_ = NULL;
+        }
+        if (error_term_->size() > 0) {
+            residual_block_id_ = problem_->AddResidualBlock(error_term_.get(), NULL, rotation_, translation_);
+        }
+        (*weight_updater_callback_)(ceres::IterationSummary());
+    }
+
+    // EM with the same E-step as the Ceres path (the weight updater callback) and a closed-form
+    // weighted rigid fit as M-step. Only the tolerances, the iteration and the time limits of
+    // options are used.
+    void solveProcrustes(const ceres::Solver::Options &options, ceres::Solver::Summary *summary)
+    {
+        solveEM(options, cost(), [this](Eigen::Affine3d *fit) {
+            return weightedRigidTransform(*error_term_, fit, *parameters_.executor, parameters_.deterministic);
+        }, [this](const ceres::IterationSummary &iteration) {
+            (*weight_updater_callback_)(iteration);
+            return cost();
+        }, summary);
+    }
+
+    /**
+     * Ceres solves of at most parameters.prune_period iterations on the active associations only,
+     * compacted into a fresh residual block so that the pruned ones take no rows in the Jacobian.
+     * The full updates of the weights are done between the solves, summary adds them up.
+     */
+    void solvePruned(ceres::Solver::Options options, ceres::Solver::Summary *summary)
+    {
+        Stopwatch solve;
+        const int period = std::max(parameters_.prune_period, 1);
+        const int max_num_iterations = options.max_num_iterations;
+        const double max_solver_time = options.max_solver_time_in_seconds;
+        int num_iterations = 0;
+        weight_updater_callback_->setPeriodicFullUpdates(false);
+        for (;;) {
+            if (num_iterations > 0) {
+                weight_updater_callback_->update(true);
+            }
+            problem_->RemoveResidualBlock(residual_block_id_);
+            residual_block_id_ = NULL;
+            if (error_term_->compact() == 0) {
+                summary->termination_type = ceres::FAILURE;
+                summary->message = "All the associations were pruned.";
+                break;
+            }
+            residual_block_id_ = problem_->AddResidualBlock(error_term_.get(), NULL, rotation_, translation_);
+            options.max_num_iterations = std::min(period, max_num_iterations - num_iterations);
+            options.max_solver_time_in_seconds = std::max(max_solver_time - solve.elapsed(), 0.0);
+            ceres::Solver::Summary part;
+            ceres::Solve(options, problem_.get(), &part);
+            const int part_iterations = part.num_successful_steps + part.num_unsuccessful_steps;
+            if (num_iterations == 0) {
+                *summary = part;
+            } else {
+                summary->final_cost = part.final_cost;
+                summary->termination_type = part.termination_type;
+                summary->message = part.message;
+                summary->num_successful_steps += part.num_successful_steps;
+                summary->num_unsuccessful_steps += part.num_unsuccessful_steps;
+                summary->total_time_in_seconds += part.total_time_in_seconds;
+                // Iteration 0 of each part is the state the previous one ended in
+                for (std::size_t i = 1; i < part.iterations.size(); i++) {
+                    summary->iterations.push_back(part.iterations[i]);
+                    summary->iterations.back().iteration += num_iterations;
+                }
+            }
+            num_iterations += part_iterations;
+            // Fewer iterations than asked for means the time limit
+            if (part.termination_type != ceres::NO_CONVERGENCE || part_iterations < options.max_num_iterations ||
+                    num_iterations >= max_num_iterations || solve.elapsed() >= max_solver_time) {
+                break;
+            }
+        }
+        weight_updater_callback_->setPeriodicFullUpdates(true);
+    }
+
+#ifdef PROB_POINT_CLOUD_REGISTRATION_USE_CUDA
+    // The same EM, both steps from the sums of the weighted associations computed on the device
+    void solveOnDevice(const ceres::Solver::Options &options, ceres::Solver::Summary *summary)
+    {
+        solveEM(options, device_moments_.cost, [this](Eigen::Affine3d *fit) {
+            return weightedRigidTransform(device_moments_, fit);
+        }, [this](const ceres::IterationSummary &) {
+            Stopwatch expectation;
+            device_moments_ = device_association_->expectation(rotation_, translation_, parameters_.dof,
+                                                               parameters_.deterministic);
+            device_weight_time_ += expectation.elapsed();
+            return device_moments_.cost;
+        }, summary);
+    }
+#endif
+
+    /**
+     * The EM loop: fit(&transform) is the M-step, from the current weights, and
+     * expectation(iteration) the E-step at the pose it moved to, returning the new cost.
+     */
+    template <typename Fit, typename Expectation>
+    void solveEM(const ceres::Solver::Options &options, double initial_cost, Fit fit, Expectation expectation,
+                 ceres::Solver::Summary *summary)
+    {
+        Stopwatch solve;
+        double current_cost = initial_cost;
+        summary->initial_cost = current_cost;
+        summary->num_successful_steps = 0;
+        summary->termination_type = ceres::NO_CONVERGENCE;
+        summary->message = "Maximum number of iterations reached.";
+        for (int i = 0; i < options.max_num_iterations; i++) {
+            Eigen::Affine3d transform;
+            if (!fit(&transform)) {
+                summary->termination_type = ceres::FAILURE;
+                summary->message = "All the weights vanished.";
+                break;
+            }
+            const Eigen::Quaterniond fit_rotation(transform.rotation());
+            Eigen::Vector4d new_rotation(fit_rotation.w(), fit_rotation.x(), fit_rotation.y(), fit_rotation.z());
+            Eigen::Map<Eigen::Vector4d> rotation(rotation_);
+            Eigen::Map<Eigen::Vector3d> translation(translation_);
+            if (new_rotation.dot(rotation) < 0) {
+                new_rotation = -new_rotation;
+            }
+            const double step_norm = std::sqrt((new_rotation - rotation).squaredNorm() +
+                                               (transform.translation() - translation).squaredNorm());
+            const double parameters_norm = std::sqrt(rotation.squaredNorm() + translation.squaredNorm());
+            rotation = new_rotation;
+            translation = transform.translation();
+
+            ceres::IterationSummary iteration;
+            iteration.iteration = i + 1;
+            iteration.step_is_successful = true;
+            const double new_cost = expectation(iteration);
+            iteration.cost = new_cost;
+            summary->iterations.push_back(iteration);
+            summary->num_successful_steps++;
+
+            const bool function_converged = std::abs(current_cost - new_cost) <= options.function_tolerance *
+                                            current_cost;
+            const bool parameters_converged = step_norm <= options.parameter_tolerance *
+                                              (parameters_norm + options.parameter_tolerance);
+            current_cost = new_cost;
+            if (function_converged || parameters_converged) {
+                summary->termination_type = ceres::CONVERGENCE;
+                summary->message = function_converged ? "Function tolerance reached." :
+                                   "Parameter tolerance reached.";
+                break;
+            }
+            if (solve.elapsed() >= options.max_solver_time_in_seconds) {
+                summary->message = "Maximum solver time reached.";
+                break;
+            }
+        }
+        summary->final_cost = current_cost;
+    }
+
+    // The pruned associations have a null weight, their errors are not needed
+    double cost()
+    {
+        error_term_->squaredErrors(rotation_, translation_, &squared_errors_, true);
+        const double total = parallelSum(*parameters_.executor, error_term_->size(), 0.0, [this](int begin, int end) {
+            double partial = 0;
+            for (int k = begin; k < end; k++) {
+                partial += error_term_->weight(k) * squared_errors_[k];
+            }
+            return partial;
+        }, parameters_.deterministic, internal::kMinParallelAssociations);
+        return total / 2;
+    }
+
+    std::unique_ptr<BasicBatchedErrorTerm<Scalar>> error_term_;
+    ceres::ResidualBlockId residual_block_id_;
+    std::vector<Scalar> squared_errors_;
     std::unique_ptr<ceres::Problem> problem_;
     double rotation_[4];
     double translation_[3];
-    Eigen::SparseMatrix<double, Eigen::RowMajor> data_association_;
+    // The associations of the last setDataAssociation(), owned_data_association_ unless given by reference
+    const Eigen::SparseMatrix<double, Eigen::RowMajor> *data_association_ = NULL;
+    Eigen::SparseMatrix<double, Eigen::RowMajor> owned_data_association_;
+    // Set when the associations, and the solve, are on the device
+    DeviceAssociation *device_association_ = NULL;
+    WeightedMoments device_moments_;
+    double device_weight_time_ = 0;
     ProbPointCloudRegistrationParams parameters_;
     ProbabilisticWeights weight_updater_;
-    std::unique_ptr<WeightUpdaterCallback> weight_updater_callback_;
+    std::unique_ptr<BasicWeightUpdaterCallback<Scalar>> weight_updater_callback_;
 };
 
+typedef BasicProbPointCloudRegistrationIteration<double> ProbPointCloudRegistrationIteration;
+
 }  // namespace prob_point_cloud_registration
 
 #endif
@@ -1,7 +1,62 @@
 #ifndef PROB_POINT_CLOUD_REGISTRATION_POINT_CLOUD_REGISTRATION_PARAMS_HPP
 #define PROB_POINT_CLOUD_REGISTRATION_POINT_CLOUD_REGISTRATION_PARAMS_HPP
 
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <vector>
+
+#include "prob_point_cloud_registration/executor.hpp"
+
 namespace prob_point_cloud_registration {
+
+// How the pose is estimated once the weights of an outer iteration are fixed: a Ceres
+// nonlinear least squares solve, or EM with closed-form weighted Procrustes M-steps.
+enum class SolverType { CERES, PROCRUSTES };
+
+// The index of the target clouds, see buildNeighbourSearch(). The voxel hash, with cells of
+// the search radius, is usually faster on dense clouds and cheaper to build. CUDA, a voxel hash
+// held on the GPU as well (CudaTarget), needs a build with USE_CUDA.
+enum class NeighbourSearchType { KDTREE, VOXEL_HASH, CUDA };
+
+// The residual between a moved source point x and an associated target point y: y - x, its
+// component n.(y - x) along the target normal at y, or y - x scaled by the inverse covariance of
+// the target around y (NDT-like). See TargetGeometry for the normals and covariances.
+enum class ResidualType { POINT_TO_POINT, POINT_TO_PLANE, POINT_TO_DISTRIBUTION };
+
+// The type of the per association weights and squared errors of the E-steps, see
+// BasicBatchedErrorTerm. FLOAT halves their memory traffic and doubles the SIMD width of the
+// weight updates. The poses, the residuals and the sums of the M-steps stay double.
+enum class ScalarType { DOUBLE, FLOAT };
+
+// A coarse level of the registration pyramid, see ProbPointCloudRegistrationParams::pyramid.
+// Leaf sizes are applied on top of source_filter_size and target_filter_size, 0 means no
+// further filtering.
+struct PyramidLevel {
+    double source_filter_size;
+    double target_filter_size;
+    double radius;
+};
+
+// The multi-hypothesis start of align(), see ProbPointCloudRegistrationParams::coarse_alignment
+struct CoarseAlignmentParams {
+    // Rotations of the source about its centroid, 0 disables the stage. Evenly spaced about the z
+    // axis when yaw_only, spread over all the rotations otherwise.
+    int num_rotations = 0;
+    bool yaw_only = true;
+    // With a target held in memory, each rotation is also tried with the source centroid moved
+    // onto the target one
+    bool align_centroids = true;
+    // The hypotheses are scored, with ClosestDistances::robustSum(robust_factor), on at most
+    // num_points source points
+    int num_points = 1000;
+    double robust_factor = 3;
+    // The best num_refined hypotheses are refined for refine_iterations outer iterations, on the
+    // same points, and the best refined one is kept
+    int num_refined = 3;
+    int refine_iterations = 5;
+};
+
 struct ProbPointCloudRegistrationParams {
     int max_neighbours = 20;
     double dof = 5;
@@ -15,7 +70,84 @@ struct ProbPointCloudRegistrationParams {
     double initial_translation[3] = {0, 0, 0};
     double source_filter_size = 0;
     double target_filter_size = 0;
+    SolverType solver_type = SolverType::CERES;
+    NeighbourSearchType neighbour_search = NeighbourSearchType::KDTREE;
+    // Procrustes only fits point-to-point residuals, the others are always solved with Ceres. The
+    // normals and covariances come from at most geometry_neighbours target points within radius,
+    // they are computed once per target index, on its first registration.
+    ResidualType residual_type = ResidualType::POINT_TO_POINT;
+    int geometry_neighbours = 20;
+    ScalarType scalar_type = ScalarType::DOUBLE;
+    // Coarse-to-fine levels run, in order, before the full resolution one (source_filter_size,
+    // target_filter_size and radius). Each level starts from the pose estimated by the previous
+    // one and runs until hasConverged(), with n_iter and n_cost_drop_it counted per level.
+    std::vector<PyramidLevel> pyramid;
+    // Tried before the pyramid, for starts too far from the solution for the refinement alone
+    CoarseAlignmentParams coarse_alignment;
+    // Reuse the neighbours of the previous outer iteration for the source points that moved less
+    // than association_margin * radius, see IncrementalDataAssociation. Same associations, fewer
+    // KD-tree queries once the estimate settles.
+    bool incremental_association = false;
+    double association_margin = 0.1;
+    // During a solve, the associations whose weight falls below prune_weight (0 disables it) are
+    // no longer evaluated and keep a null weight. Every prune_period weight updates all of them
+    // are evaluated again, and the ones whose weight recovered are reactivated.
+    double prune_weight = 0;
+    int prune_period = 5;
+    // Wall-clock limit of align(), in seconds, 0 for none. The outer iterations stop once it is
+    // spent, each solve is limited to what is left, and the estimate reached so far is kept.
+    double time_budget = 0;
+    // The same limit as a point in time, for callers charging the construction (the source
+    // filtering) or their own work to the budget, as OdometryRegistration does. align() stops at
+    // whichever of the two comes first, the default is none.
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+    // Sums the weighted associations (cost, Procrustes fits, the moments of the CUDA target) over
+    // fixed blocks in a fixed order, see parallelSum(): the transforms are then bit-identical
+    // whatever the thread count or the GPU scheduling, a little slower. The Ceres solves then
+    // run on a single thread.
+    bool deterministic = false;
+    // Runs the parallel sections and sets the threads of the Ceres solve. When empty, an
+    // OpenMPExecutor of num_threads threads (0 for one per hardware thread) is used.
+    // BatchRegistration splits num_threads among the scans it aligns concurrently.
+    std::shared_ptr<Executor> executor;
+    int num_threads = 0;
+    // Caps the threads of each Ceres solve below the thread count of the executor, 0 for none.
+    // BatchRegistration sets it when several scans share parameters.executor.
+    int max_solver_threads = 0;
 };
+
+// The threads of the Ceres solves of parameters, which must have an executor
+inline int solverThreads(const ProbPointCloudRegistrationParams &parameters)
+{
+    // Ceres sums the residuals of its threads in the order they end
+    if (parameters.deterministic) {
+        return 1;
+    }
+    const int num_threads = parameters.executor->numThreads();
+    return parameters.max_solver_threads > 0 ? std::min(num_threads, parameters.max_solver_threads) : num_threads;
+}
+
+// parameters, with an OpenMPExecutor of parameters.num_threads threads if it has no executor
+inline ProbPointCloudRegistrationParams withDefaultExecutor(ProbPointCloudRegistrationParams parameters)
+{
+    if (!parameters.executor) {
+        parameters.executor = std::make_shared<OpenMPExecutor>(parameters.num_threads);
+    }
+    return parameters;
+}
+
+// The earlier of parameters.deadline and parameters.time_budget after start
+inline std::chrono::steady_clock::time_point budgetDeadline(const ProbPointCloudRegistrationParams &parameters,
+                                                            std::chrono::steady_clock::time_point start)
+{
+    // Also keeps the cast of the budget in range
+    if (parameters.time_budget > 0 &&
+        parameters.time_budget < std::chrono::duration<double>(parameters.deadline - start).count()) {
+        return start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                   std::chrono::duration<double>(parameters.time_budget));
+    }
+    return parameters.deadline;
+}
 }
 
 #endif
@@ -8,6 +8,8 @@
 #include <limits>
 #include <vector>
 
+#include "prob_point_cloud_registration/executor.hpp"
+
 namespace prob_point_cloud_registration {
 
 inline double pi()
@@ -26,6 +28,63 @@ private:
     bool is_normal_;
     int max_neighbours_;
 
+    static const int kMinParallelRows = 1024;
+
+    /**
+     * The element-wise passes (log-probabilities, exponentials, expected weights) run over the
+     * whole array as Eigen array expressions, so they are vectorized with whatever instruction
+     * set the build targets (SSE2 by default, AVX2/AVX-512 with USE_NATIVE_INSTRUCTIONS). Only
+     * the per row max and sum, over at most max_neighbours entries, are scalar.
+     * The normalization exp(lp - max) / sum(exp(lp - max)) equals exp(lp - log-sum-exp).
+     * Instantiated per noise model and scalar type: float packs twice the entries per register.
+     */
+    template <bool kGaussian, typename Scalar>
+    void computeWeights(const int *outer_index, int rows, const Scalar *squared_errors,
+                        Scalar *weights) const
+    {
+        typedef Eigen::Array<Scalar, Eigen::Dynamic, 1> Array;
+        const int size = outer_index[rows] - outer_index[0];
+        Eigen::Map<const Array> errors(squared_errors + outer_index[0], size);
+        Eigen::Map<Array> values(weights + outer_index[0], size);
+        const Scalar v = static_cast<Scalar>(v_);
+        if (kGaussian) {
+            values = -errors / 2;
+        } else {
+            // The normalization constants cancel out in the per row normalization. log(1 + x)
+            // instead of log1p(x), which Eigen does not vectorize for double.
+            values = static_cast<Scalar>(t_exponent_) * (1 + errors / v).log();
+        }
+        for (int i = 0; i < rows; ++i) {
+            const int row_begin = outer_index[i] - outer_index[0];
+            const int row_size = outer_index[i + 1] - outer_index[i];
+            if (row_size > 0) {
+                values.segment(row_begin, row_size) -= values.segment(row_begin, row_size).maxCoeff();
+            }
+        }
+        values = values.exp();
+        for (int i = 0; i < rows; ++i) {
+            const int row_begin = outer_index[i] - outer_index[0];
+            const int row_size = outer_index[i + 1] - outer_index[i];
+            if (row_size > 0) {
+                values.segment(row_begin, row_size) /= values.segment(row_begin, row_size).sum();
+            }
+        }
+        if (!kGaussian) {
+            values *= (v + dimension_) / (v + errors);
+        }
+    }
+
+    // The model is chosen once per update, not per block
+    template <bool kGaussian, typename Scalar>
+    void updateModelWeights(const Eigen::SparseMatrix<double, Eigen::RowMajor> &data_association,
+                            const Scalar *squared_errors, Scalar *weights, Executor &executor) const
+    {
+        const int *outer_index = data_association.outerIndexPtr();
+        parallelForBlocks(executor, data_association.outerSize(), [&](int, int begin, int end) {
+            computeWeights<kGaussian>(outer_index + begin, end - begin, squared_errors, weights);
+        }, kMinParallelRows);
+    }
+
 public:
     ProbabilisticWeights(double v, int dimension, int max_neighbours)
         : max_neighbours_(max_neighbours), dimension_(dimension)
@@ -45,62 +104,34 @@ public:
         }
     }
 
-    Eigen::SparseMatrix<double, Eigen::RowMajor> updateWeights(
-        Eigen::SparseMatrix<double, Eigen::RowMajor> data_association, std::vector<double> squared_errors)
+    /**
+     * Computes the weight of every association, writing it in weights at the same position the
+     * association has in data_association.valuePtr(). data_association has to be compressed,
+     * squared_errors follows the same ordering. No memory is allocated: the log-probabilities are
+     * staged in the output buffer itself. Blocks of rows are processed in parallel by executor.
+     * Scalar is float or double.
+     */
+    template <typename Scalar>
+    void updateWeights(const Eigen::SparseMatrix<double, Eigen::RowMajor> &data_association,
+                       const std::vector<Scalar> &squared_errors, Scalar *weights,
+                       Executor &executor = defaultExecutor()) const
     {
-        Eigen::SparseMatrix<double, Eigen::RowMajor> weights(data_association.rows(),
-                                                             data_association.cols());
-        weights.reserve(
-            Eigen::VectorXi::Constant(data_association.rows(), max_neighbours_));
-        int squared_errors_index = 0;
-        for (std::size_t i = 0; i < data_association.outerSize(); ++i) {
-            double max_log_prob = -std::numeric_limits<double>::infinity();
-            std::vector<double> log_probs;
-            std::vector<double> expected_weights;
-            log_probs.reserve(max_neighbours_);
-            expected_weights.reserve(max_neighbours_);
-            double marginal_log_likelihood = 0;
-            for (Eigen::SparseMatrix<double, Eigen::RowMajor>::InnerIterator it(
-                        data_association, i);
-                    it; ++it) {
-                // Update log_probs
-                double log_prob;
-                if (is_normal_) {
-                    log_prob = -squared_errors[squared_errors_index] / 2 + log_norm_constant_;
-                } else {
-                    log_prob =
-                        (t_exponent_) * std::log1p(squared_errors[squared_errors_index] / v_) - log_norm_constant_;
-                    const double expected_weight = (v_ + dimension_) / (v_ + squared_errors[squared_errors_index]);
-                    expected_weights.push_back(expected_weight);
-                }
-
-                if (log_prob > max_log_prob) {
-                    max_log_prob = log_prob;
-                }
-                log_probs.push_back(log_prob);
-                ++squared_errors_index;
-            }
-            for (double log_p : log_probs) {
-                marginal_log_likelihood += std::exp(log_p - max_log_prob);
-            }
-            marginal_log_likelihood =
-                std::log(marginal_log_likelihood) + max_log_prob;
-            int k = 0;
-            for (Eigen::SparseMatrix<double, Eigen::RowMajor>::InnerIterator it(
-                        data_association, i);
-                    it; ++it) {
-                if (is_normal_) {
-                    weights.insert(it.row(), it.col()) =
-                        std::exp(log_probs[k] - marginal_log_likelihood);
-                } else {
-                    weights.insert(it.row(), it.col()) =
-                        std::exp(log_probs[k] - marginal_log_likelihood) *
-                        expected_weights[k];
-                }
-                ++k;
-            }
+        assert(data_association.isCompressed());
+        assert(squared_errors.size() == data_association.nonZeros());
+        if (is_normal_) {
+            updateModelWeights<true>(data_association, squared_errors.data(), weights, executor);
+        } else {
+            updateModelWeights<false>(data_association, squared_errors.data(), weights, executor);
         }
+    }
+
+    Eigen::SparseMatrix<double, Eigen::RowMajor> updateWeights(
+        const Eigen::SparseMatrix<double, Eigen::RowMajor> &data_association,
+        const std::vector<double> &squared_errors) const
+    {
+        Eigen::SparseMatrix<double, Eigen::RowMajor> weights(data_association);
         weights.makeCompressed();
+        updateWeights(weights, squared_errors, weights.valuePtr());
         return weights;
     }
 };
@@ -0,0 +1,118 @@
+#ifndef PROB_POINT_CLOUD_REGISTRATION_PROCRUSTES_HPP
+#define PROB_POINT_CLOUD_REGISTRATION_PROCRUSTES_HPP
+
+#include <Eigen/Core>
+#include <Eigen/Geometry>
+#include <Eigen/SVD>
+
+#include "prob_point_cloud_registration/batched_error_term.hpp"
+#include "prob_point_cloud_registration/executor.hpp"
+
+namespace prob_point_cloud_registration {
+
+// The weighted sums over a set of associations (x_k, y_k) with weights w_k, enough for the fit below
+struct WeightedMoments {
+    double total_weight = 0;
+    // sum_k w_k * x_k and sum_k w_k * y_k
+    Eigen::Vector3d source_sum = Eigen::Vector3d::Zero();
+    Eigen::Vector3d target_sum = Eigen::Vector3d::Zero();
+    // sum_k w_k * x_k * y_k^T
+    Eigen::Matrix3d cross_sum = Eigen::Matrix3d::Zero();
+    // sum_k w_k * ||y_k - x_k||^2 / 2, x_k in the pose the weights were computed at
+    double cost = 0;
+};
+
+namespace internal {
+
+// Below, the sums over the associations run on the calling thread
+const int kMinParallelAssociations = 16384;
+
+// The rotation maximising trace(R * covariance), a proper one
+inline Eigen::Matrix3d rotationFromCovariance(const Eigen::Matrix3d &covariance)
+{
+    Eigen::JacobiSVD<Eigen::Matrix3d> svd(covariance, Eigen::ComputeFullU | Eigen::ComputeFullV);
+    Eigen::Matrix3d reflection = Eigen::Matrix3d::Identity();
+    reflection(2, 2) = (svd.matrixV() * svd.matrixU().transpose()).determinant() < 0 ? -1 : 1;
+    return svd.matrixV() * reflection * svd.matrixU().transpose();
+}
+
+}  // namespace internal
+
+/**
+ * Closed form minimiser (Kabsch/Horn) of sum_k w_k * ||y_k - (R * x_k + t)||^2 over the
+ * associations of error_term, with the weights held fixed. Returns false, leaving transform
+ * untouched, when the total weight vanishes. The sums run on executor, see parallelSum() for
+ * deterministic.
+ */
+template <typename Scalar>
+inline bool weightedRigidTransform(const BasicBatchedErrorTerm<Scalar> &error_term, Eigen::Affine3d *transform,
+                                   Executor &executor = defaultExecutor(), bool deterministic = false)
+{
+    // The total weight, then the weighted sums of the source and of the target points
+    typedef Eigen::Matrix<double, 7, 1> Sums;
+    const Sums sums = parallelSum(executor, error_term.size(), Sums(Sums::Zero()), [&](int begin, int end) {
+        Sums partial = Sums::Zero();
+        for (int k = begin; k < end; k++) {
+            const double weight = error_term.weight(k);
+            // Null for the pruned associations
+            if (weight == 0) {
+                continue;
+            }
+            partial(0) += weight;
+            partial.segment<3>(1) += weight * error_term.sourcePoint(k);
+            partial.segment<3>(4) += weight * error_term.targetPoint(k);
+        }
+        return partial;
+    }, deterministic, internal::kMinParallelAssociations);
+    const double total_weight = sums(0);
+    if (!(total_weight > 0)) {
+        return false;
+    }
+    const Eigen::Vector3d source_centroid = sums.segment<3>(1) / total_weight;
+    const Eigen::Vector3d target_centroid = sums.segment<3>(4) / total_weight;
+
+    const Eigen::Matrix3d covariance = parallelSum(executor, error_term.size(),
+                                                   Eigen::Matrix3d(Eigen::Matrix3d::Zero()), [&](int begin, int end) {
+        Eigen::Matrix3d partial = Eigen::Matrix3d::Zero();
+        for (int k = begin; k < end; k++) {
+            if (error_term.weight(k) == 0) {
+                continue;
+            }
+            partial += error_term.weight(k) * (error_term.sourcePoint(k) - source_centroid) *
+                       (error_term.targetPoint(k) - target_centroid).transpose();
+        }
+        return partial;
+    }, deterministic, internal::kMinParallelAssociations);
+    const Eigen::Matrix3d rotation = internal::rotationFromCovariance(covariance);
+
+    transform->setIdentity();
+    transform->linear() = rotation;
+    transform->translation() = target_centroid - rotation * source_centroid;
+    return true;
+}
+
+/**
+ * The same fit from the sums of the associations, as accumulated where the associations are
+ * (see CudaTarget). The covariance is recovered as cross_sum - total_weight * x_mean * y_mean^T,
+ * less accurate than the two pass version above when the clouds are far from the origin.
+ */
+inline bool weightedRigidTransform(const WeightedMoments &moments, Eigen::Affine3d *transform)
+{
+    if (!(moments.total_weight > 0)) {
+        return false;
+    }
+    const Eigen::Vector3d source_centroid = moments.source_sum / moments.total_weight;
+    const Eigen::Vector3d target_centroid = moments.target_sum / moments.total_weight;
+    const Eigen::Matrix3d covariance = moments.cross_sum - moments.total_weight * source_centroid *
+                                       target_centroid.transpose();
+    const Eigen::Matrix3d rotation = internal::rotationFromCovariance(covariance);
+
+    transform->setIdentity();
+    transform->linear() = rotation;
+    transform->translation() = target_centroid - rotation * source_centroid;
+    return true;
+}
+
+}  // namespace prob_point_cloud_registration
+
+#endif
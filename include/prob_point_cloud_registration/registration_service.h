@@ -0,0 +1,87 @@
+#ifndef PROB_POINT_CLOUD_REGISTRATION_REGISTRATION_SERVICE_HPP
+#define PROB_POINT_CLOUD_REGISTRATION_REGISTRATION_SERVICE_HPP
+
+#include <condition_variable>
+#include <cstddef>
+#include <istream>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "prob_point_cloud_registration/prob_point_cloud_registration_params.hpp"
+#include "prob_point_cloud_registration/target_cache.h"
+
+namespace prob_point_cloud_registration {
+
+// What the clients of a RegistrationService may ask for
+struct RegistrationServiceOptions {
+    // The targets are the files under this directory, that the requests name relative to it
+    std::string target_root = ".";
+    // The allowed target filter sizes, any finite one >= 0 when empty
+    std::vector<double> target_filter_sizes;
+    // The largest source cloud of a request
+    std::size_t max_source_points = 10000000;
+};
+
+/**
+ * Registers streamed source clouds against the targets of a TargetCache, for the clients that
+ * register small scans against the same large maps many times. A request is a line
+ *
+ *     register <target file> <target filter size> <number of points>
+ *
+ * followed by the x, y, z of the source points as 32 bit floats in the byte order of the
+ * server. The target is fetched from the cache while the points are read. The response is a line
+ *
+ *     ok <outer iterations> <the 3 x 4 source to target transformation, row major>
+ *
+ * or "error <message>". A connection sends any number of requests, one after the other.
+ *
+ * The requests are not authenticated: the target files are only looked up under
+ * options.target_root, names that are absolute, contain ".." or resolve out of it are refused,
+ * and so are the filter sizes and the source sizes options does not allow.
+ *
+ * The registrations of the connections served concurrently share max_concurrent_solves solve
+ * slots, each with parameters.num_threads / max_concurrent_solves threads (of all the hardware
+ * threads when num_threads is 0), unless parameters.executor is set: the other connections
+ * keep reading their sources and loading their targets meanwhile.
+ */
+class RegistrationService
+{
+public:
+    RegistrationService(ProbPointCloudRegistrationParams parameters, std::size_t cache_capacity,
+                        int max_concurrent_solves, RegistrationServiceOptions options = RegistrationServiceOptions());
+
+    // Serves the requests read from in until it ends or a request is malformed
+    void serve(std::istream &in, std::ostream &out);
+
+    /**
+     * Accepts TCP connections on port of the address, the loopback interface by default, each
+     * served by its own thread, until an error is thrown
+     */
+    void listen(unsigned short port, const std::string &address = "127.0.0.1");
+
+    inline const TargetCache &cache() const
+    {
+        return cache_;
+    }
+
+private:
+    // False when the connection must be closed
+    bool serveRequest(std::istream &in, std::ostream &out);
+    // The file of the target a request names, empty when it is not allowed
+    std::string targetFile(const std::string &target_name) const;
+
+    ProbPointCloudRegistrationParams parameters_;
+    RegistrationServiceOptions options_;
+    // The canonical options_.target_root
+    std::string target_root_;
+    TargetCache cache_;
+    std::mutex solve_mutex_;
+    std::condition_variable solve_released_;
+    int free_solves_;
+};
+
+}  // namespace prob_point_cloud_registration
+
+#endif
@@ -0,0 +1,101 @@
+#ifndef PROB_POINT_CLOUD_REGISTRATION_REGISTRATION_STATISTICS_HPP
+#define PROB_POINT_CLOUD_REGISTRATION_REGISTRATION_STATISTICS_HPP
+
+#include <sys/resource.h>
+
+#include <chrono>
+#include <cstddef>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace prob_point_cloud_registration {
+
+// Wall times are in seconds
+struct IterationStatistics {
+    int iteration = 0;
+    double association_time = 0;
+    double problem_construction_time = 0;
+    // Includes the weight updates done by the solver
+    double solve_time = 0;
+    double weight_update_time = 0;
+    double transform_time = 0;
+    std::size_t num_associations = 0;
+    // Associations still evaluated at the end of the solve, all of them without pruning
+    std::size_t num_active_associations = 0;
+    // Source points looked up in the KD-tree, less than the source size with incremental association
+    int num_association_queries = 0;
+    int num_solver_iterations = 0;
+    // High-water mark of the resident set size of the process at the end of the iteration
+    long peak_memory_kb = 0;
+
+    static std::string csvHeader()
+    {
+        return "association_time, problem_construction_time, solve_time, weight_update_time, transform_time, "
+               "n_associations, n_active_associations, n_association_queries, n_solver_iterations, peak_memory_kb";
+    }
+
+    std::string csv() const
+    {
+        std::stringstream row;
+        row << association_time << ", " << problem_construction_time << ", " << solve_time << ", " <<
+            weight_update_time << ", " << transform_time << ", " << num_associations << ", " <<
+            num_active_associations << ", " << num_association_queries << ", " << num_solver_iterations << ", " << peak_memory_kb;
+        return row.str();
+    }
+};
+
+struct RegistrationStatistics {
+    double filtering_time = 0;
+    // Target index builds, KD-tree or voxel hash, with the normals or covariances of the target
+    double kdtree_build_time = 0;
+    // Scoring and refinement of the hypotheses, see CoarseAlignmentParams
+    double coarse_alignment_time = 0;
+    std::vector<IterationStatistics> iterations;
+
+    std::string json() const
+    {
+        std::stringstream json;
+        json << "{\"filtering_time\": " << filtering_time << ", \"kdtree_build_time\": " << kdtree_build_time <<
+             ", \"coarse_alignment_time\": " << coarse_alignment_time << ", \"iterations\": [";
+        for (std::size_t i = 0; i < iterations.size(); i++) {
+            const IterationStatistics &it = iterations[i];
+            json << (i > 0 ? ", " : "") << "{\"iteration\": " << it.iteration << ", \"association_time\": " <<
+                 it.association_time << ", \"problem_construction_time\": " << it.problem_construction_time <<
+                 ", \"solve_time\": " << it.solve_time << ", \"weight_update_time\": " << it.weight_update_time <<
+                 ", \"transform_time\": " << it.transform_time << ", \"n_associations\": " << it.num_associations <<
+                 ", \"n_active_associations\": " << it.num_active_associations <<
+                 ", \"n_association_queries\": " << it.num_association_queries << ", \"n_solver_iterations\": " <<
+                 it.num_solver_iterations << ", \"peak_memory_kb\": " << it.peak_memory_kb << "}";
+        }
+        json << "]}";
+        return json.str();
+    }
+};
+
+class Stopwatch
+{
+public:
+    Stopwatch(): start_(std::chrono::steady_clock::now()) {}
+
+    double elapsed() const
+    {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start_).count();
+    }
+
+private:
+    std::chrono::steady_clock::time_point start_;
+};
+
+inline long peakMemoryKb()
+{
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0;
+    }
+    return usage.ru_maxrss;
+}
+
+}  // namespace prob_point_cloud_registration
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef PROB_POINT_CLOUD_REGISTRATION_TARGET_CACHE_HPP
+#define PROB_POINT_CLOUD_REGISTRATION_TARGET_CACHE_HPP
+
+#include <cstddef>
+#include <future>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+
+#include "prob_point_cloud_registration/neighbour_search.hpp"
+#include "prob_point_cloud_registration/prob_point_cloud_registration_params.hpp"
+
+namespace prob_point_cloud_registration {
+
+/**
+ * The indexed targets of the most recently used (file, target filter size) pairs. A miss reads
+ * the file with loadPointCloud(), filtering it while it is read, and indexes it with
+ * ProbPointCloudRegistration::buildTarget() and the parameters' neighbour_search. The normals
+ * and covariances of the non point-to-point residuals are kept with the index, see
+ * NeighbourSearch::geometry(), so they are also computed once per cached target.
+ *
+ * Thread safe. Concurrent requests for a target being loaded wait for that single load, the
+ * loads of different targets run concurrently. An evicted target stays alive as long as a
+ * registration holds it.
+ */
+class TargetCache
+{
+public:
+    // Keeps at most capacity targets, at least one
+    TargetCache(std::size_t capacity, ProbPointCloudRegistrationParams parameters);
+
+    // Throws std::runtime_error when the file cannot be read
+    std::shared_ptr<NeighbourSearch> get(const std::string &file_name, double target_filter_size);
+
+    std::size_t size() const;
+
+    // The requests served from the cache or from a load in progress
+    std::size_t hits() const;
+
+    std::size_t misses() const;
+
+private:
+    typedef std::pair<std::string, double> Key;
+    struct Entry {
+        std::shared_future<std::shared_ptr<NeighbourSearch>> target;
+        // Position in lru_
+        std::list<Key>::iterator use;
+        // Tells the loads of a key apart once it has been evicted and loaded again
+        std::size_t generation;
+    };
+
+    std::shared_ptr<NeighbourSearch> load(const std::string &file_name, double target_filter_size) const;
+
+    const std::size_t capacity_;
+    const ProbPointCloudRegistrationParams parameters_;
+    mutable std::mutex mutex_;
+    std::map<Key, Entry> entries_;
+    // Most recently used first
+    std::list<Key> lru_;
+    std::size_t hits_ = 0;
+    std::size_t misses_ = 0;
+    std::size_t generations_ = 0;
+};
+
+}  // namespace prob_point_cloud_registration
+
+#endif
@@ -0,0 +1,218 @@
+#ifndef PROB_POINT_CLOUD_REGISTRATION_TARGET_FILE_HPP
+#define PROB_POINT_CLOUD_REGISTRATION_TARGET_FILE_HPP
+
+#include <limits.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <boost/make_shared.hpp>
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+
+#include "prob_point_cloud_registration/neighbour_search.hpp"
+#include "prob_point_cloud_registration/point_cloud_io.hpp"
+#include "prob_point_cloud_registration/prob_point_cloud_registration_params.hpp"
+
+namespace prob_point_cloud_registration {
+
+namespace internal {
+
+/**
+ * A target file is this header, the canonical path of the source cloud padded to a multiple of 8
+ * bytes, then the x, y, z floats of the filtered target points, then for a voxel hash its cells
+ * (VoxelHashSearch::kCellInts ints each) and the point indices, all in the byte order of the
+ * machine that wrote it.
+ */
+struct TargetFileHeader {
+    char magic[8];
+    std::uint32_t version;
+    // NeighbourSearchType
+    std::uint32_t neighbour_search;
+    double target_filter_size;
+    // The cell size of a voxel hash, 0 otherwise
+    double cell_size;
+    std::uint64_t num_points;
+    std::uint64_t num_cells;
+    std::uint64_t num_indices;
+    // The source cloud, as it was when the target was built
+    std::uint64_t source_size;
+    std::int64_t source_mtime_ns;
+    std::uint64_t source_path_size;
+};
+
+const char kTargetFileMagic[8] = {'P', 'P', 'C', 'R', 'T', 'G', 'T', '\0'};
+const std::uint32_t kTargetFileVersion = 2;
+
+// The identity of a source cloud file, false when it does not exist
+struct SourceStamp {
+    std::string path;
+    std::uint64_t size = 0;
+    std::int64_t mtime_ns = 0;
+};
+
+inline bool sourceStamp(const std::string &file_name, SourceStamp *stamp)
+{
+    char path[PATH_MAX];
+    struct stat file_stat;
+    if (realpath(file_name.c_str(), path) == NULL || stat(path, &file_stat) != 0) {
+        return false;
+    }
+    stamp->path = path;
+    stamp->size = file_stat.st_size;
+    stamp->mtime_ns = static_cast<std::int64_t>(file_stat.st_mtim.tv_sec) * 1000000000 + file_stat.st_mtim.tv_nsec;
+    return true;
+}
+
+inline std::uint64_t paddedPathSize(std::uint64_t size)
+{
+    return (size + 7) / 8 * 8;
+}
+
+}  // namespace internal
+
+// What readTargetFile() restores
+struct TargetFile {
+    pcl::PointCloud<pcl::PointXYZ>::Ptr cloud;
+    // The restored voxel hash, NULL for the other neighbour searches, which are built again on cloud
+    std::shared_ptr<VoxelHashSearch> voxel_hash;
+};
+
+/**
+ * Writes the filtered cloud of target, built from source_file_name with neighbour_search after a
+ * voxel filter of target_filter_size, and the cells of a voxel hash. False when target has no
+ * cloud in memory, source_file_name does not exist or the file cannot be written.
+ */
+inline bool writeTargetFile(const std::string &file_name, const std::string &source_file_name,
+                            const NeighbourSearch &target, NeighbourSearchType neighbour_search,
+                            double target_filter_size)
+{
+    pcl::PointCloud<pcl::PointXYZ>::ConstPtr cloud = target.cloud();
+    internal::SourceStamp source;
+    if (!cloud || !internal::sourceStamp(source_file_name, &source)) {
+        return false;
+    }
+    const VoxelHashSearch *voxel_hash = dynamic_cast<const VoxelHashSearch *>(&target);
+    std::vector<int> cells;
+    if (voxel_hash != NULL) {
+        cells = voxel_hash->cells();
+    }
+    internal::TargetFileHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, internal::kTargetFileMagic, sizeof(header.magic));
+    header.version = internal::kTargetFileVersion;
+    header.neighbour_search = static_cast<std::uint32_t>(neighbour_search);
+    header.target_filter_size = target_filter_size;
+    header.cell_size = voxel_hash != NULL ? voxel_hash->cellSize() : 0;
+    header.num_points = cloud->size();
+    header.num_cells = cells.size() / VoxelHashSearch::kCellInts;
+    header.num_indices = voxel_hash != NULL ? voxel_hash->pointIndices().size() : 0;
+    header.source_size = source.size;
+    header.source_mtime_ns = source.mtime_ns;
+    header.source_path_size = source.path.size();
+
+    std::ofstream file(file_name, std::ios::binary | std::ios::trunc);
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    source.path.resize(internal::paddedPathSize(source.path.size()), '\0');
+    file.write(source.path.data(), source.path.size());
+    for (const pcl::PointXYZ &point : *cloud) {
+        const float xyz[3] = {point.x, point.y, point.z};
+        file.write(reinterpret_cast<const char *>(xyz), sizeof(xyz));
+    }
+    file.write(reinterpret_cast<const char *>(cells.data()), cells.size() * sizeof(int));
+    if (voxel_hash != NULL) {
+        file.write(reinterpret_cast<const char *>(voxel_hash->pointIndices().data()),
+                   header.num_indices * sizeof(int));
+    }
+    return static_cast<bool>(file.flush());
+}
+
+/**
+ * Reads a file written by writeTargetFile() from the current source_file_name, with the same
+ * neighbour_search, target_filter_size and, for a voxel hash, cell size. The file is mapped and
+ * its points copied into the cloud, the voxel hash cells are inserted straight from the mapping.
+ * False, and target untouched, when the file is missing, truncated, of another version, written
+ * with other settings, or when the source cloud has moved or changed since.
+ */
+inline bool readTargetFile(const std::string &file_name, const std::string &source_file_name,
+                           NeighbourSearchType neighbour_search, double target_filter_size, double cell_size,
+                           TargetFile *target)
+{
+    internal::MappedFile file(file_name);
+    internal::TargetFileHeader header;
+    if (file.data() == NULL || file.size() < sizeof(header)) {
+        return false;
+    }
+    std::memcpy(&header, file.data(), sizeof(header));
+    const bool is_voxel_hash = neighbour_search == NeighbourSearchType::VOXEL_HASH;
+    if (std::memcmp(header.magic, internal::kTargetFileMagic, sizeof(header.magic)) != 0 ||
+            header.version != internal::kTargetFileVersion ||
+            header.neighbour_search != static_cast<std::uint32_t>(neighbour_search) ||
+            header.target_filter_size != target_filter_size ||
+            (is_voxel_hash && static_cast<float>(header.cell_size) != static_cast<float>(cell_size))) {
+        return false;
+    }
+    // The counts are untrusted, each is checked against the bytes left before it is used
+    std::uint64_t remaining = file.size() - sizeof(header);
+    if (header.source_path_size > remaining ||
+            !internal::takeBytes(internal::paddedPathSize(header.source_path_size), 1, &remaining) ||
+            !internal::takeBytes(header.num_points, 3 * sizeof(float), &remaining) ||
+            !internal::takeBytes(header.num_cells, VoxelHashSearch::kCellInts * sizeof(int), &remaining) ||
+            !internal::takeBytes(header.num_indices, sizeof(int), &remaining) || remaining != 0 ||
+            header.num_points > static_cast<std::uint64_t>(std::numeric_limits<int>::max()) ||
+            header.num_indices > static_cast<std::uint64_t>(std::numeric_limits<int>::max())) {
+        return false;
+    }
+    const char *data = file.data() + sizeof(header);
+    internal::SourceStamp source;
+    if (!internal::sourceStamp(source_file_name, &source) ||
+            source.path != std::string(data, header.source_path_size) || source.size != header.source_size ||
+            source.mtime_ns != header.source_mtime_ns) {
+        return false;
+    }
+    data += internal::paddedPathSize(header.source_path_size);
+
+    // The header and the padded path keep the ints below aligned in the page aligned mapping
+    const int *cells = reinterpret_cast<const int *>(data + 3 * sizeof(float) * header.num_points);
+    const int *indices = cells + VoxelHashSearch::kCellInts * header.num_cells;
+    if (is_voxel_hash) {
+        // A corrupted layout would index out of the points
+        for (std::size_t p = 0; p < header.num_indices; p++) {
+            if (indices[p] < 0 || indices[p] >= static_cast<int>(header.num_points)) {
+                return false;
+            }
+        }
+        for (std::size_t c = 0; c < header.num_cells; c++) {
+            const int *cell = cells + VoxelHashSearch::kCellInts * c;
+            if (cell[3] < 0 || cell[3] > cell[4] || cell[4] > static_cast<int>(header.num_indices)) {
+                return false;
+            }
+        }
+    }
+    auto cloud = boost::make_shared<pcl::PointCloud<pcl::PointXYZ>>();
+    cloud->resize(header.num_points);
+    for (std::size_t i = 0; i < header.num_points; i++, data += 3 * sizeof(float)) {
+        float xyz[3];
+        std::memcpy(xyz, data, sizeof(xyz));
+        (*cloud)[i] = pcl::PointXYZ(xyz[0], xyz[1], xyz[2]);
+    }
+    std::shared_ptr<VoxelHashSearch> voxel_hash;
+    if (is_voxel_hash) {
+        voxel_hash = std::make_shared<VoxelHashSearch>(cloud, header.cell_size, cells, header.num_cells, indices,
+                                                       header.num_indices);
+    }
+    target->cloud = cloud;
+    target->voxel_hash = voxel_hash;
+    return true;
+}
+
+}  // namespace prob_point_cloud_registration
+
+#endif
@@ -0,0 +1,113 @@
+#ifndef PROB_POINT_CLOUD_REGISTRATION_TILED_TARGET_MAP_HPP
+#define PROB_POINT_CLOUD_REGISTRATION_TILED_TARGET_MAP_HPP
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <Eigen/Geometry>
+#include <pcl/kdtree/kdtree_flann.h>
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+
+#include "prob_point_cloud_registration/neighbour_search.hpp"
+
+namespace prob_point_cloud_registration {
+
+/**
+ * Splits cloud in cubic tiles of side tile_size, written to directory (created if needed) as
+ * "<ix>_<iy>_<iz>.xyz32" files, plus a "tiles.txt" index with the tile size on the first line
+ * and "ix iy iz num_points" on the next ones. Returns false when a file can not be written.
+ */
+bool writeTargetTiles(const pcl::PointCloud<pcl::PointXYZ> &cloud, double tile_size, const std::string &directory);
+
+/**
+ * A target map too large to be kept in memory, stored as the tiles of writeTargetTiles(). Each
+ * tile gets its own KD-tree when it is loaded; the index of a point is its rank in the
+ * concatenation of the tiles in index order, so that it is stable while tiles come and go.
+ *
+ * prepare() loads the tiles within radius of the query box and, when more than
+ * max_resident_tiles are in memory, evicts the least recently needed ones (never the ones just
+ * needed). Queries and point() load on demand, with a lock, the tiles they miss; those are only
+ * evicted by the next prepare(). Throws std::runtime_error when the index or a tile can not be
+ * read.
+ */
+class TiledTargetMap : public NeighbourSearch
+{
+public:
+    TiledTargetMap(const std::string &directory, int max_resident_tiles);
+
+    int radiusSearch(const pcl::PointXYZ &point, double radius, int max_neighbours, std::vector<int> &indices,
+                     std::vector<float> &squared_distances) const override;
+
+    // Visits the tiles by increasing distance, loading them as needed
+    bool nearestSearch(const pcl::PointXYZ &point, int &index, float &squared_distance) const override;
+
+    int size() const override
+    {
+        return num_points_;
+    }
+
+    pcl::PointXYZ point(int index) const override;
+
+    void prepare(const Eigen::AlignedBox3f &query_box, double radius) override;
+
+    inline double tileSize() const
+    {
+        return tile_size_;
+    }
+
+    inline int numTiles() const
+    {
+        return tiles_.size();
+    }
+
+    int numResidentTiles() const;
+
+    // Tile reads since the construction
+    inline int numTileLoads() const
+    {
+        return num_tile_loads_;
+    }
+
+private:
+    typedef internal::GridKey Key;
+
+    struct TileInfo {
+        Key key;
+        int offset;
+        int num_points;
+    };
+
+    struct Tile {
+        pcl::PointCloud<pcl::PointXYZ>::Ptr cloud;
+        pcl::KdTreeFLANN<pcl::PointXYZ> kdtree;
+    };
+
+    Key key(const Eigen::Vector3f &point) const;
+    // The tile, loaded if it is not resident
+    const Tile &tile(int tile) const;
+    std::shared_ptr<const Tile> load(int tile) const;
+
+    std::string directory_;
+    double tile_size_;
+    int max_resident_tiles_;
+    int num_points_;
+    std::vector<TileInfo> tiles_;
+    std::unordered_map<Key, int, internal::GridKeyHash> tile_numbers_;
+    // Only modified by prepare(), read without locking by the queries
+    std::vector<std::shared_ptr<const Tile>> resident_;
+    std::vector<long> last_needed_;
+    long num_prepares_;
+    // The tiles loaded by the queries since the last prepare()
+    mutable std::mutex loaded_mutex_;
+    mutable std::vector<std::shared_ptr<const Tile>> loaded_;
+    mutable std::atomic<int> num_tile_loads_;
+};
+
+}  // namespace prob_point_cloud_registration
+
+#endif
@@ -1,14 +1,20 @@
 #ifndef PROB_POINT_CLOUD_REGISTRATION_UTILITIES_HPP
 #define PROB_POINT_CLOUD_REGISTRATION_UTILITIES_HPP
 #include <assert.h>
+#include <algorithm>
 #include <limits>
+#include <vector>
 #include <Eigen/Core>
+#include <Eigen/Geometry>
 #include <Eigen/Sparse>
 #include <pcl/common/distances.h>
 #include <pcl/point_cloud.h>
 #include <pcl/point_types.h>
 #include <pcl/kdtree/kdtree_flann.h>
 
+#include "prob_point_cloud_registration/executor.hpp"
+#include "prob_point_cloud_registration/neighbour_search.hpp"
+
 namespace prob_point_cloud_registration {
 
 using pcl::euclideanDistance;
@@ -25,228 +31,260 @@ inline double calculateMSE(pcl::PointCloud<pcl::PointXYZ>::Ptr cloud1,
     return mse;
 }
 
-inline double averageClosestDistance(pcl::PointCloud<pcl::PointXYZ>::Ptr cloud1,
-                                     pcl::PointCloud<pcl::PointXYZ>::Ptr cloud2)
+// Same as calculateMSE(transformed cloud1, cloud2), without materializing the transformed cloud1
+inline double calculateMSE(pcl::PointCloud<pcl::PointXYZ>::Ptr cloud1, const Eigen::Affine3d &transform,
+                           pcl::PointCloud<pcl::PointXYZ>::Ptr cloud2)
 {
-    double avgDistance = 0;
-    pcl::KdTreeFLANN<pcl::PointXYZ> kdtree;
-    kdtree.setInputCloud(cloud2);
-
-    for (std::size_t i = 0; i < cloud1->size(); i++) {
-        std::vector<int> neighbours;
-        std::vector<float> distances;
-        neighbours.reserve(1);
-        distances.reserve(1);
-        kdtree.nearestKSearch(*cloud1, i, 1, neighbours, distances);
-        avgDistance += distances[0];
+    assert(cloud1->size() == cloud2->size());
+    double mse = 0;
+    for (int i = 0; i < cloud1->size(); i++) {
+        const Eigen::Vector3d point = transform * cloud1->at(i).getVector3fMap().cast<double>();
+        mse += (point - cloud2->at(i).getVector3fMap().cast<double>()).norm();
     }
-    avgDistance /= cloud1->size();
-    return avgDistance;
+    mse /= cloud1->size();
+    return mse;
 }
 
-inline double sumSquaredError(pcl::PointCloud<pcl::PointXYZ>::Ptr cloud1,
-                              pcl::PointCloud<pcl::PointXYZ>::Ptr cloud2)
+// MSE between the cloud transformed by transform1 and the cloud transformed by transform2
+inline double calculateMSE(pcl::PointCloud<pcl::PointXYZ>::Ptr cloud, const Eigen::Affine3d &transform1,
+                           const Eigen::Affine3d &transform2)
 {
-    double sum = 0;
-    double median_distance;
-    pcl::KdTreeFLANN<pcl::PointXYZ> kdtree;
-    kdtree.setInputCloud(cloud2);
-    for (std::size_t i = 0; i < cloud1->size(); i++) {
-        std::vector<int> neighbours;
-        std::vector<float> distances;
-        neighbours.reserve(1);
-        distances.reserve(1);
-        kdtree.nearestKSearch(*cloud1, i, 1, neighbours, distances);
-        sum += distances[0];
+    const Eigen::Matrix<double, 3, 4> difference = transform1.affine() - transform2.affine();
+    double mse = 0;
+    for (int i = 0; i < cloud->size(); i++) {
+        mse += (difference * cloud->at(i).getVector3fMap().cast<double>().homogeneous()).norm();
     }
-    return sum;
+    mse /= cloud->size();
+    return mse;
 }
 
-inline double robustSumSquaredError(pcl::PointCloud<pcl::PointXYZ>::Ptr cloud1,
-                                    pcl::PointCloud<pcl::PointXYZ>::Ptr cloud2)
+namespace internal {
+
+/**
+ * Median of values, which are reordered, with the convention of the original metrics: the
+ * element of rank (n + 1) / 2 when n is odd, the mean of ranks n / 2 and n / 2 + 1 otherwise
+ * (ranks from 0, clamped to the last element). O(n) through nth_element, 0 when empty.
+ */
+template <typename T>
+double median(std::vector<T> &values)
 {
-    double sum = 0;
-    double median_distance;
-    pcl::KdTreeFLANN<pcl::PointXYZ> kdtree;
-    kdtree.setInputCloud(cloud2);
-    std::vector<double> all_distances;
-    for (std::size_t i = 0; i < cloud1->size(); i++) {
-        std::vector<int> neighbours;
-        std::vector<float> distances;
-        neighbours.reserve(1);
-        distances.reserve(1);
-        kdtree.nearestKSearch(*cloud1, i, 1, neighbours, distances);
-        all_distances.push_back(distances[0]);
+    const std::size_t n = values.size();
+    if (n == 0) {
+        return 0;
+    }
+    const std::size_t rank = std::min(n % 2 != 0 ? (n + 1) / 2 : n / 2, n - 1);
+    std::nth_element(values.begin(), values.begin() + rank, values.end());
+    if (n % 2 != 0) {
+        return values[rank];
     }
+    // The element of the next rank is the smallest one after rank
+    const T next = rank + 1 < n ? *std::min_element(values.begin() + rank + 1, values.end()) : values[rank];
+    return (values[rank] + next) / 2.0;
+}
 
-    std::sort(all_distances.begin(), all_distances.end());
-    if (all_distances.size() % 2 != 0) {
-        median_distance = all_distances[(all_distances.size() + 1) / 2];
-    } else {
-        median_distance = (all_distances[all_distances.size() / 2] + all_distances[(all_distances.size() /
-                                                                                    2) + 1]) / 2.0;
+}  // namespace internal
+
+/**
+ * The squared distances from every point of cloud1 to its closest point of cloud2, queried once
+ * and in parallel, and the metrics computed from them. Building one of these and reading several
+ * metrics is cheaper than calling the corresponding functions below, which each make their own.
+ */
+class ClosestDistances
+{
+public:
+    ClosestDistances(const pcl::PointCloud<pcl::PointXYZ> &cloud1, const NeighbourSearch &cloud2,
+                     Executor &executor = defaultExecutor())
+    {
+        compute(cloud1, cloud2, executor);
     }
-    int num_filtered = 0;
-    for (auto it = all_distances.begin(); it != all_distances.end(); it++) {
-        if (*it <= median_distance * 3 && *it >= median_distance / 3) {
-            sum += (*it);
-            num_filtered++;
-        }
+
+    // Indexes cloud2 with a KD-tree
+    ClosestDistances(const pcl::PointCloud<pcl::PointXYZ> &cloud1, pcl::PointCloud<pcl::PointXYZ>::ConstPtr cloud2,
+                     Executor &executor = defaultExecutor())
+    {
+        compute(cloud1, KdTreeSearch(cloud2), executor);
     }
-    if (num_filtered < 10) {
-        return std::numeric_limits<double>::max();
+
+    inline const std::vector<float> &squaredDistances() const
+    {
+        return squared_distances_;
     }
-    return sum;
-}
 
-inline double robustSumSquaredError(pcl::PointCloud<pcl::PointXYZ>::Ptr cloud1,
-                                    pcl::PointCloud<pcl::PointXYZ>::Ptr cloud2, double factor)
-{
-    double sum = 0;
-    double median_distance;
-    pcl::KdTreeFLANN<pcl::PointXYZ> kdtree;
-    kdtree.setInputCloud(cloud2);
-    std::vector<double> all_distances;
-    for (std::size_t i = 0; i < cloud1->size(); i++) {
-        std::vector<int> neighbours;
-        std::vector<float> distances;
-        neighbours.reserve(1);
-        distances.reserve(1);
-        kdtree.nearestKSearch(*cloud1, i, 1, neighbours, distances);
-        all_distances.push_back(distances[0]);
+    inline double sum() const
+    {
+        return sum_;
     }
 
-    std::sort(all_distances.begin(), all_distances.end());
-    if (all_distances.size() % 2 != 0) {
-        median_distance = all_distances[(all_distances.size() + 1) / 2];
-    } else {
-        median_distance = (all_distances[all_distances.size() / 2] + all_distances[(all_distances.size() /
-                                                                                    2) + 1]) / 2.0;
+    inline double average() const
+    {
+        return sum_ / squared_distances_.size();
     }
-    int num_filtered = 0;
-    for (auto it = all_distances.begin(); it != all_distances.end(); it++) {
-        if (*it <= median_distance * factor && *it >= median_distance / factor) {
-            sum += (*it);
-            num_filtered++;
+
+    // Computed on the first call, sum() and average() do not need it
+    inline double median() const
+    {
+        if (!has_median_) {
+            std::vector<float> distances = squared_distances_;
+            median_ = internal::median(distances);
+            has_median_ = true;
         }
+        return median_;
     }
-    if (num_filtered < 10) {
-        return std::numeric_limits<double>::max();
+
+    // Sum of the distances within [median / factor, median * factor], the largest double when fewer than 10 are
+    double robustSum(double factor = 3) const
+    {
+        int num_filtered;
+        const double sum = robustSum(factor, &num_filtered);
+        return num_filtered < 10 ? std::numeric_limits<double>::max() : sum;
     }
-    return sum;
-}
 
-inline double robustAveragedSumSquaredError(pcl::PointCloud<pcl::PointXYZ>::Ptr cloud1,
-                                            pcl::PointCloud<pcl::PointXYZ>::Ptr cloud2)
-{
-    double sum = 0;
-    double median_distance;
-    pcl::KdTreeFLANN<pcl::PointXYZ> kdtree;
-    kdtree.setInputCloud(cloud2);
-    std::vector<double> all_distances;
-    for (std::size_t i = 0; i < cloud1->size(); i++) {
-        std::vector<int> neighbours;
-        std::vector<float> distances;
-        neighbours.reserve(1);
-        distances.reserve(1);
-        kdtree.nearestKSearch(*cloud1, i, 1, neighbours, distances);
-        all_distances.push_back(distances[0]);
+    // Average of the distances robustSum() keeps
+    double robustAverage() const
+    {
+        int num_filtered;
+        const double sum = robustSum(3, &num_filtered);
+        return num_filtered < 10 ? std::numeric_limits<double>::max() : sum / num_filtered;
     }
 
-    std::sort(all_distances.begin(), all_distances.end());
-    if (all_distances.size() % 2 != 0) {
-        median_distance = all_distances[(all_distances.size() + 1) / 2];
-    } else {
-        median_distance = (all_distances[all_distances.size() / 2] + all_distances[(all_distances.size() /
-                                                                                    2) + 1]) / 2.0;
+    // Median of the distances within [median / 3, median * 3], divided by their number
+    double robustMedian() const
+    {
+        const double median = this->median();
+        std::vector<float> filtered_distances;
+        for (float distance : squared_distances_) {
+            if (distance <= median * 3 && distance >= median / 3.0) {
+                filtered_distances.push_back(distance);
+            }
+        }
+        return internal::median(filtered_distances) / filtered_distances.size();
     }
-    int num_filtered = 0;
-    for (auto it = all_distances.begin(); it != all_distances.end(); it++) {
-        if (*it <= median_distance * 3 && *it >= median_distance / 3) {
-            sum += (*it);
-            num_filtered++;
+
+private:
+    void compute(const pcl::PointCloud<pcl::PointXYZ> &cloud1, const NeighbourSearch &cloud2, Executor &executor)
+    {
+        squared_distances_.resize(cloud1.size());
+        parallelForBlocks(executor, cloud1.size(), [&](int block, int begin, int end) {
+            cloud2.nearestSquaredDistances(cloud1, begin, end, squared_distances_.data() + begin);
+        });
+        sum_ = 0;
+        for (float distance : squared_distances_) {
+            sum_ += distance;
         }
+        has_median_ = false;
     }
-    if (num_filtered < 10) {
-        return std::numeric_limits<double>::max();
+
+    double robustSum(double factor, int *num_filtered) const
+    {
+        const double median = this->median();
+        double sum = 0;
+        *num_filtered = 0;
+        for (float distance : squared_distances_) {
+            if (distance <= median * factor && distance >= median / factor) {
+                sum += distance;
+                (*num_filtered)++;
+            }
+        }
+        return sum;
     }
-    return sum / num_filtered;
+
+    std::vector<float> squared_distances_;
+    double sum_;
+    mutable double median_ = 0;
+    mutable bool has_median_ = false;
+};
+
+inline double averageClosestDistance(const pcl::PointCloud<pcl::PointXYZ> &cloud1,
+                                     const NeighbourSearch &cloud2)
+{
+    return ClosestDistances(cloud1, cloud2).average();
+}
+
+inline double averageClosestDistance(pcl::PointCloud<pcl::PointXYZ>::Ptr cloud1,
+                                     pcl::PointCloud<pcl::PointXYZ>::Ptr cloud2)
+{
+    return ClosestDistances(*cloud1, cloud2).average();
+}
+
+inline double sumSquaredError(const pcl::PointCloud<pcl::PointXYZ> &cloud1,
+                              const NeighbourSearch &cloud2)
+{
+    return ClosestDistances(cloud1, cloud2).sum();
+}
+
+inline double sumSquaredError(pcl::PointCloud<pcl::PointXYZ>::Ptr cloud1,
+                              pcl::PointCloud<pcl::PointXYZ>::Ptr cloud2)
+{
+    return ClosestDistances(*cloud1, cloud2).sum();
+}
+
+inline double robustSumSquaredError(const pcl::PointCloud<pcl::PointXYZ> &cloud1,
+                                    const NeighbourSearch &cloud2)
+{
+    return ClosestDistances(cloud1, cloud2).robustSum();
+}
+
+inline double robustSumSquaredError(pcl::PointCloud<pcl::PointXYZ>::Ptr cloud1,
+                                    pcl::PointCloud<pcl::PointXYZ>::Ptr cloud2)
+{
+    return ClosestDistances(*cloud1, cloud2).robustSum();
+}
+
+inline double robustSumSquaredError(const pcl::PointCloud<pcl::PointXYZ> &cloud1,
+                                    const NeighbourSearch &cloud2, double factor)
+{
+    return ClosestDistances(cloud1, cloud2).robustSum(factor);
+}
+
+inline double robustSumSquaredError(pcl::PointCloud<pcl::PointXYZ>::Ptr cloud1,
+                                    pcl::PointCloud<pcl::PointXYZ>::Ptr cloud2, double factor)
+{
+    return ClosestDistances(*cloud1, cloud2).robustSum(factor);
+}
+
+inline double robustAveragedSumSquaredError(const pcl::PointCloud<pcl::PointXYZ> &cloud1,
+                                            const NeighbourSearch &cloud2)
+{
+    return ClosestDistances(cloud1, cloud2).robustAverage();
+}
+
+inline double robustAveragedSumSquaredError(pcl::PointCloud<pcl::PointXYZ>::Ptr cloud1,
+                                            pcl::PointCloud<pcl::PointXYZ>::Ptr cloud2)
+{
+    return ClosestDistances(*cloud1, cloud2).robustAverage();
+}
+
+inline double medianClosestDistance(const pcl::PointCloud<pcl::PointXYZ> &cloud1,
+                                    const NeighbourSearch &cloud2)
+{
+    return ClosestDistances(cloud1, cloud2).median();
 }
 
 inline double medianClosestDistance(pcl::PointCloud<pcl::PointXYZ>::Ptr cloud1,
                                     pcl::PointCloud<pcl::PointXYZ>::Ptr cloud2)
 {
-    double median_distance = 0;
-    pcl::KdTreeFLANN<pcl::PointXYZ> kdtree;
-    kdtree.setInputCloud(cloud2);
-    std::vector<float> distances;
-    for (std::size_t i = 0; i < cloud1->size(); i++) {
-        std::vector<int> neighbours;
-        std::vector<float> dist;
-        neighbours.reserve(1);
-        distances.reserve(1);
-        kdtree.nearestKSearch(*cloud1, i, 1, neighbours, dist);
-        distances.push_back(dist[0]);
-    }
-    std::sort(distances.begin(), distances.end());
-    if (distances.size() % 2 != 0) {
-        median_distance = distances[(distances.size() + 1) / 2];
-    } else {
-        median_distance = (distances[distances.size() / 2] + distances[(distances.size() / 2) + 1]) / 2.0;
-    }
-    return median_distance;
+    return ClosestDistances(*cloud1, cloud2).median();
+}
+
+inline double robustMedianClosestDistance(const pcl::PointCloud<pcl::PointXYZ> &cloud1,
+                                          const NeighbourSearch &cloud2)
+{
+    return ClosestDistances(cloud1, cloud2).robustMedian();
 }
 
 inline double robustMedianClosestDistance(pcl::PointCloud<pcl::PointXYZ>::Ptr cloud1,
                                           pcl::PointCloud<pcl::PointXYZ>::Ptr cloud2)
 {
-    double median_distance = 0;
-    pcl::KdTreeFLANN<pcl::PointXYZ> kdtree;
-    kdtree.setInputCloud(cloud2);
-    std::vector<float> distances;
-    std::vector<float> filtered_distances;
-    for (std::size_t i = 0; i < cloud1->size(); i++) {
-        std::vector<int> neighbours;
-        std::vector<float> dist;
-        neighbours.reserve(1);
-        distances.reserve(1);
-        kdtree.nearestKSearch(*cloud1, i, 1, neighbours, dist);
-        distances.push_back(dist[0]);
-    }
-    std::sort(distances.begin(), distances.end());
-    if (distances.size() % 2 != 0) {
-        median_distance = distances[(distances.size() + 1) / 2];
-    } else {
-        median_distance = (distances[distances.size() / 2] + distances[(distances.size() / 2) + 1]) / 2.0;
-    }
-    for (auto it = distances.begin(); it != distances.end(); it++) {
-        if (*it <= median_distance * 3 && *it >= median_distance / 3.0) {
-            filtered_distances.push_back(*it);
-        }
-    }
-    if (filtered_distances.size() % 2 != 0) {
-        median_distance = filtered_distances[(filtered_distances.size() + 1) / 2];
-    } else {
-        median_distance = (filtered_distances[filtered_distances.size() / 2] +
-                           filtered_distances[(filtered_distances.size() / 2) + 1]) / 2.0;
-    }
-    return median_distance / filtered_distances.size();
+    return ClosestDistances(*cloud1, cloud2).robustMedian();
 }
 
-inline double medianDistance(std::vector<Eigen::Triplet<double>> tripletList)
+inline double medianDistance(const std::vector<Eigen::Triplet<double>> &tripletList)
 {
-    double median_distance;
-    std::sort(tripletList.begin(), tripletList.end(), [] (Eigen::Triplet<double> x,
-    Eigen::Triplet<double> y) {
-        return x.value() < y.value();
-    });
-    if (tripletList.size() % 2 != 0) {
-        median_distance = tripletList[(tripletList.size() + 1) / 2].value();
-    } else {
-        median_distance = (tripletList[tripletList.size() / 2].value() + tripletList[(tripletList.size() /
-                                                                                      2) + 1].value()) / 2.0;
+    std::vector<double> values(tripletList.size());
+    for (std::size_t i = 0; i < tripletList.size(); i++) {
+        values[i] = tripletList[i].value();
     }
-    return median_distance;
+    return internal::median(values);
 }
 
 inline Eigen::Quaterniond
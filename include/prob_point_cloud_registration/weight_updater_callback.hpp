@@ -5,64 +5,92 @@
 #include <Eigen/Core>
 #include <Eigen/Sparse>
 
+#include <algorithm>
 #include <vector>
 
-#include "prob_point_cloud_registration/error_term.hpp"
+#include "prob_point_cloud_registration/batched_error_term.hpp"
 #include "prob_point_cloud_registration/prob_point_cloud_registration_params.hpp"
+#include "prob_point_cloud_registration/registration_statistics.hpp"
 
 namespace prob_point_cloud_registration {
 
-class WeightUpdaterCallback : public ceres::IterationCallback
+// Updates the weights of error_term, see BasicBatchedErrorTerm for Scalar
+template <typename Scalar>
+class BasicWeightUpdaterCallback : public ceres::IterationCallback
 {
 
 private:
-    Eigen::SparseMatrix<double, Eigen::RowMajor> *data_association_;
+    const Eigen::SparseMatrix<double, Eigen::RowMajor> *data_association_;
     ProbPointCloudRegistrationParams *params_;
-    std::vector<ErrorTerm *> *error_terms_;
+    BasicBatchedErrorTerm<Scalar> *error_term_;
     ProbabilisticWeights *weight_updater_;
     double *rotation_;
     double *translation_;
+    std::vector<Scalar> squared_errors_;
+    double elapsed_time_;
+    int num_updates_;
+    bool periodic_full_updates_;
 
 public:
-    WeightUpdaterCallback(Eigen::SparseMatrix<double, Eigen::RowMajor> *data_association,
-                          ProbPointCloudRegistrationParams *params,
-                          std::vector<ErrorTerm *> *error_terms, ProbabilisticWeights *weight_updater, double rotation[4],
-                          double translation[3]):
-        data_association_(data_association), params_(params), error_terms_(error_terms),
+    BasicWeightUpdaterCallback(ProbPointCloudRegistrationParams *params, BasicBatchedErrorTerm<Scalar> *error_term,
+                               ProbabilisticWeights *weight_updater, double rotation[4], double translation[3]):
+        data_association_(NULL), params_(params), error_term_(error_term),
         weight_updater_(weight_updater), rotation_(rotation),
-        translation_(translation) {}
+        translation_(translation), elapsed_time_(0), num_updates_(0), periodic_full_updates_(true) {}
 
 
     ceres::CallbackReturnType operator()(const ceres::IterationSummary &summary)
     {
-        std::vector<double> squared_errors;
-        squared_errors.reserve(data_association_->cols()*
-                               params_->max_neighbours);
-
-        for (std::size_t i = 0; i < error_terms_->size(); ++i) {
-
-            double residual[3];
-            (*(error_terms_->at(i)))(rotation_, translation_, residual);
-            double squared_error = residual[0] * residual[0] +
-                                   residual[1] * residual[1] +
-                                   residual[2] * residual[2];
-            squared_errors.push_back(squared_error);
+        const bool pruning = params_->prune_weight > 0;
+        // The pruned errors keep the values of the last full update, where they were negligible
+        update(!pruning || (periodic_full_updates_ && num_updates_ % std::max(params_->prune_period, 1) == 0));
+        return ceres::SOLVER_CONTINUE;
+    }
 
+    // A full update evaluates the pruned associations again, the others only the active ones
+    void update(bool full_update)
+    {
+        Stopwatch stopwatch;
+        const bool pruning = params_->prune_weight > 0;
+        if (pruning && full_update) {
+            error_term_->activateAll();
         }
-        Eigen::SparseMatrix<double, Eigen::RowMajor> weights_ =
-            weight_updater_->updateWeights(*data_association_, squared_errors);
-        for (int i = 0, k = 0; i < weights_.outerSize(); ++i) {
-            for (Eigen::SparseMatrix<double, Eigen::RowMajor>::InnerIterator it(
-                        weights_, i);
-                    it; ++it) {
-                error_terms_->at(k)->updateWeight(it.value());
-                k++;
-            }
+        error_term_->squaredErrors(rotation_, translation_, &squared_errors_, !full_update);
+        weight_updater_->updateWeights(*data_association_, squared_errors_, error_term_->weights().data(),
+                                       *params_->executor);
+        if (pruning) {
+            error_term_->prune(params_->prune_weight);
         }
-        return ceres::SOLVER_CONTINUE;
+        num_updates_++;
+        elapsed_time_ += stopwatch.elapsed();
+    }
+
+    // Off while the caller does the full updates itself, between solves on compacted residuals
+    void setPeriodicFullUpdates(bool periodic_full_updates)
+    {
+        periodic_full_updates_ = periodic_full_updates;
+    }
+
+    // Seconds spent updating the weights since the last reset()
+    double elapsedTime() const
+    {
+        return elapsed_time_;
+    }
+
+    /**
+     * For new point pairs, data_association being referenced until the next reset(): the next
+     * update is a full one, that evaluates the pruned associations too.
+     */
+    void reset(const Eigen::SparseMatrix<double, Eigen::RowMajor> *data_association)
+    {
+        data_association_ = data_association;
+        elapsed_time_ = 0;
+        num_updates_ = 0;
     }
 };
 
+typedef BasicWeightUpdaterCallback<double> WeightUpdaterCallback;
+
 }  // namespace prob_point_cloud_registration
 
 #endif
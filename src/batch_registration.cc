@@ -0,0 +1,96 @@
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <exception>
+#include <mutex>
+#include <thread>
+
+#include <boost/make_shared.hpp>
+#include <pcl/common/transforms.h>
+
+#include "prob_point_cloud_registration/batch_registration.h"
+#include "prob_point_cloud_registration/prob_point_cloud_registration.h"
+
+namespace prob_point_cloud_registration {
+
+BatchRegistration::BatchRegistration(pcl::PointCloud<pcl::PointXYZ>::Ptr target_cloud,
+                                     ProbPointCloudRegistrationParams parameters): parameters_(parameters)
+{
+    target_ = ProbPointCloudRegistration::buildTarget(target_cloud, parameters_, &target_statistics_);
+    if (auto kdtree_search = std::dynamic_pointer_cast<KdTreeSearch>(target_)) {
+        target_kdtree_ = kdtree_search->kdtree();
+    }
+}
+
+std::vector<BatchRegistrationResult> BatchRegistration::align(
+    const std::vector<pcl::PointCloud<pcl::PointXYZ>::Ptr> &source_clouds,
+    const std::vector<Eigen::Affine3d> &initial_guesses) const
+{
+    assert(initial_guesses.empty() || initial_guesses.size() == source_clouds.size());
+    const int num_scans = source_clouds.size();
+    std::vector<BatchRegistrationResult> results(num_scans);
+    if (num_scans == 0) {
+        return results;
+    }
+    ProbPointCloudRegistrationParams parameters = parameters_;
+    std::exception_ptr error;
+    std::mutex error_mutex;
+    auto align_scan = [&](int i) {
+        try {
+            pcl::PointCloud<pcl::PointXYZ>::Ptr source_cloud = source_clouds[i];
+            Eigen::Affine3d initial_guess = Eigen::Affine3d::Identity();
+            if (!initial_guesses.empty()) {
+                initial_guess = initial_guesses[i];
+                source_cloud = boost::make_shared<pcl::PointCloud<pcl::PointXYZ>>();
+                pcl::transformPointCloud(*source_clouds[i], *source_cloud, initial_guess);
+            }
+            ProbPointCloudRegistration registration(source_cloud, target_, parameters);
+            registration.align();
+            results[i].transformation = registration.transformation() * initial_guess;
+            results[i].report = registration.report();
+            results[i].statistics = registration.statistics();
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(error_mutex);
+            if (!error) {
+                error = std::current_exception();
+            }
+        }
+    };
+
+    if (parameters_.executor) {
+        // The scans are tasks of the caller's executor, the parallel sections of each
+        // registration are nested in them. Ceres starts its own threads, so each solve only
+        // gets the share of one of the concurrent scans.
+        const int num_threads = parameters_.executor->numThreads();
+        const int solver_threads = std::max(1, num_threads / std::max(1, std::min(num_threads, num_scans)));
+        parameters.max_solver_threads = parameters.max_solver_threads > 0 ?
+                                        std::min(parameters.max_solver_threads, solver_threads) : solver_threads;
+        parameters_.executor->parallelFor(num_scans, align_scan);
+    } else {
+        int num_threads = parameters_.num_threads;
+        if (num_threads <= 0) {
+            num_threads = std::max(1u, std::thread::hardware_concurrency());
+        }
+        const int num_workers = std::min(num_threads, num_scans);
+        // Stateless, shared by the concurrent registrations that get num_threads / num_workers threads each
+        parameters.executor = std::make_shared<OpenMPExecutor>(std::max(1, num_threads / num_workers));
+        std::atomic<int> next_scan(0);
+        std::vector<std::thread> workers;
+        for (int w = 0; w < num_workers; w++) {
+            workers.emplace_back([&]() {
+                for (int i = next_scan++; i < num_scans; i = next_scan++) {
+                    align_scan(i);
+                }
+            });
+        }
+        for (std::thread &thread : workers) {
+            thread.join();
+        }
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+    return results;
+}
+
+}  // namespace prob_point_cloud_registration
@@ -0,0 +1,419 @@
+#include <cmath>
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <cuda_runtime.h>
+
+#include "prob_point_cloud_registration/cuda_kernels.h"
+
+namespace prob_point_cloud_registration {
+namespace cuda {
+
+namespace {
+
+const int kBlockSize = 256;
+const int kWarpSize = 32;
+// Moments as an array: total weight, source sum, target sum, cross sum and cost
+const int kNumMoments = 17;
+
+void check(cudaError_t error, const char *what)
+{
+    if (error != cudaSuccess) {
+        throw std::runtime_error(std::string(what) + ": " + cudaGetErrorString(error));
+    }
+}
+
+int numBlocks(int size)
+{
+    return (size + kBlockSize - 1) / kBlockSize;
+}
+
+// Device memory, grown on demand and kept across the calls
+template <typename T>
+class DeviceArray
+{
+public:
+    DeviceArray() = default;
+    DeviceArray(const DeviceArray &) = delete;
+    DeviceArray &operator=(const DeviceArray &) = delete;
+
+    ~DeviceArray()
+    {
+        if (data_ != NULL) {
+            cudaFree(data_);
+        }
+    }
+
+    void reserve(std::size_t size)
+    {
+        if (size <= capacity_) {
+            return;
+        }
+        if (data_ != NULL) {
+            check(cudaFree(data_), "cudaFree");
+            data_ = NULL;
+            capacity_ = 0;
+        }
+        check(cudaMalloc(&data_, size * sizeof(T)), "cudaMalloc");
+        capacity_ = size;
+    }
+
+    T *data() const
+    {
+        return data_;
+    }
+
+private:
+    T *data_ = NULL;
+    std::size_t capacity_ = 0;
+};
+
+struct Pose {
+    double rotation[9];
+    double translation[3];
+};
+
+// The position of key in the sorted keys, -1 when it is not there
+__device__ int findCell(const std::uint64_t *keys, int num_cells, std::uint64_t key)
+{
+    int begin = 0;
+    int end = num_cells;
+    while (begin < end) {
+        const int middle = begin + (end - begin) / 2;
+        if (keys[middle] < key) {
+            begin = middle + 1;
+        } else {
+            end = middle;
+        }
+    }
+    return begin < num_cells && keys[begin] == key ? begin : -1;
+}
+
+// The order of VoxelHashSearch::radiusSearch(), ties broken by index
+__device__ bool closer(float squared_distance, int index, float other_squared_distance, int other_index)
+{
+    return squared_distance < other_squared_distance ||
+           (squared_distance == other_squared_distance && index < other_index);
+}
+
+// One thread per source point, its row kept sorted by insertion
+__global__ void associateKernel(const float *source, int size, const float *points, const std::uint64_t *cell_keys,
+                                const int *cell_begin, int num_cells, const int *cell_points,
+                                float inverse_cell_size, float radius, int max_neighbours, int *indices,
+                                float *squared_distances, int *row_sizes)
+{
+    const int i = blockIdx.x * blockDim.x + threadIdx.x;
+    if (i >= size) {
+        return;
+    }
+    const float query[3] = {source[3 * i], source[3 * i + 1], source[3 * i + 2]};
+    int *row_indices = indices + static_cast<std::size_t>(i) * max_neighbours;
+    float *row_distances = squared_distances + static_cast<std::size_t>(i) * max_neighbours;
+    int found = 0;
+    if (isfinite(query[0]) && isfinite(query[1]) && isfinite(query[2])) {
+        const float squared_radius = radius * radius;
+        int min_key[3];
+        int max_key[3];
+        for (int d = 0; d < 3; d++) {
+            min_key[d] = static_cast<int>(floorf((query[d] - radius) * inverse_cell_size));
+            max_key[d] = static_cast<int>(floorf((query[d] + radius) * inverse_cell_size));
+        }
+        for (int x = min_key[0]; x <= max_key[0]; x++) {
+            for (int y = min_key[1]; y <= max_key[1]; y++) {
+                for (int z = min_key[2]; z <= max_key[2]; z++) {
+                    const int cell = findCell(cell_keys, num_cells, cellKey(x, y, z));
+                    if (cell < 0) {
+                        continue;
+                    }
+                    for (int p = cell_begin[cell]; p < cell_begin[cell + 1]; p++) {
+                        const int index = cell_points[p];
+                        const float dx = points[3 * index] - query[0];
+                        const float dy = points[3 * index + 1] - query[1];
+                        const float dz = points[3 * index + 2] - query[2];
+                        const float squared_distance = dx * dx + dy * dy + dz * dz;
+                        if (squared_distance > squared_radius) {
+                            continue;
+                        }
+                        // A full row only takes a closer point, in place of its last one
+                        if (found == max_neighbours && !closer(squared_distance, index, row_distances[found - 1],
+                                                               row_indices[found - 1])) {
+                            continue;
+                        }
+                        int k = found < max_neighbours ? found++ : found - 1;
+                        for (; k > 0 && closer(squared_distance, index, row_distances[k - 1], row_indices[k - 1]);
+                             k--) {
+                            row_distances[k] = row_distances[k - 1];
+                            row_indices[k] = row_indices[k - 1];
+                        }
+                        row_distances[k] = squared_distance;
+                        row_indices[k] = index;
+                    }
+                }
+            }
+        }
+    }
+    row_sizes[i] = found;
+}
+
+__device__ double squaredError(const float *target, const double *moved)
+{
+    const double dx = target[0] - moved[0];
+    const double dy = target[1] - moved[1];
+    const double dz = target[2] - moved[2];
+    return dx * dx + dy * dy + dz * dz;
+}
+
+__device__ double warpSum(double value)
+{
+    for (int offset = kWarpSize / 2; offset > 0; offset /= 2) {
+        value += __shfl_down_sync(0xffffffff, value, offset);
+    }
+    return value;
+}
+
+/**
+ * One thread per source point: the weights of its row, normalised as in ProbabilisticWeights,
+ * and its share of the moments, summed per warp. Every thread of the block takes part in the
+ * warp sums, the ones past the source with nothing to add. The warp sums are then added to
+ * moments with atomics or, when deterministic, summed in order into the moments of the block,
+ * moments[kNumMoments * block].
+ */
+template <bool kDeterministic>
+__global__ void expectationKernel(const float *source, int size, const float *points, const int *indices,
+                                  const int *row_sizes, int stride, Pose pose, double dof, double *weights,
+                                  double *moments)
+{
+    const int i = blockIdx.x * blockDim.x + threadIdx.x;
+    double sums[kNumMoments];
+    for (int m = 0; m < kNumMoments; m++) {
+        sums[m] = 0;
+    }
+    if (i < size && row_sizes[i] > 0) {
+        const double x[3] = {source[3 * i], source[3 * i + 1], source[3 * i + 2]};
+        double moved[3];
+        for (int r = 0; r < 3; r++) {
+            moved[r] = pose.rotation[3 * r] * x[0] + pose.rotation[3 * r + 1] * x[1] +
+                       pose.rotation[3 * r + 2] * x[2] + pose.translation[r];
+        }
+        const int *row_indices = indices + static_cast<std::size_t>(i) * stride;
+        double *row_weights = weights + static_cast<std::size_t>(i) * stride;
+        const int row_size = row_sizes[i];
+        const bool gaussian = isinf(dof);
+        const double t_exponent = -(dof + 3) / 2;
+        // The log-probabilities first, staged in the weights
+        double max_log_probability = -INFINITY;
+        for (int k = 0; k < row_size; k++) {
+            const double error = squaredError(points + 3 * row_indices[k], moved);
+            row_weights[k] = gaussian ? -error / 2 : t_exponent * log1p(error / dof);
+            max_log_probability = fmax(max_log_probability, row_weights[k]);
+        }
+        double normalization = 0;
+        for (int k = 0; k < row_size; k++) {
+            row_weights[k] = exp(row_weights[k] - max_log_probability);
+            normalization += row_weights[k];
+        }
+        for (int k = 0; k < row_size; k++) {
+            const float *y = points + 3 * row_indices[k];
+            const double error = squaredError(y, moved);
+            double weight = row_weights[k] / normalization;
+            if (!gaussian) {
+                weight *= (dof + 3) / (dof + error);
+            }
+            row_weights[k] = weight;
+            sums[0] += weight;
+            for (int r = 0; r < 3; r++) {
+                sums[1 + r] += weight * x[r];
+                sums[4 + r] += weight * y[r];
+                for (int c = 0; c < 3; c++) {
+                    sums[7 + 3 * r + c] += weight * x[r] * y[c];
+                }
+            }
+            sums[16] += weight * error / 2;
+        }
+    }
+    __shared__ double warp_sums[kBlockSize / kWarpSize][kNumMoments];
+    for (int m = 0; m < kNumMoments; m++) {
+        const double total = warpSum(sums[m]);
+        if (threadIdx.x % kWarpSize == 0) {
+            if (kDeterministic) {
+                warp_sums[threadIdx.x / kWarpSize][m] = total;
+            } else {
+                atomicAdd(moments + m, total);
+            }
+        }
+    }
+    if (kDeterministic) {
+        __syncthreads();
+        if (threadIdx.x < kNumMoments) {
+            double total = 0;
+            for (int warp = 0; warp < kBlockSize / kWarpSize; warp++) {
+                total += warp_sums[warp][threadIdx.x];
+            }
+            moments[static_cast<std::size_t>(blockIdx.x) * kNumMoments + threadIdx.x] = total;
+        }
+    }
+}
+
+}  // namespace
+
+bool deviceAvailable()
+{
+    int count = 0;
+    return cudaGetDeviceCount(&count) == cudaSuccess && count > 0;
+}
+
+struct DeviceGrid::Buffers {
+    DeviceArray<float> points;
+    DeviceArray<std::uint64_t> cell_keys;
+    DeviceArray<int> cell_begin;
+    DeviceArray<int> cell_points;
+    int num_cells;
+    float inverse_cell_size;
+};
+
+DeviceGrid::DeviceGrid(const float *points, int num_points, const std::uint64_t *cell_keys, const int *cell_begin,
+                       int num_cells, const int *cell_points, float inverse_cell_size): buffers_(new Buffers())
+{
+    buffers_->num_cells = num_cells;
+    buffers_->inverse_cell_size = inverse_cell_size;
+    const int num_cell_points = cell_begin[num_cells];
+    // Never empty, so that the kernels always get valid pointers
+    buffers_->points.reserve(3 * num_points + 1);
+    buffers_->cell_keys.reserve(num_cells + 1);
+    buffers_->cell_begin.reserve(num_cells + 1);
+    buffers_->cell_points.reserve(num_cell_points + 1);
+    check(cudaMemcpy(buffers_->points.data(), points, 3 * num_points * sizeof(float), cudaMemcpyHostToDevice),
+          "cudaMemcpy");
+    check(cudaMemcpy(buffers_->cell_keys.data(), cell_keys, num_cells * sizeof(std::uint64_t),
+                     cudaMemcpyHostToDevice), "cudaMemcpy");
+    check(cudaMemcpy(buffers_->cell_begin.data(), cell_begin, (num_cells + 1) * sizeof(int), cudaMemcpyHostToDevice),
+          "cudaMemcpy");
+    check(cudaMemcpy(buffers_->cell_points.data(), cell_points, num_cell_points * sizeof(int),
+                     cudaMemcpyHostToDevice), "cudaMemcpy");
+}
+
+DeviceGrid::~DeviceGrid()
+{
+}
+
+struct DeviceSource::Buffers {
+    cudaStream_t stream;
+    const DeviceGrid *grid = NULL;
+    int size = 0;
+    int stride = 1;
+    DeviceArray<float> source;
+    DeviceArray<int> indices;
+    DeviceArray<float> squared_distances;
+    DeviceArray<int> row_sizes;
+    DeviceArray<double> weights;
+    DeviceArray<double> moments;
+    // The moments copied back, per block when deterministic
+    std::vector<double> block_moments;
+};
+
+DeviceSource::DeviceSource(): buffers_(new Buffers())
+{
+    check(cudaStreamCreate(&buffers_->stream), "cudaStreamCreate");
+}
+
+DeviceSource::~DeviceSource()
+{
+    cudaStreamDestroy(buffers_->stream);
+}
+
+void DeviceSource::associate(const DeviceGrid &grid, const float *source, int size, float radius,
+                             int max_neighbours, int *indices, float *squared_distances, int *row_sizes)
+{
+    if (max_neighbours < 1 || max_neighbours > kMaxNeighbours) {
+        throw std::invalid_argument("Unsupported number of neighbours: " + std::to_string(max_neighbours));
+    }
+    Buffers &buffers = *buffers_;
+    const DeviceGrid::Buffers &target = *grid.buffers_;
+    buffers.grid = &grid;
+    buffers.size = size;
+    buffers.stride = max_neighbours;
+    const std::size_t capacity = static_cast<std::size_t>(size) * max_neighbours + 1;
+    buffers.source.reserve(3 * static_cast<std::size_t>(size) + 1);
+    buffers.indices.reserve(capacity);
+    buffers.squared_distances.reserve(capacity);
+    buffers.row_sizes.reserve(size + 1);
+    buffers.weights.reserve(capacity);
+    if (size == 0) {
+        return;
+    }
+    check(cudaMemcpyAsync(buffers.source.data(), source, 3 * size * sizeof(float), cudaMemcpyHostToDevice,
+                          buffers.stream), "cudaMemcpyAsync");
+    associateKernel<<<numBlocks(size), kBlockSize, 0, buffers.stream>>>(
+        buffers.source.data(), size, target.points.data(), target.cell_keys.data(), target.cell_begin.data(),
+        target.num_cells, target.cell_points.data(), target.inverse_cell_size, radius, max_neighbours,
+        buffers.indices.data(), buffers.squared_distances.data(), buffers.row_sizes.data());
+    check(cudaGetLastError(), "associateKernel");
+    const std::size_t num_entries = static_cast<std::size_t>(size) * max_neighbours;
+    check(cudaMemcpyAsync(indices, buffers.indices.data(), num_entries * sizeof(int), cudaMemcpyDeviceToHost,
+                          buffers.stream), "cudaMemcpyAsync");
+    check(cudaMemcpyAsync(squared_distances, buffers.squared_distances.data(), num_entries * sizeof(float),
+                          cudaMemcpyDeviceToHost, buffers.stream), "cudaMemcpyAsync");
+    check(cudaMemcpyAsync(row_sizes, buffers.row_sizes.data(), size * sizeof(int), cudaMemcpyDeviceToHost,
+                          buffers.stream), "cudaMemcpyAsync");
+    check(cudaStreamSynchronize(buffers.stream), "associateKernel");
+}
+
+Moments DeviceSource::expectation(const double rotation[9], const double translation[3], double dof,
+                                  bool deterministic)
+{
+    Buffers &buffers = *buffers_;
+    if (buffers.grid == NULL) {
+        throw std::logic_error("DeviceSource::expectation() before associate()");
+    }
+    Pose pose;
+    for (int k = 0; k < 9; k++) {
+        pose.rotation[k] = rotation[k];
+    }
+    for (int k = 0; k < 3; k++) {
+        pose.translation[k] = translation[k];
+    }
+    double moments[kNumMoments] = {0};
+    if (buffers.size > 0) {
+        const int num_blocks = numBlocks(buffers.size);
+        const int num_sums = deterministic ? num_blocks * kNumMoments : kNumMoments;
+        buffers.moments.reserve(num_sums);
+        const DeviceGrid::Buffers &target = *buffers.grid->buffers_;
+        if (deterministic) {
+            expectationKernel<true><<<num_blocks, kBlockSize, 0, buffers.stream>>>(
+                buffers.source.data(), buffers.size, target.points.data(), buffers.indices.data(),
+                buffers.row_sizes.data(), buffers.stride, pose, dof, buffers.weights.data(), buffers.moments.data());
+        } else {
+            check(cudaMemsetAsync(buffers.moments.data(), 0, kNumMoments * sizeof(double), buffers.stream),
+                  "cudaMemsetAsync");
+            expectationKernel<false><<<num_blocks, kBlockSize, 0, buffers.stream>>>(
+                buffers.source.data(), buffers.size, target.points.data(), buffers.indices.data(),
+                buffers.row_sizes.data(), buffers.stride, pose, dof, buffers.weights.data(), buffers.moments.data());
+        }
+        check(cudaGetLastError(), "expectationKernel");
+        buffers.block_moments.resize(num_sums);
+        check(cudaMemcpyAsync(buffers.block_moments.data(), buffers.moments.data(), num_sums * sizeof(double),
+                              cudaMemcpyDeviceToHost, buffers.stream), "cudaMemcpyAsync");
+        check(cudaStreamSynchronize(buffers.stream), "expectationKernel");
+        for (int block = 0; block < num_sums / kNumMoments; block++) {
+            for (int m = 0; m < kNumMoments; m++) {
+                moments[m] += buffers.block_moments[block * kNumMoments + m];
+            }
+        }
+    }
+    Moments result;
+    result.total_weight = moments[0];
+    for (int r = 0; r < 3; r++) {
+        result.source_sum[r] = moments[1 + r];
+        result.target_sum[r] = moments[4 + r];
+    }
+    for (int k = 0; k < 9; k++) {
+        result.cross_sum[k] = moments[7 + k];
+    }
+    result.cost = moments[16];
+    return result;
+}
+
+}  // namespace cuda
+}  // namespace prob_point_cloud_registration
@@ -0,0 +1,116 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <stdexcept>
+#include <utility>
+
+#include <Eigen/Geometry>
+
+#include "prob_point_cloud_registration/cuda_kernels.h"
+#include "prob_point_cloud_registration/cuda_target.h"
+
+namespace prob_point_cloud_registration {
+
+DeviceAssociation::DeviceAssociation(): device_(new cuda::DeviceSource())
+{
+}
+
+DeviceAssociation::~DeviceAssociation()
+{
+}
+
+WeightedMoments DeviceAssociation::expectation(const double rotation[4], const double translation[3], double dof,
+                                               bool deterministic)
+{
+    const Eigen::Quaterniond quaternion(rotation[0], rotation[1], rotation[2], rotation[3]);
+    const Eigen::Matrix<double, 3, 3, Eigen::RowMajor> matrix = quaternion.normalized().toRotationMatrix();
+    const cuda::Moments sums = device_->expectation(matrix.data(), translation, dof, deterministic);
+    WeightedMoments moments;
+    moments.total_weight = sums.total_weight;
+    moments.source_sum = Eigen::Map<const Eigen::Vector3d>(sums.source_sum);
+    moments.target_sum = Eigen::Map<const Eigen::Vector3d>(sums.target_sum);
+    moments.cross_sum = Eigen::Map<const Eigen::Matrix<double, 3, 3, Eigen::RowMajor>>(sums.cross_sum);
+    moments.cost = sums.cost;
+    return moments;
+}
+
+CudaTarget::CudaTarget(pcl::PointCloud<pcl::PointXYZ>::ConstPtr cloud, double cell_size):
+    host_search_(cloud, cell_size)
+{
+    if (!available()) {
+        throw std::runtime_error("No CUDA device available for the target");
+    }
+    // The cells of VoxelHashSearch, sorted by key
+    const float inverse_cell_size = 1 / cell_size;
+    std::vector<float> points(3 * cloud->size());
+    std::vector<std::pair<std::uint64_t, int>> keyed_points;
+    keyed_points.reserve(cloud->size());
+    for (std::size_t i = 0; i < cloud->size(); i++) {
+        const pcl::PointXYZ &point = (*cloud)[i];
+        points[3 * i] = point.x;
+        points[3 * i + 1] = point.y;
+        points[3 * i + 2] = point.z;
+        if (!std::isfinite(point.x) || !std::isfinite(point.y) || !std::isfinite(point.z)) {
+            continue;
+        }
+        const std::uint64_t key = cuda::cellKey(static_cast<int>(std::floor(point.x * inverse_cell_size)),
+                                                static_cast<int>(std::floor(point.y * inverse_cell_size)),
+                                                static_cast<int>(std::floor(point.z * inverse_cell_size)));
+        keyed_points.push_back(std::make_pair(key, i));
+    }
+    std::sort(keyed_points.begin(), keyed_points.end());
+    std::vector<std::uint64_t> cell_keys;
+    std::vector<int> cell_begin;
+    std::vector<int> cell_points(keyed_points.size());
+    for (std::size_t p = 0; p < keyed_points.size(); p++) {
+        if (cell_keys.empty() || cell_keys.back() != keyed_points[p].first) {
+            cell_keys.push_back(keyed_points[p].first);
+            cell_begin.push_back(p);
+        }
+        cell_points[p] = keyed_points[p].second;
+    }
+    cell_begin.push_back(keyed_points.size());
+    device_.reset(new cuda::DeviceGrid(points.data(), cloud->size(), cell_keys.data(), cell_begin.data(),
+                                       cell_keys.size(), cell_points.data(), inverse_cell_size));
+}
+
+CudaTarget::~CudaTarget()
+{
+}
+
+bool CudaTarget::available()
+{
+    return cuda::deviceAvailable();
+}
+
+bool CudaTarget::supports(int max_neighbours)
+{
+    return max_neighbours > 0 && max_neighbours <= cuda::kMaxNeighbours;
+}
+
+void CudaTarget::associate(const pcl::PointCloud<pcl::PointXYZ> &source, double radius, int max_neighbours,
+                           DeviceAssociation *device_association, DataAssociation *data_association) const
+{
+    const int size = source.size();
+    DeviceAssociation &staging = *device_association;
+    staging.source_.resize(3 * source.size());
+    for (int i = 0; i < size; i++) {
+        staging.source_[3 * i] = source[i].x;
+        staging.source_[3 * i + 1] = source[i].y;
+        staging.source_[3 * i + 2] = source[i].z;
+    }
+    staging.indices_.resize(static_cast<std::size_t>(size) * max_neighbours);
+    staging.squared_distances_.resize(staging.indices_.size());
+    staging.row_sizes_.resize(size);
+    staging.device_->associate(*device_, staging.source_.data(), size, radius, max_neighbours,
+                               staging.indices_.data(), staging.squared_distances_.data(), staging.row_sizes_.data());
+    data_association->reset(size, this->size(), max_neighbours);
+    for (int i = 0; i < size; i++) {
+        const std::size_t offset = static_cast<std::size_t>(i) * max_neighbours;
+        data_association->setRow(i, staging.indices_.data() + offset, staging.squared_distances_.data() + offset,
+                                 staging.row_sizes_[i]);
+    }
+    data_association->finish();
+}
+
+}  // namespace prob_point_cloud_registration
@@ -0,0 +1,236 @@
+#include <algorithm>
+#include <cassert>
+#include <limits>
+#include <memory>
+
+#include <boost/make_shared.hpp>
+#include <ceres/ceres.h>
+#include <pcl/common/transforms.h>
+#include <pcl/filters/voxel_grid.h>
+
+#include "prob_point_cloud_registration/data_association.hpp"
+#include "prob_point_cloud_registration/multi_view_registration.h"
+#include "prob_point_cloud_registration/output_stream.hpp"
+#include "prob_point_cloud_registration/pairwise_error_term.hpp"
+#include "prob_point_cloud_registration/prob_point_cloud_registration.h"
+#include "prob_point_cloud_registration/probabilistic_weights.hpp"
+
+namespace prob_point_cloud_registration {
+
+namespace {
+
+// The associations of a pair of scans during an outer iteration
+struct PairTerm {
+    int source;
+    int target;
+    DataAssociation association;
+    PairwiseErrorTerm error_term;
+    std::vector<double> squared_errors;
+};
+
+// The weights of all the pairs, from the poses of parameters (7 per scan: rotation, translation)
+class MultiViewWeightUpdater : public ceres::IterationCallback
+{
+public:
+    MultiViewWeightUpdater(const std::vector<std::unique_ptr<PairTerm>> &pairs, const double *parameters,
+                           const ProbabilisticWeights &weight_updater, Executor &executor):
+        pairs_(pairs), parameters_(parameters), weight_updater_(weight_updater), executor_(executor),
+        elapsed_time_(0) {}
+
+    ceres::CallbackReturnType operator()(const ceres::IterationSummary &summary) override
+    {
+        Stopwatch stopwatch;
+        for (const std::unique_ptr<PairTerm> &pair : pairs_) {
+            if (pair->error_term.size() == 0) {
+                continue;
+            }
+            const double *source = parameters_ + 7 * pair->source;
+            const double *target = parameters_ + 7 * pair->target;
+            pair->error_term.squaredErrors(source, source + 4, target, target + 4, &pair->squared_errors);
+            weight_updater_.updateWeights(pair->association.matrix(), pair->squared_errors,
+                                          pair->error_term.weights().data(), executor_);
+        }
+        elapsed_time_ += stopwatch.elapsed();
+        return ceres::SOLVER_CONTINUE;
+    }
+
+    double elapsedTime() const
+    {
+        return elapsed_time_;
+    }
+
+private:
+    const std::vector<std::unique_ptr<PairTerm>> &pairs_;
+    const double *parameters_;
+    const ProbabilisticWeights &weight_updater_;
+    Executor &executor_;
+    double elapsed_time_;
+};
+
+}  // namespace
+
+MultiViewRegistration::MultiViewRegistration(const std::vector<pcl::PointCloud<pcl::PointXYZ>::Ptr> &scans,
+                                             ProbPointCloudRegistrationParams parameters):
+    parameters_(withDefaultExecutor(parameters)), filtered_scans_(scans.size()), targets_(scans.size()),
+    poses_(scans.size(), Eigen::Affine3d::Identity())
+{
+    std::vector<RegistrationStatistics> scan_statistics(scans.size());
+    parameters_.executor->parallelFor(scans.size(), [&](int i) {
+        Stopwatch filtering;
+        filtered_scans_[i] = boost::make_shared<pcl::PointCloud<pcl::PointXYZ>>();
+        if (parameters_.source_filter_size > 0) {
+            pcl::VoxelGrid<pcl::PointXYZ> filter;
+            filter.setInputCloud(scans[i]);
+            filter.setLeafSize(parameters_.source_filter_size, parameters_.source_filter_size,
+                               parameters_.source_filter_size);
+            filter.filter(*filtered_scans_[i]);
+        } else {
+            *filtered_scans_[i] = *scans[i];
+        }
+        scan_statistics[i].filtering_time = filtering.elapsed();
+        // buildTarget() filters its cloud in place
+        targets_[i] = ProbPointCloudRegistration::buildTarget(
+                          boost::make_shared<pcl::PointCloud<pcl::PointXYZ>>(*scans[i]), parameters_,
+                          &scan_statistics[i]);
+    });
+    for (const RegistrationStatistics &statistics : scan_statistics) {
+        statistics_.filtering_time += statistics.filtering_time;
+        statistics_.kdtree_build_time += statistics.kdtree_build_time;
+    }
+    for (std::size_t i = 0; i < scans.size(); i++) {
+        for (std::size_t j = i + 1; j < scans.size(); j++) {
+            pairs_.push_back(std::make_pair(i, j));
+        }
+    }
+}
+
+void MultiViewRegistration::setPairs(const std::vector<std::pair<int, int>> &pairs)
+{
+    for (const std::pair<int, int> &pair : pairs) {
+        assert(pair.first != pair.second && pair.first >= 0 && pair.second >= 0);
+        assert(pair.first < static_cast<int>(targets_.size()) && pair.second < static_cast<int>(targets_.size()));
+    }
+    pairs_ = pairs;
+}
+
+void MultiViewRegistration::align(const std::vector<Eigen::Affine3d> &initial_poses)
+{
+    assert(initial_poses.empty() || initial_poses.size() == targets_.size());
+    const int num_scans = targets_.size();
+    poses_.assign(num_scans, Eigen::Affine3d::Identity());
+    if (!initial_poses.empty()) {
+        poses_ = initial_poses;
+    }
+    OutputStream output_stream(parameters_.verbose);
+    Executor &executor = *parameters_.executor;
+    // Rotation (w, x, y, z) and translation of every scan
+    std::vector<double> parameters(7 * num_scans);
+    for (int i = 0; i < num_scans; i++) {
+        const Eigen::Quaterniond rotation(poses_[i].rotation());
+        parameters[7 * i] = rotation.w();
+        parameters[7 * i + 1] = rotation.x();
+        parameters[7 * i + 2] = rotation.y();
+        parameters[7 * i + 3] = rotation.z();
+        Eigen::Map<Eigen::Vector3d> translation(&parameters[7 * i + 4]);
+        translation = poses_[i].translation();
+    }
+    std::vector<std::unique_ptr<PairTerm>> pairs;
+    for (const std::pair<int, int> &pair : pairs_) {
+        pairs.emplace_back(new PairTerm());
+        pairs.back()->source = pair.first;
+        pairs.back()->target = pair.second;
+        pairs.back()->error_term.setExecutor(&executor);
+    }
+    const ProbabilisticWeights weight_updater(parameters_.dof, 3, parameters_.max_neighbours);
+    num_unusefull_iter_ = 0;
+    statistics_.iterations.clear();
+    double cost_drop = 0;
+    for (int iteration = 0; !hasConverged(iteration, cost_drop); iteration++) {
+        IterationStatistics iteration_statistics;
+        iteration_statistics.iteration = iteration;
+        // Each pair associates the source scan, moved into the frame of the target scan
+        Stopwatch association;
+        executor.parallelFor(pairs.size(), [&](int p) {
+            PairTerm &pair = *pairs[p];
+            pcl::PointCloud<pcl::PointXYZ> moved_source;
+            pcl::transformPointCloud(*filtered_scans_[pair.source], moved_source,
+                                     poses_[pair.target].inverse() * poses_[pair.source]);
+            computeDataAssociation(moved_source, *targets_[pair.target], parameters_.radius,
+                                   parameters_.max_neighbours, executor, &pair.association);
+            pair.error_term.setAssociations(*filtered_scans_[pair.source], *targets_[pair.target],
+                                            pair.association.matrix());
+        });
+        iteration_statistics.association_time = association.elapsed();
+
+        Stopwatch problem_construction;
+        ceres::Problem::Options problem_options;
+        problem_options.cost_function_ownership = ceres::DO_NOT_TAKE_OWNERSHIP;
+        ceres::Problem problem(problem_options);
+        std::vector<bool> in_problem(num_scans, false);
+        for (const std::unique_ptr<PairTerm> &pair : pairs) {
+            iteration_statistics.num_associations += pair->error_term.size();
+            iteration_statistics.num_association_queries += filtered_scans_[pair->source]->size();
+            if (pair->error_term.size() == 0) {
+                continue;
+            }
+            double *source = &parameters[7 * pair->source];
+            double *target = &parameters[7 * pair->target];
+            problem.AddResidualBlock(&pair->error_term, NULL, source, source + 4, target, target + 4);
+            in_problem[pair->source] = true;
+            in_problem[pair->target] = true;
+        }
+        iteration_statistics.num_active_associations = iteration_statistics.num_associations;
+        if (!in_problem[0]) {
+            output_stream << "Terminating because the first scan overlaps none of the others\n";
+            break;
+        }
+        // The gauge: the first scan does not move
+        problem.SetParameterBlockConstant(&parameters[0]);
+        problem.SetParameterBlockConstant(&parameters[4]);
+        MultiViewWeightUpdater weight_update(pairs, parameters.data(), weight_updater, executor);
+        weight_update(ceres::IterationSummary());
+        iteration_statistics.problem_construction_time = problem_construction.elapsed() - weight_update.elapsedTime();
+
+        // The normal equations couple only the poses of the scans that overlap
+        ceres::Solver::Options options;
+        options.linear_solver_type = ceres::SPARSE_NORMAL_CHOLESKY;
+        options.use_nonmonotonic_steps = true;
+        options.minimizer_progress_to_stdout = parameters_.verbose;
+        options.max_num_iterations = std::numeric_limits<int>::max();
+        options.function_tolerance = 10e-6;
+        options.num_threads = parameters_.deterministic ? 1 : executor.numThreads();
+        options.update_state_every_iteration = true;
+        options.callbacks.push_back(&weight_update);
+        ceres::Solver::Summary summary;
+        Stopwatch solve;
+        ceres::Solve(options, &problem, &summary);
+        iteration_statistics.solve_time = solve.elapsed();
+        iteration_statistics.weight_update_time = weight_update.elapsedTime();
+        iteration_statistics.num_solver_iterations = summary.num_successful_steps + summary.num_unsuccessful_steps;
+        output_stream << summary.BriefReport() << "\n";
+
+        for (int i = 1; i < num_scans; i++) {
+            const Eigen::Quaterniond rotation(parameters[7 * i], parameters[7 * i + 1], parameters[7 * i + 2],
+                                              parameters[7 * i + 3]);
+            poses_[i] = Eigen::Translation3d(Eigen::Map<const Eigen::Vector3d>(&parameters[7 * i + 4])) *
+                        rotation.normalized();
+        }
+        cost_drop = (summary.initial_cost - summary.final_cost) / summary.initial_cost;
+        iteration_statistics.peak_memory_kb = peakMemoryKb();
+        statistics_.iterations.push_back(iteration_statistics);
+    }
+}
+
+bool MultiViewRegistration::hasConverged(int iteration, double cost_drop)
+{
+    if (iteration == parameters_.n_iter) {
+        return true;
+    }
+    if (iteration == 0 || !(cost_drop < parameters_.cost_drop_thresh)) {
+        num_unusefull_iter_ = 0;
+        return false;
+    }
+    return num_unusefull_iter_++ > parameters_.n_cost_drop_it;
+}
+
+}  // namespace prob_point_cloud_registration
@@ -0,0 +1,68 @@
+#include <chrono>
+
+#include <boost/make_shared.hpp>
+#include <pcl/common/transforms.h>
+
+#include "prob_point_cloud_registration/odometry_registration.h"
+#include "prob_point_cloud_registration/prob_point_cloud_registration.h"
+
+namespace prob_point_cloud_registration {
+
+OdometryRegistration::OdometryRegistration(ProbPointCloudRegistrationParams parameters):
+    parameters_(withDefaultExecutor(parameters))
+{
+}
+
+OdometryResult OdometryRegistration::registerScan(pcl::PointCloud<pcl::PointXYZ>::Ptr scan)
+{
+    Stopwatch frame_time;
+    const auto start = std::chrono::steady_clock::now();
+    OdometryResult result;
+    if (target_) {
+        // Constant velocity: the scan moved as much as the previous one did
+        const Eigen::Affine3d guess = map_target_ ? pose_ * motion_ : motion_;
+        auto source_cloud = boost::make_shared<pcl::PointCloud<pcl::PointXYZ>>();
+        pcl::transformPointCloud(*scan, *source_cloud, guess);
+        ProbPointCloudRegistrationParams parameters = parameters_;
+        // From the call, so that the prediction and the filtering of the scan are charged too
+        parameters.deadline = budgetDeadline(parameters_, start);
+        parameters.time_budget = 0;
+        ProbPointCloudRegistration registration(source_cloud, target_, parameters);
+        registration.align();
+        const Eigen::Affine3d estimate = registration.transformation() * guess;
+        const Eigen::Affine3d pose = map_target_ ? estimate : pose_ * estimate;
+        motion_ = pose_.inverse() * pose;
+        pose_ = pose;
+        result.timed_out = registration.timedOut();
+        result.statistics = registration.statistics();
+    }
+    result.pose = pose_;
+    result.motion = motion_;
+    result.time = frame_time.elapsed();
+    if (!map_target_) {
+        // buildTarget() filters in place
+        pcl::PointCloud<pcl::PointXYZ>::Ptr target_cloud = scan;
+        if (parameters_.target_filter_size > 0) {
+            target_cloud = boost::make_shared<pcl::PointCloud<pcl::PointXYZ>>(*scan);
+        }
+        target_ = ProbPointCloudRegistration::buildTarget(target_cloud, parameters_, &result.statistics);
+    }
+    return result;
+}
+
+void OdometryRegistration::setMap(std::shared_ptr<NeighbourSearch> map, const Eigen::Affine3d &pose)
+{
+    target_ = map;
+    map_target_ = true;
+    pose_ = pose;
+}
+
+void OdometryRegistration::reset()
+{
+    target_.reset();
+    map_target_ = false;
+    pose_ = Eigen::Affine3d::Identity();
+    motion_ = Eigen::Affine3d::Identity();
+}
+
+}  // namespace prob_point_cloud_registration
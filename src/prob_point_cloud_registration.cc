@@ -1,52 +1,100 @@
+#include <algorithm>
 #include <cstdio>
 #include <fstream>
-#include <thread>
+#include <stdexcept>
 
 #include <boost/make_shared.hpp>
 #include <pcl/common/angles.h>
 #include <pcl/common/transforms.h>
 #include <pcl/kdtree/kdtree_flann.h>
 
+#include "prob_point_cloud_registration/coarse_alignment.hpp"
+#include "prob_point_cloud_registration/data_association.hpp"
 #include "prob_point_cloud_registration/prob_point_cloud_registration.h"
+#include "prob_point_cloud_registration/target_file.hpp"
 #include "prob_point_cloud_registration/utilities.hpp"
+#ifdef PROB_POINT_CLOUD_REGISTRATION_USE_CUDA
+#include "prob_point_cloud_registration/cuda_target.h"
+#endif
 
 namespace prob_point_cloud_registration {
 
+namespace {
+
+// buildNeighbourSearch(), and the CUDA target of the builds that have one
+std::shared_ptr<NeighbourSearch> indexTarget(pcl::PointCloud<pcl::PointXYZ>::ConstPtr cloud,
+                                             NeighbourSearchType type, double radius)
+{
+    if (type == NeighbourSearchType::CUDA) {
+#ifdef PROB_POINT_CLOUD_REGISTRATION_USE_CUDA
+        return std::make_shared<CudaTarget>(cloud, radius);
+#else
+        throw std::invalid_argument("NeighbourSearchType::CUDA needs a build with USE_CUDA");
+#endif
+    }
+    return buildNeighbourSearch(cloud, type, radius);
+}
+
+}  // namespace
+
 ProbPointCloudRegistration::ProbPointCloudRegistration(
     pcl::PointCloud<pcl::PointXYZ>::Ptr source_cloud,
     pcl::PointCloud<pcl::PointXYZ>::Ptr target_cloud,
-    ProbPointCloudRegistrationParams parameters): parameters_(parameters),
-    target_cloud_(target_cloud), mse_ground_truth_(0), current_iteration_(0), mse_prev_it_(0),
-    cost_drop_(0), num_unusefull_iter_(0), output_stream_(parameters.verbose)
+    ProbPointCloudRegistrationParams parameters): parameters_(withDefaultExecutor(parameters)), output_stream_(parameters.verbose)
 {
-    source_cloud_ = boost::make_shared<pcl::PointCloud<pcl::PointXYZ>>(*source_cloud);
+    target_ = buildTarget(target_cloud, parameters_, &statistics_);
+    target_cloud_ = target_->cloud();
+    if (auto kdtree_search = std::dynamic_pointer_cast<KdTreeSearch>(target_)) {
+        target_kdtree_ = kdtree_search->kdtree();
+    }
+    initialize(source_cloud);
+}
+
+ProbPointCloudRegistration::ProbPointCloudRegistration(
+    pcl::PointCloud<pcl::PointXYZ>::Ptr source_cloud,
+    pcl::KdTreeFLANN<pcl::PointXYZ>::Ptr target_kdtree,
+    ProbPointCloudRegistrationParams parameters): parameters_(withDefaultExecutor(parameters)),
+    target_cloud_(target_kdtree->getInputCloud()), target_kdtree_(target_kdtree),
+    target_(std::make_shared<KdTreeSearch>(target_kdtree)), output_stream_(parameters.verbose)
+{
+    initialize(source_cloud);
+}
+
+ProbPointCloudRegistration::ProbPointCloudRegistration(
+    pcl::PointCloud<pcl::PointXYZ>::Ptr source_cloud,
+    std::shared_ptr<NeighbourSearch> target,
+    ProbPointCloudRegistrationParams parameters): parameters_(withDefaultExecutor(parameters)),
+    target_cloud_(target->cloud()), target_(target), output_stream_(parameters.verbose)
+{
+    if (auto kdtree_search = std::dynamic_pointer_cast<KdTreeSearch>(target_)) {
+        target_kdtree_ = kdtree_search->kdtree();
+    }
+    initialize(source_cloud);
+}
+
+void ProbPointCloudRegistration::initialize(pcl::PointCloud<pcl::PointXYZ>::Ptr source_cloud)
+{
+    if (parameters_.scalar_type == ScalarType::FLOAT) {
+        float_registration_.reset(new BasicProbPointCloudRegistrationIteration<float>(parameters_));
+    } else {
+        registration_.reset(new ProbPointCloudRegistrationIteration(parameters_));
+    }
+    source_cloud_ = source_cloud;
     filtered_source_cloud_ = boost::make_shared<pcl::PointCloud<pcl::PointXYZ>>();
     if (parameters_.source_filter_size > 0) {
         output_stream_ << "Filtering source point cloud with leaf of size " <<
                        parameters_.source_filter_size << "\n";
-        filter_.setInputCloud(source_cloud_);
-        filter_.setLeafSize(parameters_.source_filter_size, parameters_.source_filter_size,
-                            parameters_.source_filter_size);
-        filter_.filter(*filtered_source_cloud_);
-    } else {
-        *filtered_source_cloud_ = *source_cloud_;
-    }
-    if (parameters_.target_filter_size > 0) {
-        output_stream_ << "Filtering target point cloud with leaf of size " <<
-                       parameters_.target_filter_size << "\n";
-        filter_.setInputCloud(target_cloud_);
-        filter_.setLeafSize(parameters_.target_filter_size, parameters_.target_filter_size,
-                            parameters_.target_filter_size);
-        filter_.filter(*target_cloud_);
     }
+    Stopwatch filtering;
+    downsample(source_cloud_, parameters_.source_filter_size, *filtered_source_cloud_);
+    statistics_.filtering_time += filtering.elapsed();
     if (parameters_.summary) {
-        prev_source_cloud_ = boost::make_shared<pcl::PointCloud<pcl::PointXYZ>>(*source_cloud);
         report_ <<
-                "iter, n_success_steps, initial_cost, final_cost, tx, ty, tz, roll, pitch, yaw, mse_prev_iter, mse_gtruth"
-                << std::endl;
+                "iter, n_success_steps, initial_cost, final_cost, tx, ty, tz, roll, pitch, yaw, mse_prev_iter, mse_gtruth, "
+                << IterationStatistics::csvHeader() << std::endl;
     }
-    ground_truth_ = false;
 }
+
 ProbPointCloudRegistration::ProbPointCloudRegistration(
     pcl::PointCloud<pcl::PointXYZ>::Ptr source_cloud,
     pcl::PointCloud<pcl::PointXYZ>::Ptr target_cloud,
@@ -54,37 +102,283 @@ ProbPointCloudRegistration::ProbPointCloudRegistration(
     pcl::PointCloud<pcl::PointXYZ>::Ptr ground_truth_cloud):
     ProbPointCloudRegistration::ProbPointCloudRegistration(source_cloud, target_cloud, parameters)
 {
-    ground_truth_cloud_ = boost::make_shared<pcl::PointCloud<pcl::PointXYZ>>(*ground_truth_cloud);
+    setGroundTruth(ground_truth_cloud);
+}
+
+ProbPointCloudRegistration::ProbPointCloudRegistration(
+    pcl::PointCloud<pcl::PointXYZ>::Ptr source_cloud,
+    std::shared_ptr<NeighbourSearch> target,
+    ProbPointCloudRegistrationParams parameters,
+    pcl::PointCloud<pcl::PointXYZ>::Ptr ground_truth_cloud):
+    ProbPointCloudRegistration::ProbPointCloudRegistration(source_cloud, target, parameters)
+{
+    setGroundTruth(ground_truth_cloud);
+}
+
+void ProbPointCloudRegistration::setGroundTruth(pcl::PointCloud<pcl::PointXYZ>::Ptr ground_truth_cloud)
+{
+    ground_truth_cloud_ = ground_truth_cloud;
     ground_truth_ = true;
     mse_ground_truth_ = prob_point_cloud_registration::calculateMSE(source_cloud_, ground_truth_cloud_);
     output_stream_ << "Initial MSE w.r.t. ground truth: " << mse_ground_truth_ << "\n";
 }
 
+double ProbPointCloudRegistration::filterTarget(pcl::PointCloud<pcl::PointXYZ>::Ptr target_cloud,
+                                                const ProbPointCloudRegistrationParams &parameters)
+{
+    Stopwatch filtering;
+    if (parameters.target_filter_size > 0) {
+        OutputStream output_stream(parameters.verbose);
+        output_stream << "Filtering target point cloud with leaf of size " <<
+                      parameters.target_filter_size << "\n";
+        downsample(target_cloud, parameters.target_filter_size, *target_cloud);
+    }
+    return filtering.elapsed();
+}
+
+pcl::KdTreeFLANN<pcl::PointXYZ>::Ptr ProbPointCloudRegistration::buildTargetKdTree(
+    pcl::PointCloud<pcl::PointXYZ>::Ptr target_cloud, const ProbPointCloudRegistrationParams &parameters,
+    RegistrationStatistics *statistics)
+{
+    const double filtering_time = filterTarget(target_cloud, parameters);
+    Stopwatch kdtree_build;
+    auto kdtree = boost::make_shared<pcl::KdTreeFLANN<pcl::PointXYZ>>();
+    kdtree->setInputCloud(target_cloud);
+    if (statistics != NULL) {
+        statistics->filtering_time += filtering_time;
+        statistics->kdtree_build_time += kdtree_build.elapsed();
+    }
+    return kdtree;
+}
+
+std::shared_ptr<NeighbourSearch> ProbPointCloudRegistration::buildTarget(
+    pcl::PointCloud<pcl::PointXYZ>::Ptr target_cloud, const ProbPointCloudRegistrationParams &parameters,
+    RegistrationStatistics *statistics)
+{
+    const double filtering_time = filterTarget(target_cloud, parameters);
+    Stopwatch index_build;
+    std::shared_ptr<NeighbourSearch> target = indexTarget(target_cloud, parameters.neighbour_search,
+                                                          parameters.radius);
+    if (statistics != NULL) {
+        statistics->filtering_time += filtering_time;
+        statistics->kdtree_build_time += index_build.elapsed();
+    }
+    return target;
+}
+
+std::shared_ptr<NeighbourSearch> ProbPointCloudRegistration::loadTarget(
+    const std::string &file_name, const std::string &source_file_name,
+    const ProbPointCloudRegistrationParams &parameters, RegistrationStatistics *statistics)
+{
+    Stopwatch index_build;
+    TargetFile target_file;
+    if (!readTargetFile(file_name, source_file_name, parameters.neighbour_search, parameters.target_filter_size,
+                        parameters.radius, &target_file)) {
+        return NULL;
+    }
+    std::shared_ptr<NeighbourSearch> target = target_file.voxel_hash;
+    if (!target) {
+        target = indexTarget(target_file.cloud, parameters.neighbour_search, parameters.radius);
+    }
+    if (statistics != NULL) {
+        statistics->kdtree_build_time += index_build.elapsed();
+    }
+    return target;
+}
+
+bool ProbPointCloudRegistration::saveTarget(const NeighbourSearch &target, const std::string &source_file_name,
+                                            const ProbPointCloudRegistrationParams &parameters,
+                                            const std::string &file_name)
+{
+    return writeTargetFile(file_name, source_file_name, target, parameters.neighbour_search,
+                           parameters.target_filter_size);
+}
+
+void ProbPointCloudRegistration::downsample(pcl::PointCloud<pcl::PointXYZ>::ConstPtr cloud,
+                                            double leaf_size, pcl::PointCloud<pcl::PointXYZ> &filtered_cloud)
+{
+    if (leaf_size > 0) {
+        pcl::VoxelGrid<pcl::PointXYZ> filter;
+        filter.setInputCloud(cloud);
+        filter.setLeafSize(leaf_size, leaf_size, leaf_size);
+        filter.filter(filtered_cloud);
+    } else if (&filtered_cloud != cloud.get()) {
+        filtered_cloud = *cloud;
+    }
+}
+
 void ProbPointCloudRegistration::align()
 {
+    deadline_ = budgetDeadline(parameters_, std::chrono::steady_clock::now());
+    timed_out_ = false;
+    const bool coarse_alignment = parameters_.coarse_alignment.num_rotations > 0;
+    if (coarse_alignment) {
+        coarseAlign();
+    }
+    for (std::size_t level = 0; level < parameters_.pyramid.size(); level++) {
+        const PyramidLevel &pyramid_level = parameters_.pyramid[level];
+        output_stream_ << "Pyramid level " << level << ": source leaf " << pyramid_level.source_filter_size <<
+                       ", target leaf " << pyramid_level.target_filter_size << ", radius " << pyramid_level.radius << "\n";
+        Stopwatch filtering;
+        auto level_source = boost::make_shared<pcl::PointCloud<pcl::PointXYZ>>();
+        downsample(filtered_source_cloud_, pyramid_level.source_filter_size, *level_source);
+        if (!transformation_history_.empty()) {
+            pcl::transformPointCloud(*level_source, *level_source, transformation_history_.back());
+        }
+        std::shared_ptr<NeighbourSearch> level_target = target_;
+        // Only a target held in memory can be filtered
+        if (pyramid_level.target_filter_size > 0 && target_cloud_) {
+            auto filtered_target = boost::make_shared<pcl::PointCloud<pcl::PointXYZ>>();
+            downsample(target_cloud_, pyramid_level.target_filter_size, *filtered_target);
+            statistics_.filtering_time += filtering.elapsed();
+            Stopwatch kdtree_build;
+            level_target = indexTarget(filtered_target, parameters_.neighbour_search, pyramid_level.radius);
+            statistics_.kdtree_build_time += kdtree_build.elapsed();
+        } else {
+            statistics_.filtering_time += filtering.elapsed();
+        }
+        // The full resolution target keeps the geometry of the base radius in every level
+        const double geometry_radius = level_target == target_ ? parameters_.radius : pyramid_level.radius;
+        alignLevel(level_source, *level_target, pyramid_level.radius,
+                   targetGeometry(*level_target, geometry_radius).get());
+    }
+    if ((coarse_alignment || !parameters_.pyramid.empty()) && !transformation_history_.empty()) {
+        pcl::transformPointCloud(*filtered_source_cloud_, *filtered_source_cloud_, transformation_history_.back());
+    }
+    alignLevel(filtered_source_cloud_, *target_, parameters_.radius,
+               targetGeometry(*target_, parameters_.radius).get());
+    if (ground_truth_ && !transformation_history_.empty()) {
+        mse_ground_truth_ = prob_point_cloud_registration::calculateMSE(source_cloud_,
+                                                                        transformation_history_.back(), ground_truth_cloud_);
+        std::cout << "MSE w.r.t. ground truth: " << mse_ground_truth_ << std::endl;
+    }
+}
+
+void ProbPointCloudRegistration::coarseAlign()
+{
+    const CoarseAlignmentParams &coarse = parameters_.coarse_alignment;
+    Stopwatch coarse_alignment;
+    auto points = boost::make_shared<pcl::PointCloud<pcl::PointXYZ>>(stridedSubset(*filtered_source_cloud_,
+                                                                                 coarse.num_points));
+    const std::vector<Eigen::Affine3d> poses = coarseHypotheses(*points, target_cloud_.get(), coarse);
+    // A tiled target loads what any of the hypotheses queries
+    const Eigen::AlignedBox3f box = boundingBox(*points);
+    Eigen::AlignedBox3f query_box;
+    for (const Eigen::Affine3d &pose : poses) {
+        for (int corner = 0; corner < 8; corner++) {
+            query_box.extend(pose.cast<float>() * box.corner(static_cast<Eigen::AlignedBox3f::CornerType>(corner)));
+        }
+    }
+    target_->prepare(query_box, parameters_.radius);
+    const std::vector<ScoredPose> hypotheses = scorePoses(*points, *target_, poses, coarse.robust_factor,
+                                                          *parameters_.executor);
+    // The best hypotheses, each refined by a short registration of the same points
+    ProbPointCloudRegistrationParams refinement = parameters_;
+    refinement.coarse_alignment.num_rotations = 0;
+    refinement.pyramid.clear();
+    refinement.source_filter_size = 0;
+    refinement.n_iter = coarse.refine_iterations;
+    // The refinements are part of the time budget of align()
+    refinement.time_budget = 0;
+    refinement.deadline = deadline_;
+    refinement.verbose = false;
+    refinement.summary = false;
+    ScoredPose best = hypotheses.front();
+    const int num_refined = std::min<int>(coarse.num_refined, hypotheses.size());
+    for (int i = 0; i < num_refined && coarse.refine_iterations > 0; i++) {
+        auto moved = boost::make_shared<pcl::PointCloud<pcl::PointXYZ>>();
+        pcl::transformPointCloud(*points, *moved, hypotheses[i].pose);
+        ProbPointCloudRegistration registration(moved, target_, refinement);
+        registration.align();
+        const Eigen::Affine3d pose = registration.transformation() * hypotheses[i].pose;
+        const std::vector<ScoredPose> refined = scorePoses(*points, *target_, std::vector<Eigen::Affine3d>(1, pose),
+                                                           coarse.robust_factor, *parameters_.executor);
+        if (refined.front().score < best.score) {
+            best = refined.front();
+        }
+    }
+    statistics_.coarse_alignment_time = coarse_alignment.elapsed();
+    output_stream_ << "Coarse alignment: " << hypotheses.size() << " hypotheses, best score " <<
+                   hypotheses.front().score << ", " << best.score << " after refinement\n";
+    transformation_history_.push_back(best.pose);
+}
+
+std::shared_ptr<const TargetGeometry> ProbPointCloudRegistration::targetGeometry(const NeighbourSearch &target,
+                                                                                double radius)
+{
+    if (parameters_.residual_type == ResidualType::POINT_TO_POINT) {
+        return std::shared_ptr<const TargetGeometry>();
+    }
+    Stopwatch geometry_build;
+    std::shared_ptr<const TargetGeometry> geometry = target.geometry(parameters_.residual_type, radius,
+                                                                     parameters_.geometry_neighbours,
+                                                                     *parameters_.executor);
+    statistics_.kdtree_build_time += geometry_build.elapsed();
+    return geometry;
+}
+
+template <typename Scalar>
+void ProbPointCloudRegistration::alignLevel(BasicProbPointCloudRegistrationIteration<Scalar> &registration,
+                                            pcl::PointCloud<pcl::PointXYZ>::Ptr source_cloud,
+                                            NeighbourSearch &target, double radius, const TargetGeometry *geometry)
+{
+    level_iteration_ = 0;
+    num_unusefull_iter_ = 0;
+    cost_drop_ = 0;
+    std::unique_ptr<IncrementalDataAssociation> incremental_association;
+    if (parameters_.incremental_association) {
+        incremental_association.reset(new IncrementalDataAssociation(target, radius, parameters_.max_neighbours,
+                                                                     parameters_.association_margin,
+                                                                     *parameters_.executor));
+    }
+#ifdef PROB_POINT_CLOUD_REGISTRATION_USE_CUDA
+    // A CUDA target associates the whole source on the device, and solves the EM there when it can
+    const CudaTarget *device_target = dynamic_cast<const CudaTarget *>(&target);
+    std::unique_ptr<DeviceAssociation> device_association;
+    if (device_target != NULL && !incremental_association && CudaTarget::supports(parameters_.max_neighbours)) {
+        device_association.reset(new DeviceAssociation());
+    }
+    const bool device_solve = device_association && parameters_.solver_type == SolverType::PROCRUSTES &&
+                              geometry == NULL && !(parameters_.prune_weight > 0);
+#endif
+    // The incremental association caches the neighbours up to a larger radius
+    const double query_radius = parameters_.incremental_association ? (1 + parameters_.association_margin) * radius :
+                                radius;
     while (!hasConverged()) {
-        pcl::KdTreeFLANN<pcl::PointXYZ> kdtree;
-        kdtree.setInputCloud(target_cloud_);
-        std::vector<float> distances;
-        Eigen::SparseMatrix<double, Eigen::RowMajor> data_association(filtered_source_cloud_->size(),
-                                                                      target_cloud_->size());
-        std::vector<Eigen::Triplet<double>> tripletList;
-        for (std::size_t i = 0; i < filtered_source_cloud_->size(); i++) {
-            std::vector<int> neighbours;
-            kdtree.radiusSearch(*filtered_source_cloud_, i, parameters_.radius, neighbours, distances,
-                                parameters_.max_neighbours);
-            int k = 0;
-            for (int j : neighbours) {
-                tripletList.push_back(Eigen::Triplet<double>(i, j, distances[k]));
-                k++;
-            }
+        IterationStatistics iteration_statistics;
+        iteration_statistics.iteration = current_iteration_;
+        Stopwatch association;
+        target.prepare(boundingBox(*source_cloud), query_radius);
+        if (incremental_association) {
+            incremental_association->compute(*source_cloud, &data_association_);
+            iteration_statistics.num_association_queries = incremental_association->numQueries();
+#ifdef PROB_POINT_CLOUD_REGISTRATION_USE_CUDA
+        } else if (device_association) {
+            device_target->associate(*source_cloud, radius, parameters_.max_neighbours, device_association.get(),
+                                     &data_association_);
+            iteration_statistics.num_association_queries = source_cloud->size();
+#endif
+        } else {
+            computeDataAssociation(*source_cloud, target, radius, parameters_.max_neighbours, *parameters_.executor,
+                                   &data_association_);
+            iteration_statistics.num_association_queries = source_cloud->size();
         }
-        data_association.setFromTriplets(tripletList.begin(), tripletList.end());
-        data_association.makeCompressed();
+        iteration_statistics.association_time = association.elapsed();
+        iteration_statistics.num_associations = data_association_.matrix().nonZeros();
 
-        ProbPointCloudRegistrationIteration registration(*filtered_source_cloud_, *target_cloud_,
-                                                     data_association,
-                                                     parameters_);
+        Stopwatch problem_construction;
+#ifdef PROB_POINT_CLOUD_REGISTRATION_USE_CUDA
+        if (device_solve) {
+            registration.setDataAssociation(*device_association, data_association_);
+        } else {
+            registration.setDataAssociation(*source_cloud, target, data_association_, geometry);
+        }
+#else
+        registration.setDataAssociation(*source_cloud, target, data_association_, geometry);
+#endif
+        // setDataAssociation() also computes the initial weights, they are accounted as weight updates
+        iteration_statistics.problem_construction_time = problem_construction.elapsed() -
+                                                         registration.weightUpdateTime();
         ceres::Solver::Options options;
         options.linear_solver_type = ceres::DENSE_QR;
         options.use_nonmonotonic_steps = true;
@@ -95,51 +389,86 @@ void ProbPointCloudRegistration::align()
         }
         options.max_num_iterations = std::numeric_limits<int>::max();
         options.function_tolerance = 10e-6;
-        options.num_threads = std::thread::hardware_concurrency();
+        options.num_threads = solverThreads(parameters_);
+        if (deadline_ != std::chrono::steady_clock::time_point::max()) {
+            options.max_solver_time_in_seconds = std::max(
+                std::chrono::duration<double>(deadline_ - std::chrono::steady_clock::now()).count(), 0.0);
+        }
         ceres::Solver::Summary summary;
+        Stopwatch solve;
         registration.solve(options, &summary);
+        iteration_statistics.solve_time = solve.elapsed();
+        iteration_statistics.weight_update_time = registration.weightUpdateTime();
+        iteration_statistics.num_solver_iterations = summary.num_successful_steps + summary.num_unsuccessful_steps;
+        iteration_statistics.num_active_associations = registration.numActiveAssociations();
         Eigen::Affine3d current_trans;
-        if (current_iteration_ > 0) {
+        if (!transformation_history_.empty()) {
             current_trans = registration.transformation() * transformation_history_.back();
         } else {
             current_trans = registration.transformation();
         }
         transformation_history_.push_back(current_trans);
-        output_stream_ << summary.FullReport() << "\n";
+        if (parameters_.solver_type == SolverType::CERES || geometry != NULL) {
+            output_stream_ << summary.FullReport() << "\n";
+        } else {
+            output_stream_ << "Procrustes EM: " << summary.message << " " << summary.num_successful_steps <<
+                           " iterations, cost " << summary.initial_cost << " -> " << summary.final_cost << "\n";
+        }
 
-        pcl::transformPointCloud (*source_cloud_, *source_cloud_, registration.transformation());
-        pcl::transformPointCloud (*filtered_source_cloud_, *filtered_source_cloud_,
-                                  registration.transformation());
+        // Only the filtered cloud takes part in the association, the full resolution one is kept in
+        // its original pose and the metrics below are computed through the accumulated transform.
+        Stopwatch transform;
+        pcl::transformPointCloud (*source_cloud, *source_cloud, registration.transformation());
+        iteration_statistics.transform_time = transform.elapsed();
+        iteration_statistics.peak_memory_kb = peakMemoryKb();
+        statistics_.iterations.push_back(iteration_statistics);
 
         if (ground_truth_) {
-            mse_ground_truth_ = prob_point_cloud_registration::calculateMSE(source_cloud_, ground_truth_cloud_);
+            mse_ground_truth_ = prob_point_cloud_registration::calculateMSE(source_cloud_, current_trans,
+                                                                            ground_truth_cloud_);
             output_stream_ << "MSE w.r.t. ground truth: " << mse_ground_truth_ << "\n";
         }
 
         cost_drop_ = (summary.initial_cost - summary.final_cost) / summary.initial_cost;
         if (parameters_.summary) {
-            mse_prev_it_ = prob_point_cloud_registration::calculateMSE(source_cloud_, prev_source_cloud_);
-            *prev_source_cloud_ = *source_cloud_;
+            Eigen::Affine3d prev_trans = Eigen::Affine3d::Identity();
+            if (transformation_history_.size() > 1) {
+                prev_trans = transformation_history_[transformation_history_.size() - 2];
+            }
+            mse_prev_it_ = prob_point_cloud_registration::calculateMSE(source_cloud_, current_trans, prev_trans);
             auto rpy = current_trans.rotation().eulerAngles(0, 1, 2);
             report_ << current_iteration_ << ", " << summary.num_successful_steps << ", " <<
                     summary.initial_cost << ", " << summary.final_cost << ", " << current_trans.translation().x() <<
                     ", " << current_trans.translation().y() << ", " << current_trans.translation().z() << ", " <<
                     pcl::rad2deg(rpy(0, 0)) << ", " << pcl::rad2deg(rpy(1, 0)) << ", " << pcl::rad2deg(rpy(2,
-                                                                                                           0)) << ", " << mse_prev_it_ << ", " << mse_ground_truth_ << std::endl;
+                                                                                                           0)) << ", " << mse_prev_it_ << ", " << mse_ground_truth_ << ", " << iteration_statistics.csv() <<
+                    std::endl;
         }
         current_iteration_++;
+        level_iteration_++;
     }
-    if (ground_truth_) {
-        mse_ground_truth_ = prob_point_cloud_registration::calculateMSE(source_cloud_, ground_truth_cloud_);
-        std::cout << "MSE w.r.t. ground truth: " << mse_ground_truth_ << std::endl;
+}
+
+void ProbPointCloudRegistration::alignLevel(pcl::PointCloud<pcl::PointXYZ>::Ptr source_cloud,
+                                            NeighbourSearch &target, double radius, const TargetGeometry *geometry)
+{
+    if (float_registration_) {
+        alignLevel(*float_registration_, source_cloud, target, radius, geometry);
+    } else {
+        alignLevel(*registration_, source_cloud, target, radius, geometry);
     }
 }
 
 bool ProbPointCloudRegistration::hasConverged()
 {
-    if (current_iteration_ == parameters_.n_iter) {
+    if (std::chrono::steady_clock::now() >= deadline_) {
+        output_stream_ << "Terminating because the time budget has been spent (" << current_iteration_ << " iter)\n";
+        timed_out_ = true;
+        return true;
+    }
+    if (level_iteration_ == parameters_.n_iter) {
         output_stream_ << "Terminating because maximum number of iterations has been reached ( " <<
-                       current_iteration_ << " iter)\n";
+                       level_iteration_ << " iter)\n";
         return true;
     }
     if (cost_drop_ < parameters_.cost_drop_thresh) {
@@ -1,3 +1,4 @@
+#include <cstdio>
 #include <limits>
 #include <memory>
 #include <vector>
@@ -14,6 +15,7 @@
 #include <pcl/point_types.h>
 #include <tclap/CmdLine.h>
 
+#include "prob_point_cloud_registration/point_cloud_io.hpp"
 #include "prob_point_cloud_registration/prob_point_cloud_registration.h"
 #include "prob_point_cloud_registration/utilities.hpp"
 
@@ -29,6 +31,7 @@ int main(int argc, char **argv)
     std::string source_file_name;
     std::string target_file_name;
     std::string ground_truth_file_name;
+    std::string preprocessed_target_file_name;
     ProbPointCloudRegistrationParams params;
     try {
         TCLAP::CmdLine cmd("Probabilistic point cloud registration", ' ', "1.0");
@@ -56,6 +59,31 @@ int main(int argc, char **argv)
                                                false, 5, "int", cmd);
         TCLAP::SwitchArg use_gaussian_arg("u", "use_gaussian",
                                           "Whether to use a gaussian instead the a t-distribution", cmd, false);
+        TCLAP::MultiArg<std::string> pyramid_arg("l", "pyramid_level",
+                                                 "A coarse level as source_filter_size,target_filter_size,radius, can be repeated", false,
+                                                 "string", cmd);
+        TCLAP::SwitchArg procrustes_arg("p", "procrustes",
+                                        "Whether to use closed-form weighted Procrustes steps instead of Ceres", cmd, false);
+        TCLAP::SwitchArg incremental_arg("a", "incremental_association",
+                                         "Whether to reuse the neighbours of the source points that barely moved", cmd, false);
+        TCLAP::SwitchArg voxel_hash_arg("x", "voxel_hash",
+                                        "Whether to index the target with a voxel hash instead of a KD-tree", cmd, false);
+        TCLAP::SwitchArg cuda_arg("", "cuda",
+                                  "Whether to associate, and with -p solve, on the GPU (builds with USE_CUDA)", cmd, false);
+        TCLAP::ValueArg<int> coarse_rotations_arg("", "coarse_rotations",
+                                                  "The rotations about z tried before the registration, 0 for none", false, 0,
+                                                  "int", cmd);
+        TCLAP::SwitchArg float_arg("", "float",
+                                   "Whether to compute the weights of the associations in single precision", cmd, false);
+        TCLAP::SwitchArg deterministic_arg("", "deterministic",
+                                           "Whether to sum in a fixed order, for the same result with any thread count",
+                                           cmd, false);
+        TCLAP::ValueArg<std::string> preprocessed_target_arg("", "target_file",
+                                                             "The filtered and indexed target, loaded when it was saved with the same settings, saved otherwise",
+                                                             false, "", "string", cmd);
+        TCLAP::ValueArg<std::string> residual_arg("e", "residual",
+                                                  "The residual: point (to point), plane or distribution", false, "point",
+                                                  "string", cmd);
         TCLAP::SwitchArg verbose_arg("v", "verbose",
                                      "Verbosity", cmd, false);
         TCLAP::ValueArg<std::string> ground_truth_arg("g", "ground_truth",
@@ -74,10 +102,43 @@ int main(int argc, char **argv)
         params.cost_drop_thresh = cost_drop_tresh_arg.getValue();
         params.n_cost_drop_it = num_drop_iter_arg.getValue();
         params.summary = dump_arg.getValue();
+        for (const std::string &level : pyramid_arg.getValue()) {
+            prob_point_cloud_registration::PyramidLevel pyramid_level;
+            if (std::sscanf(level.c_str(), "%lf,%lf,%lf", &pyramid_level.source_filter_size,
+                            &pyramid_level.target_filter_size, &pyramid_level.radius) != 3) {
+                std::cerr << "error: invalid pyramid level " << level << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            params.pyramid.push_back(pyramid_level);
+        }
+        if (procrustes_arg.getValue()) {
+            params.solver_type = prob_point_cloud_registration::SolverType::PROCRUSTES;
+        }
+        params.incremental_association = incremental_arg.getValue();
+        if (voxel_hash_arg.getValue()) {
+            params.neighbour_search = prob_point_cloud_registration::NeighbourSearchType::VOXEL_HASH;
+        }
+        if (cuda_arg.getValue()) {
+            params.neighbour_search = prob_point_cloud_registration::NeighbourSearchType::CUDA;
+        }
+        params.deterministic = deterministic_arg.getValue();
+        if (float_arg.getValue()) {
+            params.scalar_type = prob_point_cloud_registration::ScalarType::FLOAT;
+        }
+        params.coarse_alignment.num_rotations = coarse_rotations_arg.getValue();
+        if (residual_arg.getValue() == "plane") {
+            params.residual_type = prob_point_cloud_registration::ResidualType::POINT_TO_PLANE;
+        } else if (residual_arg.getValue() == "distribution") {
+            params.residual_type = prob_point_cloud_registration::ResidualType::POINT_TO_DISTRIBUTION;
+        } else if (residual_arg.getValue() != "point") {
+            std::cerr << "error: invalid residual " << residual_arg.getValue() << std::endl;
+            exit(EXIT_FAILURE);
+        }
         source_file_name = source_file_name_arg.getValue();
         target_file_name = target_file_name_arg.getValue();
         params.source_filter_size = source_filter_arg.getValue();
         params.target_filter_size = target_filter_arg.getValue();
+        preprocessed_target_file_name = preprocessed_target_arg.getValue();
 
         if (ground_truth_arg.isSet()) {
             ground_truth = true;
@@ -110,38 +171,63 @@ int main(int argc, char **argv)
     }
     pcl::PointCloud<PointType>::Ptr source_cloud =
         boost::make_shared<pcl::PointCloud<PointType>>();
-    if (pcl::io::loadPCDFile<PointType>(source_file_name, *source_cloud) == -1) {
+    if (!prob_point_cloud_registration::loadPointCloud(source_file_name, 0, *source_cloud)) {
         std::cout << "Could not load source cloud, closing" << std::endl;
         exit(EXIT_FAILURE);
     }
 
-    if (params.verbose) {
-        std::cout << "Loading target point cloud from " << target_file_name << std::endl;
+    ProbPointCloudRegistrationParams registration_params = params;
+    registration_params.target_filter_size = 0;
+    std::shared_ptr<prob_point_cloud_registration::NeighbourSearch> target;
+    if (!preprocessed_target_file_name.empty()) {
+        target = ProbPointCloudRegistration::loadTarget(preprocessed_target_file_name, target_file_name, params);
+        if (target && params.verbose) {
+            std::cout << "Loaded the preprocessed target from " << preprocessed_target_file_name << std::endl;
+        }
     }
     pcl::PointCloud<PointType>::Ptr target_cloud =
         boost::make_shared<pcl::PointCloud<PointType>>();
-    if (pcl::io::loadPCDFile<PointType>(target_file_name, *target_cloud) == -1) {
-        std::cout << "Could not load target cloud, closing" << std::endl;
-        exit(EXIT_FAILURE);
+    if (!target) {
+        if (params.verbose) {
+            std::cout << "Loading target point cloud from " << target_file_name << std::endl;
+        }
+        // Filtered while it is read, the full resolution target is never built
+        if (!prob_point_cloud_registration::loadPointCloud(target_file_name, params.target_filter_size,
+                                                           *target_cloud)) {
+            std::cout << "Could not load target cloud, closing" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        if (!preprocessed_target_file_name.empty()) {
+            target = ProbPointCloudRegistration::buildTarget(target_cloud, registration_params);
+            if (!ProbPointCloudRegistration::saveTarget(*target, target_file_name, params,
+                                                        preprocessed_target_file_name)) {
+                std::cout << "Could not save the preprocessed target to " << preprocessed_target_file_name << std::endl;
+            }
+        }
     }
 
     pcl::PointCloud<PointType>::Ptr source_ground_truth;
     if (ground_truth) {
         std::cout << "Loading ground truth point cloud from " << ground_truth_file_name << std::endl;
         source_ground_truth = boost::make_shared<pcl::PointCloud<PointType>>();
-        if (pcl::io::loadPCDFile<PointType>(ground_truth_file_name, *source_ground_truth) == -1) {
+        if (!prob_point_cloud_registration::loadPointCloud(ground_truth_file_name, 0, *source_ground_truth)) {
             std::cout << "Could not load ground truth" << std::endl;
             ground_truth = false;
         }
     }
 
     std::unique_ptr<ProbPointCloudRegistration> registration;
-    if (ground_truth) {
-        registration = std::make_unique<ProbPointCloudRegistration>(source_cloud, target_cloud, params,
+    if (ground_truth && target) {
+        registration = std::make_unique<ProbPointCloudRegistration>(source_cloud, target, registration_params,
+                                                                source_ground_truth);
+    } else if (ground_truth) {
+        registration = std::make_unique<ProbPointCloudRegistration>(source_cloud, target_cloud, registration_params,
                                                                 source_ground_truth);
+    } else if (target) {
+        registration = std::make_unique<ProbPointCloudRegistration>(source_cloud, target, registration_params);
     } else {
         registration = std::make_unique<ProbPointCloudRegistration>(source_cloud, target_cloud,
-                                                                params);
+                                                                registration_params);
     }
     if (params.verbose) {
         std::cout << "Registration\n";
@@ -180,6 +266,11 @@ int main(int argc, char **argv)
                     params.n_iter << " | Max neigh: " << params.max_neighbours << " | Cost_drop_thresh_: " <<
                     params.cost_drop_thresh << " | N_cost_drop_it: " << params.n_cost_drop_it << std::endl;
         report_file << registration->report();
+        std::string statistics_file_name = source_path.stem().string() + "_" + target_path.stem().string() +
+                                           "_statistics.json";
+        std::cout << "Saving registration statistics to: " << statistics_file_name << std::endl;
+        std::ofstream statistics_file(statistics_file_name);
+        statistics_file << registration->statistics().json() << std::endl;
     }
    if (ground_truth)
     {
@@ -0,0 +1,119 @@
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <limits>
+#include <string>
+
+#include <tclap/CmdLine.h>
+
+#include "prob_point_cloud_registration/prob_point_cloud_registration_params.hpp"
+#include "prob_point_cloud_registration/registration_service.h"
+
+using prob_point_cloud_registration::ProbPointCloudRegistrationParams;
+using prob_point_cloud_registration::RegistrationService;
+using prob_point_cloud_registration::RegistrationServiceOptions;
+
+int main(int argc, char **argv)
+{
+    ProbPointCloudRegistrationParams params;
+    RegistrationServiceOptions options;
+    int port = 0, cache_size = 0, concurrent_solves = 0;
+    std::string bind_address;
+    try {
+        TCLAP::CmdLine cmd("Probabilistic point cloud registration server", ' ', "1.0");
+        TCLAP::ValueArg<int> port_arg("", "port", "The TCP port to listen on", false, 5555, "int", cmd);
+        TCLAP::ValueArg<std::string> bind_arg("", "bind", "The address to listen on, 0.0.0.0 for all the interfaces",
+                                              false, "127.0.0.1", "string", cmd);
+        TCLAP::ValueArg<std::string> target_root_arg("", "target_root",
+                                                     "The directory of the target files the clients can register "
+                                                     "against", false, ".", "string", cmd);
+        TCLAP::MultiArg<double> filter_sizes_arg("", "filter_size",
+                                                 "A target filter size the clients can ask for, any if none is given",
+                                                 false, "double", cmd);
+        TCLAP::ValueArg<long long> max_source_points_arg("", "max_source_points",
+                                                         "The largest source cloud of a request", false, 10000000,
+                                                         "int", cmd);
+        TCLAP::ValueArg<int> cache_size_arg("", "cache_size", "The number of preprocessed targets kept in memory",
+                                            false, 4, "int", cmd);
+        TCLAP::ValueArg<int> concurrent_solves_arg("", "concurrent_solves",
+                                                   "The number of registrations solved at the same time", false, 2,
+                                                   "int", cmd);
+        TCLAP::ValueArg<int> num_threads_arg("j", "num_threads",
+                                             "The threads shared by the concurrent solves, 0 for all", false, 0,
+                                             "int", cmd);
+        TCLAP::ValueArg<float> source_filter_arg("s", "source_filter_size",
+                                                 "The leaf size of the voxel filter of the source cloud", false, 0, "float", cmd);
+        TCLAP::ValueArg<int> max_neighbours_arg("m", "max_neighbours",
+                                                "The max cardinality of the neighbours' set", false, 20, "int", cmd);
+        TCLAP::ValueArg<int> num_iter_arg("i", "num_iter",
+                                          "The maximum number of iterations to perform", false, 1000, "int", cmd);
+        TCLAP::ValueArg<float> dof_arg("d", "dof", "The Degree of freedom of t-distribution", false, 5,
+                                       "float", cmd);
+        TCLAP::ValueArg<float> radius_arg("r", "radius", "The radius of the neighborhood search", false, 3,
+                                          "float", cmd);
+        TCLAP::ValueArg<float> cost_drop_tresh_arg("c", "cost_drop_treshold",
+                                                   "If the cost_drop drops below this threshold for too many iterations, the algorithm terminate",
+                                                   false, 0.01, "float", cmd);
+        TCLAP::ValueArg<int> num_drop_iter_arg("n", "num_drop_iter",
+                                               "The maximum number of iterations during which the cost drop is allowed to be under cost_drop_thresh",
+                                               false, 5, "int", cmd);
+        TCLAP::SwitchArg use_gaussian_arg("u", "use_gaussian",
+                                          "Whether to use a gaussian instead the a t-distribution", cmd, false);
+        TCLAP::SwitchArg procrustes_arg("p", "procrustes",
+                                        "Whether to use closed-form weighted Procrustes steps instead of Ceres", cmd, false);
+        TCLAP::SwitchArg voxel_hash_arg("x", "voxel_hash",
+                                        "Whether to index the targets with a voxel hash instead of a KD-tree", cmd, false);
+        TCLAP::SwitchArg float_arg("", "float",
+                                   "Whether to compute the weights of the associations in single precision", cmd, false);
+        TCLAP::ValueArg<std::string> residual_arg("e", "residual",
+                                                  "The residual: point (to point), plane or distribution", false, "point",
+                                                  "string", cmd);
+        cmd.parse(argc, argv);
+
+        port = port_arg.getValue();
+        bind_address = bind_arg.getValue();
+        options.target_root = target_root_arg.getValue();
+        options.target_filter_sizes = filter_sizes_arg.getValue();
+        options.max_source_points = std::max(0LL, max_source_points_arg.getValue());
+        cache_size = cache_size_arg.getValue();
+        concurrent_solves = concurrent_solves_arg.getValue();
+        params.num_threads = num_threads_arg.getValue();
+        params.source_filter_size = source_filter_arg.getValue();
+        params.max_neighbours = max_neighbours_arg.getValue();
+        params.n_iter = num_iter_arg.getValue();
+        params.dof = use_gaussian_arg.getValue() ? std::numeric_limits<double>::infinity() : dof_arg.getValue();
+        params.radius = radius_arg.getValue();
+        params.cost_drop_thresh = cost_drop_tresh_arg.getValue();
+        params.n_cost_drop_it = num_drop_iter_arg.getValue();
+        if (procrustes_arg.getValue()) {
+            params.solver_type = prob_point_cloud_registration::SolverType::PROCRUSTES;
+        }
+        if (voxel_hash_arg.getValue()) {
+            params.neighbour_search = prob_point_cloud_registration::NeighbourSearchType::VOXEL_HASH;
+        }
+        if (float_arg.getValue()) {
+            params.scalar_type = prob_point_cloud_registration::ScalarType::FLOAT;
+        }
+        if (residual_arg.getValue() == "plane") {
+            params.residual_type = prob_point_cloud_registration::ResidualType::POINT_TO_PLANE;
+        } else if (residual_arg.getValue() == "distribution") {
+            params.residual_type = prob_point_cloud_registration::ResidualType::POINT_TO_DISTRIBUTION;
+        } else if (residual_arg.getValue() != "point") {
+            std::cerr << "error: invalid residual " << residual_arg.getValue() << std::endl;
+            exit(EXIT_FAILURE);
+        }
+    } catch (TCLAP::ArgException &e) {
+        std::cerr << "error: " << e.error() << " for arg " << e.argId() << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    RegistrationService service(params, cache_size, concurrent_solves, options);
+    std::cout << "Listening on " << bind_address << " port " << port << std::endl;
+    try {
+        service.listen(port, bind_address);
+    } catch (const std::exception &e) {
+        std::cerr << "error: " << e.what() << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    return 0;
+}
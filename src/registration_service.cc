@@ -0,0 +1,208 @@
+#include <limits.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <cmath>
+#include <exception>
+#include <future>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/make_shared.hpp>
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+
+#include "prob_point_cloud_registration/prob_point_cloud_registration.h"
+#include "prob_point_cloud_registration/registration_service.h"
+
+namespace prob_point_cloud_registration {
+
+namespace {
+
+// The source points are read by chunks of this many points
+const std::size_t kChunkPoints = 4096;
+
+// parameters, with an executor of num_threads / max_concurrent_solves threads if it has none
+ProbPointCloudRegistrationParams solveParameters(ProbPointCloudRegistrationParams parameters,
+                                                 int max_concurrent_solves)
+{
+    if (!parameters.executor) {
+        int num_threads = parameters.num_threads;
+        if (num_threads <= 0) {
+            num_threads = std::max(1u, std::thread::hardware_concurrency());
+        }
+        // Stateless, shared by the concurrent registrations
+        parameters.executor = std::make_shared<OpenMPExecutor>(std::max(1, num_threads / max_concurrent_solves));
+    }
+    return parameters;
+}
+
+// num_points comes from the client: the cloud grows with what is actually received
+bool readPoints(std::istream &in, std::size_t num_points, pcl::PointCloud<pcl::PointXYZ> &cloud)
+{
+    std::vector<float> chunk;
+    for (std::size_t begin = 0; begin < num_points; begin += kChunkPoints) {
+        const std::size_t size = std::min(kChunkPoints, num_points - begin);
+        chunk.resize(3 * size);
+        if (!in.read(reinterpret_cast<char *>(chunk.data()), chunk.size() * sizeof(float))) {
+            return false;
+        }
+        for (std::size_t i = 0; i < size; i++) {
+            cloud.push_back(pcl::PointXYZ(chunk[3 * i], chunk[3 * i + 1], chunk[3 * i + 2]));
+        }
+    }
+    return true;
+}
+
+bool allowedFilterSize(double target_filter_size, const std::vector<double> &target_filter_sizes)
+{
+    if (!std::isfinite(target_filter_size) || target_filter_size < 0) {
+        return false;
+    }
+    return target_filter_sizes.empty() || std::find(target_filter_sizes.begin(), target_filter_sizes.end(),
+                                                    target_filter_size) != target_filter_sizes.end();
+}
+
+// Empty when the directory does not exist
+std::string canonicalPath(const std::string &file_name)
+{
+    char path[PATH_MAX];
+    return realpath(file_name.c_str(), path) == NULL ? std::string() : std::string(path);
+}
+
+}  // namespace
+
+RegistrationService::RegistrationService(ProbPointCloudRegistrationParams parameters, std::size_t cache_capacity,
+                                         int max_concurrent_solves, RegistrationServiceOptions options):
+    parameters_(solveParameters(parameters, std::max(1, max_concurrent_solves))), options_(options),
+    target_root_(canonicalPath(options.target_root)), cache_(cache_capacity, parameters),
+    free_solves_(std::max(1, max_concurrent_solves)) {}
+
+void RegistrationService::serve(std::istream &in, std::ostream &out)
+{
+    while (serveRequest(in, out)) {
+    }
+}
+
+void RegistrationService::listen(unsigned short port, const std::string &address)
+{
+    boost::asio::io_context io_context;
+    boost::asio::ip::tcp::acceptor acceptor(io_context, boost::asio::ip::tcp::endpoint(
+                                                boost::asio::ip::make_address(address), port));
+    for (;;) {
+        auto stream = std::make_shared<boost::asio::ip::tcp::iostream>();
+        acceptor.accept(*stream->rdbuf());
+        std::thread([this, stream]() {
+            // A failing connection is closed, the others are still served
+            try {
+                serve(*stream, *stream);
+            } catch (const std::exception &e) {
+                *stream << "error " << e.what() << std::endl;
+            }
+        }).detach();
+    }
+}
+
+bool RegistrationService::serveRequest(std::istream &in, std::ostream &out)
+{
+    std::string line;
+    if (!std::getline(in, line)) {
+        return false;
+    }
+    std::istringstream request(line);
+    std::string command, target_name;
+    double target_filter_size = 0;
+    long long num_points = 0;
+    if (!(request >> command >> target_name >> target_filter_size >> num_points) || command != "register" ||
+            num_points < 0) {
+        // The size of what follows is unknown
+        out << "error malformed request: " << line << std::endl;
+        return false;
+    }
+    if (static_cast<unsigned long long>(num_points) > options_.max_source_points) {
+        // Not worth reading through
+        out << "error too many source points: " << num_points << std::endl;
+        return false;
+    }
+    // The target is looked up, and loaded on a miss, while the source is streamed in
+    const std::string target_file_name = targetFile(target_name);
+    const bool allowed = !target_file_name.empty() &&
+                         allowedFilterSize(target_filter_size, options_.target_filter_sizes);
+    std::future<std::shared_ptr<NeighbourSearch>> target;
+    if (allowed) {
+        target = std::async(std::launch::async, [&]() {
+            return cache_.get(target_file_name, target_filter_size);
+        });
+    }
+    auto source_cloud = boost::make_shared<pcl::PointCloud<pcl::PointXYZ>>();
+    if (!readPoints(in, num_points, *source_cloud)) {
+        out << "error truncated source cloud" << std::endl;
+        return false;
+    }
+    if (!allowed) {
+        out << "error unknown or forbidden target: " << target_name << " " << target_filter_size << std::endl;
+        return true;
+    }
+    std::shared_ptr<NeighbourSearch> target_search;
+    try {
+        target_search = target.get();
+    } catch (const std::exception &e) {
+        out << "error " << e.what() << std::endl;
+        return true;
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(solve_mutex_);
+        solve_released_.wait(lock, [this]() {
+            return free_solves_ > 0;
+        });
+        free_solves_--;
+    }
+    std::ostringstream response;
+    try {
+        ProbPointCloudRegistration registration(source_cloud, target_search, parameters_);
+        registration.align();
+        const Eigen::Matrix<double, 3, 4> transformation = registration.transformation().matrix().topRows<3>();
+        response.precision(17);
+        response << "ok " << registration.statistics().iterations.size();
+        for (int row = 0; row < 3; row++) {
+            for (int col = 0; col < 4; col++) {
+                response << " " << transformation(row, col);
+            }
+        }
+    } catch (const std::exception &e) {
+        response.str("");
+        response << "error " << e.what();
+    }
+    {
+        std::lock_guard<std::mutex> lock(solve_mutex_);
+        free_solves_++;
+    }
+    solve_released_.notify_one();
+    out << response.str() << std::endl;
+    return true;
+}
+
+std::string RegistrationService::targetFile(const std::string &target_name) const
+{
+    if (target_root_.empty() || target_name.empty() || target_name[0] == '/') {
+        return std::string();
+    }
+    std::istringstream components(target_name);
+    std::string component;
+    while (std::getline(components, component, '/')) {
+        if (component == "..") {
+            return std::string();
+        }
+    }
+    // A symbolic link under the root may still lead out of it
+    const std::string file_name = canonicalPath(target_root_ + "/" + target_name);
+    const std::string prefix = target_root_ == "/" ? target_root_ : target_root_ + "/";
+    return file_name.compare(0, prefix.size(), prefix) == 0 ? file_name : std::string();
+}
+
+}  // namespace prob_point_cloud_registration
@@ -0,0 +1,96 @@
+#include <algorithm>
+#include <exception>
+#include <future>
+#include <stdexcept>
+
+#include <boost/make_shared.hpp>
+
+#include "prob_point_cloud_registration/point_cloud_io.hpp"
+#include "prob_point_cloud_registration/prob_point_cloud_registration.h"
+#include "prob_point_cloud_registration/target_cache.h"
+
+namespace prob_point_cloud_registration {
+
+TargetCache::TargetCache(std::size_t capacity, ProbPointCloudRegistrationParams parameters):
+    capacity_(std::max<std::size_t>(1, capacity)), parameters_(withDefaultExecutor(parameters)) {}
+
+std::shared_ptr<NeighbourSearch> TargetCache::get(const std::string &file_name, double target_filter_size)
+{
+    const Key key(file_name, target_filter_size);
+    std::promise<std::shared_ptr<NeighbourSearch>> promise;
+    std::shared_future<std::shared_ptr<NeighbourSearch>> target;
+    bool loading = false;
+    std::size_t generation = 0;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = entries_.find(key);
+        if (it != entries_.end()) {
+            hits_++;
+            lru_.splice(lru_.begin(), lru_, it->second.use);
+            target = it->second.target;
+        } else {
+            misses_++;
+            loading = true;
+            target = promise.get_future().share();
+            generation = ++generations_;
+            lru_.push_front(key);
+            entries_[key] = Entry{target, lru_.begin(), generation};
+            while (entries_.size() > capacity_) {
+                entries_.erase(lru_.back());
+                lru_.pop_back();
+            }
+        }
+    }
+    if (loading) {
+        try {
+            promise.set_value(load(file_name, target_filter_size));
+        } catch (...) {
+            promise.set_exception(std::current_exception());
+            // The next request retries, unless the entry has already been evicted and loaded again
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto it = entries_.find(key);
+            if (it != entries_.end() && it->second.generation == generation) {
+                lru_.erase(it->second.use);
+                entries_.erase(it);
+            }
+        }
+    }
+    return target.get();
+}
+
+std::size_t TargetCache::size() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return entries_.size();
+}
+
+std::size_t TargetCache::hits() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return hits_;
+}
+
+std::size_t TargetCache::misses() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return misses_;
+}
+
+std::shared_ptr<NeighbourSearch> TargetCache::load(const std::string &file_name, double target_filter_size) const
+{
+    auto cloud = boost::make_shared<pcl::PointCloud<pcl::PointXYZ>>();
+    // Filtered while it is read, the full resolution target is never built
+    if (!loadPointCloud(file_name, target_filter_size, *cloud)) {
+        throw std::runtime_error("Could not load the target cloud " + file_name);
+    }
+    ProbPointCloudRegistrationParams parameters = parameters_;
+    parameters.target_filter_size = 0;
+    std::shared_ptr<NeighbourSearch> target = ProbPointCloudRegistration::buildTarget(cloud, parameters);
+    if (parameters_.residual_type != ResidualType::POINT_TO_POINT) {
+        target->geometry(parameters_.residual_type, parameters_.radius, parameters_.geometry_neighbours,
+                         *parameters_.executor);
+    }
+    return target;
+}
+
+}  // namespace prob_point_cloud_registration
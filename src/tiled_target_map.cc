@@ -0,0 +1,259 @@
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <fstream>
+#include <limits>
+#include <map>
+#include <stdexcept>
+#include <utility>
+
+#include <boost/make_shared.hpp>
+
+#include "prob_point_cloud_registration/point_cloud_io.hpp"
+#include "prob_point_cloud_registration/tiled_target_map.h"
+
+namespace prob_point_cloud_registration {
+
+namespace {
+
+std::string tileFileName(const std::string &directory, const internal::GridKey &key)
+{
+    return directory + "/" + std::to_string(key[0]) + "_" + std::to_string(key[1]) + "_" +
+           std::to_string(key[2]) + ".xyz32";
+}
+
+internal::GridKey tileKey(const Eigen::Vector3f &point, double tile_size)
+{
+    internal::GridKey key;
+    for (int d = 0; d < 3; d++) {
+        key[d] = static_cast<int>(std::floor(point[d] / tile_size));
+    }
+    return key;
+}
+
+}  // namespace
+
+bool writeTargetTiles(const pcl::PointCloud<pcl::PointXYZ> &cloud, double tile_size, const std::string &directory)
+{
+    if (mkdir(directory.c_str(), 0755) != 0 && errno != EEXIST) {
+        return false;
+    }
+    std::map<internal::GridKey, std::vector<float>> tiles;
+    for (const pcl::PointXYZ &point : cloud) {
+        if (!std::isfinite(point.x) || !std::isfinite(point.y) || !std::isfinite(point.z)) {
+            continue;
+        }
+        std::vector<float> &coordinates = tiles[tileKey(point.getVector3fMap(), tile_size)];
+        coordinates.push_back(point.x);
+        coordinates.push_back(point.y);
+        coordinates.push_back(point.z);
+    }
+    std::ofstream index(directory + "/tiles.txt");
+    index.precision(17);
+    index << tile_size << "\n";
+    for (const auto &tile : tiles) {
+        std::ofstream file(tileFileName(directory, tile.first), std::ios::binary);
+        file.write(reinterpret_cast<const char *>(tile.second.data()), tile.second.size() * sizeof(float));
+        if (!file) {
+            return false;
+        }
+        index << tile.first[0] << " " << tile.first[1] << " " << tile.first[2] << " " << tile.second.size() / 3 <<
+              "\n";
+    }
+    return static_cast<bool>(index);
+}
+
+TiledTargetMap::TiledTargetMap(const std::string &directory, int max_resident_tiles):
+    directory_(directory), tile_size_(0), max_resident_tiles_(max_resident_tiles), num_points_(0), num_prepares_(0),
+    num_tile_loads_(0)
+{
+    std::ifstream index(directory + "/tiles.txt");
+    if (!(index >> tile_size_) || tile_size_ <= 0) {
+        throw std::runtime_error("Can not read the tile index of " + directory);
+    }
+    TileInfo info;
+    while (index >> info.key[0] >> info.key[1] >> info.key[2] >> info.num_points) {
+        info.offset = num_points_;
+        num_points_ += info.num_points;
+        tile_numbers_[info.key] = tiles_.size();
+        tiles_.push_back(info);
+    }
+    resident_.resize(tiles_.size());
+    last_needed_.assign(tiles_.size(), -1);
+    loaded_.resize(tiles_.size());
+}
+
+TiledTargetMap::Key TiledTargetMap::key(const Eigen::Vector3f &point) const
+{
+    return tileKey(point, tile_size_);
+}
+
+std::shared_ptr<const TiledTargetMap::Tile> TiledTargetMap::load(int tile) const
+{
+    auto loaded = std::make_shared<Tile>();
+    loaded->cloud = boost::make_shared<pcl::PointCloud<pcl::PointXYZ>>();
+    if (!loadPointCloud(tileFileName(directory_, tiles_[tile].key), 0, *loaded->cloud) ||
+        static_cast<int>(loaded->cloud->size()) != tiles_[tile].num_points) {
+        throw std::runtime_error("Can not read the tile " + tileFileName(directory_, tiles_[tile].key));
+    }
+    loaded->kdtree.setInputCloud(loaded->cloud);
+    num_tile_loads_++;
+    return loaded;
+}
+
+const TiledTargetMap::Tile &TiledTargetMap::tile(int tile) const
+{
+    if (resident_[tile]) {
+        return *resident_[tile];
+    }
+    std::lock_guard<std::mutex> lock(loaded_mutex_);
+    if (!loaded_[tile]) {
+        loaded_[tile] = load(tile);
+    }
+    return *loaded_[tile];
+}
+
+int TiledTargetMap::radiusSearch(const pcl::PointXYZ &point, double radius, int max_neighbours,
+                                 std::vector<int> &indices, std::vector<float> &squared_distances) const
+{
+    indices.clear();
+    squared_distances.clear();
+    const Key min_key = key((point.getVector3fMap().array() - static_cast<float>(radius)).matrix());
+    const Key max_key = key((point.getVector3fMap().array() + static_cast<float>(radius)).matrix());
+    std::vector<int> tile_indices;
+    std::vector<float> tile_distances;
+    int num_tiles = 0;
+    Key current;
+    for (current[0] = min_key[0]; current[0] <= max_key[0]; current[0]++) {
+        for (current[1] = min_key[1]; current[1] <= max_key[1]; current[1]++) {
+            for (current[2] = min_key[2]; current[2] <= max_key[2]; current[2]++) {
+                const auto tile_number = tile_numbers_.find(current);
+                if (tile_number == tile_numbers_.end()) {
+                    continue;
+                }
+                const int offset = tiles_[tile_number->second].offset;
+                tile(tile_number->second).kdtree.radiusSearch(point, radius, tile_indices, tile_distances,
+                                                              max_neighbours);
+                for (std::size_t k = 0; k < tile_indices.size(); k++) {
+                    indices.push_back(offset + tile_indices[k]);
+                    squared_distances.push_back(tile_distances[k]);
+                }
+                num_tiles += !tile_indices.empty();
+            }
+        }
+    }
+    if (num_tiles > 1) {
+        // Every tile returned its sorted closest points, merge them
+        std::vector<std::pair<float, int>> neighbours(indices.size());
+        for (std::size_t k = 0; k < indices.size(); k++) {
+            neighbours[k] = std::make_pair(squared_distances[k], indices[k]);
+        }
+        std::sort(neighbours.begin(), neighbours.end());
+        if (max_neighbours > 0 && static_cast<int>(neighbours.size()) > max_neighbours) {
+            neighbours.resize(max_neighbours);
+        }
+        indices.resize(neighbours.size());
+        squared_distances.resize(neighbours.size());
+        for (std::size_t k = 0; k < neighbours.size(); k++) {
+            squared_distances[k] = neighbours[k].first;
+            indices[k] = neighbours[k].second;
+        }
+    }
+    return indices.size();
+}
+
+bool TiledTargetMap::nearestSearch(const pcl::PointXYZ &point, int &index, float &squared_distance) const
+{
+    std::vector<std::pair<float, int>> tiles(tiles_.size());
+    for (std::size_t t = 0; t < tiles_.size(); t++) {
+        const Eigen::Vector3f tile_min = Eigen::Vector3f(tiles_[t].key[0], tiles_[t].key[1], tiles_[t].key[2]) *
+                                         static_cast<float>(tile_size_);
+        const Eigen::AlignedBox3f box(tile_min, tile_min + Eigen::Vector3f::Constant(tile_size_));
+        tiles[t] = std::make_pair(box.squaredExteriorDistance(point.getVector3fMap()), static_cast<int>(t));
+    }
+    std::sort(tiles.begin(), tiles.end());
+    index = -1;
+    squared_distance = std::numeric_limits<float>::max();
+    std::vector<int> neighbours(1);
+    std::vector<float> distances(1);
+    for (const auto &candidate : tiles) {
+        if (index >= 0 && candidate.first > squared_distance) {
+            break;
+        }
+        if (tile(candidate.second).kdtree.nearestKSearch(point, 1, neighbours, distances) > 0 &&
+            distances[0] < squared_distance) {
+            squared_distance = distances[0];
+            index = tiles_[candidate.second].offset + neighbours[0];
+        }
+    }
+    return index >= 0;
+}
+
+pcl::PointXYZ TiledTargetMap::point(int index) const
+{
+    // The last tile starting at or before index
+    const auto info = std::upper_bound(tiles_.begin(), tiles_.end(), index, [](int i, const TileInfo & tile) {
+        return i < tile.offset;
+    }) - 1;
+    return (*tile(info - tiles_.begin()).cloud)[index - info->offset];
+}
+
+void TiledTargetMap::prepare(const Eigen::AlignedBox3f &query_box, double radius)
+{
+    num_prepares_++;
+    for (std::size_t t = 0; t < tiles_.size(); t++) {
+        if (loaded_[t]) {
+            resident_[t] = std::move(loaded_[t]);
+            loaded_[t].reset();
+            last_needed_[t] = num_prepares_;
+        }
+    }
+    if (query_box.isEmpty()) {
+        return;
+    }
+    const Key min_key = key((query_box.min().array() - static_cast<float>(radius)).matrix());
+    const Key max_key = key((query_box.max().array() + static_cast<float>(radius)).matrix());
+    int num_resident = 0;
+    for (std::size_t t = 0; t < tiles_.size(); t++) {
+        const Key &tile_key = tiles_[t].key;
+        bool needed = true;
+        for (int d = 0; d < 3; d++) {
+            needed = needed && tile_key[d] >= min_key[d] && tile_key[d] <= max_key[d];
+        }
+        if (needed) {
+            if (!resident_[t]) {
+                resident_[t] = load(t);
+            }
+            last_needed_[t] = num_prepares_;
+        }
+        num_resident += static_cast<bool>(resident_[t]);
+    }
+    if (num_resident <= max_resident_tiles_) {
+        return;
+    }
+    // Least recently needed first, the tiles needed now are kept even beyond the bound
+    std::vector<std::pair<long, int>> candidates;
+    for (std::size_t t = 0; t < tiles_.size(); t++) {
+        if (resident_[t] && last_needed_[t] != num_prepares_) {
+            candidates.push_back(std::make_pair(last_needed_[t], static_cast<int>(t)));
+        }
+    }
+    std::sort(candidates.begin(), candidates.end());
+    for (std::size_t c = 0; c < candidates.size() && num_resident > max_resident_tiles_; c++, num_resident--) {
+        resident_[candidates[c].second].reset();
+    }
+}
+
+int TiledTargetMap::numResidentTiles() const
+{
+    int num_resident = 0;
+    std::lock_guard<std::mutex> lock(loaded_mutex_);
+    for (std::size_t t = 0; t < tiles_.size(); t++) {
+        num_resident += resident_[t] || loaded_[t];
+    }
+    return num_resident;
+}
+
+}  // namespace prob_point_cloud_registration
@@ -0,0 +1,120 @@
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <boost/make_shared.hpp>
+#include <Eigen/Geometry>
+#include <gtest/gtest.h>
+#include <pcl/common/transforms.h>
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+#include "prob_point_cloud_registration/batch_registration.h"
+#include "prob_point_cloud_registration/prob_point_cloud_registration.h"
+#include "test_clouds.hpp"
+
+using prob_point_cloud_registration::BatchRegistration;
+using prob_point_cloud_registration::BatchRegistrationResult;
+using prob_point_cloud_registration::Executor;
+using prob_point_cloud_registration::ProbPointCloudRegistration;
+using prob_point_cloud_registration::ProbPointCloudRegistrationParams;
+using prob_point_cloud_registration::SolverType;
+using prob_point_cloud_registration::test::generateSurface;
+using prob_point_cloud_registration::test::testParams;
+
+namespace {
+
+Eigen::Affine3d pose(double x, double y, double yaw)
+{
+    Eigen::Affine3d transform = Eigen::Affine3d::Identity();
+    transform.translation() << x, y, 0;
+    transform.rotate(Eigen::AngleAxisd(yaw, Eigen::Vector3d::UnitZ()));
+    return transform;
+}
+
+// Runs everything on the calling thread, counting the parallel sections
+class CountingExecutor : public Executor
+{
+public:
+    CountingExecutor(): num_calls(0) {}
+
+    int numThreads() const override
+    {
+        return 3;
+    }
+
+    void parallelFor(int num_tasks, const std::function<void(int)> &task) override
+    {
+        num_calls++;
+        for (int i = 0; i < num_tasks; i++) {
+            task(i);
+        }
+    }
+
+    std::atomic<int> num_calls;
+};
+
+}  // namespace
+
+TEST(BatchRegistrationTestSuite, matchesSingleRegistrationsTest)
+{
+    auto target_cloud = generateSurface(30, 30, 0.2);
+    const std::vector<Eigen::Affine3d> ground_truths = {pose(0.1, -0.05, 0.02), pose(-0.08, 0.1, -0.03),
+                                                        pose(1.5, 0.5, 0.3)
+                                                       };
+    std::vector<pcl::PointCloud<pcl::PointXYZ>::Ptr> source_clouds;
+    for (const Eigen::Affine3d &ground_truth : ground_truths) {
+        auto source_cloud = boost::make_shared<pcl::PointCloud<pcl::PointXYZ>>();
+        pcl::transformPointCloud(*target_cloud, *source_cloud, ground_truth.inverse());
+        source_clouds.push_back(source_cloud);
+    }
+    const std::vector<Eigen::Affine3d> initial_guesses = {Eigen::Affine3d::Identity(), Eigen::Affine3d::Identity(),
+                                                          pose(1.45, 0.45, 0.28)
+                                                         };
+
+    ProbPointCloudRegistrationParams params = testParams();
+    params.n_iter = 15;
+    params.solver_type = SolverType::CERES;
+    params.num_threads = 2;
+    BatchRegistration batch(target_cloud, params);
+    const std::vector<BatchRegistrationResult> results = batch.align(source_clouds, initial_guesses);
+    ASSERT_EQ(ground_truths.size(), results.size());
+    for (std::size_t i = 0; i < results.size(); i++) {
+        auto source_cloud = boost::make_shared<pcl::PointCloud<pcl::PointXYZ>>();
+        pcl::transformPointCloud(*source_clouds[i], *source_cloud, initial_guesses[i]);
+        ProbPointCloudRegistration registration(source_cloud, boost::make_shared<pcl::PointCloud<pcl::PointXYZ>>
+                                                (*target_cloud), params);
+        registration.align();
+        const Eigen::Affine3d expected = registration.transformation() * initial_guesses[i];
+        EXPECT_TRUE(results[i].transformation.isApprox(expected, 1e-9)) << "scan " << i;
+        EXPECT_EQ(registration.statistics().iterations.size(), results[i].statistics.iterations.size());
+        // Every scan ends closer to its ground truth than it started
+        const Eigen::Vector3d initial_error = initial_guesses[i].translation() - ground_truths[i].translation();
+        const Eigen::Vector3d final_error = results[i].transformation.translation() - ground_truths[i].translation();
+        EXPECT_LT(final_error.norm(), initial_error.norm()) << "scan " << i;
+    }
+}
+
+TEST(BatchRegistrationTestSuite, customExecutorTest)
+{
+    auto target_cloud = generateSurface(30, 30, 0.2);
+    std::vector<pcl::PointCloud<pcl::PointXYZ>::Ptr> source_clouds;
+    const std::vector<Eigen::Affine3d> ground_truths = {pose(0.1, -0.05, 0.02), pose(-0.08, 0.1, -0.03)};
+    for (const Eigen::Affine3d &ground_truth : ground_truths) {
+        auto source_cloud = boost::make_shared<pcl::PointCloud<pcl::PointXYZ>>();
+        pcl::transformPointCloud(*target_cloud, *source_cloud, ground_truth.inverse());
+        source_clouds.push_back(source_cloud);
+    }
+    ProbPointCloudRegistrationParams params = testParams();
+    params.n_iter = 5;
+    params.solver_type = SolverType::CERES;
+    const std::vector<BatchRegistrationResult> expected = BatchRegistration(target_cloud, params).align(source_clouds);
+
+    auto executor = std::make_shared<CountingExecutor>();
+    params.executor = executor;
+    const std::vector<BatchRegistrationResult> results = BatchRegistration(target_cloud, params).align(source_clouds);
+    ASSERT_EQ(expected.size(), results.size());
+    for (std::size_t i = 0; i < results.size(); i++) {
+        EXPECT_TRUE(results[i].transformation.isApprox(expected[i].transformation, 1e-9)) << "scan " << i;
+    }
+    // The scans plus, in every outer iteration, at least the association
+    EXPECT_GT(executor->num_calls, 1 + 2 * params.n_iter);
+}
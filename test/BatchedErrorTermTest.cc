@@ -0,0 +1,286 @@
+#include <cmath>
+#include <vector>
+#include <boost/make_shared.hpp>
+#include <ceres/ceres.h>
+#include <Eigen/Sparse>
+#include <gtest/gtest.h>
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+#include "prob_point_cloud_registration/batched_error_term.hpp"
+#include "prob_point_cloud_registration/error_term.hpp"
+#include "prob_point_cloud_registration/executor.hpp"
+#include "prob_point_cloud_registration/neighbour_search.hpp"
+
+using prob_point_cloud_registration::BatchedErrorTerm;
+using prob_point_cloud_registration::ErrorTerm;
+using prob_point_cloud_registration::KdTreeSearch;
+using prob_point_cloud_registration::ResidualType;
+using prob_point_cloud_registration::TargetGeometry;
+
+TEST(BatchedErrorTermTestSuite, matchesAutoDiffErrorTermTest)
+{
+    pcl::PointCloud<pcl::PointXYZ> source_cloud;
+    pcl::PointCloud<pcl::PointXYZ> target_cloud;
+    for (int i = 0; i < 4; i++) {
+        source_cloud.push_back(pcl::PointXYZ(0.3 * i, 1 - 0.2 * i, 0.5 + 0.1 * i * i));
+        target_cloud.push_back(pcl::PointXYZ(1 + 0.1 * i, -0.4 * i, 0.2 * i));
+    }
+    Eigen::SparseMatrix<double, Eigen::RowMajor> data_association(4, 4);
+    std::vector<Eigen::Triplet<double>> tripletList;
+    tripletList.push_back(Eigen::Triplet<double>(0, 0, 1));
+    tripletList.push_back(Eigen::Triplet<double>(0, 2, 1));
+    tripletList.push_back(Eigen::Triplet<double>(1, 1, 1));
+    tripletList.push_back(Eigen::Triplet<double>(2, 3, 1));
+    tripletList.push_back(Eigen::Triplet<double>(3, 0, 1));
+    tripletList.push_back(Eigen::Triplet<double>(3, 3, 1));
+    data_association.setFromTriplets(tripletList.begin(), tripletList.end());
+    data_association.makeCompressed();
+
+    BatchedErrorTerm batched_term(source_cloud, target_cloud, data_association);
+    ASSERT_EQ(batched_term.size(), 6);
+    for (int k = 0; k < batched_term.size(); k++) {
+        batched_term.weights()[k] = 0.5 + 0.25 * k;
+    }
+
+    // Non unit quaternion, the rotation is normalized inside both cost functions
+    double rotation[4] = {0.9, 0.1, -0.3, 0.2};
+    double translation[3] = {0.5, -1, 0.25};
+    const double *parameters[2] = {rotation, translation};
+    std::vector<double> residuals(batched_term.num_residuals());
+    std::vector<double> rotation_jacobian(batched_term.num_residuals() * 4);
+    std::vector<double> translation_jacobian(batched_term.num_residuals() * 3);
+    double *jacobians[2] = {rotation_jacobian.data(), translation_jacobian.data()};
+    ASSERT_TRUE(batched_term.Evaluate(parameters, residuals.data(), jacobians));
+    std::vector<double> squared_errors;
+    batched_term.squaredErrors(rotation, translation, &squared_errors);
+
+    int k = 0;
+    for (int i = 0; i < data_association.outerSize(); i++) {
+        for (Eigen::SparseMatrix<double, Eigen::RowMajor>::InnerIterator it(data_association, i); it; ++it) {
+            ceres::AutoDiffCostFunction<ErrorTerm, ErrorTerm::kResiduals, 4, 3> error_term(
+                new ErrorTerm(source_cloud[it.row()], target_cloud[it.col()]));
+            double expected_residuals[3];
+            double expected_rotation_jacobian[12];
+            double expected_translation_jacobian[9];
+            double *expected_jacobians[2] = {expected_rotation_jacobian, expected_translation_jacobian};
+            error_term.Evaluate(parameters, expected_residuals, expected_jacobians);
+            const double scale = std::sqrt(batched_term.weights()[k]);
+            double expected_squared_error = 0;
+            for (int r = 0; r < 3; r++) {
+                expected_squared_error += expected_residuals[r] * expected_residuals[r];
+                EXPECT_NEAR(scale * expected_residuals[r], residuals[3 * k + r], 1e-9);
+                for (int c = 0; c < 4; c++) {
+                    EXPECT_NEAR(scale * expected_rotation_jacobian[4 * r + c], rotation_jacobian[12 * k + 4 * r + c],
+                                1e-6);
+                }
+                for (int c = 0; c < 3; c++) {
+                    EXPECT_NEAR(scale * expected_translation_jacobian[3 * r + c],
+                                translation_jacobian[9 * k + 3 * r + c], 1e-9);
+                }
+            }
+            EXPECT_NEAR(expected_squared_error, squared_errors[k], 1e-9);
+            k++;
+        }
+    }
+}
+
+TEST(BatchedErrorTermTestSuite, geometryResidualsTest)
+{
+    pcl::PointCloud<pcl::PointXYZ> source_cloud;
+    auto target_cloud = boost::make_shared<pcl::PointCloud<pcl::PointXYZ>>();
+    for (int i = 0; i < 5; i++) {
+        for (int j = 0; j < 5; j++) {
+            target_cloud->push_back(pcl::PointXYZ(0.1 * i, 0.1 * j, 0.05 * i * j + 0.02 * i * i));
+        }
+        source_cloud.push_back(pcl::PointXYZ(0.1 * i + 0.03, 0.2 - 0.02 * i, 0.1));
+    }
+    Eigen::SparseMatrix<double, Eigen::RowMajor> data_association(5, target_cloud->size());
+    std::vector<Eigen::Triplet<double>> tripletList;
+    for (int i = 0; i < 5; i++) {
+        tripletList.push_back(Eigen::Triplet<double>(i, 6 * i, 1));
+        tripletList.push_back(Eigen::Triplet<double>(i, (7 * i + 3) % 25, 1));
+    }
+    data_association.setFromTriplets(tripletList.begin(), tripletList.end());
+    data_association.makeCompressed();
+    const KdTreeSearch target(target_cloud);
+
+    double rotation[4] = {0.9, 0.1, -0.3, 0.2};
+    double translation[3] = {0.5, -1, 0.25};
+    const double *parameters[2] = {rotation, translation};
+    for (ResidualType residual_type : {ResidualType::POINT_TO_PLANE, ResidualType::POINT_TO_DISTRIBUTION}) {
+        const TargetGeometry geometry(target, residual_type, 0.25, 10,
+                                      prob_point_cloud_registration::defaultExecutor());
+        BatchedErrorTerm batched_term;
+        batched_term.setAssociations(source_cloud, target, data_association, &geometry);
+        ASSERT_FALSE(batched_term.isPointToPoint());
+        for (int k = 0; k < batched_term.size(); k++) {
+            batched_term.weights()[k] = 0.5 + 0.25 * k;
+        }
+        std::vector<double> residuals(batched_term.num_residuals());
+        std::vector<double> rotation_jacobian(batched_term.num_residuals() * 4);
+        std::vector<double> translation_jacobian(batched_term.num_residuals() * 3);
+        double *jacobians[2] = {rotation_jacobian.data(), translation_jacobian.data()};
+        ASSERT_TRUE(batched_term.Evaluate(parameters, residuals.data(), jacobians));
+        std::vector<double> squared_errors;
+        batched_term.squaredErrors(rotation, translation, &squared_errors);
+
+        // L times the point-to-point residual and Jacobians
+        int k = 0;
+        for (int i = 0; i < data_association.outerSize(); i++) {
+            for (Eigen::SparseMatrix<double, Eigen::RowMajor>::InnerIterator it(data_association, i); it; ++it) {
+                ceres::AutoDiffCostFunction<ErrorTerm, ErrorTerm::kResiduals, 4, 3> error_term(
+                    new ErrorTerm(source_cloud[it.row()], (*target_cloud)[it.col()]));
+                Eigen::Vector3d point_residual;
+                Eigen::Matrix<double, 3, 4, Eigen::RowMajor> point_rotation_jacobian;
+                Eigen::Matrix<double, 3, 3, Eigen::RowMajor> point_translation_jacobian;
+                double *point_jacobians[2] = {point_rotation_jacobian.data(), point_translation_jacobian.data()};
+                error_term.Evaluate(parameters, point_residual.data(), point_jacobians);
+                const Eigen::Matrix3d sqrt_information = geometry.sqrtInformation(it.col()).cast<double>();
+                const double scale = std::sqrt(batched_term.weights()[k]);
+                const Eigen::Vector3d expected_residual = sqrt_information * point_residual;
+                const Eigen::Matrix<double, 3, 4> expected_rotation_jacobian = sqrt_information *
+                                                                               point_rotation_jacobian;
+                const Eigen::Matrix3d expected_translation_jacobian = sqrt_information * point_translation_jacobian;
+                for (int r = 0; r < 3; r++) {
+                    EXPECT_NEAR(scale * expected_residual[r], residuals[3 * k + r], 1e-6);
+                    for (int c = 0; c < 4; c++) {
+                        EXPECT_NEAR(scale * expected_rotation_jacobian(r, c), rotation_jacobian[12 * k + 4 * r + c],
+                                    1e-5);
+                    }
+                    for (int c = 0; c < 3; c++) {
+                        EXPECT_NEAR(scale * expected_translation_jacobian(r, c),
+                                    translation_jacobian[9 * k + 3 * r + c], 1e-6);
+                    }
+                }
+                EXPECT_NEAR(expected_residual.squaredNorm(), squared_errors[k], 1e-6);
+                k++;
+            }
+        }
+    }
+}
+
+TEST(BatchedErrorTermTestSuite, pruneTest)
+{
+    pcl::PointCloud<pcl::PointXYZ> source_cloud;
+    pcl::PointCloud<pcl::PointXYZ> target_cloud;
+    for (int i = 0; i < 3; i++) {
+        source_cloud.push_back(pcl::PointXYZ(0.3 * i, 1 - 0.2 * i, 0.5));
+        target_cloud.push_back(pcl::PointXYZ(1 + 0.1 * i, -0.4 * i, 0.2 * i));
+    }
+    Eigen::SparseMatrix<double, Eigen::RowMajor> data_association(3, 3);
+    std::vector<Eigen::Triplet<double>> tripletList;
+    for (int i = 0; i < 3; i++) {
+        tripletList.push_back(Eigen::Triplet<double>(i, i, 1));
+        tripletList.push_back(Eigen::Triplet<double>(i, (i + 1) % 3, 1));
+    }
+    data_association.setFromTriplets(tripletList.begin(), tripletList.end());
+    data_association.makeCompressed();
+    BatchedErrorTerm batched_term(source_cloud, target_cloud, data_association);
+    const std::vector<double> weights = {0.9, 0.1, 0.05, 0.95, 0.5, 0.5};
+    batched_term.weights() = weights;
+
+    double rotation[4] = {1, 0, 0, 0};
+    double translation[3] = {0.5, -1, 0.25};
+    const double *parameters[2] = {rotation, translation};
+    std::vector<double> expected_residuals(batched_term.num_residuals());
+    ASSERT_TRUE(batched_term.Evaluate(parameters, expected_residuals.data(), NULL));
+    std::vector<double> expected_squared_errors;
+    batched_term.squaredErrors(rotation, translation, &expected_squared_errors);
+
+    EXPECT_EQ(4, batched_term.prune(0.3));
+    EXPECT_EQ(4, batched_term.numActive());
+    std::vector<double> residuals(batched_term.num_residuals());
+    std::vector<double> rotation_jacobian(batched_term.num_residuals() * 4, 1);
+    std::vector<double> translation_jacobian(batched_term.num_residuals() * 3, 1);
+    double *jacobians[2] = {rotation_jacobian.data(), translation_jacobian.data()};
+    ASSERT_TRUE(batched_term.Evaluate(parameters, residuals.data(), jacobians));
+    std::vector<double> squared_errors(batched_term.size(), -1);
+    batched_term.squaredErrors(rotation, translation, &squared_errors, true);
+    for (int k = 0; k < batched_term.size(); k++) {
+        const bool active = weights[k] >= 0.3;
+        EXPECT_EQ(active, batched_term.isActive(k));
+        EXPECT_EQ(active ? weights[k] : 0, batched_term.weight(k));
+        EXPECT_EQ(active ? expected_squared_errors[k] : -1, squared_errors[k]);
+        for (int r = 0; r < 3; r++) {
+            EXPECT_EQ(active ? expected_residuals[3 * k + r] : 0, residuals[3 * k + r]);
+            if (!active) {
+                for (int c = 0; c < 4; c++) {
+                    EXPECT_EQ(0, rotation_jacobian[12 * k + 4 * r + c]);
+                }
+                for (int c = 0; c < 3; c++) {
+                    EXPECT_EQ(0, translation_jacobian[9 * k + 3 * r + c]);
+                }
+            }
+        }
+    }
+    // A pruned association stays pruned whatever its new weight, until activateAll()
+    batched_term.weights() = weights;
+    EXPECT_EQ(4, batched_term.prune(0.01));
+    batched_term.activateAll();
+    EXPECT_EQ(batched_term.size(), batched_term.numActive());
+}
+
+TEST(BatchedErrorTermTestSuite, compactTest)
+{
+    pcl::PointCloud<pcl::PointXYZ> source_cloud;
+    pcl::PointCloud<pcl::PointXYZ> target_cloud;
+    for (int i = 0; i < 3; i++) {
+        source_cloud.push_back(pcl::PointXYZ(0.3 * i, 1 - 0.2 * i, 0.5));
+        target_cloud.push_back(pcl::PointXYZ(1 + 0.1 * i, -0.4 * i, 0.2 * i));
+    }
+    Eigen::SparseMatrix<double, Eigen::RowMajor> data_association(3, 3);
+    std::vector<Eigen::Triplet<double>> tripletList;
+    for (int i = 0; i < 3; i++) {
+        tripletList.push_back(Eigen::Triplet<double>(i, i, 1));
+        tripletList.push_back(Eigen::Triplet<double>(i, (i + 1) % 3, 1));
+    }
+    data_association.setFromTriplets(tripletList.begin(), tripletList.end());
+    data_association.makeCompressed();
+    BatchedErrorTerm batched_term(source_cloud, target_cloud, data_association);
+    const std::vector<double> weights = {0.9, 0.1, 0.05, 0.95, 0.5, 0.5};
+    batched_term.weights() = weights;
+
+    double rotation[4] = {0.99, 0.1, 0, 0.05};
+    double translation[3] = {0.5, -1, 0.25};
+    const double *parameters[2] = {rotation, translation};
+    std::vector<double> expected_residuals(batched_term.num_residuals());
+    std::vector<double> expected_rotation_jacobian(batched_term.num_residuals() * 4);
+    std::vector<double> expected_translation_jacobian(batched_term.num_residuals() * 3);
+    double *expected_jacobians[2] = {expected_rotation_jacobian.data(), expected_translation_jacobian.data()};
+    ASSERT_TRUE(batched_term.Evaluate(parameters, expected_residuals.data(), expected_jacobians));
+
+    batched_term.prune(0.3);
+    EXPECT_EQ(4, batched_term.compact());
+    ASSERT_EQ(3 * 4, batched_term.num_residuals());
+    std::vector<double> residuals(batched_term.num_residuals());
+    std::vector<double> rotation_jacobian(batched_term.num_residuals() * 4);
+    std::vector<double> translation_jacobian(batched_term.num_residuals() * 3);
+    double *jacobians[2] = {rotation_jacobian.data(), translation_jacobian.data()};
+    ASSERT_TRUE(batched_term.Evaluate(parameters, residuals.data(), jacobians));
+    // The rows of the active associations, in the same order
+    int row = 0;
+    for (int k = 0; k < batched_term.size(); k++) {
+        if (!batched_term.isActive(k)) {
+            continue;
+        }
+        for (int r = 0; r < 3; r++) {
+            EXPECT_EQ(expected_residuals[3 * k + r], residuals[3 * row + r]);
+            for (int c = 0; c < 4; c++) {
+                EXPECT_EQ(expected_rotation_jacobian[12 * k + 4 * r + c], rotation_jacobian[12 * row + 4 * r + c]);
+            }
+            for (int c = 0; c < 3; c++) {
+                EXPECT_EQ(expected_translation_jacobian[9 * k + 3 * r + c], translation_jacobian[9 * row + 3 * r + c]);
+            }
+        }
+        row++;
+    }
+    // Pruned after the compaction, an association keeps its rows, with null residuals
+    batched_term.weights()[0] = 0.2;
+    EXPECT_EQ(3, batched_term.prune(0.3));
+    ASSERT_TRUE(batched_term.Evaluate(parameters, residuals.data(), NULL));
+    for (int r = 0; r < 3; r++) {
+        EXPECT_EQ(0, residuals[r]);
+    }
+    batched_term.setAssociations(source_cloud, target_cloud, data_association);
+    EXPECT_EQ(3 * batched_term.size(), batched_term.num_residuals());
+}
@@ -0,0 +1,96 @@
+#include <cmath>
+#include <vector>
+#include <boost/make_shared.hpp>
+#include <Eigen/Geometry>
+#include <gtest/gtest.h>
+#include <pcl/common/transforms.h>
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+#include "prob_point_cloud_registration/coarse_alignment.hpp"
+#include "prob_point_cloud_registration/neighbour_search.hpp"
+#include "prob_point_cloud_registration/prob_point_cloud_registration.h"
+#include "test_clouds.hpp"
+
+using prob_point_cloud_registration::CoarseAlignmentParams;
+using prob_point_cloud_registration::KdTreeSearch;
+using prob_point_cloud_registration::ProbPointCloudRegistration;
+using prob_point_cloud_registration::ProbPointCloudRegistrationParams;
+using prob_point_cloud_registration::ScoredPose;
+using prob_point_cloud_registration::test::generateSurface;
+using prob_point_cloud_registration::test::testParams;
+
+namespace {
+
+// An elongated, asymmetric surface: only the identity among the rotations about z maps it onto itself
+pcl::PointCloud<pcl::PointXYZ>::Ptr generateTarget()
+{
+    return generateSurface(50, 25, 0.2, 0, 0, [](double x, double y) {
+        return 0.05 * x * x + 0.5 * std::sin(0.7 * y) + 0.02 * x * y;
+    });
+}
+
+Eigen::Affine3d groundTruth()
+{
+    Eigen::Affine3d transform = Eigen::Affine3d::Identity();
+    transform.translation() << 1.5, -2.0, 0.3;
+    transform.rotate(Eigen::AngleAxisd(2.0, Eigen::Vector3d::UnitZ()));
+    return transform;
+}
+
+}  // namespace
+
+TEST(CoarseAlignmentTestSuite, hypothesesTest)
+{
+    auto cloud = generateTarget();
+    pcl::PointCloud<pcl::PointXYZ> moved_cloud;
+    pcl::transformPointCloud(*cloud, moved_cloud, Eigen::Affine3d(Eigen::Translation3d(1, 0, 0)));
+    CoarseAlignmentParams params;
+    params.num_rotations = 8;
+    // The identity, then the other 7 rotations about the source and the 8 about the target centroid
+    std::vector<Eigen::Affine3d> hypotheses = prob_point_cloud_registration::coarseHypotheses(*cloud, &moved_cloud,
+                                                                                              params);
+    ASSERT_EQ(1u + 7u + 8u, hypotheses.size());
+    EXPECT_TRUE(hypotheses[0].isApprox(Eigen::Affine3d::Identity()));
+    params.align_centroids = false;
+    params.yaw_only = false;
+    hypotheses = prob_point_cloud_registration::coarseHypotheses(*cloud, &moved_cloud, params);
+    ASSERT_EQ(8u, hypotheses.size());
+    for (const Eigen::Affine3d &hypothesis : hypotheses) {
+        EXPECT_NEAR(hypothesis.rotation().determinant(), 1, 1e-9);
+    }
+}
+
+TEST(CoarseAlignmentTestSuite, scoresFavourTheTruePoseTest)
+{
+    auto target_cloud = generateTarget();
+    pcl::PointCloud<pcl::PointXYZ> source_cloud;
+    pcl::transformPointCloud(*target_cloud, source_cloud, groundTruth().inverse());
+    const KdTreeSearch target(target_cloud);
+    const std::vector<Eigen::Affine3d> poses = {Eigen::Affine3d::Identity(), groundTruth(),
+                                                groundTruth() * Eigen::Translation3d(0.5, 0, 0)
+                                               };
+    const std::vector<ScoredPose> scored = prob_point_cloud_registration::scorePoses(source_cloud, target, poses, 3);
+    ASSERT_EQ(poses.size(), scored.size());
+    EXPECT_TRUE(scored[0].pose.isApprox(groundTruth()));
+    EXPECT_LE(scored[0].score, scored[1].score);
+    EXPECT_LE(scored[1].score, scored[2].score);
+}
+
+TEST(CoarseAlignmentTestSuite, recoversLargeRotationTest)
+{
+    auto target_cloud = generateTarget();
+    auto source_cloud = boost::make_shared<pcl::PointCloud<pcl::PointXYZ>>();
+    pcl::transformPointCloud(*target_cloud, *source_cloud, groundTruth().inverse());
+    ProbPointCloudRegistrationParams params = testParams();
+    ProbPointCloudRegistration without_coarse(source_cloud, boost::make_shared<pcl::PointCloud<pcl::PointXYZ>>
+                                              (*target_cloud), params);
+    without_coarse.align();
+    params.coarse_alignment.num_rotations = 12;
+    ProbPointCloudRegistration registration(source_cloud, without_coarse.target(), params);
+    registration.align();
+    EXPECT_GT(registration.statistics().coarse_alignment_time, 0);
+    // The refinement alone ends in a wrong minimum, 115 degrees away
+    EXPECT_GT((without_coarse.transformation().translation() - groundTruth().translation()).norm(), 0.5);
+    EXPECT_LT((registration.transformation().translation() - groundTruth().translation()).norm(), 0.1);
+    EXPECT_TRUE(registration.transformation().rotation().isApprox(groundTruth().rotation(), 1e-2));
+}
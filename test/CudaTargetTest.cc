@@ -0,0 +1,118 @@
+#include <boost/make_shared.hpp>
+#include <Eigen/Geometry>
+#include <gtest/gtest.h>
+#include <pcl/common/transforms.h>
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+#include "prob_point_cloud_registration/cuda_target.h"
+#include "prob_point_cloud_registration/data_association.hpp"
+#include "prob_point_cloud_registration/prob_point_cloud_registration.h"
+#include "test_clouds.hpp"
+
+using prob_point_cloud_registration::CudaTarget;
+using prob_point_cloud_registration::DataAssociation;
+using prob_point_cloud_registration::DeviceAssociation;
+using prob_point_cloud_registration::NeighbourSearchType;
+using prob_point_cloud_registration::OpenMPExecutor;
+using prob_point_cloud_registration::ProbPointCloudRegistration;
+using prob_point_cloud_registration::ProbPointCloudRegistrationParams;
+using prob_point_cloud_registration::VoxelHashSearch;
+using prob_point_cloud_registration::test::generateSurface;
+using prob_point_cloud_registration::test::testParams;
+
+namespace {
+
+pcl::PointCloud<pcl::PointXYZ>::Ptr movedScene(const pcl::PointCloud<pcl::PointXYZ> &scene)
+{
+    Eigen::Affine3d transform = Eigen::Affine3d::Identity();
+    transform.translation() << 0.13, -0.07, 0.05;
+    transform.rotate(Eigen::AngleAxisd(0.03, Eigen::Vector3d::UnitZ()));
+    auto cloud = boost::make_shared<pcl::PointCloud<pcl::PointXYZ>>();
+    pcl::transformPointCloud(scene, *cloud, transform);
+    return cloud;
+}
+
+}  // namespace
+
+TEST(CudaTargetTestSuite, associationMatchesVoxelHashTest)
+{
+    if (!CudaTarget::available()) {
+        GTEST_SKIP() << "No CUDA device";
+    }
+    auto target_cloud = generateSurface(60, 60, 0.1);
+    auto source_cloud = movedScene(*target_cloud);
+    const double radius = 0.25;
+    const CudaTarget device_target(target_cloud, radius);
+    const VoxelHashSearch host_target(target_cloud, radius);
+    OpenMPExecutor executor(2);
+    DeviceAssociation device_association;
+    DataAssociation actual;
+    DataAssociation expected;
+    for (int max_neighbours : {1, 8, 64}) {
+        device_target.associate(*source_cloud, radius, max_neighbours, &device_association, &actual);
+        prob_point_cloud_registration::computeDataAssociation(*source_cloud, host_target, radius, max_neighbours,
+                                                              executor, &expected);
+        ASSERT_EQ(expected.matrix().nonZeros(), actual.matrix().nonZeros());
+        for (int i = 0; i < expected.matrix().outerSize(); i++) {
+            Eigen::SparseMatrix<double, Eigen::RowMajor>::InnerIterator actual_it(actual.matrix(), i);
+            for (Eigen::SparseMatrix<double, Eigen::RowMajor>::InnerIterator it(expected.matrix(), i); it;
+                 ++it, ++actual_it) {
+                ASSERT_TRUE(actual_it);
+                EXPECT_EQ(it.col(), actual_it.col());
+                EXPECT_NEAR(it.value(), actual_it.value(), 1e-6);
+            }
+        }
+    }
+}
+
+TEST(CudaTargetTestSuite, deviceSolveMatchesHostTest)
+{
+    if (!CudaTarget::available()) {
+        GTEST_SKIP() << "No CUDA device";
+    }
+    auto target_cloud = generateSurface(60, 60, 0.1);
+    auto source_cloud = movedScene(*target_cloud);
+    ProbPointCloudRegistrationParams params = testParams();
+    params.radius = 0.3;
+    params.n_iter = 10;
+    params.neighbour_search = NeighbourSearchType::VOXEL_HASH;
+    ProbPointCloudRegistration host_registration(boost::make_shared<pcl::PointCloud<pcl::PointXYZ>>(*source_cloud),
+                                                 target_cloud, params);
+    host_registration.align();
+    params.neighbour_search = NeighbourSearchType::CUDA;
+    ProbPointCloudRegistration device_registration(boost::make_shared<pcl::PointCloud<pcl::PointXYZ>>(*source_cloud),
+                                                   target_cloud, params);
+    ASSERT_TRUE(std::dynamic_pointer_cast<CudaTarget>(device_registration.target()));
+    device_registration.align();
+    // Float distances and the one pass covariance on the device
+    EXPECT_TRUE(device_registration.transformation().isApprox(host_registration.transformation(), 1e-5));
+}
+
+TEST(CudaTargetTestSuite, deterministicExpectationTest)
+{
+    if (!CudaTarget::available()) {
+        GTEST_SKIP() << "No CUDA device";
+    }
+    auto target_cloud = generateSurface(60, 60, 0.1);
+    auto source_cloud = movedScene(*target_cloud);
+    const double radius = 0.3;
+    const CudaTarget device_target(target_cloud, radius);
+    DeviceAssociation device_association;
+    DataAssociation data_association;
+    device_target.associate(*source_cloud, radius, 10, &device_association, &data_association);
+    const double rotation[4] = {1, 0, 0, 0};
+    const double translation[3] = {-0.1, 0.05, -0.03};
+    const auto expected = device_association.expectation(rotation, translation, 5, true);
+    const auto fast = device_association.expectation(rotation, translation, 5);
+    EXPECT_NEAR(expected.total_weight, fast.total_weight, 1e-9 * expected.total_weight);
+    EXPECT_TRUE(expected.cross_sum.isApprox(fast.cross_sum, 1e-9));
+    // Bit-identical sums from one call to the other
+    for (int run = 0; run < 3; run++) {
+        const auto actual = device_association.expectation(rotation, translation, 5, true);
+        EXPECT_EQ(expected.total_weight, actual.total_weight);
+        EXPECT_EQ(expected.source_sum, actual.source_sum);
+        EXPECT_EQ(expected.target_sum, actual.target_sum);
+        EXPECT_EQ(expected.cross_sum, actual.cross_sum);
+        EXPECT_EQ(expected.cost, actual.cost);
+    }
+}
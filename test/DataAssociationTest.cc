@@ -0,0 +1,106 @@
+#include <cmath>
+#include <vector>
+#include <boost/make_shared.hpp>
+#include <Eigen/Geometry>
+#include <Eigen/Sparse>
+#include <gtest/gtest.h>
+#include <pcl/common/transforms.h>
+#include <pcl/kdtree/kdtree_flann.h>
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+#include "prob_point_cloud_registration/data_association.hpp"
+#include "test_clouds.hpp"
+
+using prob_point_cloud_registration::DataAssociation;
+using prob_point_cloud_registration::IncrementalDataAssociation;
+using prob_point_cloud_registration::KdTreeSearch;
+using prob_point_cloud_registration::OpenMPExecutor;
+using prob_point_cloud_registration::computeDataAssociation;
+using prob_point_cloud_registration::test::generateSurface;
+
+void expectSameAssociation(const Eigen::SparseMatrix<double, Eigen::RowMajor> &expected,
+                           const Eigen::SparseMatrix<double, Eigen::RowMajor> &actual)
+{
+    ASSERT_EQ(expected.rows(), actual.rows());
+    ASSERT_EQ(expected.nonZeros(), actual.nonZeros());
+    for (int i = 0; i < expected.outerSize(); i++) {
+        Eigen::SparseMatrix<double, Eigen::RowMajor>::InnerIterator actual_it(actual, i);
+        for (Eigen::SparseMatrix<double, Eigen::RowMajor>::InnerIterator it(expected, i); it; ++it, ++actual_it) {
+            ASSERT_TRUE(actual_it);
+            EXPECT_EQ(it.col(), actual_it.col());
+            EXPECT_NEAR(it.value(), actual_it.value(), 1e-5);
+        }
+    }
+}
+
+TEST(DataAssociationTestSuite, incrementalMatchesFullSearchTest)
+{
+    auto target_cloud = generateSurface(40, 40, 0.1);
+    auto kdtree = boost::make_shared<pcl::KdTreeFLANN<pcl::PointXYZ>>();
+    kdtree->setInputCloud(target_cloud);
+    const KdTreeSearch target(kdtree);
+    const double radius = 0.35;
+    const int max_neighbours = 8;
+    IncrementalDataAssociation incremental_association(target, radius, max_neighbours, 0.2);
+
+    pcl::PointCloud<pcl::PointXYZ> source_cloud;
+    Eigen::Affine3d transform = Eigen::Affine3d::Identity();
+    transform.translation() << 0.3, -0.2, 0.1;
+    transform.rotate(Eigen::AngleAxisd(0.1, Eigen::Vector3d::UnitZ()));
+    pcl::transformPointCloud(*target_cloud, source_cloud, transform);
+
+    // Steps shrinking as in a converging registration, the first ones move every point past the margin
+    Eigen::Affine3d step = Eigen::Affine3d::Identity();
+    int num_queries = 0;
+    for (int iteration = 0; iteration < 8; iteration++) {
+        expectSameAssociation(computeDataAssociation(source_cloud, *target_cloud, *kdtree, radius, max_neighbours),
+                              incremental_association.compute(source_cloud));
+        num_queries = incremental_association.numQueries();
+        if (iteration == 0) {
+            EXPECT_EQ(source_cloud.size(), num_queries);
+        }
+        const double scale = std::pow(0.3, iteration);
+        step = Eigen::Affine3d::Identity();
+        step.translation() << -0.1 * scale, 0.05 * scale, -0.03 * scale;
+        step.rotate(Eigen::AngleAxisd(-0.03 * scale, Eigen::Vector3d::UnitZ()));
+        pcl::transformPointCloud(source_cloud, source_cloud, step);
+    }
+    EXPECT_LT(num_queries, static_cast<int>(source_cloud.size()) / 10);
+}
+
+TEST(DataAssociationTestSuite, reusedContainerMatchesTripletsTest)
+{
+    auto target_cloud = generateSurface(40, 40, 0.1);
+    auto kdtree = boost::make_shared<pcl::KdTreeFLANN<pcl::PointXYZ>>();
+    kdtree->setInputCloud(target_cloud);
+    const KdTreeSearch target(kdtree);
+    OpenMPExecutor executor(3);
+    DataAssociation data_association;
+    // Growing, shrinking and unbounded fills of the same container
+    for (int max_neighbours : {4, 12, 3, 0}) {
+        for (int size : {500, 1600, 200}) {
+            pcl::PointCloud<pcl::PointXYZ> source_cloud;
+            for (int i = 0; i < size; i++) {
+                const pcl::PointXYZ &point = (*target_cloud)[(i * 7) % target_cloud->size()];
+                source_cloud.push_back(pcl::PointXYZ(point.x + 0.03f, point.y - 0.02f, point.z + 0.05f));
+            }
+            const double radius = 0.25;
+            std::vector<Eigen::Triplet<double>> triplets;
+            std::vector<int> indices;
+            std::vector<float> squared_distances;
+            for (int i = 0; i < size; i++) {
+                const int found = kdtree->radiusSearch(source_cloud[i], radius, indices, squared_distances,
+                                                       max_neighbours);
+                for (int k = 0; k < found; k++) {
+                    triplets.push_back(Eigen::Triplet<double>(i, indices[k], squared_distances[k]));
+                }
+            }
+            Eigen::SparseMatrix<double, Eigen::RowMajor> expected(size, target_cloud->size());
+            expected.setFromTriplets(triplets.begin(), triplets.end());
+            computeDataAssociation(source_cloud, target, radius, max_neighbours, executor, &data_association);
+            ASSERT_TRUE(data_association.matrix().isCompressed());
+            ASSERT_EQ(target_cloud->size(), data_association.matrix().cols());
+            expectSameAssociation(expected, data_association.matrix());
+        }
+    }
+}
@@ -0,0 +1,147 @@
+#include <cmath>
+#include <random>
+#include <utility>
+#include <vector>
+#include <boost/make_shared.hpp>
+#include <Eigen/Geometry>
+#include <Eigen/Sparse>
+#include <gtest/gtest.h>
+#include <pcl/common/transforms.h>
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+#include "prob_point_cloud_registration/multi_view_registration.h"
+#include "prob_point_cloud_registration/neighbour_search.hpp"
+#include "prob_point_cloud_registration/pairwise_error_term.hpp"
+
+using prob_point_cloud_registration::KdTreeSearch;
+using prob_point_cloud_registration::MultiViewRegistration;
+using prob_point_cloud_registration::PairwiseErrorTerm;
+using prob_point_cloud_registration::ProbPointCloudRegistrationParams;
+
+namespace {
+
+Eigen::Affine3d pose(double x, double y, double yaw)
+{
+    Eigen::Affine3d transform = Eigen::Affine3d::Identity();
+    transform.translation() << x, y, 0.02;
+    transform.rotate(Eigen::AngleAxisd(yaw, Eigen::Vector3d::UnitZ()));
+    return transform;
+}
+
+// Random samples of the surface, different for every seed, seen from ground_truth (which maps them into the world)
+pcl::PointCloud<pcl::PointXYZ>::Ptr scan(const Eigen::Affine3d &ground_truth, unsigned int seed)
+{
+    std::mt19937 generator(seed);
+    std::uniform_real_distribution<double> distribution(0, 3);
+    pcl::PointCloud<pcl::PointXYZ> world;
+    for (int i = 0; i < 1500; ++i) {
+        const double x = distribution(generator);
+        const double y = distribution(generator);
+        world.push_back(pcl::PointXYZ(x, y, 0.3 * std::sin(2.5 * x) * std::cos(2.0 * y) + 0.1 * x));
+    }
+    auto cloud = boost::make_shared<pcl::PointCloud<pcl::PointXYZ>>();
+    pcl::transformPointCloud(world, *cloud, ground_truth.inverse());
+    return cloud;
+}
+
+ProbPointCloudRegistrationParams multiViewParams()
+{
+    ProbPointCloudRegistrationParams params;
+    params.radius = 0.3;
+    params.max_neighbours = 10;
+    params.n_iter = 40;
+    // The samples differ between scans, the point-to-point refinement converges slowly
+    params.cost_drop_thresh = 1e-4;
+    params.num_threads = 2;
+    return params;
+}
+
+}  // namespace
+
+TEST(MultiViewRegistrationTestSuite, pairwiseJacobiansTest)
+{
+    auto source_cloud = boost::make_shared<pcl::PointCloud<pcl::PointXYZ>>();
+    auto target_cloud = boost::make_shared<pcl::PointCloud<pcl::PointXYZ>>();
+    for (int i = 0; i < 4; i++) {
+        source_cloud->push_back(pcl::PointXYZ(0.3 * i, 0.1 + 0.2 * i, -0.1 * i));
+        target_cloud->push_back(pcl::PointXYZ(0.2 * i + 0.1, -0.3 * i, 0.5));
+    }
+    const KdTreeSearch target(target_cloud);
+    Eigen::SparseMatrix<double, Eigen::RowMajor> data_association(4, 4);
+    data_association.insert(0, 1) = 1;
+    data_association.insert(0, 2) = 1;
+    data_association.insert(2, 3) = 1;
+    data_association.insert(3, 0) = 1;
+    data_association.makeCompressed();
+    PairwiseErrorTerm error_term;
+    error_term.setAssociations(*source_cloud, target, data_association);
+    ASSERT_EQ(4, error_term.size());
+    error_term.weights()[1] = 0.5;
+
+    // Unnormalized quaternions, as the parameters are during a solve
+    double parameters[14] = {0.9, 0.1, -0.2, 0.3, 0.1, 0.2, 0.3, 0.8, -0.3, 0.1, 0.2, -0.1, 0.4, 0.2};
+    double *blocks[4] = {parameters, parameters + 4, parameters + 7, parameters + 11};
+    const int block_sizes[4] = {4, 3, 4, 3};
+    const int num_residuals = error_term.num_residuals();
+    std::vector<double> residuals(num_residuals);
+    std::vector<double> moved_residuals(num_residuals);
+    std::vector<std::vector<double>> jacobians(4);
+    double *jacobian_pointers[4];
+    for (int b = 0; b < 4; b++) {
+        jacobians[b].resize(num_residuals * block_sizes[b]);
+        jacobian_pointers[b] = jacobians[b].data();
+    }
+    ASSERT_TRUE(error_term.Evaluate(blocks, residuals.data(), jacobian_pointers));
+    const double step = 1e-7;
+    for (int b = 0; b < 4; b++) {
+        for (int c = 0; c < block_sizes[b]; c++) {
+            blocks[b][c] += step;
+            error_term.Evaluate(blocks, moved_residuals.data(), NULL);
+            blocks[b][c] -= step;
+            for (int r = 0; r < num_residuals; r++) {
+                EXPECT_NEAR((moved_residuals[r] - residuals[r]) / step, jacobians[b][r * block_sizes[b] + c], 1e-5);
+            }
+        }
+    }
+}
+
+TEST(MultiViewRegistrationTestSuite, recoversPosesTest)
+{
+    const std::vector<Eigen::Affine3d> ground_truths = {Eigen::Affine3d::Identity(), pose(0.08, -0.05, 0.03),
+                                                        pose(-0.06, 0.04, -0.02)
+                                                       };
+    std::vector<pcl::PointCloud<pcl::PointXYZ>::Ptr> scans;
+    for (std::size_t i = 0; i < ground_truths.size(); i++) {
+        scans.push_back(scan(ground_truths[i], i));
+    }
+    MultiViewRegistration registration(scans, multiViewParams());
+    ASSERT_EQ(3u, registration.pairs().size());
+    registration.align();
+    ASSERT_FALSE(registration.statistics().iterations.empty());
+    ASSERT_EQ(ground_truths.size(), registration.poses().size());
+    EXPECT_TRUE(registration.poses()[0].isApprox(Eigen::Affine3d::Identity()));
+    for (std::size_t i = 1; i < ground_truths.size(); i++) {
+        const Eigen::Vector3d error = registration.poses()[i].translation() - ground_truths[i].translation();
+        EXPECT_LT(error.norm(), 0.02) << "scan " << i;
+        EXPECT_TRUE(registration.poses()[i].rotation().isApprox(ground_truths[i].rotation(), 1e-2)) << "scan " << i;
+    }
+}
+
+TEST(MultiViewRegistrationTestSuite, chainOfPairsTest)
+{
+    // No pair between the first and the last scan, the pose of the last one comes through the middle one
+    const std::vector<Eigen::Affine3d> ground_truths = {Eigen::Affine3d::Identity(), pose(0.05, 0.05, 0.02),
+                                                        pose(0.1, -0.02, 0.04)
+                                                       };
+    std::vector<pcl::PointCloud<pcl::PointXYZ>::Ptr> scans;
+    for (std::size_t i = 0; i < ground_truths.size(); i++) {
+        scans.push_back(scan(ground_truths[i], i));
+    }
+    MultiViewRegistration registration(scans, multiViewParams());
+    registration.setPairs({std::make_pair(1, 0), std::make_pair(2, 1)});
+    const std::vector<Eigen::Affine3d> initial_poses(3, Eigen::Affine3d::Identity());
+    registration.align(initial_poses);
+    const Eigen::Affine3d &estimated = registration.poses()[2];
+    EXPECT_LT((estimated.translation() - ground_truths[2].translation()).norm(), 0.03);
+    EXPECT_TRUE(estimated.rotation().isApprox(ground_truths[2].rotation(), 1e-2));
+}
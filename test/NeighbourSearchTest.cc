@@ -0,0 +1,177 @@
+#include <cmath>
+#include <memory>
+#include <random>
+#include <vector>
+#include <boost/make_shared.hpp>
+#include <Eigen/Geometry>
+#include <gtest/gtest.h>
+#include <pcl/common/transforms.h>
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+#include "prob_point_cloud_registration/neighbour_search.hpp"
+#include "prob_point_cloud_registration/prob_point_cloud_registration.h"
+#include "prob_point_cloud_registration/utilities.hpp"
+
+using prob_point_cloud_registration::KdTreeSearch;
+using prob_point_cloud_registration::NeighbourSearchType;
+using prob_point_cloud_registration::ProbPointCloudRegistration;
+using prob_point_cloud_registration::ProbPointCloudRegistrationParams;
+using prob_point_cloud_registration::ResidualType;
+using prob_point_cloud_registration::SolverType;
+using prob_point_cloud_registration::TargetGeometry;
+using prob_point_cloud_registration::VoxelHashSearch;
+
+namespace {
+
+// A noisy surface and a few scattered outliers
+pcl::PointCloud<pcl::PointXYZ>::Ptr generateCloud()
+{
+    std::mt19937 generator(42);
+    std::uniform_real_distribution<float> noise(-0.02f, 0.02f);
+    std::uniform_real_distribution<float> outlier(-3, 3);
+    auto cloud = boost::make_shared<pcl::PointCloud<pcl::PointXYZ>>();
+    for (int i = 0; i < 30; ++i) {
+        for (int j = 0; j < 30; ++j) {
+            const float x = 0.1f * i - 1.5f + noise(generator);
+            const float y = 0.1f * j - 1.5f + noise(generator);
+            cloud->push_back(pcl::PointXYZ(x, y, std::sin(x) * std::cos(y) + noise(generator)));
+        }
+    }
+    for (int i = 0; i < 50; ++i) {
+        cloud->push_back(pcl::PointXYZ(outlier(generator), outlier(generator), outlier(generator)));
+    }
+    return cloud;
+}
+
+}  // namespace
+
+TEST(NeighbourSearchTestSuite, voxelHashMatchesKdTreeTest)
+{
+    auto cloud = generateCloud();
+    const KdTreeSearch kdtree(cloud);
+    const VoxelHashSearch voxel_hash(cloud, 0.3);
+    ASSERT_EQ(kdtree.size(), voxel_hash.size());
+
+    std::mt19937 generator(7);
+    std::uniform_real_distribution<float> coordinate(-2, 2);
+    std::vector<int> expected_indices, indices;
+    std::vector<float> expected_distances, distances;
+    for (int q = 0; q < 200; q++) {
+        // Some queries far from every point as well
+        const float scale = q % 10 == 0 ? 5 : 1;
+        const pcl::PointXYZ query(scale * coordinate(generator), scale * coordinate(generator), coordinate(generator));
+        for (double radius : {0.1, 0.3, 0.7}) {
+            for (int max_neighbours : {0, 5}) {
+                kdtree.radiusSearch(query, radius, max_neighbours, expected_indices, expected_distances);
+                voxel_hash.radiusSearch(query, radius, max_neighbours, indices, distances);
+                ASSERT_EQ(expected_indices.size(), indices.size()) << "query " << q << ", radius " << radius;
+                for (std::size_t k = 0; k < indices.size(); k++) {
+                    EXPECT_EQ(expected_indices[k], indices[k]);
+                    EXPECT_FLOAT_EQ(expected_distances[k], distances[k]);
+                }
+            }
+        }
+        int expected_index, index;
+        float expected_distance, distance;
+        ASSERT_TRUE(kdtree.nearestSearch(query, expected_index, expected_distance));
+        ASSERT_TRUE(voxel_hash.nearestSearch(query, index, distance));
+        EXPECT_EQ(expected_index, index) << "query " << q;
+        EXPECT_FLOAT_EQ(expected_distance, distance);
+    }
+}
+
+TEST(NeighbourSearchTestSuite, metricsMatchKdTreeTest)
+{
+    auto cloud1 = generateCloud();
+    auto cloud2 = boost::make_shared<pcl::PointCloud<pcl::PointXYZ>>();
+    Eigen::Affine3d transform = Eigen::Affine3d::Identity();
+    transform.translation() << 0.05, -0.03, 0.01;
+    pcl::transformPointCloud(*cloud1, *cloud2, transform);
+    const VoxelHashSearch voxel_hash(cloud2, 0.2);
+    EXPECT_FLOAT_EQ(prob_point_cloud_registration::averageClosestDistance(cloud1, cloud2),
+                    prob_point_cloud_registration::averageClosestDistance(*cloud1, voxel_hash));
+    EXPECT_FLOAT_EQ(prob_point_cloud_registration::robustSumSquaredError(cloud1, cloud2, 5),
+                    prob_point_cloud_registration::robustSumSquaredError(*cloud1, voxel_hash, 5));
+    EXPECT_FLOAT_EQ(prob_point_cloud_registration::medianClosestDistance(cloud1, cloud2),
+                    prob_point_cloud_registration::medianClosestDistance(*cloud1, voxel_hash));
+}
+
+TEST(NeighbourSearchTestSuite, voxelHashRegistrationTest)
+{
+    auto target_cloud = generateCloud();
+    Eigen::Affine3d ground_truth = Eigen::Affine3d::Identity();
+    ground_truth.translation() << 0.08, -0.05, 0.03;
+    ground_truth.rotate(Eigen::AngleAxisd(0.03, Eigen::Vector3d::UnitZ()));
+    auto source_cloud = boost::make_shared<pcl::PointCloud<pcl::PointXYZ>>();
+    pcl::transformPointCloud(*target_cloud, *source_cloud, ground_truth.inverse());
+
+    ProbPointCloudRegistrationParams params;
+    params.radius = 0.3;
+    params.max_neighbours = 10;
+    params.n_iter = 10;
+    ProbPointCloudRegistration expected(source_cloud, boost::make_shared<pcl::PointCloud<pcl::PointXYZ>>
+                                        (*target_cloud), params);
+    expected.align();
+    params.neighbour_search = NeighbourSearchType::VOXEL_HASH;
+    ProbPointCloudRegistration registration(source_cloud, target_cloud, params);
+    registration.align();
+    EXPECT_FALSE(registration.targetKdTree());
+    EXPECT_TRUE(registration.transformation().isApprox(expected.transformation(), 1e-6));
+}
+
+TEST(NeighbourSearchTestSuite, geometryTest)
+{
+    // A tilted plane
+    auto cloud = boost::make_shared<pcl::PointCloud<pcl::PointXYZ>>();
+    for (int i = 0; i < 20; ++i) {
+        for (int j = 0; j < 20; ++j) {
+            cloud->push_back(pcl::PointXYZ(0.1f * i, 0.1f * j, 0.05f * i));
+        }
+    }
+    const Eigen::Vector3f normal = Eigen::Vector3f(-0.5f, 0, 1).normalized();
+    const VoxelHashSearch target(cloud, 0.3);
+    auto plane = target.geometry(ResidualType::POINT_TO_PLANE, 0.3, 20,
+                                 prob_point_cloud_registration::defaultExecutor());
+    for (int i = 0; i < target.size(); i++) {
+        const Eigen::Matrix3f &sqrt_information = plane->sqrtInformation(i);
+        EXPECT_NEAR(1, std::abs(sqrt_information.row(0).dot(normal)), 1e-4);
+        EXPECT_NEAR(0, sqrt_information.bottomRows<2>().norm(), 1e-6);
+    }
+    // Kept with the index while the settings do not change
+    EXPECT_EQ(plane, target.geometry(ResidualType::POINT_TO_PLANE, 0.3, 20,
+                                     prob_point_cloud_registration::defaultExecutor()));
+    auto distribution = target.geometry(ResidualType::POINT_TO_DISTRIBUTION, 0.3, 20,
+                                        prob_point_cloud_registration::defaultExecutor());
+    EXPECT_NE(plane, distribution);
+    // Flat neighbourhoods: the normal direction gets the clamped information, 1 / 0.01
+    const Eigen::Matrix3f information = distribution->sqrtInformation(210).transpose() *
+                                        distribution->sqrtInformation(210);
+    EXPECT_NEAR(100, normal.dot(information * normal), 1e-2);
+    EXPECT_GT(information.trace(), 101);
+}
+
+TEST(NeighbourSearchTestSuite, planeResidualRegistrationTest)
+{
+    auto target_cloud = generateCloud();
+    Eigen::Affine3d ground_truth = Eigen::Affine3d::Identity();
+    ground_truth.translation() << 0.08, -0.05, 0.03;
+    ground_truth.rotate(Eigen::AngleAxisd(0.03, Eigen::Vector3d::UnitZ()));
+    auto source_cloud = boost::make_shared<pcl::PointCloud<pcl::PointXYZ>>();
+    pcl::transformPointCloud(*target_cloud, *source_cloud, ground_truth.inverse());
+
+    ProbPointCloudRegistrationParams params;
+    params.radius = 0.3;
+    params.max_neighbours = 10;
+    params.n_iter = 10;
+    params.residual_type = ResidualType::POINT_TO_PLANE;
+    ProbPointCloudRegistration registration(source_cloud, target_cloud, params);
+    registration.align();
+    EXPECT_FALSE(registration.statistics().iterations.empty());
+    EXPECT_LT((registration.transformation().translation() - ground_truth.translation()).norm(),
+              ground_truth.translation().norm());
+    // Procrustes falls back to Ceres
+    params.solver_type = SolverType::PROCRUSTES;
+    ProbPointCloudRegistration procrustes(source_cloud, registration.target(), params);
+    procrustes.align();
+    EXPECT_TRUE(procrustes.transformation().isApprox(registration.transformation(), 1e-9));
+}
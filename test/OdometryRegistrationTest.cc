@@ -0,0 +1,125 @@
+#include <chrono>
+#include <limits>
+#include <boost/make_shared.hpp>
+#include <Eigen/Geometry>
+#include <gtest/gtest.h>
+#include <pcl/common/transforms.h>
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+#include "prob_point_cloud_registration/odometry_registration.h"
+#include "prob_point_cloud_registration/prob_point_cloud_registration.h"
+#include "test_clouds.hpp"
+
+using prob_point_cloud_registration::OdometryRegistration;
+using prob_point_cloud_registration::OdometryResult;
+using prob_point_cloud_registration::ProbPointCloudRegistration;
+using prob_point_cloud_registration::ProbPointCloudRegistrationParams;
+using prob_point_cloud_registration::test::generateSurface;
+using prob_point_cloud_registration::test::testParams;
+
+namespace {
+
+// The pose of the sensor at frame k, moving at a constant velocity
+Eigen::Affine3d truePose(int k)
+{
+    Eigen::Affine3d transform = Eigen::Affine3d::Identity();
+    transform.translation() << 0.04 * k, 0.02 * k, 0;
+    transform.rotate(Eigen::AngleAxisd(0.01 * k, Eigen::Vector3d::UnitZ()));
+    return transform;
+}
+
+// The scene seen from the pose of frame k
+pcl::PointCloud<pcl::PointXYZ>::Ptr scan(const pcl::PointCloud<pcl::PointXYZ> &scene, int k)
+{
+    auto cloud = boost::make_shared<pcl::PointCloud<pcl::PointXYZ>>();
+    pcl::transformPointCloud(scene, *cloud, truePose(k).inverse());
+    return cloud;
+}
+
+}  // namespace
+
+TEST(OdometryRegistrationTestSuite, matchesChainedRegistrationsTest)
+{
+    auto scene = generateSurface(30, 30, 0.2);
+    ProbPointCloudRegistrationParams params = testParams();
+    params.radius = 0.3;
+    OdometryRegistration odometry(params);
+    auto previous_scan = scan(*scene, 0);
+    const OdometryResult first = odometry.registerScan(previous_scan);
+    EXPECT_TRUE(first.pose.isApprox(Eigen::Affine3d::Identity()));
+    EXPECT_TRUE(first.statistics.iterations.empty());
+    ASSERT_TRUE(odometry.target());
+    Eigen::Affine3d pose = Eigen::Affine3d::Identity();
+    Eigen::Affine3d motion = Eigen::Affine3d::Identity();
+    for (int k = 1; k < 5; k++) {
+        auto current_scan = scan(*scene, k);
+        const OdometryResult result = odometry.registerScan(current_scan);
+        EXPECT_FALSE(result.timed_out);
+        // The same registration, started from the previous motion
+        auto source_cloud = boost::make_shared<pcl::PointCloud<pcl::PointXYZ>>();
+        pcl::transformPointCloud(*current_scan, *source_cloud, motion);
+        ProbPointCloudRegistration registration(source_cloud, boost::make_shared<pcl::PointCloud<pcl::PointXYZ>>
+                                                (*previous_scan), params);
+        registration.align();
+        motion = registration.transformation() * motion;
+        pose = pose * motion;
+        EXPECT_TRUE(result.motion.isApprox(motion, 1e-9)) << "frame " << k;
+        EXPECT_TRUE(result.pose.isApprox(pose, 1e-9)) << "frame " << k;
+        EXPECT_TRUE(odometry.pose().isApprox(pose, 1e-9));
+        EXPECT_EQ(registration.statistics().iterations.size(), result.statistics.iterations.size());
+        previous_scan = current_scan;
+    }
+}
+
+TEST(OdometryRegistrationTestSuite, spentBudgetKeepsPredictionTest)
+{
+    auto scene = generateSurface(30, 30, 0.2);
+    ProbPointCloudRegistrationParams params = testParams();
+    params.radius = 0.3;
+    params.time_budget = std::numeric_limits<double>::min();
+    OdometryRegistration odometry(params);
+    odometry.registerScan(scan(*scene, 0));
+    const OdometryResult result = odometry.registerScan(scan(*scene, 1));
+    EXPECT_TRUE(result.timed_out);
+    EXPECT_TRUE(result.statistics.iterations.empty());
+    // No motion estimated yet, the prediction is the previous pose
+    EXPECT_TRUE(result.pose.isApprox(Eigen::Affine3d::Identity()));
+}
+
+TEST(OdometryRegistrationTestSuite, pastDeadlineTest)
+{
+    auto scene = generateSurface(30, 30, 0.2);
+    ProbPointCloudRegistrationParams params = testParams();
+    params.radius = 0.3;
+    // The earlier limit wins over a generous budget
+    params.time_budget = 1000;
+    params.deadline = std::chrono::steady_clock::now();
+    ProbPointCloudRegistration registration(scan(*scene, 1), boost::make_shared<pcl::PointCloud<pcl::PointXYZ>>
+                                            (*scene), params);
+    registration.align();
+    EXPECT_TRUE(registration.timedOut());
+    EXPECT_TRUE(registration.statistics().iterations.empty());
+}
+
+TEST(OdometryRegistrationTestSuite, mapTargetTest)
+{
+    auto scene = generateSurface(30, 30, 0.2);
+    ProbPointCloudRegistrationParams params = testParams();
+    params.radius = 0.3;
+    OdometryRegistration odometry(params);
+    auto map = ProbPointCloudRegistration::buildTarget(boost::make_shared<pcl::PointCloud<pcl::PointXYZ>>(*scene),
+                                                       params);
+    odometry.setMap(map, truePose(2));
+    auto current_scan = scan(*scene, 3);
+    const OdometryResult result = odometry.registerScan(current_scan);
+    auto source_cloud = boost::make_shared<pcl::PointCloud<pcl::PointXYZ>>();
+    pcl::transformPointCloud(*current_scan, *source_cloud, truePose(2));
+    ProbPointCloudRegistration registration(source_cloud, map, params);
+    registration.align();
+    const Eigen::Affine3d expected = registration.transformation() * truePose(2);
+    EXPECT_TRUE(result.pose.isApprox(expected, 1e-9));
+    EXPECT_TRUE(result.motion.isApprox(truePose(2).inverse() * expected, 1e-9));
+    // The map stays the target
+    odometry.registerScan(scan(*scene, 4));
+    EXPECT_EQ(map, odometry.target());
+}
@@ -0,0 +1,170 @@
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <string>
+#include <tuple>
+#include <vector>
+#include <boost/make_shared.hpp>
+#include <gtest/gtest.h>
+#include <pcl/filters/voxel_grid.h>
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+#include "prob_point_cloud_registration/point_cloud_io.hpp"
+
+using prob_point_cloud_registration::loadPointCloud;
+
+namespace {
+
+pcl::PointCloud<pcl::PointXYZ> generatePoints()
+{
+    pcl::PointCloud<pcl::PointXYZ> cloud;
+    for (int i = 0; i < 20; ++i) {
+        for (int j = 0; j < 15; ++j) {
+            const float x = 0.13f * i - 1;
+            const float y = 0.17f * j;
+            cloud.push_back(pcl::PointXYZ(x, y, std::sin(x) * std::cos(y)));
+        }
+    }
+    return cloud;
+}
+
+// Binary PCD with an extra field between y and z, to exercise the field offsets
+std::string writeBinaryPCD(const pcl::PointCloud<pcl::PointXYZ> &cloud)
+{
+    const std::string file_name = ::testing::TempDir() + "point_cloud_io_test.pcd";
+    std::ofstream file(file_name, std::ios::binary);
+    file << "# .PCD v0.7 - Point Cloud Data file format\nVERSION 0.7\nFIELDS x y intensity z\n"
+         << "SIZE 4 4 2 4\nTYPE F F U F\nCOUNT 1 1 1 1\nWIDTH " << cloud.size() << "\nHEIGHT 1\n"
+         << "VIEWPOINT 0 0 0 1 0 0 0\nPOINTS " << cloud.size() << "\nDATA binary\n";
+    for (const pcl::PointXYZ &point : cloud) {
+        const unsigned short intensity = 7;
+        file.write(reinterpret_cast<const char *>(&point.x), sizeof(float));
+        file.write(reinterpret_cast<const char *>(&point.y), sizeof(float));
+        file.write(reinterpret_cast<const char *>(&intensity), sizeof(intensity));
+        file.write(reinterpret_cast<const char *>(&point.z), sizeof(float));
+    }
+    return file_name;
+}
+
+// A binary PCD header with the given lines, then data_size bytes of data
+std::string writePCDHeader(const std::string &name, const std::string &size, const std::string &count,
+                           const std::string &points, std::size_t data_size)
+{
+    const std::string file_name = ::testing::TempDir() + name + ".pcd";
+    std::ofstream file(file_name, std::ios::binary);
+    file << "VERSION 0.7\nFIELDS x y intensity z\nSIZE " << size << "\nTYPE F F U F\nCOUNT " << count
+         << "\nWIDTH 1\nHEIGHT 1\nPOINTS " << points << "\nDATA binary\n" << std::string(data_size, '\0');
+    return file_name;
+}
+
+std::string writePackedXYZ(const pcl::PointCloud<pcl::PointXYZ> &cloud)
+{
+    const std::string file_name = ::testing::TempDir() + "point_cloud_io_test.xyz32";
+    std::ofstream file(file_name, std::ios::binary);
+    for (const pcl::PointXYZ &point : cloud) {
+        const float xyz[3] = {point.x, point.y, point.z};
+        file.write(reinterpret_cast<const char *>(xyz), sizeof(xyz));
+    }
+    return file_name;
+}
+
+void expectSamePoints(const pcl::PointCloud<pcl::PointXYZ> &expected, const pcl::PointCloud<pcl::PointXYZ> &actual)
+{
+    ASSERT_EQ(expected.size(), actual.size());
+    for (std::size_t i = 0; i < expected.size(); i++) {
+        EXPECT_NEAR(expected[i].x, actual[i].x, 1e-5);
+        EXPECT_NEAR(expected[i].y, actual[i].y, 1e-5);
+        EXPECT_NEAR(expected[i].z, actual[i].z, 1e-5);
+    }
+}
+
+pcl::PointCloud<pcl::PointXYZ> sorted(pcl::PointCloud<pcl::PointXYZ> cloud)
+{
+    std::sort(cloud.begin(), cloud.end(), [](const pcl::PointXYZ &a, const pcl::PointXYZ &b) {
+        return std::tie(a.x, a.y, a.z) < std::tie(b.x, b.y, b.z);
+    });
+    return cloud;
+}
+
+}  // namespace
+
+TEST(PointCloudIOTestSuite, loadsMappedFilesTest)
+{
+    const pcl::PointCloud<pcl::PointXYZ> expected = generatePoints();
+    const std::vector<std::string> file_names = {writeBinaryPCD(expected), writePackedXYZ(expected)};
+    for (const std::string &file_name : file_names) {
+        pcl::PointCloud<pcl::PointXYZ> cloud;
+        ASSERT_TRUE(loadPointCloud(file_name, 0, cloud)) << file_name;
+        expectSamePoints(expected, cloud);
+    }
+}
+
+TEST(PointCloudIOTestSuite, fusedVoxelFilterTest)
+{
+    const pcl::PointCloud<pcl::PointXYZ> points = generatePoints();
+    pcl::VoxelGrid<pcl::PointXYZ> filter;
+    filter.setInputCloud(points.makeShared());
+    filter.setLeafSize(0.5, 0.5, 0.5);
+    pcl::PointCloud<pcl::PointXYZ> expected;
+    filter.filter(expected);
+    const std::vector<std::string> file_names = {writeBinaryPCD(points), writePackedXYZ(points)};
+    for (const std::string &file_name : file_names) {
+        pcl::PointCloud<pcl::PointXYZ> cloud;
+        ASSERT_TRUE(loadPointCloud(file_name, 0.5, cloud)) << file_name;
+        // Same voxels, the order is up to the PCL version
+        expectSamePoints(sorted(expected), sorted(cloud));
+    }
+}
+
+TEST(PointCloudIOTestSuite, voxelKeyOverflowTest)
+{
+    // 1e6 / 1e-4 is beyond the int voxel coordinates
+    pcl::PointCloud<pcl::PointXYZ> points = generatePoints();
+    points.push_back(pcl::PointXYZ(1e6f, 0, 0));
+    prob_point_cloud_registration::internal::VoxelAccumulator accumulator(1e-4);
+    accumulator.add(points[0].x, points[0].y, points[0].z);
+    EXPECT_FALSE(accumulator.outOfRange());
+    accumulator.add(1e6f, 0, 0);
+    EXPECT_TRUE(accumulator.outOfRange());
+
+    pcl::VoxelGrid<pcl::PointXYZ> filter;
+    filter.setInputCloud(points.makeShared());
+    filter.setLeafSize(1e-4, 1e-4, 1e-4);
+    pcl::PointCloud<pcl::PointXYZ> expected;
+    filter.filter(expected);
+    pcl::PointCloud<pcl::PointXYZ> cloud;
+    ASSERT_TRUE(loadPointCloud(writePackedXYZ(points), 1e-4, cloud));
+    expectSamePoints(sorted(expected), sorted(cloud));
+}
+
+TEST(PointCloudIOTestSuite, missingFileTest)
+{
+    pcl::PointCloud<pcl::PointXYZ> cloud;
+    EXPECT_FALSE(loadPointCloud(::testing::TempDir() + "missing.xyz32", 0, cloud));
+}
+
+TEST(PointCloudIOTestSuite, craftedHeadersTest)
+{
+    using prob_point_cloud_registration::internal::MappedFile;
+    using prob_point_cloud_registration::internal::PointLayout;
+    using prob_point_cloud_registration::internal::parseBinaryPCDHeader;
+    PointLayout layout;
+    // 14 bytes per point
+    EXPECT_TRUE(parseBinaryPCDHeader(MappedFile(writePCDHeader("pcd_valid", "4 4 2 4", "1 1 1 1", "2", 28)),
+                                     &layout));
+    EXPECT_EQ(14u, layout.point_step);
+    EXPECT_EQ(10u, layout.z_offset);
+    EXPECT_FALSE(parseBinaryPCDHeader(MappedFile(writePCDHeader("pcd_truncated", "4 4 2 4", "1 1 1 1", "3", 28)),
+                                      &layout));
+    // 16 bytes times 2^60 + 2 points wraps to 32
+    EXPECT_FALSE(parseBinaryPCDHeader(MappedFile(writePCDHeader("pcd_points_overflow", "4 4 4 4", "1 1 1 1",
+                                                                "1152921504606846978", 32)), &layout));
+    EXPECT_FALSE(parseBinaryPCDHeader(MappedFile(writePCDHeader("pcd_negative_points", "4 4 2 4", "1 1 1 1", "-2",
+                                                                28)), &layout));
+    EXPECT_FALSE(parseBinaryPCDHeader(MappedFile(writePCDHeader("pcd_negative_size", "4 4 -6 4", "1 1 1 1", "2",
+                                                                28)), &layout));
+    EXPECT_FALSE(parseBinaryPCDHeader(MappedFile(writePCDHeader("pcd_zero_count", "4 4 2 4", "1 1 0 1", "2", 28)),
+                                      &layout));
+    EXPECT_FALSE(parseBinaryPCDHeader(MappedFile(writePCDHeader("pcd_count_overflow", "4 4 2 4",
+                                                                "1 1 9223372036854775807 1", "0", 28)), &layout));
+}
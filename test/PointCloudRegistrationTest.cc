@@ -4,10 +4,16 @@
 #include <pcl/kdtree/kdtree_flann.h>
 #include <gtest/gtest.h>
 #include <pcl/common/transforms.h>
+#include <boost/make_shared.hpp>
+#include "prob_point_cloud_registration/prob_point_cloud_registration.h"
 #include "prob_point_cloud_registration/prob_point_cloud_registration_iteration.hpp"
+#include "test_clouds.hpp"
 
+using prob_point_cloud_registration::ProbPointCloudRegistration;
 using prob_point_cloud_registration::ProbPointCloudRegistrationIteration;
 using prob_point_cloud_registration::ProbPointCloudRegistrationParams;
+using prob_point_cloud_registration::test::generateSurface;
+using prob_point_cloud_registration::test::testParams;
 
 pcl::PointCloud<pcl::PointXYZ> generateCloud()
 {
@@ -115,6 +121,157 @@ TEST(ProbPointCloudRegistrationTestSuite, exactDataAssociationTDistributionTest)
     EXPECT_NEAR(mean_error, 0, 1e-6);
 }
 
+TEST(ProbPointCloudRegistrationTestSuite, exactDataAssociationProcrustesTest)
+{
+    auto source_cloud = generateCloud();
+    pcl::PointCloud<pcl::PointXYZ> target_cloud;
+    Eigen::Affine3d transform = Eigen::Affine3d::Identity();
+    transform.translation() << 2.5, 0.0, 0.0;
+    transform.prerotate (Eigen::AngleAxisd (0.34, Eigen::Vector3d::UnitZ()));
+    pcl::transformPointCloud(source_cloud, target_cloud, transform);
+    Eigen::SparseMatrix<double, Eigen::RowMajor> data_association(source_cloud.size(),
+                                                                  target_cloud.size());
+    std::vector<Eigen::Triplet<double>> tripletList;
+    for (std::size_t i = 0; i < source_cloud.size(); ++i) {
+        tripletList.push_back(Eigen::Triplet<double>(i, i, 1));
+    }
+    data_association.setFromTriplets(tripletList.begin(), tripletList.end());
+    data_association.makeCompressed();
+    ProbPointCloudRegistrationParams params;
+    params.dof = 5;
+    params.max_neighbours = 3;
+    params.solver_type = prob_point_cloud_registration::SolverType::PROCRUSTES;
+    ProbPointCloudRegistrationIteration registration(source_cloud, target_cloud, data_association, params);
+    ceres::Solver::Options options;
+    options.max_num_iterations = 100;
+    options.function_tolerance = 10e-5;
+    ceres::Solver::Summary summary;
+    registration.solve(options, &summary);
+
+    auto estimated_transform = registration.transformation();
+    pcl::PointCloud<pcl::PointXYZ> aligned_source;
+    pcl::transformPointCloud (source_cloud, aligned_source, estimated_transform);
+    double mean_error = 0;
+    for (std::size_t i = 0; i < target_cloud.size(); ++i) {
+        double error = std::sqrt(std::pow(target_cloud.at(i).x - aligned_source[i].x, 2) +
+                                 std::pow(target_cloud.at(i).y - aligned_source[i].y, 2) +
+                                 std::pow(target_cloud.at(i).z - aligned_source[i].z, 2));
+        mean_error += error;
+    }
+    mean_error /= target_cloud.size();
+    EXPECT_NEAR(mean_error, 0, 1e-6);
+}
+
+TEST(ProbPointCloudRegistrationTestSuite, weightedMomentsProcrustesTest)
+{
+    auto source_cloud = generateCloud();
+    Eigen::Affine3d transform = Eigen::Affine3d::Identity();
+    transform.translation() << 2.5, -1.0, 0.3;
+    transform.prerotate(Eigen::AngleAxisd(0.34, Eigen::Vector3d::UnitZ()));
+    prob_point_cloud_registration::WeightedMoments moments;
+    for (std::size_t i = 0; i < source_cloud.size(); ++i) {
+        const Eigen::Vector3d x = source_cloud[i].getVector3fMap().cast<double>();
+        const Eigen::Vector3d y = transform * x;
+        const double weight = 0.5 + (i % 7) / 7.0;
+        moments.total_weight += weight;
+        moments.source_sum += weight * x;
+        moments.target_sum += weight * y;
+        moments.cross_sum += weight * x * y.transpose();
+    }
+    Eigen::Affine3d estimated_transform;
+    ASSERT_TRUE(prob_point_cloud_registration::weightedRigidTransform(moments, &estimated_transform));
+    EXPECT_TRUE(estimated_transform.isApprox(transform, 1e-9));
+    EXPECT_FALSE(prob_point_cloud_registration::weightedRigidTransform(
+                     prob_point_cloud_registration::WeightedMoments(), &estimated_transform));
+}
+
+TEST(ProbPointCloudRegistrationTestSuite, pruningTest)
+{
+    // Spread out, so that the far neighbours have a negligible weight
+    auto target_cloud = boost::make_shared<pcl::PointCloud<pcl::PointXYZ>>();
+    pcl::transformPointCloud(generateCloud(), *target_cloud, Eigen::Affine3d(Eigen::Scaling(10.0)));
+    Eigen::Affine3d transform = Eigen::Affine3d::Identity();
+    transform.translation() << 1, -0.5, 0.2;
+    transform.prerotate(Eigen::AngleAxisd(0.02, Eigen::Vector3d::UnitZ()));
+    auto source_cloud = boost::make_shared<pcl::PointCloud<pcl::PointXYZ>>();
+    pcl::transformPointCloud(*target_cloud, *source_cloud, transform.inverse());
+    // The Ceres solves run on the compacted active associations
+    for (auto solver_type : {prob_point_cloud_registration::SolverType::PROCRUSTES,
+                             prob_point_cloud_registration::SolverType::CERES}) {
+        ProbPointCloudRegistrationParams params = testParams();
+        params.radius = 12;
+        params.n_iter = 5;
+        params.solver_type = solver_type;
+        ProbPointCloudRegistration expected(source_cloud, target_cloud, params);
+        expected.align();
+        params.prune_weight = 1e-4;
+        ProbPointCloudRegistration registration(source_cloud, expected.target(), params);
+        registration.align();
+        ASSERT_EQ(expected.statistics().iterations.size(), registration.statistics().iterations.size());
+        for (const auto &iteration : expected.statistics().iterations) {
+            EXPECT_EQ(iteration.num_associations, iteration.num_active_associations);
+        }
+        // Pruning the negligible weights barely moves the estimate
+        const auto &last = registration.statistics().iterations.back();
+        EXPECT_LT(last.num_active_associations, last.num_associations);
+        EXPECT_TRUE(registration.transformation().isApprox(expected.transformation(), 1e-4));
+    }
+}
+
+TEST(ProbPointCloudRegistrationTestSuite, deterministicTest)
+{
+    // Enough associations for the sums to be split in several blocks
+    auto target_cloud = generateSurface(120, 100, 0.25);
+    Eigen::Affine3d transform = Eigen::Affine3d::Identity();
+    transform.translation() << 0.2, -0.1, 0.05;
+    transform.prerotate(Eigen::AngleAxisd(0.03, Eigen::Vector3d::UnitZ()));
+    auto source_cloud = boost::make_shared<pcl::PointCloud<pcl::PointXYZ>>();
+    pcl::transformPointCloud(*target_cloud, *source_cloud, transform.inverse());
+    ProbPointCloudRegistrationParams params = testParams();
+    params.radius = 0.6;
+    params.max_neighbours = 5;
+    params.n_iter = 4;
+    params.deterministic = true;
+    std::vector<Eigen::Matrix4d> transformations;
+    for (int num_threads : {1, 3, 8}) {
+        params.executor = std::make_shared<prob_point_cloud_registration::OpenMPExecutor>(num_threads);
+        ProbPointCloudRegistration registration(source_cloud, target_cloud, params);
+        registration.align();
+        ASSERT_GT(registration.statistics().iterations.back().num_associations,
+                  2u * prob_point_cloud_registration::kDeterministicBlockSize);
+        transformations.push_back(registration.transformation().matrix());
+    }
+    // Bit-identical whatever the thread count
+    EXPECT_EQ(transformations[0], transformations[1]);
+    EXPECT_EQ(transformations[0], transformations[2]);
+}
+
+TEST(ProbPointCloudRegistrationTestSuite, floatScalarTypeTest)
+{
+    auto target_cloud = generateSurface(40, 40, 0.25);
+    Eigen::Affine3d transform = Eigen::Affine3d::Identity();
+    transform.translation() << 0.2, -0.1, 0.05;
+    transform.prerotate(Eigen::AngleAxisd(0.03, Eigen::Vector3d::UnitZ()));
+    auto source_cloud = boost::make_shared<pcl::PointCloud<pcl::PointXYZ>>();
+    pcl::transformPointCloud(*target_cloud, *source_cloud, transform.inverse());
+    ProbPointCloudRegistrationParams params = testParams();
+    params.radius = 0.6;
+    params.max_neighbours = 5;
+    params.n_iter = 10;
+    for (auto solver_type : {prob_point_cloud_registration::SolverType::CERES,
+                             prob_point_cloud_registration::SolverType::PROCRUSTES}) {
+        params.solver_type = solver_type;
+        params.scalar_type = prob_point_cloud_registration::ScalarType::DOUBLE;
+        ProbPointCloudRegistration expected(source_cloud, target_cloud, params);
+        expected.align();
+        params.scalar_type = prob_point_cloud_registration::ScalarType::FLOAT;
+        ProbPointCloudRegistration registration(source_cloud, expected.target(), params);
+        registration.align();
+        // Single precision weights barely move the estimate
+        EXPECT_TRUE(registration.transformation().isApprox(expected.transformation(), 1e-4));
+    }
+}
+
 //TEST(PointCloudRegistrationTestSuite, nonExactDataAssociationTest)
 //{
 //    auto source_cloud = generateCloud();
@@ -64,3 +64,33 @@ TEST(UpdateWeightsTestSuite, gaussianCallbackTest)
         }
     }
 }
+
+TEST(UpdateWeightsTestSuite, inPlaceWeightsTest)
+{
+    auto data_association = dataAssociation();
+    std::vector<double> squared_errors = squaredErrors();
+    ProbabilisticWeights weightUpdater(5, 1, 4);
+    auto expected_weights = weightUpdater.updateWeights(data_association, squared_errors);
+    std::vector<double> weights(data_association.nonZeros(), -1);
+    weightUpdater.updateWeights(data_association, squared_errors, weights.data());
+    for (std::size_t k = 0; k < weights.size(); k++) {
+        EXPECT_DOUBLE_EQ(expected_weights.valuePtr()[k], weights[k]);
+    }
+    EXPECT_NEAR(0.7151351, weights[3], 1e-6);
+}
+
+TEST(UpdateWeightsTestSuite, floatWeightsTest)
+{
+    auto data_association = dataAssociation();
+    const std::vector<double> squared_errors = squaredErrors();
+    const std::vector<float> float_squared_errors(squared_errors.begin(), squared_errors.end());
+    for (double dof : {5.0, std::numeric_limits<double>::infinity()}) {
+        ProbabilisticWeights weightUpdater(dof, 1, 4);
+        auto expected_weights = weightUpdater.updateWeights(data_association, squared_errors);
+        std::vector<float> weights(data_association.nonZeros(), -1);
+        weightUpdater.updateWeights(data_association, float_squared_errors, weights.data());
+        for (std::size_t k = 0; k < weights.size(); k++) {
+            EXPECT_NEAR(expected_weights.valuePtr()[k], weights[k], 1e-6);
+        }
+    }
+}
@@ -0,0 +1,232 @@
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <boost/make_shared.hpp>
+#include <Eigen/Geometry>
+#include <gtest/gtest.h>
+#include <pcl/common/transforms.h>
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+#include "prob_point_cloud_registration/neighbour_search.hpp"
+#include "prob_point_cloud_registration/prob_point_cloud_registration.h"
+#include "prob_point_cloud_registration/registration_service.h"
+#include "prob_point_cloud_registration/target_cache.h"
+#include "test_clouds.hpp"
+
+using prob_point_cloud_registration::NeighbourSearch;
+using prob_point_cloud_registration::ProbPointCloudRegistration;
+using prob_point_cloud_registration::ProbPointCloudRegistrationParams;
+using prob_point_cloud_registration::RegistrationService;
+using prob_point_cloud_registration::RegistrationServiceOptions;
+using prob_point_cloud_registration::TargetCache;
+using prob_point_cloud_registration::test::generateSurface;
+
+namespace {
+
+// Packed float x, y, z, see loadPointCloud()
+std::string writeTarget(const std::string &name, const pcl::PointCloud<pcl::PointXYZ> &cloud)
+{
+    const std::string file_name = ::testing::TempDir() + name + ".xyz32";
+    std::ofstream file(file_name, std::ios::binary);
+    for (const pcl::PointXYZ &point : cloud) {
+        const float xyz[3] = {point.x, point.y, point.z};
+        file.write(reinterpret_cast<const char *>(xyz), sizeof(xyz));
+    }
+    return file_name;
+}
+
+void writeRequest(const std::string &target_name, const pcl::PointCloud<pcl::PointXYZ> &source, std::ostream &out,
+                  double target_filter_size = 0)
+{
+    out << "register " << target_name << " " << target_filter_size << " " << source.size() << "\n";
+    for (const pcl::PointXYZ &point : source) {
+        const float xyz[3] = {point.x, point.y, point.z};
+        out.write(reinterpret_cast<const char *>(xyz), sizeof(xyz));
+    }
+}
+
+ProbPointCloudRegistrationParams serviceParams()
+{
+    ProbPointCloudRegistrationParams params = prob_point_cloud_registration::test::testParams();
+    params.radius = 0.6;
+    params.max_neighbours = 5;
+    params.num_threads = 2;
+    // The same result for any number of threads
+    params.deterministic = true;
+    return params;
+}
+
+// Serves the targets written by writeTarget()
+RegistrationServiceOptions serviceOptions()
+{
+    RegistrationServiceOptions options;
+    options.target_root = ::testing::TempDir();
+    return options;
+}
+
+}  // namespace
+
+TEST(RegistrationServiceTestSuite, leastRecentlyUsedEvictionTest)
+{
+    const pcl::PointCloud<pcl::PointXYZ> cloud = *generateSurface(30, 30, 0.2);
+    const std::string a = writeTarget("target_cache_a", cloud);
+    const std::string b = writeTarget("target_cache_b", cloud);
+    TargetCache cache(2, serviceParams());
+    const std::shared_ptr<NeighbourSearch> first = cache.get(a, 0);
+    cache.get(b, 0);
+    EXPECT_EQ(first, cache.get(a, 0));
+    // Another filter size is another target, it evicts b
+    const std::shared_ptr<NeighbourSearch> filtered = cache.get(a, 0.5);
+    EXPECT_LT(filtered->size(), first->size());
+    EXPECT_EQ(2u, cache.size());
+    EXPECT_EQ(first, cache.get(a, 0));
+    cache.get(b, 0);
+    EXPECT_EQ(2u, cache.hits());
+    EXPECT_EQ(4u, cache.misses());
+    EXPECT_EQ(cloud.size(), first->size());
+}
+
+TEST(RegistrationServiceTestSuite, concurrentRequestsLoadOnceTest)
+{
+    const std::string file_name = writeTarget("target_cache_concurrent", *generateSurface(30, 30, 0.2));
+    TargetCache cache(1, serviceParams());
+    std::vector<std::shared_ptr<NeighbourSearch>> targets(4);
+    std::vector<std::thread> threads;
+    for (std::size_t i = 0; i < targets.size(); i++) {
+        threads.emplace_back([&, i]() {
+            targets[i] = cache.get(file_name, 0);
+        });
+    }
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+    EXPECT_EQ(1u, cache.misses());
+    EXPECT_EQ(3u, cache.hits());
+    for (const std::shared_ptr<NeighbourSearch> &target : targets) {
+        EXPECT_EQ(targets[0], target);
+    }
+}
+
+TEST(RegistrationServiceTestSuite, missingTargetTest)
+{
+    TargetCache cache(2, serviceParams());
+    const std::string file_name = ::testing::TempDir() + "missing_target.xyz32";
+    EXPECT_THROW(cache.get(file_name, 0), std::runtime_error);
+    // Failed loads are not cached
+    EXPECT_THROW(cache.get(file_name, 0), std::runtime_error);
+    EXPECT_EQ(2u, cache.misses());
+    EXPECT_EQ(0u, cache.size());
+}
+
+TEST(RegistrationServiceTestSuite, serveRequestsTest)
+{
+    const pcl::PointCloud<pcl::PointXYZ> target_cloud = *generateSurface(30, 30, 0.2);
+    const std::string file_name = writeTarget("registration_service", target_cloud);
+    Eigen::Affine3d ground_truth = Eigen::Affine3d::Identity();
+    ground_truth.translation() << 0.1, -0.05, 0.05;
+    ground_truth.rotate(Eigen::AngleAxisd(0.05, Eigen::Vector3d::UnitZ()));
+    auto source_cloud = boost::make_shared<pcl::PointCloud<pcl::PointXYZ>>();
+    pcl::transformPointCloud(target_cloud, *source_cloud, ground_truth.inverse());
+    ProbPointCloudRegistration expected(source_cloud, boost::make_shared<pcl::PointCloud<pcl::PointXYZ>>(target_cloud),
+                                        serviceParams());
+    expected.align();
+
+    std::stringstream in;
+    writeRequest("missing_target.xyz32", *source_cloud, in);
+    writeRequest("registration_service.xyz32", *source_cloud, in);
+    writeRequest("registration_service.xyz32", *source_cloud, in);
+    std::stringstream out;
+    RegistrationService service(serviceParams(), 2, 2, serviceOptions());
+    service.serve(in, out);
+
+    std::string line;
+    ASSERT_TRUE(std::getline(out, line));
+    EXPECT_EQ(0u, line.find("error"));
+    for (int request = 0; request < 2; request++) {
+        ASSERT_TRUE(std::getline(out, line));
+        std::istringstream response(line);
+        std::string status;
+        int iterations = 0;
+        Eigen::Matrix4d transformation = Eigen::Matrix4d::Identity();
+        response >> status >> iterations;
+        for (int row = 0; row < 3; row++) {
+            for (int col = 0; col < 4; col++) {
+                response >> transformation(row, col);
+            }
+        }
+        ASSERT_EQ("ok", status) << line;
+        EXPECT_EQ(static_cast<int>(expected.statistics().iterations.size()), iterations);
+        EXPECT_TRUE(transformation.isApprox(expected.transformation().matrix(), 1e-9)) << transformation;
+    }
+    EXPECT_FALSE(std::getline(out, line));
+    EXPECT_EQ(1u, service.cache().hits());
+}
+
+TEST(RegistrationServiceTestSuite, malformedRequestTest)
+{
+    std::stringstream in("align target.pcd\n");
+    std::stringstream out;
+    RegistrationService service(serviceParams(), 1, 1);
+    service.serve(in, out);
+    EXPECT_EQ(0u, out.str().find("error malformed request"));
+}
+
+TEST(RegistrationServiceTestSuite, hugePointCountTest)
+{
+    // The announced size is not allocated up front, the missing points end the connection
+    std::stringstream in;
+    in << "register target.xyz32 0 99999999999999\n";
+    in.write("\0\0\0\0\0\0\0\0\0\0\0\0", 12);
+    std::stringstream out;
+    RegistrationServiceOptions options = serviceOptions();
+    options.max_source_points = std::numeric_limits<std::size_t>::max();
+    RegistrationService service(serviceParams(), 1, 1, options);
+    service.serve(in, out);
+    EXPECT_EQ(0u, out.str().find("error truncated source cloud"));
+}
+
+TEST(RegistrationServiceTestSuite, forbiddenRequestsTest)
+{
+    const pcl::PointCloud<pcl::PointXYZ> target_cloud = *generateSurface(30, 30, 0.2);
+    const std::string outside = writeTarget("service_outside_target", target_cloud);
+    RegistrationServiceOptions options;
+    options.target_root = ::testing::TempDir() + "service_root";
+    options.target_filter_sizes = {0, 0.5};
+    options.max_source_points = target_cloud.size();
+    mkdir(options.target_root.c_str(), 0755);
+    writeTarget("service_root/target", target_cloud);
+    const std::string link = options.target_root + "/link.xyz32";
+    unlink(link.c_str());
+    ASSERT_EQ(0, symlink(outside.c_str(), link.c_str()));
+
+    std::stringstream in;
+    writeRequest(outside, target_cloud, in);
+    writeRequest("../service_outside_target.xyz32", target_cloud, in);
+    writeRequest("link.xyz32", target_cloud, in);
+    writeRequest("target.xyz32", target_cloud, in, 0.3);
+    writeRequest("target.xyz32", target_cloud, in, 0.5);
+    // Refused before it is read, the connection is closed
+    in << "register target.xyz32 0 " << target_cloud.size() + 1 << "\n";
+    std::stringstream out;
+    RegistrationService service(serviceParams(), 1, 1, options);
+    service.serve(in, out);
+
+    std::string line;
+    for (int request = 0; request < 4; request++) {
+        ASSERT_TRUE(std::getline(out, line));
+        EXPECT_EQ(0u, line.find("error unknown or forbidden target")) << line;
+    }
+    ASSERT_TRUE(std::getline(out, line));
+    EXPECT_EQ(0u, line.find("ok")) << line;
+    ASSERT_TRUE(std::getline(out, line));
+    EXPECT_EQ(0u, line.find("error too many source points")) << line;
+    EXPECT_FALSE(std::getline(out, line));
+    EXPECT_EQ(1u, service.cache().misses());
+}
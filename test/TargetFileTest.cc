@@ -0,0 +1,192 @@
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <vector>
+#include <boost/make_shared.hpp>
+#include <Eigen/Geometry>
+#include <gtest/gtest.h>
+#include <pcl/common/transforms.h>
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+#include "prob_point_cloud_registration/neighbour_search.hpp"
+#include "prob_point_cloud_registration/prob_point_cloud_registration.h"
+#include "prob_point_cloud_registration/target_file.hpp"
+#include "test_clouds.hpp"
+
+using prob_point_cloud_registration::NeighbourSearch;
+using prob_point_cloud_registration::NeighbourSearchType;
+using prob_point_cloud_registration::ProbPointCloudRegistration;
+using prob_point_cloud_registration::ProbPointCloudRegistrationParams;
+using prob_point_cloud_registration::VoxelHashSearch;
+using prob_point_cloud_registration::test::generateSurface;
+
+namespace {
+
+ProbPointCloudRegistrationParams targetParams(NeighbourSearchType neighbour_search)
+{
+    ProbPointCloudRegistrationParams params = prob_point_cloud_registration::test::testParams();
+    params.radius = 0.4;
+    params.max_neighbours = 5;
+    params.target_filter_size = 0.15;
+    params.neighbour_search = neighbour_search;
+    params.deterministic = true;
+    params.num_threads = 2;
+    return params;
+}
+
+// Stands for the cloud file the targets are built from
+std::string writeSource(const std::string &name, const pcl::PointCloud<pcl::PointXYZ> &cloud)
+{
+    const std::string file_name = ::testing::TempDir() + name + ".xyz32";
+    std::ofstream file(file_name, std::ios::binary | std::ios::trunc);
+    for (const pcl::PointXYZ &point : cloud) {
+        const float xyz[3] = {point.x, point.y, point.z};
+        file.write(reinterpret_cast<const char *>(xyz), sizeof(xyz));
+    }
+    return file_name;
+}
+
+// The neighbours of a few query points are the same in both searches
+void expectSameNeighbours(const NeighbourSearch &expected, const NeighbourSearch &actual, double radius)
+{
+    ASSERT_EQ(expected.size(), actual.size());
+    for (int i = 0; i < 20; i++) {
+        const pcl::PointXYZ query(0.2 * i, 0.15 * i, 0.3);
+        std::vector<int> expected_indices, actual_indices;
+        std::vector<float> expected_distances, actual_distances;
+        expected.radiusSearch(query, radius, 5, expected_indices, expected_distances);
+        actual.radiusSearch(query, radius, 5, actual_indices, actual_distances);
+        EXPECT_EQ(expected_indices, actual_indices);
+        EXPECT_EQ(expected_distances, actual_distances);
+    }
+}
+
+}  // namespace
+
+TEST(TargetFileTestSuite, voxelHashRoundTripTest)
+{
+    const ProbPointCloudRegistrationParams params = targetParams(NeighbourSearchType::VOXEL_HASH);
+    const std::string file_name = ::testing::TempDir() + "voxel_hash.ppcrtgt";
+    const std::string source_file_name = writeSource("voxel_hash_source", *generateSurface(40, 40, 0.1));
+    std::shared_ptr<NeighbourSearch> built = ProbPointCloudRegistration::buildTarget(generateSurface(40, 40, 0.1),
+                                                                                     params);
+    ASSERT_TRUE(ProbPointCloudRegistration::saveTarget(*built, source_file_name, params, file_name));
+    std::shared_ptr<NeighbourSearch> loaded = ProbPointCloudRegistration::loadTarget(file_name, source_file_name,
+                                                                                     params);
+    ASSERT_TRUE(loaded != NULL);
+    auto loaded_hash = std::dynamic_pointer_cast<VoxelHashSearch>(loaded);
+    ASSERT_TRUE(loaded_hash != NULL);
+    EXPECT_EQ(std::dynamic_pointer_cast<VoxelHashSearch>(built)->numCells(), loaded_hash->numCells());
+    expectSameNeighbours(*built, *loaded, params.radius);
+}
+
+TEST(TargetFileTestSuite, kdTreeRoundTripTest)
+{
+    const ProbPointCloudRegistrationParams params = targetParams(NeighbourSearchType::KDTREE);
+    const std::string file_name = ::testing::TempDir() + "kdtree.ppcrtgt";
+    const std::string source_file_name = writeSource("kdtree_source", *generateSurface(40, 40, 0.1));
+    std::shared_ptr<NeighbourSearch> built = ProbPointCloudRegistration::buildTarget(generateSurface(40, 40, 0.1),
+                                                                                     params);
+    ASSERT_TRUE(ProbPointCloudRegistration::saveTarget(*built, source_file_name, params, file_name));
+    std::shared_ptr<NeighbourSearch> loaded = ProbPointCloudRegistration::loadTarget(file_name, source_file_name,
+                                                                                     params);
+    ASSERT_TRUE(loaded != NULL);
+    expectSameNeighbours(*built, *loaded, params.radius);
+}
+
+TEST(TargetFileTestSuite, rejectedFilesTest)
+{
+    const ProbPointCloudRegistrationParams params = targetParams(NeighbourSearchType::VOXEL_HASH);
+    const std::string file_name = ::testing::TempDir() + "rejected.ppcrtgt";
+    const std::string source_file_name = writeSource("rejected_source", *generateSurface(40, 40, 0.1));
+    EXPECT_TRUE(ProbPointCloudRegistration::loadTarget(::testing::TempDir() + "missing.ppcrtgt", source_file_name,
+                                                       params) == NULL);
+    std::shared_ptr<NeighbourSearch> built = ProbPointCloudRegistration::buildTarget(generateSurface(40, 40, 0.1),
+                                                                                     params);
+    ASSERT_TRUE(ProbPointCloudRegistration::saveTarget(*built, source_file_name, params, file_name));
+
+    ProbPointCloudRegistrationParams other_filter = params;
+    other_filter.target_filter_size = 0.2;
+    EXPECT_TRUE(ProbPointCloudRegistration::loadTarget(file_name, source_file_name, other_filter) == NULL);
+    ProbPointCloudRegistrationParams other_radius = params;
+    other_radius.radius = 0.5;
+    EXPECT_TRUE(ProbPointCloudRegistration::loadTarget(file_name, source_file_name, other_radius) == NULL);
+    EXPECT_TRUE(ProbPointCloudRegistration::loadTarget(file_name, source_file_name,
+                                                       targetParams(NeighbourSearchType::KDTREE)) == NULL);
+    // Built from another cloud file
+    const std::string other_source_file_name = writeSource("rejected_other_source", *generateSurface(40, 40, 0.1));
+    EXPECT_TRUE(ProbPointCloudRegistration::loadTarget(file_name, other_source_file_name, params) == NULL);
+
+    std::string content;
+    {
+        std::ifstream file(file_name, std::ios::binary);
+        content.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    }
+    {
+        std::ofstream file(file_name, std::ios::binary | std::ios::trunc);
+        file.write(content.data(), content.size() - 4);
+    }
+    EXPECT_TRUE(ProbPointCloudRegistration::loadTarget(file_name, source_file_name, params) == NULL);
+}
+
+TEST(TargetFileTestSuite, changedSourceTest)
+{
+    const ProbPointCloudRegistrationParams params = targetParams(NeighbourSearchType::KDTREE);
+    const std::string file_name = ::testing::TempDir() + "changed_source.ppcrtgt";
+    pcl::PointCloud<pcl::PointXYZ>::Ptr cloud = generateSurface(40, 40, 0.1);
+    const std::string source_file_name = writeSource("changed_source", *cloud);
+    std::shared_ptr<NeighbourSearch> built = ProbPointCloudRegistration::buildTarget(cloud, params);
+    ASSERT_TRUE(ProbPointCloudRegistration::saveTarget(*built, source_file_name, params, file_name));
+    ASSERT_TRUE(ProbPointCloudRegistration::loadTarget(file_name, source_file_name, params) != NULL);
+    cloud->resize(cloud->size() / 2);
+    writeSource("changed_source", *cloud);
+    EXPECT_TRUE(ProbPointCloudRegistration::loadTarget(file_name, source_file_name, params) == NULL);
+}
+
+TEST(TargetFileTestSuite, overflowingCountsTest)
+{
+    const ProbPointCloudRegistrationParams params = targetParams(NeighbourSearchType::KDTREE);
+    const std::string file_name = ::testing::TempDir() + "overflowing_counts.ppcrtgt";
+    const std::string source_file_name = writeSource("overflowing_counts_source", *generateSurface(40, 40, 0.1));
+    std::shared_ptr<NeighbourSearch> built = ProbPointCloudRegistration::buildTarget(generateSurface(40, 40, 0.1),
+                                                                                     params);
+    ASSERT_TRUE(ProbPointCloudRegistration::saveTarget(*built, source_file_name, params, file_name));
+    // 12 bytes times 2^62 more points wraps to the same byte count
+    std::fstream file(file_name, std::ios::binary | std::ios::in | std::ios::out);
+    std::uint64_t num_points = 0;
+    file.seekg(offsetof(prob_point_cloud_registration::internal::TargetFileHeader, num_points));
+    file.read(reinterpret_cast<char *>(&num_points), sizeof(num_points));
+    num_points += std::uint64_t(1) << 62;
+    file.seekp(offsetof(prob_point_cloud_registration::internal::TargetFileHeader, num_points));
+    file.write(reinterpret_cast<const char *>(&num_points), sizeof(num_points));
+    file.close();
+    EXPECT_TRUE(ProbPointCloudRegistration::loadTarget(file_name, source_file_name, params) == NULL);
+}
+
+TEST(TargetFileTestSuite, registrationWithLoadedTargetTest)
+{
+    const ProbPointCloudRegistrationParams params = targetParams(NeighbourSearchType::VOXEL_HASH);
+    const std::string file_name = ::testing::TempDir() + "registration.ppcrtgt";
+    const std::string source_file_name = writeSource("registration_source", *generateSurface(40, 40, 0.1));
+    std::shared_ptr<NeighbourSearch> built = ProbPointCloudRegistration::buildTarget(generateSurface(40, 40, 0.1),
+                                                                                     params);
+    ASSERT_TRUE(ProbPointCloudRegistration::saveTarget(*built, source_file_name, params, file_name));
+    std::shared_ptr<NeighbourSearch> loaded = ProbPointCloudRegistration::loadTarget(file_name, source_file_name,
+                                                                                     params);
+    ASSERT_TRUE(loaded != NULL);
+
+    Eigen::Affine3d ground_truth = Eigen::Affine3d::Identity();
+    ground_truth.translation() << 0.05, -0.03, 0.02;
+    ground_truth.rotate(Eigen::AngleAxisd(0.03, Eigen::Vector3d::UnitZ()));
+    auto source_cloud = boost::make_shared<pcl::PointCloud<pcl::PointXYZ>>();
+    pcl::transformPointCloud(*generateSurface(40, 40, 0.1), *source_cloud, ground_truth.inverse());
+    ProbPointCloudRegistration expected(source_cloud, built, params);
+    expected.align();
+    ProbPointCloudRegistration registration(source_cloud, loaded, params);
+    registration.align();
+    EXPECT_EQ(expected.statistics().iterations.size(), registration.statistics().iterations.size());
+    EXPECT_TRUE(registration.transformation().isApprox(expected.transformation(), 1e-12));
+}
@@ -0,0 +1,103 @@
+#include <memory>
+#include <string>
+#include <vector>
+#include <boost/make_shared.hpp>
+#include <Eigen/Geometry>
+#include <gtest/gtest.h>
+#include <pcl/common/transforms.h>
+#include <pcl/kdtree/kdtree_flann.h>
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+#include "prob_point_cloud_registration/neighbour_search.hpp"
+#include "prob_point_cloud_registration/prob_point_cloud_registration.h"
+#include "prob_point_cloud_registration/tiled_target_map.h"
+#include "test_clouds.hpp"
+
+using prob_point_cloud_registration::KdTreeSearch;
+using prob_point_cloud_registration::ProbPointCloudRegistration;
+using prob_point_cloud_registration::ProbPointCloudRegistrationParams;
+using prob_point_cloud_registration::TiledTargetMap;
+using prob_point_cloud_registration::writeTargetTiles;
+using prob_point_cloud_registration::test::generateSurface;
+using prob_point_cloud_registration::test::testParams;
+
+namespace {
+
+std::string writeTiles(const pcl::PointCloud<pcl::PointXYZ> &cloud, const std::string &name)
+{
+    const std::string directory = ::testing::TempDir() + name;
+    EXPECT_TRUE(writeTargetTiles(cloud, 1.0, directory));
+    return directory;
+}
+
+}  // namespace
+
+TEST(TiledTargetMapTestSuite, matchesSingleKdTreeTest)
+{
+    auto cloud = generateSurface(40, 40, 0.15, -1, -2);
+    TiledTargetMap tiles(writeTiles(*cloud, "tiled_target_map_search"), 4);
+    auto kdtree = boost::make_shared<pcl::KdTreeFLANN<pcl::PointXYZ>>();
+    kdtree->setInputCloud(cloud);
+    const KdTreeSearch expected_search(kdtree);
+    ASSERT_EQ(cloud->size(), tiles.size());
+    EXPECT_GT(tiles.numTiles(), 9);
+
+    std::vector<int> expected_indices, indices;
+    std::vector<float> expected_distances, distances;
+    for (int i = 0; i < 40; i++) {
+        // Queries around the tile corners as well
+        const pcl::PointXYZ query(0.13f * i - 1, 0.11f * i - 2, 1);
+        for (int max_neighbours : {0, 7}) {
+            expected_search.radiusSearch(query, 0.6, max_neighbours, expected_indices, expected_distances);
+            tiles.radiusSearch(query, 0.6, max_neighbours, indices, distances);
+            ASSERT_EQ(expected_indices.size(), indices.size()) << "query " << i;
+            for (std::size_t k = 0; k < indices.size(); k++) {
+                EXPECT_FLOAT_EQ(expected_distances[k], distances[k]);
+                EXPECT_FLOAT_EQ(expected_distances[k],
+                                (tiles.point(indices[k]).getVector3fMap() - query.getVector3fMap()).squaredNorm());
+            }
+        }
+    }
+}
+
+TEST(TiledTargetMapTestSuite, residencyIsBoundedTest)
+{
+    auto cloud = generateSurface(40, 40, 0.15, -1, -2);
+    TiledTargetMap tiles(writeTiles(*cloud, "tiled_target_map_residency"), 2);
+    // Sweeps a small box over the map, only the tiles around it stay in memory
+    for (int i = 0; i < 5; i++) {
+        const Eigen::Vector3f corner(i - 0.5f, -1.5f, 0.5f);
+        tiles.prepare(Eigen::AlignedBox3f(corner, corner + Eigen::Vector3f::Constant(0.2f)), 0.1);
+        EXPECT_LE(tiles.numResidentTiles(), 2) << "step " << i;
+    }
+    const int num_loads = tiles.numTileLoads();
+    // A box spanning more tiles than the bound keeps all of them
+    tiles.prepare(Eigen::AlignedBox3f(Eigen::Vector3f(-0.5f, -1.5f, 0.5f), Eigen::Vector3f(1.5f, -0.5f, 0.5f)), 0.1);
+    EXPECT_GT(tiles.numResidentTiles(), 2);
+    EXPECT_GT(tiles.numTileLoads(), num_loads);
+}
+
+TEST(TiledTargetMapTestSuite, registrationMatchesInMemoryTargetTest)
+{
+    auto target_cloud = generateSurface(40, 40, 0.15, -1, -2);
+    auto tiles = std::make_shared<TiledTargetMap>(writeTiles(*target_cloud, "tiled_target_map_registration"), 4);
+    Eigen::Affine3d ground_truth = Eigen::Affine3d::Identity();
+    ground_truth.translation() << 0.1, -0.05, 0.02;
+    ground_truth.rotate(Eigen::AngleAxisd(0.02, Eigen::Vector3d::UnitZ()));
+    auto source_cloud = boost::make_shared<pcl::PointCloud<pcl::PointXYZ>>();
+    pcl::transformPointCloud(*target_cloud, *source_cloud, ground_truth.inverse());
+
+    ProbPointCloudRegistrationParams params = testParams();
+    params.radius = 0.4;
+    params.n_iter = 10;
+    params.solver_type = prob_point_cloud_registration::SolverType::CERES;
+    ProbPointCloudRegistration expected(source_cloud, target_cloud, params);
+    expected.align();
+    ProbPointCloudRegistration registration(source_cloud, tiles, params);
+    registration.align();
+    // The same associations, up to the order of the target points
+    EXPECT_TRUE(registration.transformation().isApprox(expected.transformation(), 1e-5));
+    EXPECT_EQ(expected.statistics().iterations.size(), registration.statistics().iterations.size());
+    EXPECT_EQ(expected.statistics().iterations.back().num_associations,
+              registration.statistics().iterations.back().num_associations);
+}
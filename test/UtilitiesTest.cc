@@ -0,0 +1,84 @@
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+#include <boost/make_shared.hpp>
+#include <gtest/gtest.h>
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+#include "prob_point_cloud_registration/executor.hpp"
+#include "prob_point_cloud_registration/neighbour_search.hpp"
+#include "prob_point_cloud_registration/utilities.hpp"
+
+using prob_point_cloud_registration::ClosestDistances;
+using prob_point_cloud_registration::OpenMPExecutor;
+using prob_point_cloud_registration::VoxelHashSearch;
+
+namespace {
+
+pcl::PointCloud<pcl::PointXYZ>::Ptr generateCloud(int size, float offset)
+{
+    auto cloud = boost::make_shared<pcl::PointCloud<pcl::PointXYZ>>();
+    for (int i = 0; i < size; ++i) {
+        const float x = 0.07f * i;
+        cloud->push_back(pcl::PointXYZ(x, std::sin(3 * x) + offset, offset * std::cos(x)));
+    }
+    return cloud;
+}
+
+// The median of the original metrics, through a full sort
+double sortedMedian(std::vector<float> values)
+{
+    std::sort(values.begin(), values.end());
+    if (values.size() % 2 != 0) {
+        return values[(values.size() + 1) / 2];
+    }
+    return (values[values.size() / 2] + values[(values.size() / 2) + 1]) / 2.0;
+}
+
+}  // namespace
+
+TEST(UtilitiesTestSuite, closestDistancesTest)
+{
+    // Odd and even sizes, for both branches of the median
+    for (int size : {201, 200}) {
+        auto cloud1 = generateCloud(size, 0.1f);
+        auto cloud2 = generateCloud(size + 50, 0);
+        OpenMPExecutor executor(3);
+        const ClosestDistances distances(*cloud1, cloud2, executor);
+        ASSERT_EQ(cloud1->size(), distances.squaredDistances().size());
+
+        std::vector<float> expected;
+        double sum = 0;
+        for (const pcl::PointXYZ &point : *cloud1) {
+            float closest = std::numeric_limits<float>::max();
+            for (const pcl::PointXYZ &target : *cloud2) {
+                closest = std::min(closest, (point.getVector3fMap() - target.getVector3fMap()).squaredNorm());
+            }
+            expected.push_back(closest);
+            sum += closest;
+        }
+        const double median = sortedMedian(expected);
+        EXPECT_NEAR(sum, distances.sum(), 1e-4);
+        EXPECT_NEAR(sum / size, distances.average(), 1e-6);
+        EXPECT_NEAR(median, distances.median(), 1e-6);
+        double robust_sum = 0;
+        std::vector<float> filtered;
+        for (float distance : expected) {
+            if (distance <= median * 3 && distance >= median / 3) {
+                robust_sum += distance;
+                filtered.push_back(distance);
+            }
+        }
+        EXPECT_NEAR(robust_sum, distances.robustSum(), 1e-4);
+        EXPECT_NEAR(robust_sum / filtered.size(), distances.robustAverage(), 1e-6);
+        EXPECT_NEAR(sortedMedian(filtered) / filtered.size(), distances.robustMedian(), 1e-8);
+
+        // The metric functions give the same values from any index
+        const VoxelHashSearch voxel_hash(cloud2, 0.2);
+        EXPECT_NEAR(distances.median(), prob_point_cloud_registration::medianClosestDistance(*cloud1, voxel_hash),
+                    1e-6);
+        EXPECT_NEAR(distances.robustSum(5), prob_point_cloud_registration::robustSumSquaredError(cloud1, cloud2, 5),
+                    1e-6);
+    }
+}
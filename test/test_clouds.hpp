@@ -0,0 +1,55 @@
+#ifndef PROB_POINT_CLOUD_REGISTRATION_TEST_CLOUDS_HPP
+#define PROB_POINT_CLOUD_REGISTRATION_TEST_CLOUDS_HPP
+
+#include <cmath>
+
+#include <boost/make_shared.hpp>
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+
+#include "prob_point_cloud_registration/prob_point_cloud_registration_params.hpp"
+
+namespace prob_point_cloud_registration {
+namespace test {
+
+// Samples z = height(x, y) on a grid of columns x rows points spaced by spacing, from (x0, y0)
+template <typename Height>
+pcl::PointCloud<pcl::PointXYZ>::Ptr generateSurface(int columns, int rows, double spacing, double x0, double y0,
+                                                    Height height)
+{
+    auto cloud = boost::make_shared<pcl::PointCloud<pcl::PointXYZ>>();
+    cloud->reserve(columns * rows);
+    for (int i = 0; i < columns; ++i) {
+        for (int j = 0; j < rows; ++j) {
+            const double x = x0 + spacing * i;
+            const double y = y0 + spacing * j;
+            cloud->push_back(pcl::PointXYZ(x, y, height(x, y)));
+        }
+    }
+    return cloud;
+}
+
+// The smooth surface z = sin(x) + cos(y) most tests register on
+inline pcl::PointCloud<pcl::PointXYZ>::Ptr generateSurface(int columns, int rows, double spacing, double x0 = 0,
+                                                           double y0 = 0)
+{
+    return generateSurface(columns, rows, spacing, x0, y0, [](double x, double y) {
+        return std::sin(x) + std::cos(y);
+    });
+}
+
+// The Procrustes EM on a few neighbours, the tests set the parameters they change on top
+inline ProbPointCloudRegistrationParams testParams()
+{
+    ProbPointCloudRegistrationParams params;
+    params.radius = 0.5;
+    params.max_neighbours = 10;
+    params.n_iter = 20;
+    params.solver_type = SolverType::PROCRUSTES;
+    return params;
+}
+
+}  // namespace test
+}  // namespace prob_point_cloud_registration
+
+#endif